@@ -0,0 +1,92 @@
+#ifndef alu_6502_hpp
+#define alu_6502_hpp
+
+#include <cstdint>
+
+// forced inline: SIMD kernels built with a target attribute pass vector
+// operands in registers a separately compiled instance would not expect
+#if defined(__GNUC__) || defined(__clang__)
+#define NES_ALU_INLINE inline __attribute__((always_inline))
+#else
+#define NES_ALU_INLINE inline
+#endif
+
+namespace nes {
+
+    /*
+        Result and flag semantics of the 6502 ALU instructions, shared by
+        cpu_6502 (B = uint8_t) and cpu_6502_soa (B = a vector of lane
+        bytes). Only operators both support: no comparisons, no branches,
+        carries come out of bit 7 of the operands and the result. Carry
+        and overflow are bytes holding 0 or 1, N and Z are taken from the
+        returned value by the caller. No decimal mode on the 2A03.
+    */
+
+    template<typename B>
+    NES_ALU_INLINE B alu_adc(B a, B v, B& carry, B& overflow)
+    {
+        B r = a + v + carry;
+        carry = ((a & v) | ((a ^ v) & ~r)) >> 7;
+        overflow = ((v ^ r) & (a ^ r)) >> 7;
+        return r;
+    }
+
+    // a + ~v + carry
+    template<typename B>
+    NES_ALU_INLINE B alu_sbc(B a, B v, B& carry, B& overflow)
+    {
+        B nv = ~v;
+        return alu_adc(a, nv, carry, overflow);
+    }
+
+    // a - v for N and Z, carry is a >= v
+    template<typename B>
+    NES_ALU_INLINE B alu_cmp(B a, B v, B& carry)
+    {
+        B nv = ~v;
+        B r = a - v;
+        carry = ((a & nv) | ((a ^ nv) & ~r)) >> 7;
+        return r;
+    }
+
+    template<typename B>
+    NES_ALU_INLINE B alu_asl(B v, B& carry)
+    {
+        carry = v >> 7;
+        return v << 1;
+    }
+
+    template<typename B>
+    NES_ALU_INLINE B alu_lsr(B v, B& carry)
+    {
+        carry = v & 1;
+        return v >> 1;
+    }
+
+    template<typename B>
+    NES_ALU_INLINE B alu_rol(B v, B& carry)
+    {
+        B r = (v << 1) | carry;
+        carry = v >> 7;
+        return r;
+    }
+
+    template<typename B>
+    NES_ALU_INLINE B alu_ror(B v, B& carry)
+    {
+        B r = (v >> 1) | (carry << 7);
+        carry = v & 1;
+        return r;
+    }
+
+    // V is bit 6 of the operand, N bit 7 of it and Z comes from v & A
+    template<typename B>
+    NES_ALU_INLINE B alu_bit_overflow(B v)
+    {
+        return (v >> 6) & 1;
+    }
+
+}
+
+
+#endif /* alu_6502_hpp */
@@ -0,0 +1,913 @@
+#include "apu.hpp"
+#include "state.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+
+#define APU_QUARTER 0x01
+#define APU_HALF    0x02
+#define APU_IRQ     0x04
+
+
+namespace nes {
+
+    struct blip_kernel_table {
+        int16_t taps[BLIP_PHASES][BLIP_WIDTH];
+
+        // Blackman windowed sinc cut off a little under Nyquist. Each
+        // phase is rounded to sum to exactly 1 << 15 so steps have no DC error.
+        blip_kernel_table() noexcept
+        {
+            const double pi = 3.14159265358979323846;
+            const double cutoff = 0.9;
+            const int half = BLIP_WIDTH / 2;
+
+            for (int p = 0; p < BLIP_PHASES; ++p) {
+                double h[BLIP_WIDTH];
+                double total = 0;
+                for (int i = 0; i < BLIP_WIDTH; ++i) {
+                    double x = i - (half - 1) - (double)p / BLIP_PHASES;
+                    double s = x == 0 ? 1.0 : sin(pi * cutoff * x) / (pi * cutoff * x);
+                    double w = 0.42 + 0.5 * cos(pi * x / half) + 0.08 * cos(2 * pi * x / half);
+                    h[i] = s * w;
+                    total += h[i];
+                }
+
+                int sum = 0;
+                for (int i = 0; i < BLIP_WIDTH; ++i) {
+                    this->taps[p][i] = (int16_t)lround(h[i] / total * (1 << 15));
+                    sum += this->taps[p][i];
+                }
+                this->taps[p][half - 1] += (int16_t)((1 << 15) - sum);
+            }
+        }
+    };
+
+    const int16_t* blip_buffer::kernel(int phase)
+    {
+        static const blip_kernel_table table;
+        return table.taps[phase];
+    }
+
+    void blip_buffer::set_rates(double clock_rate, double sample_rate, size_t max_samples)
+    {
+        this->factor_ = (uint64_t)(sample_rate / clock_rate * 4294967296.0 + 0.5);
+        this->buf_.assign(max_samples + BLIP_WIDTH, 0);
+        this->clear();
+    }
+
+    void blip_buffer::clear()
+    {
+        std::fill(this->buf_.begin(), this->buf_.end(), 0);
+        this->offset_ = 0;
+        this->avail_ = 0;
+        this->sum_ = 0;
+    }
+
+    void blip_buffer::end_frame(uint32_t clocks)
+    {
+        uint64_t pos = clocks * this->factor_ + this->offset_;
+        this->avail_ += (size_t)(pos >> 32);
+        this->offset_ = pos & 0xffffffff;
+        assert(this->avail_ + BLIP_WIDTH <= this->buf_.size());
+    }
+
+    size_t blip_buffer::read_samples(int16_t *out, size_t count)
+    {
+        size_t n = count < this->avail_ ? count : this->avail_;
+        int32_t sum = this->sum_;
+        for (size_t i = 0; i < n; ++i) {
+            sum += this->buf_[i];
+            int32_t s = sum >> 15;
+            // high pass, the DC of the unipolar channels drains out over ~512 samples
+            sum -= s * (1 << (15 - 9));
+            out[i] = (int16_t)(s < -32768 ? -32768 : s > 32767 ? 32767 : s);
+        }
+        this->sum_ = sum;
+
+        // what is left, including the tails of the last impulses, moves to the front
+        size_t live = this->avail_ + BLIP_WIDTH;
+        memmove(&this->buf_[0], &this->buf_[n], (live - n) * sizeof(int32_t));
+        std::fill(this->buf_.begin() + (live - n), this->buf_.begin() + live, 0);
+        this->avail_ -= n;
+        return n;
+    }
+
+    void blip_buffer::save_state(state_writer& w) const
+    {
+        uint32_t live = (uint32_t)(this->avail_ + BLIP_WIDTH);
+        w.put(this->offset_);
+        w.put(this->sum_);
+        w.put<uint32_t>((uint32_t)this->avail_);
+        for (uint32_t i = 0; i < live; ++i) {
+            w.put(this->buf_[i]);
+        }
+    }
+
+    bool blip_buffer::load_state(state_reader& c)
+    {
+        uint64_t offset = c.get<uint64_t>();
+        int32_t sum = c.get<int32_t>();
+        size_t avail = c.get<uint32_t>();
+        if (!c.ok() || avail + BLIP_WIDTH > this->buf_.size()) {
+            return false;
+        }
+        this->clear();
+        this->offset_ = offset;
+        this->sum_ = sum;
+        this->avail_ = avail;
+        for (size_t i = 0; i < avail + BLIP_WIDTH; ++i) {
+            c.get(this->buf_[i]);
+        }
+        return c.ok();
+    }
+
+    static const uint8_t g_length_table[32] = {
+        10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+        12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+    };
+
+    static const uint8_t g_duty_table[4][8] = {
+        { 0, 1, 0, 0, 0, 0, 0, 0 },
+        { 0, 1, 1, 0, 0, 0, 0, 0 },
+        { 0, 1, 1, 1, 1, 0, 0, 0 },
+        { 1, 0, 0, 1, 1, 1, 1, 1 },
+    };
+
+    static const uint8_t g_triangle_table[32] = {
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    };
+
+    // NTSC, in CPU cycles
+    static const uint16_t g_noise_periods[16] = {
+        4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068,
+    };
+
+    static const uint16_t g_dmc_rates[16] = {
+        428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54,
+    };
+
+    // frame counter steps, CPU cycles after the sequence start, 4 and 5 step mode
+    static const struct {
+        uint32_t cycle;
+        uint8_t clocks;
+    } g_frame_steps[2][4] = {
+        { { 7457, APU_QUARTER }, { 14913, APU_QUARTER | APU_HALF }, { 22371, APU_QUARTER }, { 29829, APU_QUARTER | APU_HALF | APU_IRQ } },
+        { { 7457, APU_QUARTER }, { 14913, APU_QUARTER | APU_HALF }, { 22371, APU_QUARTER }, { 37281, APU_QUARTER | APU_HALF } },
+    };
+    static const uint32_t g_frame_periods[2] = { 29830, 37282 };
+
+    // linear mix, output level x weight, 32768 is full scale
+    static const int g_pulse_weight = 246;
+    static const int g_triangle_weight = 279;
+    static const int g_noise_weight = 162;
+    static const int g_dmc_weight = 110;
+
+    static void envelope_clock(apu_envelope& e)
+    {
+        if (e.start) {
+            e.start = false;
+            e.decay = 15;
+            e.divider = e.reg & 0x0f;
+        }
+        else if (e.divider == 0) {
+            e.divider = e.reg & 0x0f;
+            if (e.decay) {
+                e.decay--;
+            }
+            else if (e.reg & 0x20) {
+                e.decay = 15;
+            }
+        }
+        else {
+            e.divider--;
+        }
+    }
+
+    static uint8_t envelope_volume(const apu_envelope& e)
+    {
+        return e.reg & 0x10 ? e.reg & 0x0f : e.decay;
+    }
+
+    // pulse 1 negates with one's complement, pulse 2 with two's
+    static int sweep_target(const apu_pulse& p, int index)
+    {
+        int change = p.timer >> (p.sweep & 0x07);
+        if (p.sweep & 0x08) {
+            return p.timer - change - (index == 0 ? 1 : 0);
+        }
+        return p.timer + change;
+    }
+
+    // timer clocks at time, time + period, ... up to end, skipped in one go. Returns how many.
+    static uint64_t skip_timer(uint64_t& time, uint64_t period, uint64_t end)
+    {
+        if (time > end) {
+            return 0;
+        }
+        uint64_t steps = (end - time) / period + 1;
+        time += steps * period;
+        return steps;
+    }
+
+    apu::apu(memory& m) noexcept
+    :mem_(m)
+    {
+        this->set_sample_rate(NES_SAMPLE_RATE);
+    }
+
+    void apu::reset()
+    {
+        this->pulse_[0] = apu_pulse();
+        this->pulse_[1] = apu_pulse();
+        this->triangle_ = apu_triangle();
+        this->noise_ = apu_noise();
+        this->dmc_ = apu_dmc();
+        this->five_step_ = false;
+        this->irq_inhibit_ = false;
+        this->frame_irq_ = false;
+        this->dmc_irq_ = false;
+        this->frame_step_ = 0;
+        this->frame_time_ = 0;
+        this->timestamp_ = 0;
+        this->frame_start_ = 0;
+        this->blip_.clear();
+        this->samples_.clear();
+    }
+
+    void apu::set_sample_rate(int rate)
+    {
+        this->sample_rate_ = rate;
+        // end_frame() at least every 100 ms
+        this->blip_.set_rates(NES_CPU_CLOCK, rate, (size_t)rate / 10);
+    }
+
+    bool apu::pulse_audible(const apu_pulse& p, int index) const
+    {
+        return p.length > 0 && p.timer >= 8 && sweep_target(p, index) <= 0x7ff && envelope_volume(p.env) > 0;
+    }
+
+    void apu::update_levels(uint64_t t)
+    {
+        for (int i = 0; i < 2; ++i) {
+            apu_pulse& p = this->pulse_[i];
+            bool high = this->pulse_audible(p, i) && g_duty_table[p.duty][p.seq];
+            this->level(p.out, high ? envelope_volume(p.env) : 0, g_pulse_weight, t);
+        }
+        this->level(this->triangle_.out, g_triangle_table[this->triangle_.seq], g_triangle_weight, t);
+        bool noise = this->noise_.length > 0 && !(this->noise_.shift & 1);
+        this->level(this->noise_.out, noise ? envelope_volume(this->noise_.env) : 0, g_noise_weight, t);
+        this->level(this->dmc_.out, this->dmc_.level, g_dmc_weight, t);
+    }
+
+    void apu::run_pulse(int index, uint64_t end)
+    {
+        apu_pulse& p = this->pulse_[index];
+        uint64_t period = (uint64_t)(p.timer + 1) * 2;
+
+        if (!this->pulse_audible(p, index)) {
+            // the level is 0 whatever the duty step, only the step moves on
+            p.seq = (uint8_t)((p.seq + skip_timer(p.time, period, end)) & 7);
+            return;
+        }
+
+        int volume = envelope_volume(p.env);
+        const uint8_t *duty = g_duty_table[p.duty];
+        while (p.time <= end) {
+            p.seq = (p.seq + 1) & 7;
+            this->level(p.out, duty[p.seq] ? volume : 0, g_pulse_weight, p.time);
+            p.time += period;
+        }
+    }
+
+    void apu::run_triangle(uint64_t end)
+    {
+        apu_triangle& t = this->triangle_;
+        uint64_t period = t.timer + 1;
+
+        // a stopped or ultrasonic triangle holds its level
+        if (t.length == 0 || t.linear == 0 || t.timer < 2) {
+            skip_timer(t.time, period, end);
+            return;
+        }
+
+        while (t.time <= end) {
+            t.seq = (t.seq + 1) & 31;
+            this->level(t.out, g_triangle_table[t.seq], g_triangle_weight, t.time);
+            t.time += period;
+        }
+    }
+
+    void apu::run_noise(uint64_t end)
+    {
+        apu_noise& n = this->noise_;
+        uint64_t period = g_noise_periods[n.period];
+        int volume = envelope_volume(n.env);
+
+        // silent, the shift register is left where it is
+        if (n.length == 0 || volume == 0) {
+            skip_timer(n.time, period, end);
+            return;
+        }
+
+        int tap = n.mode ? 6 : 1;
+        while (n.time <= end) {
+            uint16_t bit = (n.shift ^ (n.shift >> tap)) & 1;
+            n.shift = (uint16_t)(n.shift >> 1 | bit << 14);
+            this->level(n.out, n.shift & 1 ? 0 : volume, g_noise_weight, n.time);
+            n.time += period;
+        }
+    }
+
+    void apu::dmc_fetch()
+    {
+        apu_dmc& d = this->dmc_;
+        if (d.buffer_full || d.bytes == 0) {
+            return;
+        }
+
+        // the 4 cycle CPU stall of the fetch is not emulated
+        d.buffer = this->mem_.read<uint8_t>(d.addr);
+        d.buffer_full = true;
+        d.addr = d.addr == 0xffff ? 0x8000 : d.addr + 1;
+        if (--d.bytes == 0) {
+            if (d.loop) {
+                d.addr = d.start;
+                d.bytes = d.size;
+            }
+            else if (d.irq_enable) {
+                this->dmc_irq_ = true;
+            }
+        }
+    }
+
+    void apu::run_dmc(uint64_t end)
+    {
+        apu_dmc& d = this->dmc_;
+        uint64_t period = g_dmc_rates[d.rate];
+
+        while (d.time <= end) {
+            // idle until $4015 starts a sample, the bit counter keeps turning
+            if (d.silence && !d.buffer_full && d.bytes == 0) {
+                uint64_t steps = skip_timer(d.time, period, end);
+                d.bits = (uint8_t)((d.bits - 1 + 8 - steps % 8) % 8 + 1);
+                return;
+            }
+
+            if (!d.silence) {
+                if (d.shift & 1) {
+                    if (d.level <= 125) {
+                        d.level += 2;
+                    }
+                }
+                else if (d.level >= 2) {
+                    d.level -= 2;
+                }
+                this->level(d.out, d.level, g_dmc_weight, d.time);
+                d.shift >>= 1;
+            }
+
+            if (--d.bits == 0) {
+                d.bits = 8;
+                d.silence = !d.buffer_full;
+                if (d.buffer_full) {
+                    d.shift = d.buffer;
+                    d.buffer_full = false;
+                    this->dmc_fetch();
+                }
+            }
+            d.time += period;
+        }
+    }
+
+    uint64_t apu::frame_next() const
+    {
+        return this->frame_time_ + g_frame_steps[this->five_step_][this->frame_step_].cycle;
+    }
+
+    void apu::quarter_frame()
+    {
+        envelope_clock(this->pulse_[0].env);
+        envelope_clock(this->pulse_[1].env);
+        envelope_clock(this->noise_.env);
+
+        apu_triangle& t = this->triangle_;
+        if (t.linear_reload) {
+            t.linear = t.reg & 0x7f;
+        }
+        else if (t.linear > 0) {
+            t.linear--;
+        }
+        if (!(t.reg & 0x80)) {
+            t.linear_reload = false;
+        }
+    }
+
+    void apu::half_frame()
+    {
+        for (int i = 0; i < 2; ++i) {
+            apu_pulse& p = this->pulse_[i];
+            if (p.length > 0 && !(p.env.reg & 0x20)) {
+                p.length--;
+            }
+
+            int target = sweep_target(p, i);
+            if (p.sweep_divider == 0 && (p.sweep & 0x80) && (p.sweep & 0x07) && p.timer >= 8 && target <= 0x7ff) {
+                p.timer = (uint16_t)target;
+            }
+            if (p.sweep_divider == 0 || p.sweep_reload) {
+                p.sweep_divider = (p.sweep >> 4) & 0x07;
+                p.sweep_reload = false;
+            }
+            else {
+                p.sweep_divider--;
+            }
+        }
+
+        if (this->triangle_.length > 0 && !(this->triangle_.reg & 0x80)) {
+            this->triangle_.length--;
+        }
+        if (this->noise_.length > 0 && !(this->noise_.env.reg & 0x20)) {
+            this->noise_.length--;
+        }
+    }
+
+    void apu::frame_clock(uint64_t t)
+    {
+        uint8_t clocks = g_frame_steps[this->five_step_][this->frame_step_].clocks;
+        if (clocks & APU_QUARTER) {
+            this->quarter_frame();
+        }
+        if (clocks & APU_HALF) {
+            this->half_frame();
+        }
+        if ((clocks & APU_IRQ) && !this->irq_inhibit_) {
+            this->frame_irq_ = true;
+        }
+
+        if (++this->frame_step_ == 4) {
+            this->frame_step_ = 0;
+            this->frame_time_ += g_frame_periods[this->five_step_];
+        }
+        this->update_levels(t);
+    }
+
+    void apu::catch_up(uint64_t cycle)
+    {
+        for (uint64_t t = this->frame_next(); t <= cycle; t = this->frame_next()) {
+            this->run_pulse(0, t);
+            this->run_pulse(1, t);
+            this->run_triangle(t);
+            this->run_noise(t);
+            this->run_dmc(t);
+            this->frame_clock(t);
+        }
+
+        this->run_pulse(0, cycle);
+        this->run_pulse(1, cycle);
+        this->run_triangle(cycle);
+        this->run_noise(cycle);
+        this->run_dmc(cycle);
+        this->timestamp_ = cycle;
+    }
+
+    uint64_t apu::next_irq() const
+    {
+        uint64_t next = UINT64_MAX;
+        if (!this->five_step_ && !this->irq_inhibit_) {
+            next = this->frame_time_ + g_frame_steps[0][3].cycle;
+        }
+
+        // the last byte is fetched when the buffer empties for the bytes-th time
+        const apu_dmc& d = this->dmc_;
+        if (d.irq_enable && !d.loop && d.bytes > 0) {
+            uint64_t period = g_dmc_rates[d.rate];
+            uint64_t t = d.buffer_full ? d.time + (d.bits - 1) * period : this->timestamp_;
+            t += (uint64_t)(d.bytes - 1) * 8 * period;
+            next = t < next ? t : next;
+        }
+        return next;
+    }
+
+    uint8_t apu::read(uint16_t addr)
+    {
+        if (addr != NES_APU_STATUS_ADDR) {
+            return 0;
+        }
+
+        uint8_t status = (this->pulse_[0].length > 0 ? 0x01 : 0)
+                       | (this->pulse_[1].length > 0 ? 0x02 : 0)
+                       | (this->triangle_.length > 0 ? 0x04 : 0)
+                       | (this->noise_.length > 0 ? 0x08 : 0)
+                       | (this->dmc_.bytes > 0 ? 0x10 : 0)
+                       | (this->frame_irq_ ? 0x40 : 0)
+                       | (this->dmc_irq_ ? 0x80 : 0);
+        this->frame_irq_ = false;
+        return status;
+    }
+
+    void apu::write(uint16_t addr, uint8_t v)
+    {
+        apu_pulse& p = this->pulse_[(addr >> 2) & 1];
+
+        switch (addr) {
+            case 0x4000: case 0x4004:
+                p.duty = v >> 6;
+                p.env.reg = v & 0x3f;
+                break;
+            case 0x4001: case 0x4005:
+                p.sweep = v;
+                p.sweep_reload = true;
+                break;
+            case 0x4002: case 0x4006:
+                p.timer = (p.timer & 0x0700) | v;
+                break;
+            case 0x4003: case 0x4007:
+                p.timer = (uint16_t)((p.timer & 0x00ff) | (v & 0x07) << 8);
+                if (p.enabled) {
+                    p.length = g_length_table[v >> 3];
+                }
+                p.seq = 0;
+                p.env.start = true;
+                break;
+
+            case 0x4008:
+                this->triangle_.reg = v;
+                break;
+            case 0x400a:
+                this->triangle_.timer = (this->triangle_.timer & 0x0700) | v;
+                break;
+            case 0x400b:
+                this->triangle_.timer = (uint16_t)((this->triangle_.timer & 0x00ff) | (v & 0x07) << 8);
+                if (this->triangle_.enabled) {
+                    this->triangle_.length = g_length_table[v >> 3];
+                }
+                this->triangle_.linear_reload = true;
+                break;
+
+            case 0x400c:
+                this->noise_.env.reg = v & 0x3f;
+                break;
+            case 0x400e:
+                this->noise_.mode = v & 0x80;
+                this->noise_.period = v & 0x0f;
+                break;
+            case 0x400f:
+                if (this->noise_.enabled) {
+                    this->noise_.length = g_length_table[v >> 3];
+                }
+                this->noise_.env.start = true;
+                break;
+
+            case 0x4010:
+                this->dmc_.irq_enable = v & 0x80;
+                this->dmc_.loop = v & 0x40;
+                this->dmc_.rate = v & 0x0f;
+                if (!this->dmc_.irq_enable) {
+                    this->dmc_irq_ = false;
+                }
+                break;
+            case 0x4011:
+                this->dmc_.level = v & 0x7f;
+                break;
+            case 0x4012:
+                this->dmc_.start = (uint16_t)(0xc000 | v << 6);
+                break;
+            case 0x4013:
+                this->dmc_.size = (uint16_t)(v << 4 | 1);
+                break;
+
+            case NES_APU_STATUS_ADDR:
+                for (int i = 0; i < 2; ++i) {
+                    this->pulse_[i].enabled = v & (1 << i);
+                    if (!this->pulse_[i].enabled) {
+                        this->pulse_[i].length = 0;
+                    }
+                }
+                this->triangle_.enabled = v & 0x04;
+                if (!this->triangle_.enabled) {
+                    this->triangle_.length = 0;
+                }
+                this->noise_.enabled = v & 0x08;
+                if (!this->noise_.enabled) {
+                    this->noise_.length = 0;
+                }
+
+                if (v & 0x10) {
+                    if (this->dmc_.bytes == 0) {
+                        this->dmc_.addr = this->dmc_.start;
+                        this->dmc_.bytes = this->dmc_.size;
+                    }
+                    this->dmc_fetch();
+                }
+                else {
+                    this->dmc_.bytes = 0;
+                }
+                this->dmc_irq_ = false;
+                break;
+
+            case NES_APU_FRAME_ADDR:
+                this->five_step_ = v & 0x80;
+                this->irq_inhibit_ = v & 0x40;
+                if (this->irq_inhibit_) {
+                    this->frame_irq_ = false;
+                }
+                this->frame_time_ = this->timestamp_;
+                this->frame_step_ = 0;
+                if (this->five_step_) {
+                    this->quarter_frame();
+                    this->half_frame();
+                }
+                break;
+        }
+
+        this->update_levels(this->timestamp_);
+    }
+
+    void apu::end_frame(uint64_t cycle)
+    {
+        this->catch_up(cycle);
+        this->blip_.end_frame((uint32_t)(cycle - this->frame_start_));
+        this->frame_start_ = cycle;
+
+        this->samples_.resize(this->blip_.samples_avail());
+        this->blip_.read_samples(this->samples_.data(), this->samples_.size());
+    }
+
+    static void save_envelope(state_writer& w, const apu_envelope& e)
+    {
+        w.put(e.reg);
+        w.put(e.start);
+        w.put(e.divider);
+        w.put(e.decay);
+    }
+
+    static void load_envelope(state_reader& c, apu_envelope& e)
+    {
+        c.get(e.reg);
+        c.get(e.start);
+        c.get(e.divider);
+        c.get(e.decay);
+    }
+
+    void apu::save_state(state_writer& w) const
+    {
+        w.begin("APU ");
+        for (const apu_pulse& p : this->pulse_) {
+            save_envelope(w, p.env);
+            w.put(p.duty);
+            w.put(p.seq);
+            w.put(p.sweep);
+            w.put(p.sweep_divider);
+            w.put(p.sweep_reload);
+            w.put(p.timer);
+            w.put(p.length);
+            w.put(p.enabled);
+            w.put(p.time);
+            w.put<int32_t>(p.out);
+        }
+
+        const apu_triangle& t = this->triangle_;
+        w.put(t.reg);
+        w.put(t.linear);
+        w.put(t.linear_reload);
+        w.put(t.seq);
+        w.put(t.timer);
+        w.put(t.length);
+        w.put(t.enabled);
+        w.put(t.time);
+        w.put<int32_t>(t.out);
+
+        const apu_noise& n = this->noise_;
+        save_envelope(w, n.env);
+        w.put(n.mode);
+        w.put(n.period);
+        w.put(n.shift);
+        w.put(n.length);
+        w.put(n.enabled);
+        w.put(n.time);
+        w.put<int32_t>(n.out);
+
+        const apu_dmc& d = this->dmc_;
+        w.put(d.irq_enable);
+        w.put(d.loop);
+        w.put(d.rate);
+        w.put(d.level);
+        w.put(d.start);
+        w.put(d.size);
+        w.put(d.addr);
+        w.put(d.bytes);
+        w.put(d.buffer);
+        w.put(d.buffer_full);
+        w.put(d.shift);
+        w.put(d.bits);
+        w.put(d.silence);
+        w.put(d.time);
+        w.put<int32_t>(d.out);
+
+        w.put(this->five_step_);
+        w.put(this->irq_inhibit_);
+        w.put(this->frame_irq_);
+        w.put(this->dmc_irq_);
+        w.put<int32_t>(this->frame_step_);
+        w.put(this->frame_time_);
+        w.put(this->timestamp_);
+        w.put(this->frame_start_);
+        this->blip_.save_state(w);
+        w.end();
+    }
+
+    int apu::load_state(const state_reader& r)
+    {
+        state_reader c;
+        if (!r.find("APU ", c)) {
+            return STATE_ERROR_FORMAT;
+        }
+
+        for (apu_pulse& p : this->pulse_) {
+            load_envelope(c, p.env);
+            c.get(p.duty);
+            c.get(p.seq);
+            c.get(p.sweep);
+            c.get(p.sweep_divider);
+            c.get(p.sweep_reload);
+            c.get(p.timer);
+            c.get(p.length);
+            c.get(p.enabled);
+            c.get(p.time);
+            p.out = c.get<int32_t>();
+            // table indices
+            p.duty &= 0x03;
+            p.seq &= 0x07;
+        }
+
+        apu_triangle& t = this->triangle_;
+        c.get(t.reg);
+        c.get(t.linear);
+        c.get(t.linear_reload);
+        c.get(t.seq);
+        c.get(t.timer);
+        c.get(t.length);
+        c.get(t.enabled);
+        c.get(t.time);
+        t.out = c.get<int32_t>();
+        t.seq &= 0x1f;
+
+        apu_noise& n = this->noise_;
+        load_envelope(c, n.env);
+        c.get(n.mode);
+        c.get(n.period);
+        c.get(n.shift);
+        c.get(n.length);
+        c.get(n.enabled);
+        c.get(n.time);
+        n.out = c.get<int32_t>();
+        n.period &= 0x0f;
+
+        apu_dmc& d = this->dmc_;
+        c.get(d.irq_enable);
+        c.get(d.loop);
+        c.get(d.rate);
+        c.get(d.level);
+        c.get(d.start);
+        c.get(d.size);
+        c.get(d.addr);
+        c.get(d.bytes);
+        c.get(d.buffer);
+        c.get(d.buffer_full);
+        c.get(d.shift);
+        c.get(d.bits);
+        c.get(d.silence);
+        c.get(d.time);
+        d.out = c.get<int32_t>();
+        d.rate &= 0x0f;
+
+        c.get(this->five_step_);
+        c.get(this->irq_inhibit_);
+        c.get(this->frame_irq_);
+        c.get(this->dmc_irq_);
+        this->frame_step_ = c.get<int32_t>();
+        c.get(this->frame_time_);
+        c.get(this->timestamp_);
+        c.get(this->frame_start_);
+        this->samples_.clear();
+        if (!this->blip_.load_state(c) || !c.ok()) {
+            this->reset();
+            return STATE_ERROR_FORMAT;
+        }
+        return 0;
+    }
+
+    void apu::test()
+    {
+        // every kernel phase integrates to exactly one step
+        for (int p = 0; p < BLIP_PHASES; ++p) {
+            int sum = 0;
+            for (int i = 0; i < BLIP_WIDTH; ++i) {
+                sum += blip_buffer::kernel(p)[i];
+            }
+            assert(sum == 1 << 15);
+            (void)sum;
+        }
+
+        {
+            blip_buffer blip;
+            blip.set_rates(NES_CPU_CLOCK, NES_SAMPLE_RATE, 4096);
+            blip.add_delta(1000, 10000);
+            blip.end_frame(29830);
+            int16_t out[1024];
+            size_t n = blip.read_samples(out, 1024);
+            // 29830 clocks are 735.0 samples, the step lands at 24.6 plus the kernel's delay
+            assert(n == 734 || n == 735);
+            assert(out[10] == 0);
+            assert(abs(out[40] - 10000) < 300);
+            (void)n;
+        }
+
+        static const uint32_t frame = 29830;
+        memory mem;
+
+        // a 440 Hz square, counted by its zero crossings once the high pass settled
+        {
+            apu a(mem);
+            a.write(NES_APU_STATUS_ADDR, 0x01);
+            a.write(0x4000, 0xbf);
+            a.write(0x4002, 253);
+            a.write(0x4003, 0x00);
+
+            int crossings = 0;
+            int16_t last = 0;
+            size_t samples = 0;
+            for (int f = 0; f < 60; ++f) {
+                a.end_frame((uint64_t)(f + 1) * frame);
+                samples += a.sample_count();
+                for (size_t i = 0; f >= 10 && i < a.sample_count(); ++i) {
+                    int16_t s = a.samples()[i];
+                    crossings += (s < 0) != (last < 0);
+                    last = s;
+                }
+            }
+            // 1789773 / (16 * 254) = 440.4 Hz over 50 frames
+            assert(crossings > 725 && crossings < 745);
+            assert(samples > 44000 && samples < 44200);
+            (void)crossings;
+            (void)samples;
+        }
+
+        // frame IRQ at the predicted cycle, length counters
+        {
+            apu a(mem);
+            a.write(NES_APU_FRAME_ADDR, 0x00);
+            uint64_t at = a.next_irq();
+            assert(at == 29829);
+            a.catch_up(at - 1);
+            assert(!a.irq());
+            a.catch_up(at);
+            assert(a.irq());
+            assert(a.read(NES_APU_STATUS_ADDR) & 0x40);
+            assert(!a.irq());
+
+            a.write(NES_APU_FRAME_ADDR, 0x40);
+            assert(a.next_irq() == UINT64_MAX);
+            a.write(NES_APU_STATUS_ADDR, 0x08);
+            a.write(0x400f, 0x00);
+            assert(a.read(NES_APU_STATUS_ADDR) == 0x08);
+            // length 10, two half frames per sequence
+            a.catch_up(a.timestamp() + 4 * frame);
+            assert(a.read(NES_APU_STATUS_ADDR) == 0x08);
+            a.catch_up(a.timestamp() + 2 * frame);
+            assert(a.read(NES_APU_STATUS_ADDR) == 0x00);
+            (void)at;
+        }
+
+        // DMC plays 17 bytes from $C000 and raises its IRQ when the last one is fetched
+        {
+            for (uint16_t i = 0; i < 17; ++i) {
+                mem.write<uint8_t>(0x55, 0xc000 + i);
+            }
+            apu a(mem);
+            a.write(NES_APU_FRAME_ADDR, 0x40);
+            a.write(0x4010, 0x8f);
+            a.write(0x4011, 0x40);
+            a.write(0x4012, 0x00);
+            a.write(0x4013, 0x01);
+            a.write(NES_APU_STATUS_ADDR, 0x10);
+
+            // the first byte is fetched at once, the last after about 16 bytes of output at 54 cycles a bit
+            uint64_t at = a.next_irq();
+            assert(at > 15 * 8 * 54 && at < 17 * 8 * 54);
+            a.catch_up(at - 1);
+            assert(!a.irq() && (a.read(NES_APU_STATUS_ADDR) & 0x10));
+            a.catch_up(at);
+            assert(a.irq());
+            assert(a.read(NES_APU_STATUS_ADDR) == 0x80);
+            a.write(NES_APU_STATUS_ADDR, 0x00);
+            assert(!a.irq());
+            (void)at;
+        }
+    }
+
+}
@@ -0,0 +1,272 @@
+#ifndef apu_hpp
+#define apu_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include "memory.hpp"
+
+#define NES_CPU_CLOCK 1789773
+#define NES_SAMPLE_RATE 44100
+// NTSC frames per second, 262 lines of 341 dots and every other frame a dot short
+#define NES_FRAME_RATE (NES_CPU_CLOCK * 3.0 / (341 * 262 - 0.5))
+
+#define NES_APU_STATUS_ADDR 0x4015
+#define NES_APU_FRAME_ADDR 0x4017
+
+// impulse phases per sample and taps per impulse
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES (1 << BLIP_PHASE_BITS)
+#define BLIP_WIDTH 16
+
+
+namespace nes {
+
+    /*
+        Band limited step synthesis in the manner of blargg's blip_buffer.
+
+        Amplitude changes come in as deltas at clock times within the
+        current frame. Each one adds a windowed sinc impulse at its sub
+        sample phase; reading integrates the impulses back into steps. The
+        output has no aliasing from the square edges and costs nothing
+        while the amplitude holds still.
+    */
+    class blip_buffer {
+
+        uint64_t factor_{0};    // samples per clock, 32.32 fixed point
+        uint64_t offset_{0};    // where the frame starts, fraction of a sample
+        std::vector<int32_t> buf_;
+        size_t avail_{0};
+        int32_t sum_{0};
+
+    public:
+        blip_buffer(const blip_buffer&) = delete;
+        blip_buffer(blip_buffer&&) = delete;
+        blip_buffer& operator=(const blip_buffer&) = delete;
+        blip_buffer& operator=(blip_buffer&&) = delete;
+
+        blip_buffer() noexcept
+        {
+        }
+
+        // room for max_samples between reads
+        void set_rates(double clock_rate, double sample_rate, size_t max_samples);
+        void clear();
+
+        // amplitude goes up by delta at clock, counted from the frame start
+        void add_delta(uint32_t clock, int delta)
+        {
+            uint64_t pos = clock * this->factor_ + this->offset_;
+            size_t index = this->avail_ + (size_t)(pos >> 32);
+            int phase = (int)(pos >> (32 - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1);
+            const int16_t *kernel = blip_buffer::kernel(phase);
+            int32_t *out = &this->buf_[index];
+            for (int i = 0; i < BLIP_WIDTH; ++i) {
+                out[i] += kernel[i] * delta;
+            }
+        }
+
+        // the frame is clocks long, its samples become readable
+        void end_frame(uint32_t clocks);
+
+        size_t samples_avail() const
+        {
+            return this->avail_;
+        }
+
+        size_t read_samples(int16_t *out, size_t count);
+
+        // the unread samples and impulse tails, inside the APU's chunk
+        void save_state(state_writer& w) const;
+        // false when they don't fit the buffer
+        bool load_state(state_reader& c);
+
+        // BLIP_WIDTH taps of the impulse at phase / BLIP_PHASES of a sample, summing to 1 << 15
+        static const int16_t* kernel(int phase);
+    };
+
+    // 4 bit volume, either constant or a decay clocked at quarter frames
+    struct apu_envelope {
+        uint8_t reg{0};         // --LC VVVV
+        bool start{false};
+        uint8_t divider{0};
+        uint8_t decay{0};
+    };
+
+    struct apu_pulse {
+        apu_envelope env;
+        uint8_t duty{0};
+        uint8_t seq{0};
+        uint8_t sweep{0};       // EPPP NSSS
+        uint8_t sweep_divider{0};
+        bool sweep_reload{false};
+        uint16_t timer{0};
+        uint8_t length{0};
+        bool enabled{false};
+        uint64_t time{0};       // CPU cycle of the next timer clock
+        int out{0};
+    };
+
+    struct apu_triangle {
+        uint8_t reg{0};         // CRRR RRRR
+        uint8_t linear{0};
+        bool linear_reload{false};
+        uint8_t seq{0};
+        uint16_t timer{0};
+        uint8_t length{0};
+        bool enabled{false};
+        uint64_t time{0};
+        int out{0};
+    };
+
+    struct apu_noise {
+        apu_envelope env;
+        bool mode{false};
+        uint8_t period{0};
+        uint16_t shift{1};
+        uint8_t length{0};
+        bool enabled{false};
+        uint64_t time{0};
+        int out{0};
+    };
+
+    struct apu_dmc {
+        bool irq_enable{false};
+        bool loop{false};
+        uint8_t rate{0};
+        uint8_t level{0};
+        uint16_t start{0};
+        uint16_t size{0};
+        uint16_t addr{0};
+        uint16_t bytes{0};
+        uint8_t buffer{0};
+        bool buffer_full{false};
+        uint8_t shift{0};
+        uint8_t bits{8};
+        bool silence{true};
+        uint64_t time{0};
+        int out{0};
+    };
+
+    /*
+        2A03 sound: two pulses, triangle, noise, DMC and the frame counter.
+
+        Nothing runs per CPU cycle. The APU keeps its own timestamp and
+        the console catches it up to the CPU's before register accesses
+        and at its IRQ events. Catching up steps every channel from timer
+        event to timer event, split at frame counter steps, and a channel
+        only adds a delta to the blip buffer when its output level moves.
+        Silent channels skip their timers arithmetically.
+
+        end_frame() turns the frame's deltas into samples in one batch.
+        The channels are mixed with the linear approximation of the DAC.
+    */
+    class apu {
+
+        memory& mem_;
+        blip_buffer blip_;
+        int sample_rate_{NES_SAMPLE_RATE};
+        std::vector<int16_t> samples_;
+
+        apu_pulse pulse_[2];
+        apu_triangle triangle_;
+        apu_noise noise_;
+        apu_dmc dmc_;
+
+        bool five_step_{false};
+        bool irq_inhibit_{false};
+        bool frame_irq_{false};
+        bool dmc_irq_{false};
+        int frame_step_{0};
+        uint64_t frame_time_{0};    // CPU cycle the frame counter sequence started
+
+        uint64_t timestamp_{0};
+        uint64_t frame_start_{0};   // CPU cycle the blip frame started
+
+        uint64_t frame_next() const;
+        void frame_clock(uint64_t t);
+        void quarter_frame();
+        void half_frame();
+
+        void run_pulse(int index, uint64_t end);
+        void run_triangle(uint64_t end);
+        void run_noise(uint64_t end);
+        void run_dmc(uint64_t end);
+        void dmc_fetch();
+
+        bool pulse_audible(const apu_pulse& p, int index) const;
+        void update_levels(uint64_t t);
+
+        void level(int& out, int v, int weight, uint64_t t)
+        {
+            if (v != out) {
+                this->blip_.add_delta((uint32_t)(t - this->frame_start_), (v - out) * weight);
+                out = v;
+            }
+        }
+
+    public:
+        apu() = delete;
+        apu(const apu&) = delete;
+        apu(apu&&) = delete;
+        apu& operator=(const apu&) = delete;
+        apu& operator=(apu&&) = delete;
+
+        // DMC samples are read through m
+        apu(memory& m) noexcept;
+
+        void reset();
+
+        void set_sample_rate(int rate);
+
+        int get_sample_rate() const
+        {
+            return this->sample_rate_;
+        }
+
+        // $4000-$4013, $4015, $4017 at timestamp()
+        uint8_t read(uint16_t addr);
+        void write(uint16_t addr, uint8_t v);
+
+        // runs up to CPU cycle, counted from reset
+        void catch_up(uint64_t cycle);
+
+        uint64_t timestamp() const
+        {
+            return this->timestamp_;
+        }
+
+        // CPU cycle the frame or DMC IRQ will go up at, UINT64_MAX for never
+        uint64_t next_irq() const;
+
+        bool irq() const
+        {
+            return this->frame_irq_ || this->dmc_irq_;
+        }
+
+        // catches up to cycle and makes the samples since the last call readable
+        void end_frame(uint64_t cycle);
+
+        // "APU " chunk, the last frame's samples are not part of it
+        void save_state(state_writer& w) const;
+        // 0 or STATE_ERROR_FORMAT
+        int load_state(const state_reader& r);
+
+        // samples of the last end_frame(), mono 16 bit
+        const int16_t* samples() const
+        {
+            return this->samples_.data();
+        }
+
+        size_t sample_count() const
+        {
+            return this->samples_.size();
+        }
+
+        static void test();
+    };
+
+}
+
+
+#endif /* apu_hpp */
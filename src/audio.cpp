@@ -0,0 +1,340 @@
+#include "audio.hpp"
+#include "apu.hpp"
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <chrono>
+
+#define NES_WAV_HEADER_SIZE 44
+
+// the fill error, -1 for an empty ring to 1 for a full one, times this
+#define AUDIO_KP NES_AUDIO_MAX_ADJUST
+// added up per input sample, takes over a steady drift in about 20 s
+#define AUDIO_KI 1.3e-8
+// weight of a new fill reading, the consumer's periods make a sawtooth of it
+#define AUDIO_SMOOTHING (1.0 / 16)
+
+
+namespace nes {
+
+    static void put_le(uint8_t *at, uint32_t v, int bytes)
+    {
+        for (int i = 0; i < bytes; ++i) {
+            at[i] = (uint8_t)(v >> (i * 8));
+        }
+    }
+
+    static double clamp_adjust(double v)
+    {
+        return v < -NES_AUDIO_MAX_ADJUST ? -NES_AUDIO_MAX_ADJUST : v > NES_AUDIO_MAX_ADJUST ? NES_AUDIO_MAX_ADJUST : v;
+    }
+
+    wav_sink::~wav_sink()
+    {
+        this->close();
+    }
+
+    int wav_sink::open(const char *path, int rate)
+    {
+        this->close();
+        FILE *f = fopen(path, "wb");
+        if (f == nullptr) {
+            return AUDIO_ERROR_OPEN;
+        }
+        int err = this->open(f, rate);
+        this->own_ = true;
+        return err;
+    }
+
+    int wav_sink::open(FILE *f, int rate)
+    {
+        this->close();
+        uint8_t h[NES_WAV_HEADER_SIZE];
+        memcpy(h, "RIFF", 4);
+        put_le(h + 4, 0xffffffff, 4);
+        memcpy(h + 8, "WAVEfmt ", 8);
+        put_le(h + 16, 16, 4);
+        put_le(h + 20, 1, 2);                   // PCM
+        put_le(h + 22, 1, 2);                   // mono
+        put_le(h + 24, (uint32_t)rate, 4);
+        put_le(h + 28, (uint32_t)rate * 2, 4);  // bytes per second
+        put_le(h + 32, 2, 2);                   // bytes per frame
+        put_le(h + 34, 16, 2);
+        memcpy(h + 36, "data", 4);
+        put_le(h + 40, 0xffffffff, 4);
+        this->out_ = f;
+        this->own_ = false;
+        this->samples_ = 0;
+        this->failed_ = fwrite(h, 1, sizeof(h), f) != sizeof(h);
+        return this->failed_ ? AUDIO_ERROR_OPEN : 0;
+    }
+
+    void wav_sink::close()
+    {
+        if (this->out_ == nullptr) {
+            return;
+        }
+        uint64_t bytes = this->samples_ * 2;
+        long end = ftell(this->out_);
+        if (!this->failed_ && bytes <= 0xffffffffu - (NES_WAV_HEADER_SIZE - 8) && end >= 0 &&
+            fseek(this->out_, end - (long)bytes - (NES_WAV_HEADER_SIZE - 4), SEEK_SET) == 0) {
+            uint8_t size[4];
+            put_le(size, (uint32_t)bytes + NES_WAV_HEADER_SIZE - 8, 4);
+            fwrite(size, 1, 4, this->out_);
+            fseek(this->out_, end - (long)bytes - 4, SEEK_SET);
+            put_le(size, (uint32_t)bytes, 4);
+            fwrite(size, 1, 4, this->out_);
+            fseek(this->out_, end, SEEK_SET);
+        }
+        if (this->own_) {
+            fclose(this->out_);
+        }
+        else {
+            fflush(this->out_);
+        }
+        this->out_ = nullptr;
+        this->own_ = false;
+    }
+
+    bool wav_sink::write(const int16_t *samples, size_t n)
+    {
+        if (this->out_ == nullptr || this->failed_) {
+            return false;
+        }
+        // little endian on disk, which is all that is supported
+        this->failed_ = fwrite(samples, sizeof(int16_t), n, this->out_) != n;
+        this->samples_ += this->failed_ ? 0 : n;
+        return !this->failed_;
+    }
+
+    audio_output::audio_output(int in_rate, int out_rate, size_t capacity) noexcept
+    :ring_(capacity), out_rate_(out_rate), step_((double)in_rate / out_rate), fill_(0.0)
+    {
+    }
+
+    audio_output::~audio_output()
+    {
+        this->stop();
+    }
+
+    void audio_output::push(const int16_t *samples, size_t n)
+    {
+        if (n == 0) {
+            return;
+        }
+
+        double half = (double)(this->ring_.capacity() / 2);
+        this->fill_ += ((double)this->ring_.size() - this->fill_) * AUDIO_SMOOTHING;
+        double error = (this->fill_ - half) / half;
+        this->integral_ = clamp_adjust(this->integral_ + error * AUDIO_KI * (double)n);
+        // fuller than half takes bigger steps through the input and makes fewer samples
+        this->ratio_ = 1.0 + clamp_adjust(error * AUDIO_KP + this->integral_);
+
+        uint64_t step = (uint64_t)(this->step_ * this->ratio_ * 4294967296.0 + 0.5);
+        uint64_t end = (uint64_t)n << 32;
+        this->out_.resize((size_t)((end - this->pos_) / step) + 2);
+        int16_t *out = this->out_.data();
+        size_t count = 0;
+        uint64_t pos = this->pos_;
+        for (; pos < end; pos += step) {
+            size_t i = (size_t)(pos >> 32);
+            int64_t a = i == 0 ? this->last_ : samples[i - 1];
+            int64_t b = samples[i];
+            int64_t frac = (int64_t)(pos & 0xffffffff);
+            out[count++] = (int16_t)(a + (((b - a) * frac) >> 32));
+        }
+        this->pos_ = pos - end;
+        this->last_ = samples[n - 1];
+
+        size_t pushed = this->ring_.push(out, count);
+        this->dropped_ += count - pushed;
+    }
+
+    size_t audio_output::pull(int16_t *out, size_t n)
+    {
+        if (!this->playing_ && this->ring_.size() >= this->ring_.capacity() / 2) {
+            this->playing_ = true;
+        }
+        size_t got = 0;
+        if (this->playing_) {
+            got = this->ring_.pop(out, n);
+            if (got != 0) {
+                this->held_ = out[got - 1];
+            }
+            if (got < n) {
+                this->underruns_.store(this->underruns_.load(std::memory_order_relaxed) + (n - got),
+                                       std::memory_order_relaxed);
+            }
+        }
+        for (size_t i = got; i < n; ++i) {
+            out[i] = this->held_;
+        }
+        return got;
+    }
+
+    void audio_output::start(audio_sink& sink, size_t period)
+    {
+        this->stop();
+        this->stop_.store(false, std::memory_order_relaxed);
+        this->thread_ = std::thread([this, &sink, period]() {
+            this->run(sink, period);
+        });
+    }
+
+    void audio_output::stop()
+    {
+        if (!this->thread_.joinable()) {
+            return;
+        }
+        this->stop_.store(true, std::memory_order_relaxed);
+        this->thread_.join();
+    }
+
+    void audio_output::run(audio_sink& sink, size_t period)
+    {
+        std::vector<int16_t> buf(period);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> tick((double)period / this->out_rate_);
+        for (uint64_t k = 1; !this->stop_.load(std::memory_order_relaxed); ++k) {
+            // from the start each time, so rounding doesn't add up
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(tick * (double)k));
+            this->pull(buf.data(), period);
+            sink.write(buf.data(), period);
+        }
+    }
+
+    // a producer at the NES frame rate and a consumer whose clock is off by drift
+    static void audio_drift_test(double drift)
+    {
+        static const int rate = 44100;
+        static const double fps = NES_FRAME_RATE;
+        audio_output a(rate, rate);
+        double half = (double)(a.capacity() / 2);
+
+        int16_t frame[1024];
+        int16_t out[NES_AUDIO_PERIOD];
+        double made = 0.0;
+        int16_t phase = 0;
+        double frame_time = 0.0;
+        double pull_time = 0.0;
+        double pull_tick = NES_AUDIO_PERIOD / (rate * (1.0 + drift));
+        double worst = 0.0;
+        double late_fill = 0.0;
+        int late_pulls = 0;
+
+        // two minutes, the last 20 s have to sit at half
+        for (double end = 120.0; frame_time < end || pull_time < end;) {
+            if (frame_time <= pull_time) {
+                made += rate / fps;
+                size_t n = (size_t)made;
+                made -= (double)n;
+                for (size_t i = 0; i < n; ++i) {
+                    phase = (int16_t)(phase + 97);
+                    frame[i] = phase;
+                }
+                a.push(frame, n);
+                frame_time += 1.0 / fps;
+            }
+            else {
+                a.pull(out, NES_AUDIO_PERIOD);
+                double off = fabs((double)a.fill() - half);
+                worst = pull_time > 5.0 && off > worst ? off : worst;
+                if (pull_time >= 100.0) {
+                    late_fill += (double)a.fill();
+                    late_pulls++;
+                }
+                pull_time += pull_tick;
+            }
+        }
+
+        late_fill /= late_pulls;
+        // nothing dropped or repeated, the ring never got near either end
+        assert(a.underruns() == 0 && a.dropped() == 0);
+        assert(worst < half * 0.75);
+        assert(fabs(late_fill - half) < half * 0.1);
+        assert(fabs(a.ratio() * (1.0 + drift) - 1.0) < 0.0005);
+        (void)worst;
+    }
+
+    void audio_output::test()
+    {
+        // interpolation: a step comes in as a ramp from the sample before, then holds
+        {
+            audio_output a(100, 100, 64);
+            int16_t in[40];
+            for (int i = 0; i < 40; ++i) {
+                in[i] = 1000;
+            }
+            a.push(in, 40);
+            // the ring was empty, so the ratio is a little short of 1 and makes a sample more
+            assert(a.fill() == 41 && a.dropped() == 0 && a.ratio() < 1.0);
+            int16_t out[40];
+            size_t got = a.pull(out, 40);
+            assert(got == 40 && out[0] == 0 && out[1] > 900 && out[1] < 1000);
+            for (size_t i = 2; i < got; ++i) {
+                assert(out[i] == 1000);
+            }
+            // one left, then the last sample holds
+            got = a.pull(out, 8);
+            assert(got == 1 && out[7] == 1000 && a.underruns() == 7);
+            (void)got;
+        }
+
+        // no playing before the ring is half full
+        {
+            audio_output a(100, 100, 64);
+            int16_t in[16] = { 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5 };
+            a.push(in, 16);
+            int16_t out[4];
+            assert(a.pull(out, 4) == 0 && out[3] == 0 && a.underruns() == 0);
+            (void)out;
+        }
+
+        audio_drift_test(0.0);
+        audio_drift_test(0.005);
+        audio_drift_test(-0.005);
+
+        // WAV sizes get patched in
+        {
+            FILE *f = tmpfile();
+            assert(f != nullptr);
+            wav_sink w;
+            int err = w.open(f, 22050);
+            assert(err == 0);
+            int16_t s[100];
+            for (int i = 0; i < 100; ++i) {
+                s[i] = (int16_t)(i * 300 - 15000);
+            }
+            assert(w.write(s, 100) && w.write(s, 50) && w.samples() == 150);
+            w.close();
+            rewind(f);
+            uint8_t h[NES_WAV_HEADER_SIZE + 4];
+            size_t n = fread(h, 1, sizeof(h), f);
+            assert(n == sizeof(h) && memcmp(h, "RIFF", 4) == 0 && memcmp(h + 8, "WAVEfmt ", 8) == 0);
+            assert(h[4] == (uint8_t)(300 + 36) && h[5] == (uint8_t)((300 + 36) >> 8) && h[6] == 0);
+            assert(h[24] == 0x22 && h[25] == 0x56 && h[40] == (uint8_t)300 && h[41] == 1 && h[42] == 0);
+            assert((int16_t)(h[44] | h[45] << 8) == -15000);
+            fclose(f);
+            (void)err;
+            (void)s;
+            (void)n;
+        }
+
+        // a real consumer thread, what it pulled reaches the sink whole
+        {
+            null_sink sink;
+            audio_output a(44100, 44100, 2048);
+            a.start(sink, 256);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            int16_t frame[735];
+            memset(frame, 0, sizeof(frame));
+            for (int f = 1; f <= 12; ++f) {
+                a.push(frame, 735);
+                std::this_thread::sleep_until(start + std::chrono::microseconds(f * 16639));
+            }
+            a.stop();
+            assert(sink.samples() > 0 && sink.samples() % 256 == 0);
+        }
+    }
+
+}
@@ -0,0 +1,187 @@
+#ifndef audio_hpp
+#define audio_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "spsc_ring.hpp"
+
+// samples in flight, 186 ms at 44.1 kHz, the rate control keeps half of them
+#define NES_AUDIO_RING 8192
+// samples a sink takes at a time
+#define NES_AUDIO_PERIOD 512
+// how far the rate control may move the ratio, 17 cents of pitch
+#define NES_AUDIO_MAX_ADJUST 0.01
+
+#define AUDIO_ERROR_OPEN -70
+
+
+namespace nes {
+
+    // where the samples end up, called from the consumer thread only
+    class audio_sink {
+
+    public:
+        virtual ~audio_sink()
+        {
+        }
+
+        // mono 16 bit, false once writing failed
+        virtual bool write(const int16_t *samples, size_t n) = 0;
+    };
+
+    // counts the samples and forgets them
+    class null_sink : public audio_sink {
+
+        uint64_t samples_{0};
+
+    public:
+        bool write(const int16_t *samples, size_t n) override
+        {
+            this->samples_ += n;
+            return true;
+        }
+
+        uint64_t samples() const
+        {
+            return this->samples_;
+        }
+    };
+
+    // RIFF WAVE, 16 bit mono PCM; the sizes in the header are patched
+    // on close() when the file can seek, a pipe keeps 0xffffffff
+    class wav_sink : public audio_sink {
+
+        FILE *out_{nullptr};
+        bool own_{false};
+        bool failed_{false};
+        uint64_t samples_{0};
+
+    public:
+        wav_sink(const wav_sink&) = delete;
+        wav_sink(wav_sink&&) = delete;
+        wav_sink& operator=(const wav_sink&) = delete;
+        wav_sink& operator=(wav_sink&&) = delete;
+
+        wav_sink() noexcept
+        {
+        }
+
+        ~wav_sink();
+
+        // 0 or AUDIO_ERROR_OPEN, a file already open is closed first
+        int open(const char *path, int rate);
+        // writes to f from where it is, f stays open
+        int open(FILE *f, int rate);
+        void close();
+
+        bool write(const int16_t *samples, size_t n) override;
+
+        uint64_t samples() const
+        {
+            return this->samples_;
+        }
+    };
+
+    /*
+        Samples from the emulation thread to a consumer with a clock of
+        its own, through an spsc_ring.
+
+        push() never blocks: it resamples what the APU made by linear
+        interpolation and hands the result to the ring. The ratio is the
+        nominal one times an adjustment that keeps the ring half full,
+        from a PI controller on the fill the producer sees. A consumer
+        clock a little fast or slow, or a frame rate that isn't quite the
+        NES's, ends up in the integral term instead of in dropped or
+        repeated samples; the adjustment stays within NES_AUDIO_MAX_ADJUST.
+
+        pull() is the consumer's. It plays silence until the ring is half
+        full the first time, then only comes up short when the producer
+        stalls longer than the ring lasts, and holds the last sample then.
+        start() runs a thread that pulls NES_AUDIO_PERIOD samples at a
+        time by the steady clock and writes them to a sink.
+    */
+    class audio_output {
+
+        spsc_ring<int16_t> ring_;
+        int out_rate_;
+
+        // the producer's
+        double step_;                   // input samples per output sample at the nominal rates
+        double ratio_{1.0};
+        double integral_{0.0};
+        double fill_;                   // smoothed ring fill
+        uint64_t pos_{0};               // 32.32, next output from last_, which is 0
+        int16_t last_{0};
+        std::vector<int16_t> out_;
+        uint64_t dropped_{0};
+
+        // the consumer's
+        bool playing_{false};
+        int16_t held_{0};
+        std::atomic<uint64_t> underruns_{0};
+
+        std::thread thread_;
+        std::atomic<bool> stop_{false};
+
+        void run(audio_sink& sink, size_t period);
+
+    public:
+        audio_output(const audio_output&) = delete;
+        audio_output(audio_output&&) = delete;
+        audio_output& operator=(const audio_output&) = delete;
+        audio_output& operator=(audio_output&&) = delete;
+
+        // samples come in at in_rate, the consumer takes them at out_rate
+        audio_output(int in_rate, int out_rate, size_t capacity = NES_AUDIO_RING) noexcept;
+        // stops the consumer thread
+        ~audio_output();
+
+        // producer
+        void push(const int16_t *samples, size_t n);
+
+        // consumer: always fills n, returns how many came from the ring
+        size_t pull(int16_t *out, size_t n);
+
+        // a consumer thread writing to sink, which has to outlive stop()
+        void start(audio_sink& sink, size_t period = NES_AUDIO_PERIOD);
+        void stop();
+
+        // the resampling ratio the rate control settled on, 1 is nominal
+        double ratio() const
+        {
+            return this->ratio_;
+        }
+
+        size_t fill() const
+        {
+            return this->ring_.size();
+        }
+
+        size_t capacity() const
+        {
+            return this->ring_.capacity();
+        }
+
+        // resampled samples that found the ring full
+        uint64_t dropped() const
+        {
+            return this->dropped_;
+        }
+
+        // samples the consumer held the last one for, once playing
+        uint64_t underruns() const
+        {
+            return this->underruns_.load(std::memory_order_relaxed);
+        }
+
+        static void test();
+    };
+
+}
+
+
+#endif /* audio_hpp */
@@ -0,0 +1,216 @@
+#include "batch.hpp"
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include "console.hpp"
+#include "bench.hpp"
+
+
+namespace nes {
+
+    int batch_read_input(const std::string& path, std::vector<uint8_t>& buttons)
+    {
+        buttons.clear();
+        if (path == "-") {
+            return 0;
+        }
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f) {
+            return BATCH_ERROR_INPUT;
+        }
+        uint8_t buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            buttons.insert(buttons.end(), buf, buf + n);
+        }
+        fclose(f);
+        return 0;
+    }
+
+    int batch_parse(FILE *f, std::vector<batch_job>& jobs, int& line)
+    {
+        char buf[1024];
+        line = 0;
+        while (fgets(buf, sizeof(buf), f)) {
+            line++;
+            char *hash = strchr(buf, '#');
+            if (hash) {
+                *hash = 0;
+            }
+            char rom[512], input[512];
+            int frames;
+            char extra;
+            int fields = sscanf(buf, "%511s %511s %d %c", rom, input, &frames, &extra);
+            if (fields <= 0) {
+                continue;
+            }
+            if (fields != 3 || frames < 0) {
+                return BATCH_ERROR_SYNTAX;
+            }
+
+            batch_job job;
+            job.rom = rom;
+            job.input = input;
+            job.frames = frames;
+            if (batch_read_input(job.input, job.buttons) != 0) {
+                return BATCH_ERROR_INPUT;
+            }
+            jobs.push_back(std::move(job));
+        }
+        return 0;
+    }
+
+    int batch_parse(const char *path, std::vector<batch_job>& jobs, int& line)
+    {
+        line = 0;
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            return BATCH_ERROR_OPEN;
+        }
+        int err = batch_parse(f, jobs, line);
+        fclose(f);
+        return err;
+    }
+
+    // the console and everything it runs are local, the demo image is only read
+    static void run_job(const batch_job& job, const std::vector<uint8_t>& demo, batch_result& result)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        std::unique_ptr<console> nes(new console());
+        int err = job.rom == "-" ? nes->load(demo.data(), demo.size()) : nes->load(job.rom.c_str());
+        if (err != 0) {
+            result.error = err;
+            return;
+        }
+        nes->get_cpu().set_dispatch_mode(dispatch_mode::jit);
+
+        size_t pairs = job.buttons.size() / 2;
+        int done = 0;
+        while (done < job.frames) {
+            if (pairs) {
+                size_t i = (size_t)done < pairs ? done : pairs - 1;
+                nes->set_buttons(0, job.buttons[2 * i]);
+                nes->set_buttons(1, job.buttons[2 * i + 1]);
+            }
+            if (!nes->run_frame()) {
+                break;
+            }
+            done++;
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        result.frames = done;
+        result.hash = frame_hash(nes->frame());
+        result.seconds = elapsed.count();
+    }
+
+    double batch_run(const std::vector<batch_job>& jobs, work_pool& pool, std::vector<batch_result>& results)
+    {
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+
+        results.assign(jobs.size(), batch_result());
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        pool.run(jobs.size(), [&](size_t task, int worker) {
+            run_job(jobs[task], demo, results[task]);
+            results[task].worker = worker;
+        });
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    void batch_report(const std::vector<batch_job>& jobs, const std::vector<batch_result>& results,
+                      const work_pool& pool, double seconds)
+    {
+        uint64_t frames = 0;
+        double busy = 0;
+        int failed = 0;
+
+        printf("%-6s%-32s%8s%10s%10s%8s\n", "job", "rom", "frames", "hash", "ms", "worker");
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            const batch_result& r = results[i];
+            if (r.error != 0) {
+                printf("%-6zu%-32s  error %d\n", i, jobs[i].rom.c_str(), r.error);
+                failed++;
+                continue;
+            }
+            printf("%-6zu%-32s%8d  %08x%10.1f%8d\n", i, jobs[i].rom.c_str(), r.frames, r.hash, r.seconds * 1e3, r.worker);
+            frames += r.frames;
+            busy += r.seconds;
+        }
+
+        printf("\n%zu jobs, %d failed, %llu frames in %.3f s on %d threads, %llu steals\n",
+               jobs.size(), failed, (unsigned long long)frames, seconds, pool.threads(),
+               (unsigned long long)pool.steals());
+        printf("%.1f frames/s aggregate, %.1f per thread, %.0f%% busy\n",
+               seconds > 0 ? frames / seconds : 0.0,
+               seconds > 0 ? frames / seconds / pool.threads() : 0.0,
+               seconds > 0 ? 100 * busy / (seconds * pool.threads()) : 0.0);
+    }
+
+    void batch_test()
+    {
+        const char *text =
+            "# demo twice\n"
+            "- - 30\n"
+            "\n"
+            "-   -   12   # trailing comment\n";
+        FILE *f = tmpfile();
+        assert(f);
+        fputs(text, f);
+        rewind(f);
+        std::vector<batch_job> jobs;
+        int line;
+        int err = batch_parse(f, jobs, line);
+        fclose(f);
+        assert(err == 0);
+        assert(jobs.size() == 2 && jobs[0].frames == 30 && jobs[1].frames == 12);
+
+        f = tmpfile();
+        fputs("- - 1\n- -\n", f);
+        rewind(f);
+        std::vector<batch_job> bad;
+        err = batch_parse(f, bad, line);
+        fclose(f);
+        assert(err == BATCH_ERROR_SYNTAX && line == 2);
+        (void)err;
+
+        // uneven jobs, some with input, a missing ROM among them
+        for (int i = 0; i < 10; ++i) {
+            batch_job job;
+            job.rom = "-";
+            job.frames = 5 + 7 * (i % 4);
+            for (int b = 0; b < 2 * i; ++b) {
+                job.buttons.push_back((uint8_t)(b * 37));
+            }
+            jobs.push_back(job);
+        }
+        batch_job missing;
+        missing.rom = "/nonexistent.nes";
+        missing.frames = 10;
+        jobs.push_back(missing);
+
+        // same hashes whatever the threads, nothing is shared between consoles
+        std::vector<batch_result> serial;
+        work_pool one(1);
+        batch_run(jobs, one, serial);
+        for (int threads = 2; threads <= 4; ++threads) {
+            work_pool pool(threads);
+            std::vector<batch_result> results;
+            batch_run(jobs, pool, results);
+            for (size_t i = 0; i < jobs.size(); ++i) {
+                assert(results[i].error == serial[i].error);
+                assert(results[i].frames == serial[i].frames);
+                assert(results[i].hash == serial[i].hash);
+            }
+        }
+        for (size_t i = 0; i + 1 < jobs.size(); ++i) {
+            assert(serial[i].error == 0 && serial[i].frames == jobs[i].frames);
+        }
+        assert(serial.back().error != 0);
+        assert(serial[0].hash != serial[1].hash);
+    }
+
+}
@@ -0,0 +1,58 @@
+#ifndef batch_hpp
+#define batch_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "work_pool.hpp"
+
+#define BATCH_ERROR_OPEN -20
+#define BATCH_ERROR_SYNTAX -21
+#define BATCH_ERROR_INPUT -22
+
+
+namespace nes {
+
+    /*
+        One headless session: a ROM ("-" is the bench demo ROM), the
+        controller input and how many frames to run. The input file is
+        two bytes of BUTTON_* bits per frame, port 0 then port 1, and
+        holds its last value once it runs out.
+    */
+    struct batch_job {
+        std::string rom;
+        std::string input;
+        std::vector<uint8_t> buttons;
+        int frames{0};
+    };
+
+    struct batch_result {
+        int error{0};
+        int frames{0};
+        uint32_t hash{0};       // frame_hash() of the last frame
+        double seconds{0};
+        int worker{-1};
+    };
+
+    // an input file into buttons, "-" is none; 0 or BATCH_ERROR_INPUT
+    int batch_read_input(const std::string& path, std::vector<uint8_t>& buttons);
+
+    // "rom input frames" per line, "-" for no input, # comments; the inputs are read as well
+    // 0, BATCH_ERROR_OPEN, BATCH_ERROR_SYNTAX or BATCH_ERROR_INPUT, line is where it failed
+    int batch_parse(FILE *f, std::vector<batch_job>& jobs, int& line);
+    int batch_parse(const char *path, std::vector<batch_job>& jobs, int& line);
+
+    // every job on its own console, spread over the pool, wall clock seconds
+    double batch_run(const std::vector<batch_job>& jobs, work_pool& pool, std::vector<batch_result>& results);
+
+    // per job lines and the aggregate frames per second
+    void batch_report(const std::vector<batch_job>& jobs, const std::vector<batch_result>& results,
+                      const work_pool& pool, double seconds);
+
+    void batch_test();
+
+}
+
+
+#endif /* batch_hpp */
@@ -0,0 +1,1081 @@
+#include "bench.hpp"
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <dirent.h>
+#include "memory.hpp"
+#include "cpu_6502.hpp"
+#include "cartridge.hpp"
+#include "console.hpp"
+#include "batch.hpp"
+#include "cpu_6502_soa.hpp"
+#include "rewind.hpp"
+#include "trace.hpp"
+#include "flight_recorder.hpp"
+#include "video.hpp"
+#include <thread>
+#include <memory>
+
+
+namespace nes {
+
+    // copy 16 x 256 bytes from $1000 to $2000
+    static const uint8_t g_copy_code[] = {
+        0xa2, 0x10,             // LDX #$10
+        0x86, 0x00,             // STX $00
+        0xa0, 0x00,             // outer: LDY #$00
+        0xb9, 0x00, 0x10,       // inner: LDA $1000,Y
+        0x99, 0x00, 0x20,       // STA $2000,Y
+        0xc8,                   // INY
+        0xd0, 0xf7,             // BNE inner
+        0xc6, 0x00,             // DEC $00
+        0xd0, 0xf1,             // BNE outer
+    };
+
+    // nested DEX/DEY countdown, almost only branches
+    static const uint8_t g_countdown_code[] = {
+        0xa0, 0x40,             // LDY #$40
+        0xa2, 0x00,             // outer: LDX #$00
+        0xca,                   // inner: DEX
+        0xd0, 0xfd,             // BNE inner
+        0x88,                   // DEY
+        0xd0, 0xf8,             // BNE outer
+    };
+
+    // ADC/ASL/EOR/LSR/AND/ORA mix over two 256 byte tables
+    static const uint8_t g_alu_code[] = {
+        0xa2, 0x20,             // LDX #$20
+        0x86, 0x00,             // STX $00
+        0xa0, 0x00,             // outer: LDY #$00
+        0xa9, 0x00,             // LDA #$00
+        0x18,                   // inner: CLC
+        0x79, 0x00, 0x10,       // ADC $1000,Y
+        0x0a,                   // ASL A
+        0x59, 0x00, 0x11,       // EOR $1100,Y
+        0x4a,                   // LSR A
+        0x29, 0x7f,             // AND #$7F
+        0x09, 0x01,             // ORA #$01
+        0xc8,                   // INY
+        0xd0, 0xf0,             // BNE inner
+        0xc6, 0x00,             // DEC $00
+        0xd0, 0xe8,             // BNE outer
+    };
+
+    // fill 8 pages through a zero page pointer
+    static const uint8_t g_fill_code[] = {
+        0xa9, 0x00,             // LDA #$00
+        0x85, 0x10,             // STA $10
+        0xa9, 0x20,             // LDA #$20
+        0x85, 0x11,             // STA $11
+        0xa2, 0x08,             // LDX #$08
+        0xa0, 0x00,             // outer: LDY #$00
+        0x8a,                   // inner: TXA
+        0x91, 0x10,             // STA ($10),Y
+        0xc8,                   // INY
+        0xd0, 0xfa,             // BNE inner
+        0xe6, 0x11,             // INC $11
+        0xca,                   // DEX
+        0xd0, 0xf3,             // BNE outer
+    };
+
+    // compare, carry-dependent branch, ADC and BIT per element
+    static const uint8_t g_flags_code[] = {
+        0xa0, 0x20,             // LDY #$20
+        0xa2, 0x00,             // outer: LDX #$00
+        0xbd, 0x00, 0x10,       // inner: LDA $1000,X
+        0xc9, 0x80,             // CMP #$80
+        0x90, 0x02,             // BCC skip
+        0x49, 0xff,             // EOR #$FF
+        0x69, 0x03,             // skip: ADC #$03
+        0x24, 0x00,             // BIT $00
+        0x30, 0x00,             // BMI next
+        0xe8,                   // next: INX
+        0xd0, 0xee,             // BNE inner
+        0x88,                   // DEY
+        0xd0, 0xe9,             // BNE outer
+    };
+
+    static const bench_program g_bench_programs[] = {
+        { "copy",      0x0600, g_copy_code,      sizeof(g_copy_code) },
+        { "countdown", 0x0600, g_countdown_code, sizeof(g_countdown_code) },
+        { "alu",       0x0600, g_alu_code,       sizeof(g_alu_code) },
+        { "fill",      0x0600, g_fill_code,      sizeof(g_fill_code) },
+        { "flags",     0x0600, g_flags_code,     sizeof(g_flags_code) },
+    };
+
+    const bench_program* bench_programs(size_t& count)
+    {
+        count = arr_len(g_bench_programs);
+        return g_bench_programs;
+    }
+
+    static double bench_mips(const bench_program& prog, dispatch_mode mode, int reps)
+    {
+        memory mem;
+        cpu_6502 cpu(mem);
+        cpu.set_dispatch_mode(mode);
+        cpu.load_code_segment(prog.base, prog.code, prog.size);
+
+        // warm up
+        cpu.run();
+
+        uint64_t start_count = cpu.get_instruction_count();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < reps; ++i) {
+            cpu.run();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        uint64_t count = cpu.get_instruction_count() - start_count;
+        return count / elapsed.count() / 1e6;
+    }
+
+    void bench_dispatch()
+    {
+        static const struct {
+            const char *name;
+            dispatch_mode mode;
+        } modes[] = {
+            { "switch",   dispatch_mode::switch_case },
+            { "table",    dispatch_mode::call_table },
+            { "threaded", dispatch_mode::threaded },
+            { "blocks",   dispatch_mode::block_cache },
+            { "jit",      dispatch_mode::jit },
+        };
+
+        size_t count = 0;
+        const bench_program *progs = bench_programs(count);
+
+        printf("%-12s", "MIPS");
+        for (size_t m = 0; m < arr_len(modes); ++m) {
+            printf("%12s", modes[m].name);
+        }
+        printf("\n");
+
+        for (size_t i = 0; i < count; ++i) {
+            printf("%-12s", progs[i].name);
+            for (size_t m = 0; m < arr_len(modes); ++m) {
+                printf("%12.1f", bench_mips(progs[i], modes[m].mode, 200));
+            }
+            printf("\n");
+        }
+    }
+
+    void bench_alu()
+    {
+        static const char * const names[] = { "alu", "flags" };
+        static const struct {
+            const char *name;
+            dispatch_mode mode;
+        } modes[] = {
+            { "switch",   dispatch_mode::switch_case },
+            { "table",    dispatch_mode::call_table },
+            { "threaded", dispatch_mode::threaded },
+            { "blocks",   dispatch_mode::block_cache },
+            { "jit",      dispatch_mode::jit },
+        };
+
+        size_t count = 0;
+        const bench_program *progs = bench_programs(count);
+
+        printf("%-12s", "ns/op");
+        for (size_t m = 0; m < arr_len(modes); ++m) {
+            printf("%12s", modes[m].name);
+        }
+        printf("\n");
+
+        for (size_t i = 0; i < count; ++i) {
+            if (strcmp(progs[i].name, names[0]) != 0 && strcmp(progs[i].name, names[1]) != 0) {
+                continue;
+            }
+
+            printf("%-12s", progs[i].name);
+            for (size_t m = 0; m < arr_len(modes); ++m) {
+                // best of 5, single runs are too noisy
+                double best = 0;
+                for (int r = 0; r < 5; ++r) {
+                    double mips = bench_mips(progs[i], modes[m].mode, 100);
+                    best = mips > best ? mips : best;
+                }
+                printf("%12.2f", 1e3 / best);
+            }
+            printf("\n");
+        }
+    }
+
+    static double elapsed_us(std::chrono::steady_clock::time_point start)
+    {
+        std::chrono::duration<double, std::micro> d = std::chrono::steady_clock::now() - start;
+        return d.count();
+    }
+
+    static void print_latency(const char *name, std::vector<double>& us)
+    {
+        std::sort(us.begin(), us.end());
+        double sum = 0;
+        for (size_t i = 0; i < us.size(); ++i) {
+            sum += us[i];
+        }
+        printf("%-12s%12.1f%12.1f%12.1f%12.1f\n", name, sum / us.size(), us[us.size() / 2], us.back(), sum / 1000);
+    }
+
+    void bench_startup(const char *dir)
+    {
+        std::vector<std::string> paths;
+        DIR *d = opendir(dir);
+        if (d == nullptr) {
+            printf("can not open %s\n", dir);
+            return;
+        }
+        while (struct dirent *e = readdir(d)) {
+            size_t len = strlen(e->d_name);
+            if (len > 4 && strcasecmp(e->d_name + len - 4, ".nes") == 0) {
+                paths.push_back(std::string(dir) + "/" + e->d_name);
+            }
+        }
+        closedir(d);
+
+        if (paths.empty()) {
+            printf("no .nes files in %s\n", dir);
+            return;
+        }
+        std::sort(paths.begin(), paths.end());
+
+        // both variants end with the reset vector read, like a power up would
+        std::vector<double> mapped, copied;
+        size_t bytes = 0, failed = 0;
+        uint32_t vectors = 0;
+
+        for (int pass = 0; pass < 2; ++pass) {
+            mapped.clear();
+            copied.clear();
+
+            for (size_t i = 0; i < paths.size(); ++i) {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                cartridge cart;
+                if (cart.load(paths[i].c_str()) != 0) {
+                    failed += pass;
+                    continue;
+                }
+                vectors += cart.prg()[cart.prg_size() - 4];
+                mapped.push_back(elapsed_us(start));
+
+                start = std::chrono::steady_clock::now();
+                FILE *f = fopen(paths[i].c_str(), "rb");
+                if (f == nullptr) {
+                    continue;
+                }
+                fseek(f, 0, SEEK_END);
+                std::vector<uint8_t> buf(ftell(f));
+                fseek(f, 0, SEEK_SET);
+                size_t n = fread(buf.data(), 1, buf.size(), f);
+                fclose(f);
+                cartridge copy;
+                if (copy.load(buf.data(), n) == 0) {
+                    vectors += copy.prg()[copy.prg_size() - 4];
+                }
+                copied.push_back(elapsed_us(start));
+
+                if (pass == 1) {
+                    bytes += n;
+                }
+            }
+        }
+
+        if (mapped.empty() || copied.empty()) {
+            printf("no loadable ROMs in %s\n", dir);
+            return;
+        }
+
+        printf("%zu ROMs, %zu failed, %.1f MiB (warm page cache, %u)\n",
+               paths.size(), failed, bytes / 1048576.0, vectors & 0xff);
+        printf("%-12s%12s%12s%12s%12s\n", "us", "mean", "median", "max", "total ms");
+        print_latency("mmap", mapped);
+        print_latency("read+copy", copied);
+    }
+
+
+    // NROM demo: fills palette, nametables and OAM, then scrolls diagonally
+    // with a sprite DMA every NMI; 8K of pseudo random CHR
+    static const uint8_t g_demo_code[] = {
+        0x78,                   // reset: SEI
+        0xd8,                   // CLD
+        0xa2, 0xff,             // LDX #$FF
+        0x9a,                   // TXS
+        0xa9, 0x40,             // LDA #$40
+        0x8d, 0x17, 0x40,       // STA $4017, no frame IRQ
+        0xa9, 0x00,             // LDA #$00
+        0x8d, 0x00, 0x20,       // STA $2000
+        0x8d, 0x01, 0x20,       // STA $2001
+        0x2c, 0x02, 0x20,       // vblank: BIT $2002
+        0x10, 0xfb,             // BPL vblank
+        0xa9, 0x3f,             // LDA #$3F
+        0x8d, 0x06, 0x20,       // STA $2006
+        0xa9, 0x00,             // LDA #$00
+        0x8d, 0x06, 0x20,       // STA $2006
+        0xa2, 0x00,             // LDX #$00
+        0x8a,                   // palette: TXA
+        0x8d, 0x07, 0x20,       // STA $2007
+        0xe8,                   // INX
+        0xe0, 0x20,             // CPX #$20
+        0xd0, 0xf7,             // BNE palette
+        0xa9, 0x20,             // LDA #$20
+        0x8d, 0x06, 0x20,       // STA $2006
+        0xa9, 0x00,             // LDA #$00
+        0x8d, 0x06, 0x20,       // STA $2006
+        0xa0, 0x08,             // LDY #$08
+        0xa2, 0x00,             // LDX #$00
+        0x8a,                   // nametable: TXA
+        0x8d, 0x07, 0x20,       // STA $2007
+        0xe8,                   // INX
+        0xd0, 0xf9,             // BNE nametable
+        0x88,                   // DEY
+        0xd0, 0xf6,             // BNE nametable
+        0xa2, 0x00,             // LDX #$00
+        0x8a,                   // oam: TXA
+        0x9d, 0x00, 0x02,       // STA $0200,X
+        0xe8,                   // INX
+        0xd0, 0xf9,             // BNE oam
+        0xa9, 0x88,             // LDA #$88
+        0x8d, 0x00, 0x20,       // STA $2000
+        0xa9, 0x1e,             // LDA #$1E
+        0x8d, 0x01, 0x20,       // STA $2001
+        0x58,                   // CLI
+        0x4c, 0x58, 0x80,       // loop: JMP loop
+        0xa9, 0x02,             // nmi: LDA #$02
+        0x8d, 0x14, 0x40,       // STA $4014
+        0xe6, 0x00,             // INC $00
+        0xa5, 0x00,             // LDA $00
+        0x8d, 0x05, 0x20,       // STA $2005
+        0x8d, 0x05, 0x20,       // STA $2005
+        0x40,                   // RTI
+    };
+
+    void bench_demo_rom(std::vector<uint8_t>& image)
+    {
+        image.assign(NES_HEADER_SIZE + 2 * NES_PRG_BANK_SIZE + NES_CHR_BANK_SIZE, 0);
+        memcpy(image.data(), "NES\x1a", 4);
+        image[4] = 2;
+        image[5] = 1;
+
+        uint8_t *prg = image.data() + NES_HEADER_SIZE;
+        memcpy(prg, g_demo_code, sizeof(g_demo_code));
+        prg[0x7ffa] = 0x5b;
+        prg[0x7ffb] = 0x80;
+        prg[0x7ffc] = 0x00;
+        prg[0x7ffd] = 0x80;
+
+        uint32_t x = 0x2545f491;
+        uint8_t *chr = prg + 2 * NES_PRG_BANK_SIZE;
+        for (size_t i = 0; i < NES_CHR_BANK_SIZE; ++i) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            chr[i] = (uint8_t)x;
+        }
+    }
+
+    // best of 3, the console is rebuilt every time so caches start cold
+    static void bench_fps_row(const char *name, const char *path, const std::vector<uint8_t>& demo, int frames,
+                              dispatch_mode mode, pixel_path pixels, bool lockstep = false)
+    {
+        double best = 0;
+        uint64_t decodes = 0;
+        double runs = 0;
+        uint32_t hash = 0;
+        for (int r = 0; r < 3; ++r) {
+            console nes;
+            int err = path ? nes.load(path) : nes.load(demo.data(), demo.size());
+            if (err != 0) {
+                printf("can not load %s: %d\n", path, err);
+                return;
+            }
+            nes.get_cpu().set_dispatch_mode(mode);
+            nes.get_ppu().set_pixel_path(pixels);
+            nes.set_lockstep(lockstep);
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            int done = 0;
+            while (done < frames && nes.run_frame()) {
+                done++;
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            double fps = done / elapsed.count();
+            best = fps > best ? fps : best;
+            decodes = nes.get_ppu().tiles().decodes();
+            runs = done ? (double)nes.get_runs() / done : 0;
+            hash = frame_hash(nes.frame());
+        }
+        printf("%-12s%12.1f%12.3f%12llu%12.1f    %08x\n", name, best, 1e3 / best, (unsigned long long)decodes, runs, hash);
+    }
+
+    void bench_fps(const char *path, int frames)
+    {
+        static const struct {
+            const char *name;
+            dispatch_mode mode;
+        } modes[] = {
+            { "switch",   dispatch_mode::switch_case },
+            { "blocks",   dispatch_mode::block_cache },
+            { "jit",      dispatch_mode::jit },
+        };
+        static const pixel_path paths[] = { pixel_path::scalar, pixel_path::ssse3, pixel_path::avx2 };
+
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+        pixel_path best_path = detect_pixel_path();
+
+        printf("%s, %d frames, %s pixels\n", path ? path : "demo", frames, pixel_path_name(best_path));
+        printf("%-12s%12s%12s%12s%12s%12s\n", "", "fps", "ms/frame", "decodes", "runs/frame", "hash");
+        for (size_t m = 0; m < arr_len(modes); ++m) {
+            bench_fps_row(modes[m].name, path, demo, frames, modes[m].mode, best_path);
+        }
+
+        // pixel paths under the JIT, where the PPU is most of the frame
+        printf("\n");
+        for (size_t i = 0; i < arr_len(paths); ++i) {
+            if (pixel_path_supported(paths[i])) {
+                bench_fps_row(pixel_path_name(paths[i]), path, demo, frames, dispatch_mode::jit, paths[i]);
+            }
+        }
+
+        // the CPU stopped at every scanline instead of at the next event
+        printf("\n");
+        bench_fps_row("switch/line", path, demo, frames, dispatch_mode::switch_case, best_path, true);
+        bench_fps_row("jit/line", path, demo, frames, dispatch_mode::jit, best_path, true);
+    }
+
+    void bench_apu(int seconds)
+    {
+        static const struct {
+            uint16_t addr;
+            uint8_t v;
+        } setup[] = {
+            { 0x4017, 0x40 },
+            { 0x4015, 0x1f },
+            { 0x4000, 0xbf }, { 0x4002, 0xfd }, { 0x4003, 0x00 },     // 440 Hz square
+            { 0x4004, 0x5f }, { 0x4006, 0x7e }, { 0x4007, 0x00 },     // 880 Hz, 25% duty
+            { 0x4008, 0xff }, { 0x400a, 0x7e }, { 0x400b, 0x00 },     // 440 Hz triangle
+            { 0x400c, 0x3f }, { 0x400e, 0x04 }, { 0x400f, 0x00 },     // noise, period 64
+            { 0x4010, 0x4f }, { 0x4012, 0x00 }, { 0x4013, 0xff },     // looping DMC at the top rate
+            { 0x4015, 0x1f },
+        };
+
+        memory mem;
+        for (int i = 0; i < 0x4000; ++i) {
+            mem.write<uint8_t>((uint8_t)(i * 0x9d), (uint16_t)(0xc000 + i));
+        }
+
+        double best = 0;
+        size_t samples = 0;
+        int frames = seconds * 60;
+        for (int r = 0; r < 3; ++r) {
+            apu a(mem);
+            for (size_t i = 0; i < arr_len(setup); ++i) {
+                a.write(setup[i].addr, setup[i].v);
+            }
+
+            samples = 0;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int f = 1; f <= frames; ++f) {
+                a.end_frame((uint64_t)f * 29781);
+                samples += a.sample_count();
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            double speed = seconds / elapsed.count();
+            best = speed > best ? speed : best;
+        }
+
+        printf("all 5 channels, %d s, %zu samples at %d Hz\n", seconds, samples, NES_SAMPLE_RATE);
+        printf("%12.1fx realtime %12.3f us/frame\n", best, 1e6 / (best * 60));
+    }
+
+    void bench_state(const char *path, int frames)
+    {
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+        console nes;
+        int err = path ? nes.load(path) : nes.load(demo.data(), demo.size());
+        if (err != 0) {
+            printf("can not load %s: %d\n", path, err);
+            return;
+        }
+
+        std::vector<uint8_t> state;
+        double seconds[2] = {0};
+        size_t bytes[2] = {0};
+        int done = 0;
+        for (int f = 0; f < frames && nes.run_frame(); ++f) {
+            // every other frame full, the incremental ones only see a frame of writes
+            bool incremental = f & 1;
+            state.clear();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            nes.save_state(state, incremental);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            seconds[incremental] += elapsed.count();
+            bytes[incremental] += state.size();
+            done += incremental;
+        }
+        if (done == 0) {
+            return;
+        }
+
+        printf("%s, %d frames, mean per state\n", path ? path : "demo", frames);
+        printf("%-12s%12s%12s\n", "", "bytes", "us");
+        printf("%-12s%12zu%12.2f\n", "full", bytes[0] / done, 1e6 * seconds[0] / done);
+        printf("%-12s%12zu%12.2f\n", "incremental", bytes[1] / done, 1e6 * seconds[1] / done);
+    }
+
+    void bench_rewind(const char *path, int frames)
+    {
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+        console nes;
+        int err = path ? nes.load(path) : nes.load(demo.data(), demo.size());
+        if (err != 0) {
+            printf("can not load %s: %d\n", path, err);
+            return;
+        }
+
+        rewind_buffer rb((size_t)64 << 20);
+        double push = 0;
+        double worst = 0;
+        int done = 0;
+        while (done < frames && nes.run_frame()) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            rb.push(nes);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            push += elapsed.count();
+            worst = elapsed.count() > worst ? elapsed.count() : worst;
+            done++;
+        }
+        size_t held = rb.frames();
+        double per_minute = rb.bytes_per_minute();
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        size_t popped = 0;
+        while (rb.pop(nes)) {
+            popped++;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double pop = elapsed.count();
+        if (done == 0 || popped == 0) {
+            return;
+        }
+
+        printf("%s, %d frames, %zu held\n", path ? path : "demo", done, held);
+        printf("%-12s%12.2f us/frame, worst %.2f us\n", "push", 1e6 * push / done, 1e6 * worst);
+        printf("%-12s%12.2f us/frame\n", "pop", 1e6 * pop / popped);
+        printf("%-12s%12.1f bytes/frame, %.2f MB/minute\n", "memory", per_minute / NES_FRAMES_PER_MINUTE,
+               per_minute / (1 << 20));
+    }
+
+    void bench_batch(int jobs, int frames)
+    {
+        std::vector<batch_job> list(jobs);
+        for (size_t i = 0; i < list.size(); ++i) {
+            list[i].rom = "-";
+            list[i].frames = frames;
+        }
+
+        int cores = (int)std::thread::hardware_concurrency();
+        cores = cores > 0 ? cores : 1;
+        printf("%d demo jobs of %d frames, %d hardware threads\n", jobs, frames, cores);
+        printf("%-12s%12s%12s%12s%12s\n", "threads", "fps", "speedup", "efficiency", "steals");
+
+        double base = 0;
+        for (int threads = 1; ; threads *= 2) {
+            threads = threads < cores ? threads : cores;
+            work_pool pool(threads);
+
+            // best of 3
+            double best = 0;
+            for (int r = 0; r < 3; ++r) {
+                std::vector<batch_result> results;
+                double seconds = batch_run(list, pool, results);
+                double fps = (double)jobs * frames / seconds;
+                best = fps > best ? fps : best;
+            }
+            base = threads == 1 ? best : base;
+            printf("%-12d%12.1f%12.2f%11.0f%%%12llu\n", threads, best, best / base,
+                   100 * best / (base * threads), (unsigned long long)pool.steals());
+            if (threads == cores) {
+                break;
+            }
+        }
+    }
+
+    // lanes machines with random RAM outside the code, or all zero when same is set
+    static void bench_soa_fill(std::vector<uint8_t>& ram, size_t lanes, const bench_program& prog, bool same)
+    {
+        uint32_t x = 0x9e3779b9;
+        ram.assign(lanes * NES_MAX_RAM, 0);
+        for (size_t l = 0; l < lanes && !same; ++l) {
+            for (uint32_t a = 0; a < NES_MAX_RAM; ++a) {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                ram[l * NES_MAX_RAM + a] = (uint8_t)x;
+            }
+        }
+        for (size_t l = 0; l < lanes; ++l) {
+            memcpy(&ram[l * NES_MAX_RAM + prog.base], prog.code, prog.size);
+        }
+    }
+
+    // lanes cpu_6502s one after the other, MIPS summed over them
+    static double bench_soa_scalar(const bench_program& prog, const std::vector<uint8_t>& ram, size_t lanes,
+                                   dispatch_mode mode)
+    {
+        std::vector<std::unique_ptr<memory>> mems(lanes);
+        std::vector<std::unique_ptr<cpu_6502>> cpus(lanes);
+        for (size_t l = 0; l < lanes; ++l) {
+            mems[l].reset(new memory());
+            memcpy(mems[l]->map_offset_addr(0), &ram[l * NES_MAX_RAM], NES_MAX_RAM);
+            cpus[l].reset(new cpu_6502(*mems[l]));
+            cpus[l]->set_dispatch_mode(mode);
+            cpus[l]->load_code_segment(prog.base, prog.code, prog.size);
+            cpus[l]->run();
+        }
+
+        double best = 0;
+        for (int r = 0; r < 5; ++r) {
+            uint64_t count = 0;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (size_t l = 0; l < lanes; ++l) {
+                uint64_t before = cpus[l]->get_instruction_count();
+                cpus[l]->run();
+                count += cpus[l]->get_instruction_count() - before;
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            double mips = count / elapsed.count() / 1e6;
+            best = mips > best ? mips : best;
+        }
+        return best;
+    }
+
+    static double bench_soa_lanes(const bench_program& prog, const std::vector<uint8_t>& ram, size_t lanes,
+                                  soa_isa isa, double& utilisation)
+    {
+        cpu_6502_soa soa(lanes);
+        soa.set_isa(isa);
+        for (size_t l = 0; l < lanes; ++l) {
+            for (uint32_t a = 0; a < NES_MAX_RAM; ++a) {
+                soa.write(l, (uint16_t)a, ram[l * NES_MAX_RAM + a]);
+            }
+        }
+        soa.load_code_segment(prog.base, prog.code, prog.size);
+        soa.run();
+
+        double best = 0;
+        for (int r = 0; r < 5; ++r) {
+            uint64_t count = soa.get_instruction_count();
+            uint64_t steps = soa.get_step_count();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            soa.run();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            count = soa.get_instruction_count() - count;
+            steps = soa.get_step_count() - steps;
+            double mips = count / elapsed.count() / 1e6;
+            best = mips > best ? mips : best;
+            utilisation = (double)count / (steps * NES_SOA_LANES);
+        }
+        return best;
+    }
+
+    void bench_soa(size_t lanes)
+    {
+        static const struct {
+            const char *name;
+            dispatch_mode mode;
+        } modes[] = {
+            { "switch", dispatch_mode::switch_case },
+            { "jit",    dispatch_mode::jit },
+        };
+        static const soa_isa isas[] = { soa_isa::generic, soa_isa::avx2, soa_isa::avx512 };
+
+        size_t count = 0;
+        const bench_program *progs = bench_programs(count);
+        lanes = (lanes + NES_SOA_LANES - 1) / NES_SOA_LANES * NES_SOA_LANES;
+        lanes = lanes ? lanes : NES_SOA_LANES;
+
+        printf("%zu lanes, MIPS summed over lanes, (lane utilisation)\n", lanes);
+        printf("%-16s", "program");
+        for (size_t m = 0; m < arr_len(modes); ++m) {
+            printf("%12s", modes[m].name);
+        }
+        for (size_t i = 0; i < arr_len(isas); ++i) {
+            printf("%20s", cpu_6502_soa::isa_name(isas[i]));
+        }
+        printf("\n");
+
+        for (size_t i = 0; i < count; ++i) {
+            for (int same = 1; same >= 0; --same) {
+                std::vector<uint8_t> ram;
+                bench_soa_fill(ram, lanes, progs[i], same != 0);
+
+                std::string name = std::string(progs[i].name) + (same ? " same" : " random");
+                printf("%-16s", name.c_str());
+                for (size_t m = 0; m < arr_len(modes); ++m) {
+                    printf("%12.1f", bench_soa_scalar(progs[i], ram, lanes, modes[m].mode));
+                }
+                for (size_t k = 0; k < arr_len(isas); ++k) {
+                    if (!cpu_6502_soa::isa_supported(isas[k])) {
+                        printf("%20s", "-");
+                        continue;
+                    }
+                    double utilisation = 0;
+                    double mips = bench_soa_lanes(progs[i], ram, lanes, isas[k], utilisation);
+                    printf("%12.1f (%3.0f%%)", mips, 100 * utilisation);
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    // MIPS of prog on the switch backend, into t when it is not nullptr
+    static double bench_trace_mips(const bench_program& prog, tracer *t, int reps)
+    {
+        memory mem;
+        cpu_6502 cpu(mem);
+        cpu.load_code_segment(prog.base, prog.code, prog.size);
+        cpu.set_tracer(t);
+        cpu.run();
+
+        double best = 0;
+        for (int r = 0; r < 3; ++r) {
+            uint64_t start_count = cpu.get_instruction_count();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int i = 0; i < reps; ++i) {
+                cpu.run();
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            double mips = (cpu.get_instruction_count() - start_count) / elapsed.count() / 1e6;
+            best = mips > best ? mips : best;
+        }
+        return best;
+    }
+
+    void bench_trace(const char *path, int frames)
+    {
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+
+        // the records dropped at every flush, then written to a real file
+        FILE *f = tmpfile();
+        if (f == nullptr) {
+            printf("can not create a trace file\n");
+            return;
+        }
+        tracer dropped;
+        tracer written;
+        written.open(f);
+
+        printf("%-12s%12s%12s%12s%12s%12s\n", "", "plain", "dropped", "slowdown", "written", "slowdown");
+        size_t count = 0;
+        const bench_program *progs = bench_programs(count);
+        for (size_t i = 0; i < count; ++i) {
+            double plain = bench_trace_mips(progs[i], nullptr, 100);
+            double cpu = bench_trace_mips(progs[i], &dropped, 100);
+            double io = bench_trace_mips(progs[i], &written, 100);
+            printf("%-12s%11.1fM%11.1fM%11.2fx%11.1fM%11.2fx\n", progs[i].name, plain, cpu, plain / cpu, io, plain / io);
+        }
+
+        double fps[3] = { 0, 0, 0 };
+        tracer *tracers[3] = { nullptr, &dropped, &written };
+        for (int k = 0; k < 3; ++k) {
+            for (int r = 0; r < 3; ++r) {
+                console nes;
+                int err = path ? nes.load(path) : nes.load(demo.data(), demo.size());
+                if (err != 0) {
+                    printf("can not load %s: %d\n", path, err);
+                    return;
+                }
+                nes.get_cpu().set_tracer(tracers[k]);
+
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                int done = 0;
+                while (done < frames && nes.run_frame()) {
+                    done++;
+                }
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                double v = done / elapsed.count();
+                fps[k] = v > fps[k] ? v : fps[k];
+            }
+        }
+        printf("%-12s%10.1f/s%10.1f/s%11.2fx%10.1f/s%11.2fx\n", path ? "frames" : "demo frames",
+               fps[0], fps[1], fps[0] / fps[1], fps[2], fps[0] / fps[2]);
+
+        written.flush();
+        printf("%llu records written, %.1f MiB\n", (unsigned long long)written.records(),
+               written.records() * sizeof(trace_record) / 1048576.0);
+        written.close();
+        fclose(f);
+    }
+
+    // MIPS of prog on mode, recording into r when it is not nullptr
+    static double bench_flight_mips(const bench_program& prog, dispatch_mode mode, flight_recorder *r, int reps)
+    {
+        memory mem;
+        cpu_6502 cpu(mem);
+        cpu.load_code_segment(prog.base, prog.code, prog.size);
+        cpu.set_dispatch_mode(mode);
+        cpu.set_flight_recorder(r, false);
+        cpu.run();
+
+        double best = 0;
+        for (int k = 0; k < 3; ++k) {
+            uint64_t start_count = cpu.get_instruction_count();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int i = 0; i < reps; ++i) {
+                cpu.run();
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            double mips = (cpu.get_instruction_count() - start_count) / elapsed.count() / 1e6;
+            best = mips > best ? mips : best;
+        }
+        return best;
+    }
+
+    void bench_flight(const char *path, int frames)
+    {
+        static const struct {
+            const char *name;
+            dispatch_mode mode;
+        } modes[] = {
+            { "switch",   dispatch_mode::switch_case },
+            { "table",    dispatch_mode::call_table },
+            { "threaded", dispatch_mode::threaded },
+            { "blocks",   dispatch_mode::block_cache },
+            { "jit",      dispatch_mode::jit },
+        };
+
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+        flight_recorder recorder;
+
+        // slowdown of every backend with the recorder on, all of them
+        // record block entries only
+        printf("%-12s", "slowdown");
+        for (size_t m = 0; m < arr_len(modes); ++m) {
+            printf("%12s", modes[m].name);
+        }
+        printf("\n");
+
+        size_t count = 0;
+        const bench_program *progs = bench_programs(count);
+        for (size_t i = 0; i < count; ++i) {
+            printf("%-12s", progs[i].name);
+            for (size_t m = 0; m < arr_len(modes); ++m) {
+                double off = bench_flight_mips(progs[i], modes[m].mode, nullptr, 100);
+                double on = bench_flight_mips(progs[i], modes[m].mode, &recorder, 100);
+                printf("%11.2fx", off / on);
+            }
+            printf("\n");
+        }
+
+        // whole frames, where the PPU and APU share the time
+        printf("%-12s", path ? "frames" : "demo frames");
+        for (size_t m = 0; m < arr_len(modes); ++m) {
+            double fps[2] = { 0, 0 };
+            for (int k = 0; k < 2; ++k) {
+                for (int r = 0; r < 3; ++r) {
+                    console nes;
+                    int err = path ? nes.load(path) : nes.load(demo.data(), demo.size());
+                    if (err != 0) {
+                        printf("can not load %s: %d\n", path, err);
+                        return;
+                    }
+                    nes.get_cpu().set_dispatch_mode(modes[m].mode);
+                    nes.get_cpu().set_flight_recorder(k ? &nes.get_flight_recorder() : nullptr, false);
+
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    int done = 0;
+                    while (done < frames && nes.run_frame()) {
+                        done++;
+                    }
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                    double v = done / elapsed.count();
+                    fps[k] = v > fps[k] ? v : fps[k];
+                }
+            }
+            printf("%11.2fx", fps[0] / fps[1]);
+        }
+        printf("\n");
+    }
+
+    // how a PPU thread runs frames: serial, waiting for every picture, or a frame late
+    enum class ppu_mode {
+        serial,
+        thread,
+        pipelined,
+    };
+
+    struct ppu_thread_row {
+        double fps;
+        double latency;         // ms from starting a frame to having its picture, mean
+        double latency_max;
+        uint64_t waits;
+        uint64_t stalls;
+        bool same;              // every picture the serial one
+    };
+
+    static bool bench_ppu_thread_row(const char *path, const std::vector<uint8_t>& demo, int frames,
+                                     dispatch_mode dispatch, ppu_mode mode, std::vector<uint32_t>& hashes,
+                                     ppu_thread_row& row)
+    {
+        typedef std::chrono::steady_clock clock;
+        row = ppu_thread_row{ 0, 0, 0, 0, 0, true };
+        for (int r = 0; r < 3; ++r) {
+            std::unique_ptr<console> nes(new console());
+            int err = path ? nes->load(path) : nes->load(demo.data(), demo.size());
+            if (err != 0) {
+                printf("can not load %s: %d\n", path, err);
+                return false;
+            }
+            nes->get_cpu().set_dispatch_mode(dispatch);
+            nes->set_ppu_thread(mode != ppu_mode::serial);
+
+            std::vector<clock::time_point> started(frames);
+            double latency = 0;
+            double latency_max = 0;
+            auto picture = [&](int f, const uint8_t *frame) {
+                std::chrono::duration<double, std::milli> t = clock::now() - started[f];
+                latency += t.count();
+                latency_max = t.count() > latency_max ? t.count() : latency_max;
+                uint32_t h = frame_hash(frame);
+                if (mode == ppu_mode::serial) {
+                    hashes[f] = h;
+                }
+                row.same = row.same && h == hashes[f];
+            };
+
+            clock::time_point start = clock::now();
+            int done = 0;
+            while (done < frames) {
+                started[done] = clock::now();
+                if (!nes->run_frame()) {
+                    break;
+                }
+                if (mode != ppu_mode::pipelined) {
+                    picture(done, nes->frame());
+                }
+                else if (done > 0) {
+                    picture(done - 1, nes->previous_frame());
+                }
+                done++;
+            }
+            if (mode == ppu_mode::pipelined && done > 0) {
+                picture(done - 1, nes->frame());
+            }
+            std::chrono::duration<double> elapsed = clock::now() - start;
+
+            double fps = done / elapsed.count();
+            if (fps > row.fps) {
+                row.fps = fps;
+                row.latency = done ? latency / done : 0;
+                row.latency_max = latency_max;
+                ppu_thread *t = nes->get_ppu().get_thread();
+                row.waits = t ? t->waits() : 0;
+                row.stalls = t ? t->stalls() : 0;
+            }
+        }
+        return true;
+    }
+
+    void bench_ppu_thread(const char *path, int frames)
+    {
+        static const struct {
+            const char *name;
+            dispatch_mode mode;
+        } dispatches[] = {
+            { "switch",   dispatch_mode::switch_case },
+            { "jit",      dispatch_mode::jit },
+        };
+        static const struct {
+            const char *name;
+            ppu_mode mode;
+        } modes[] = {
+            { "serial",    ppu_mode::serial },
+            { "thread",    ppu_mode::thread },
+            { "pipelined", ppu_mode::pipelined },
+        };
+
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+        std::vector<uint32_t> hashes(frames);
+
+        printf("%s, %d frames, %s pixels\n", path ? path : "demo", frames, pixel_path_name(detect_pixel_path()));
+        printf("%-20s%12s%12s%12s%12s%10s%10s%8s\n", "", "fps", "ms/frame", "latency ms", "max ms", "waits",
+               "stalls", "same");
+        for (size_t d = 0; d < arr_len(dispatches); ++d) {
+            for (size_t m = 0; m < arr_len(modes); ++m) {
+                ppu_thread_row row;
+                if (!bench_ppu_thread_row(path, demo, frames, dispatches[d].mode, modes[m].mode, hashes, row)) {
+                    return;
+                }
+                char name[32];
+                snprintf(name, sizeof(name), "%s/%s", dispatches[d].name, modes[m].name);
+                printf("%-20s%12.1f%12.3f%12.3f%12.3f%10llu%10llu%8s\n", name, row.fps, 1e3 / row.fps, row.latency,
+                       row.latency_max, (unsigned long long)row.waits, (unsigned long long)row.stalls,
+                       row.same ? "yes" : "NO");
+            }
+        }
+    }
+
+    void bench_video(const char *path, int frames)
+    {
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+        std::unique_ptr<console> nes(new console());
+        int err = path ? nes->load(path) : nes->load(demo.data(), demo.size());
+        if (err != 0) {
+            printf("can not load %s: %d\n", path, err);
+            return;
+        }
+        // pictures the way the PPU leaves them, converted from where they are
+        std::vector<uint8_t> pictures;
+        for (int f = 0; f < frames && nes->run_frame(); ++f) {
+            pictures.insert(pictures.end(), nes->frame(), nes->frame() + NES_SCREEN_PIXELS);
+        }
+        size_t count = pictures.size() / NES_SCREEN_PIXELS;
+        if (count == 0) {
+            return;
+        }
+
+        static const pixel_format formats[] = { pixel_format::rgba, pixel_format::rgb565, pixel_format::yuv444 };
+        static const pixel_path paths[] = { pixel_path::scalar, pixel_path::ssse3, pixel_path::avx2 };
+        video_output out;
+        std::vector<uint8_t> pixels(NES_SCREEN_PIXELS * 4);
+        printf("%s, %zu pictures, us per picture\n%-8s", path ? path : "demo", count, "");
+        for (size_t f = 0; f < arr_len(formats); ++f) {
+            printf("%10s", pixel_format_name(formats[f]));
+        }
+        printf("\n");
+        for (size_t p = 0; p < arr_len(paths); ++p) {
+            if (!pixel_path_supported(paths[p])) {
+                printf("%-8s not supported\n", pixel_path_name(paths[p]));
+                continue;
+            }
+            out.set_pixel_path(paths[p]);
+            printf("%-8s", pixel_path_name(paths[p]));
+            for (size_t f = 0; f < arr_len(formats); ++f) {
+                double best = 1e30;
+                for (int r = 0; r < 5; ++r) {
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    for (size_t i = 0; i < count; ++i) {
+                        out.convert(&pictures[i * NES_SCREEN_PIXELS], formats[f], pixels.data());
+                    }
+                    double us = elapsed_us(start) / (double)count;
+                    best = us < best ? us : best;
+                }
+                printf("%10.2f", best);
+            }
+            printf("\n");
+        }
+    }
+
+}
@@ -0,0 +1,84 @@
+#ifndef bench_hpp
+#define bench_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+
+namespace nes {
+
+    struct bench_program {
+        const char *name;
+        uint16_t base;
+        const uint8_t *code;
+        size_t size;
+    };
+
+    // 6502 kernels shared by the benchmarks
+    const bench_program* bench_programs(size_t& count);
+
+    // emulated MIPS of every dispatch backend on every bench program
+    void bench_dispatch();
+
+    // ns per instruction of every backend on the ALU/flag heavy kernels
+    void bench_alu();
+
+    // cartridge load latency over every .nes file in dir, mmap against read + copy
+    void bench_startup(const char *dir);
+
+    // NROM image that renders a scrolling background and sprites
+    void bench_demo_rom(std::vector<uint8_t>& image);
+
+    // headless frames per second, path may be nullptr for the demo ROM
+    void bench_fps(const char *path, int frames);
+
+    // APU synthesis speed with every channel playing
+    void bench_apu(int seconds);
+
+    // aggregate frames per second of jobs demo sessions on 1, 2, 4 ... threads
+    void bench_batch(int jobs, int frames);
+
+    // bytes and time of a full save state against one per frame incremental, path may be nullptr for the demo ROM
+    void bench_state(const char *path, int frames);
+
+    // rewind_buffer push and pop cost per frame and the memory a minute of it takes
+    void bench_rewind(const char *path, int frames);
+
+    // lockstep lanes of cpu_6502_soa against as many cpu_6502s, same and per lane random data
+    void bench_soa(size_t lanes);
+
+    // switch backend MIPS and frames per second untraced, traced into a buffer that is dropped and traced to a file
+    void bench_trace(const char *path, int frames);
+
+    // how much slower every backend runs with a flight_recorder attached, on
+    // the bench programs and on whole frames; path may be nullptr for the demo ROM
+    void bench_flight(const char *path, int frames);
+
+    // frames per second and the latency from starting a frame to its
+    // picture, drawn serially, on a PPU thread waiting for every picture
+    // and on one a frame late, with every picture checked against the
+    // serial ones; path may be nullptr for the demo ROM
+    void bench_ppu_thread(const char *path, int frames);
+
+    // microseconds per picture of the palette conversion to every pixel
+    // format on every pixel path, over frames pictures of a ROM; path may
+    // be nullptr for the demo ROM
+    void bench_video(const char *path, int frames);
+
+    // the workload kernels (memcpy, multiply, sort, CRC, RLE, branch and stack
+    // heavy) on every dispatch backend as JSON: per kernel and backend the
+    // instructions and cycles of a run, then instructions and cycles per
+    // second over reps timed repetitions after warmup untimed runs.
+    // kernel and mode pick one of each, nullptr for all; false when a
+    // kernel's result was wrong
+    bool bench_suite(FILE *out, int reps, int warmup, const char *kernel, const char *mode);
+
+    // every suite kernel's result and counts checked on every backend
+    void bench_suite_test();
+
+}
+
+
+#endif /* bench_hpp */
@@ -0,0 +1,516 @@
+#include "bench.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include "memory.hpp"
+#include "cpu_6502.hpp"
+
+// a timed repetition is at least this many runs of a kernel back to back
+#define BENCH_SUITE_REP_SECONDS 0.005
+#define BENCH_SUITE_VERSION 1
+
+
+namespace nes {
+
+    // copy 8 pages from $1000 to $3000 through two zero page pointers
+    static const uint8_t g_memcpy_code[] = {
+        0xa9, 0x00,             // LDA #$00
+        0x85, 0x10,             // STA $10
+        0x85, 0x12,             // STA $12
+        0xa9, 0x10,             // LDA #$10
+        0x85, 0x11,             // STA $11
+        0xa9, 0x30,             // LDA #$30
+        0x85, 0x13,             // STA $13
+        0xa2, 0x08,             // LDX #$08
+        0xa0, 0x00,             // LDY #$00
+        0xb1, 0x10,             // loop: LDA ($10),Y
+        0x91, 0x12,             // STA ($12),Y
+        0xc8,                   // INY
+        0xd0, 0xf9,             // BNE loop
+        0xe6, 0x11,             // INC $11
+        0xe6, 0x13,             // INC $13
+        0xca,                   // DEX
+        0xd0, 0xf2,             // BNE loop
+    };
+
+    // x * (x ^ $5A) for every x, shift and add, 16 bit products to $2000/$2100
+    static const uint8_t g_multiply_code[] = {
+        0xa2, 0x00,             // LDX #$00
+        0x86, 0x20,             // outer: STX $20
+        0x8a,                   // TXA
+        0x49, 0x5a,             // EOR #$5A
+        0x85, 0x21,             // STA $21
+        0xa9, 0x00,             // LDA #$00
+        0xa0, 0x08,             // LDY #$08
+        0x46, 0x21,             // bit: LSR $21
+        0x90, 0x03,             // BCC skip
+        0x18,                   // CLC
+        0x65, 0x20,             // ADC $20
+        0x6a,                   // skip: ROR A
+        0x66, 0x22,             // ROR $22
+        0x88,                   // DEY
+        0xd0, 0xf3,             // BNE bit
+        0x9d, 0x00, 0x21,       // STA $2100,X
+        0xa5, 0x22,             // LDA $22
+        0x9d, 0x00, 0x20,       // STA $2000,X
+        0xe8,                   // INX
+        0xd0, 0xdd,             // BNE outer
+    };
+
+    // fill $1000 with the x * 5 + 1 sequence, a permutation, then bubble sort it
+    static const uint8_t g_sort_code[] = {
+        0xa2, 0x00,             // LDX #$00
+        0xa9, 0x37,             // LDA #$37
+        0x85, 0x00,             // fill: STA $00
+        0x0a,                   // ASL A
+        0x0a,                   // ASL A
+        0x38,                   // SEC
+        0x65, 0x00,             // ADC $00
+        0x9d, 0x00, 0x10,       // STA $1000,X
+        0xe8,                   // INX
+        0xd0, 0xf3,             // BNE fill
+        0xa0, 0xff,             // LDY #$FF
+        0xa2, 0x00,             // pass: LDX #$00
+        0xbd, 0x00, 0x10,       // cmp: LDA $1000,X
+        0xdd, 0x01, 0x10,       // CMP $1001,X
+        0x90, 0x0d,             // BCC next
+        0x85, 0x00,             // STA $00
+        0xbd, 0x01, 0x10,       // LDA $1001,X
+        0x9d, 0x00, 0x10,       // STA $1000,X
+        0xa5, 0x00,             // LDA $00
+        0x9d, 0x01, 0x10,       // STA $1001,X
+        0xe8,                   // next: INX
+        0xe0, 0xff,             // CPX #$FF
+        0xd0, 0xe6,             // BNE cmp
+        0x88,                   // DEY
+        0xd0, 0xe1,             // BNE pass
+    };
+
+    // bitwise CRC-16/CCITT of $1000-$13FF into $00/$01
+    static const uint8_t g_crc_code[] = {
+        0xa9, 0xff,             // LDA #$FF
+        0x85, 0x00,             // STA $00
+        0x85, 0x01,             // STA $01
+        0xa9, 0x00,             // LDA #$00
+        0x85, 0x10,             // STA $10
+        0xa9, 0x10,             // LDA #$10
+        0x85, 0x11,             // STA $11
+        0xa2, 0x04,             // LDX #$04
+        0xa0, 0x00,             // LDY #$00
+        0xb1, 0x10,             // byte: LDA ($10),Y
+        0x45, 0x01,             // EOR $01
+        0x85, 0x01,             // STA $01
+        0xa9, 0x08,             // LDA #$08
+        0x85, 0x02,             // STA $02
+        0x06, 0x00,             // bit: ASL $00
+        0x26, 0x01,             // ROL $01
+        0x90, 0x0c,             // BCC next
+        0xa5, 0x01,             // LDA $01
+        0x49, 0x10,             // EOR #$10
+        0x85, 0x01,             // STA $01
+        0xa5, 0x00,             // LDA $00
+        0x49, 0x21,             // EOR #$21
+        0x85, 0x00,             // STA $00
+        0xc6, 0x02,             // next: DEC $02
+        0xd0, 0xea,             // BNE bit
+        0xc8,                   // INY
+        0xd0, 0xdd,             // BNE byte
+        0xe6, 0x11,             // INC $11
+        0xca,                   // DEX
+        0xd0, 0xd8,             // BNE byte
+    };
+
+    // RLE stream after the code to $2000: $80 | n then a byte is a run of
+    // n, 1..$7F is that many literals, 0 ends; fetches and stores are subroutines
+    static const uint8_t g_rle_code[] = {
+        0xa9, 0x49,             // LDA #<stream
+        0x85, 0x10,             // STA $10
+        0xa9, 0x06,             // LDA #>stream
+        0x85, 0x11,             // STA $11
+        0xa9, 0x00,             // LDA #$00
+        0x85, 0x12,             // STA $12
+        0xa9, 0x20,             // LDA #$20
+        0x85, 0x13,             // STA $13
+        0xa0, 0x00,             // LDY #$00
+        0x20, 0x34, 0x06,       // token: JSR get
+        0xaa,                   // TAX
+        0xf0, 0x2e,             // BEQ done
+        0x30, 0x0b,             // BMI run
+        0x20, 0x34, 0x06,       // literal: JSR get
+        0x20, 0x3d, 0x06,       // JSR put
+        0xca,                   // DEX
+        0xd0, 0xf7,             // BNE literal
+        0xf0, 0xed,             // BEQ token
+        0x8a,                   // run: TXA
+        0x29, 0x7f,             // AND #$7F
+        0xaa,                   // TAX
+        0x20, 0x34, 0x06,       // JSR get
+        0x20, 0x3d, 0x06,       // repeat: JSR put
+        0xca,                   // DEX
+        0xd0, 0xfa,             // BNE repeat
+        0xf0, 0xde,             // BEQ token
+        0xb1, 0x10,             // get: LDA ($10),Y
+        0xe6, 0x10,             // INC $10
+        0xd0, 0x02,             // BNE got
+        0xe6, 0x11,             // INC $11
+        0x60,                   // got: RTS
+        0x91, 0x12,             // put: STA ($12),Y
+        0xe6, 0x12,             // INC $12
+        0xd0, 0x02,             // BNE stored
+        0xe6, 0x13,             // INC $13
+        0x60,                   // stored: RTS
+        0x4c, 0x2f, 0x07,       // done: JMP end
+        // stream, 1643 bytes unpacked
+        0xb1, 0x4d, 0x07, 0x18, 0x25, 0x30, 0xbb, 0x1d, 0x6d, 0x13, 0x93, 0xde,
+        0x07, 0x23, 0x7b, 0x2e, 0xd9, 0x1e, 0x3f, 0x72, 0xd8, 0x1f, 0x0a, 0xcb,
+        0x19, 0x71, 0x17, 0x44, 0x94, 0xd6, 0x49, 0x3c, 0x9d, 0xcf, 0x5c, 0x02,
+        0x60, 0xbe, 0x94, 0x20, 0x0a, 0x1e, 0x69, 0xfe, 0xda, 0xa0, 0xee, 0xe8,
+        0xb9, 0x99, 0x7f, 0xed, 0x5c, 0x0c, 0x7c, 0x29, 0x99, 0xfd, 0xaf, 0xe5,
+        0x93, 0x25, 0x3c, 0xd6, 0x54, 0xaf, 0x9b, 0xfa, 0x07, 0x14, 0x27, 0xa0,
+        0xae, 0xb3, 0xfe, 0xe9, 0x90, 0x2f, 0x05, 0xf2, 0x21, 0x1f, 0x9e, 0xe4,
+        0xac, 0xc5, 0x0b, 0xb1, 0x0b, 0xec, 0xb5, 0x56, 0x3b, 0xfc, 0x1e, 0x6f,
+        0x93, 0x42, 0xe6, 0x7e, 0x07, 0xc8, 0xfe, 0x29, 0x55, 0xe5, 0xcd, 0x8e,
+        0xf9, 0x46, 0x07, 0x8e, 0xd4, 0xb7, 0xc2, 0x76, 0x4d, 0x2a, 0x9e, 0x4d,
+        0x04, 0x77, 0x06, 0xf8, 0x5d, 0xa9, 0x90, 0x01, 0x4a, 0xbd, 0xbd, 0x0a,
+        0xa3, 0x40, 0x1b, 0xe9, 0xc8, 0xcb, 0xcc, 0xc9, 0x35, 0xf6, 0xd9, 0xcd,
+        0x01, 0x61, 0x90, 0x6a, 0x08, 0x53, 0x38, 0xae, 0x1a, 0x34, 0x00, 0x4d,
+        0x33, 0xb6, 0x0d, 0x02, 0x6a, 0xc0, 0x9b, 0x81, 0x06, 0xba, 0xf2, 0x3e,
+        0x3b, 0xf9, 0xee, 0xc5, 0xf7, 0x05, 0x2b, 0x49, 0x34, 0xaf, 0x87, 0xc5,
+        0x52, 0x09, 0x0b, 0x69, 0xb9, 0x4b, 0x0d, 0x98, 0x2e, 0x85, 0xbb, 0xfc,
+        0x55, 0x06, 0x72, 0xa8, 0x72, 0x63, 0x7a, 0xcd, 0xe6, 0x74, 0x04, 0xfc,
+        0xb6, 0x0e, 0x0e, 0xed, 0x8f, 0x08, 0x84, 0x63, 0xb0, 0xe4, 0xb2, 0xba,
+        0x29, 0x70, 0x95, 0x74, 0x08, 0x64, 0xac, 0x68, 0xf7, 0x00, 0xf5, 0xb0,
+        0x2b, 0x00,
+    };
+
+    // 5 passes over the x * 5 + 1 sequence sorted into 4 buckets at $30-$33,
+    // one to three data dependent branches per element
+    static const uint8_t g_branch_code[] = {
+        0xa9, 0x00,             // LDA #$00
+        0x85, 0x30,             // STA $30
+        0x85, 0x31,             // STA $31
+        0x85, 0x32,             // STA $32
+        0x85, 0x33,             // STA $33
+        0xa9, 0x01,             // LDA #$01
+        0x85, 0x02,             // STA $02
+        0xa9, 0x37,             // LDA #$37
+        0xa0, 0x05,             // LDY #$05
+        0xa2, 0x00,             // outer: LDX #$00
+        0x85, 0x00,             // next: STA $00
+        0x0a,                   // ASL A
+        0x0a,                   // ASL A
+        0x38,                   // SEC
+        0x65, 0x00,             // ADC $00
+        0xc9, 0x40,             // CMP #$40
+        0xb0, 0x05,             // BCS high
+        0xe6, 0x30,             // INC $30
+        0x4c, 0x38, 0x06,       // JMP counted
+        0xc9, 0x80,             // high: CMP #$80
+        0xb0, 0x05,             // BCS top
+        0xe6, 0x31,             // INC $31
+        0x4c, 0x38, 0x06,       // JMP counted
+        0x24, 0x02,             // top: BIT $02
+        0xf0, 0x05,             // BEQ even
+        0xe6, 0x32,             // INC $32
+        0x4c, 0x38, 0x06,       // JMP counted
+        0xe6, 0x33,             // even: INC $33
+        0xe8,                   // counted: INX
+        0xd0, 0xd9,             // BNE next
+        0x88,                   // DEY
+        0xd0, 0xd4,             // BNE outer
+    };
+
+    // recursive fib(16) through JSR/RTS and PHA/PLA, 3193 calls 16 deep,
+    // the sum of the leaves in $00/$01
+    static const uint8_t g_stack_code[] = {
+        0xa9, 0x00,             // LDA #$00
+        0x85, 0x00,             // STA $00
+        0x85, 0x01,             // STA $01
+        0xa9, 0x10,             // LDA #$10
+        0x20, 0x0e, 0x06,       // JSR fib
+        0x4c, 0x2a, 0x06,       // JMP end
+        0xc9, 0x02,             // fib: CMP #$02
+        0xb0, 0x0a,             // BCS split
+        0x18,                   // CLC
+        0x65, 0x00,             // ADC $00
+        0x85, 0x00,             // STA $00
+        0x90, 0x02,             // BCC leaf
+        0xe6, 0x01,             // INC $01
+        0x60,                   // leaf: RTS
+        0x48,                   // split: PHA
+        0xe9, 0x01,             // SBC #$01
+        0x20, 0x0e, 0x06,       // JSR fib
+        0x68,                   // PLA
+        0x38,                   // SEC
+        0xe9, 0x02,             // SBC #$02
+        0x20, 0x0e, 0x06,       // JSR fib
+        0x60,                   // RTS
+    };
+
+    static void seed_source(memory& mem)
+    {
+        for (uint32_t i = 0; i < 0x800; ++i) {
+            mem.write((uint8_t)(i * 13 + (i >> 8) * 7), (uint16_t)(0x1000 + i));
+        }
+    }
+
+    static bool check_memcpy(memory& mem)
+    {
+        for (uint32_t i = 0; i < 0x800; ++i) {
+            if (mem.read<uint8_t>((uint16_t)(0x3000 + i)) != mem.read<uint8_t>((uint16_t)(0x1000 + i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool check_multiply(memory& mem)
+    {
+        for (uint32_t x = 0; x < 256; ++x) {
+            uint32_t p = x * (x ^ 0x5a);
+            if (mem.read<uint8_t>((uint16_t)(0x2000 + x)) != (p & 0xff) || mem.read<uint8_t>((uint16_t)(0x2100 + x)) != p >> 8) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool check_sort(memory& mem)
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            if (mem.read<uint8_t>((uint16_t)(0x1000 + i)) != i) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool check_crc(memory& mem)
+    {
+        uint16_t crc = 0xffff;
+        for (uint32_t i = 0; i < 0x400; ++i) {
+            crc ^= (uint16_t)(mem.read<uint8_t>((uint16_t)(0x1000 + i)) << 8);
+            for (int b = 0; b < 8; ++b) {
+                crc = (uint16_t)(crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1);
+            }
+        }
+        return mem.read<uint16_t>((uint16_t)0) == crc;
+    }
+
+    static bool check_rle(memory& mem)
+    {
+        const uint8_t *p = g_rle_code + 0x49;
+        uint16_t at = 0x2000;
+        while (uint8_t n = *p++) {
+            for (int i = 0; i < (n & 0x7f); ++i) {
+                if (mem.read<uint8_t>(at++) != *p) {
+                    return false;
+                }
+                p += !(n & 0x80);
+            }
+            p += (n & 0x80) != 0;
+        }
+        return at == 0x2000 + 1643;
+    }
+
+    static bool check_branch(memory& mem)
+    {
+        // every pass sees each value once, 64 of them per bucket
+        for (uint16_t i = 0x30; i < 0x34; ++i) {
+            if (mem.read<uint8_t>(i) != (5 * 64 & 0xff)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool check_stack(memory& mem)
+    {
+        return mem.read<uint16_t>((uint16_t)0) == 987;
+    }
+
+    struct bench_kernel {
+        bench_program prog;
+        // puts the input in place once, nullptr when the kernel makes its own
+        void (*setup)(memory&);
+        bool (*check)(memory&);
+    };
+
+    static const bench_kernel g_bench_kernels[] = {
+        { { "memcpy",   0x0600, g_memcpy_code,   sizeof(g_memcpy_code) },   seed_source, check_memcpy },
+        { { "multiply", 0x0600, g_multiply_code, sizeof(g_multiply_code) }, nullptr,     check_multiply },
+        { { "sort",     0x0600, g_sort_code,     sizeof(g_sort_code) },     nullptr,     check_sort },
+        { { "crc",      0x0600, g_crc_code,      sizeof(g_crc_code) },      seed_source, check_crc },
+        { { "rle",      0x0600, g_rle_code,      sizeof(g_rle_code) },      nullptr,     check_rle },
+        { { "branch",   0x0600, g_branch_code,   sizeof(g_branch_code) },   nullptr,     check_branch },
+        { { "stack",    0x0600, g_stack_code,    sizeof(g_stack_code) },    nullptr,     check_stack },
+    };
+
+    static const struct {
+        const char *name;
+        dispatch_mode mode;
+    } g_suite_modes[] = {
+        { "switch",   dispatch_mode::switch_case },
+        { "table",    dispatch_mode::call_table },
+        { "threaded", dispatch_mode::threaded },
+        { "blocks",   dispatch_mode::block_cache },
+        { "jit",      dispatch_mode::jit },
+    };
+
+    struct bench_stats {
+        double mean;
+        double stddev;
+        double min;
+        double median;
+        double max;
+    };
+
+    static bench_stats summarize(std::vector<double> v)
+    {
+        bench_stats s = { 0, 0, 0, 0, 0 };
+        if (v.empty()) {
+            return s;
+        }
+        std::sort(v.begin(), v.end());
+        for (size_t i = 0; i < v.size(); ++i) {
+            s.mean += v[i];
+        }
+        s.mean /= v.size();
+        for (size_t i = 0; i < v.size(); ++i) {
+            s.stddev += (v[i] - s.mean) * (v[i] - s.mean);
+        }
+        // sample deviation, one rep has none
+        s.stddev = v.size() > 1 ? sqrt(s.stddev / (v.size() - 1)) : 0;
+        s.min = v.front();
+        s.max = v.back();
+        s.median = v.size() & 1 ? v[v.size() / 2] : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+        return s;
+    }
+
+    static void print_stats(FILE *out, const char *name, const bench_stats& s)
+    {
+        fprintf(out, "\"%s\": { \"mean\": %.0f, \"stddev\": %.0f, \"min\": %.0f, \"median\": %.0f, \"max\": %.0f }",
+                name, s.mean, s.stddev, s.min, s.median, s.max);
+    }
+
+    // one kernel on one backend, false when it computed the wrong thing
+    static bool bench_kernel_run(FILE *out, const bench_kernel& k, const char *mode_name, dispatch_mode mode,
+                                 int reps, int warmup)
+    {
+        memory mem;
+        cpu_6502 cpu(mem);
+        cpu.set_dispatch_mode(mode);
+        cpu.load_code_segment(k.prog.base, k.prog.code, k.prog.size);
+        if (k.setup != nullptr) {
+            k.setup(mem);
+        }
+
+        // the first run counts the work, the ones after it size a rep
+        uint64_t instructions = cpu.get_instruction_count();
+        uint64_t cycles = cpu.timestamp();
+        cpu.run();
+        instructions = cpu.get_instruction_count() - instructions;
+        cycles = cpu.timestamp() - cycles;
+        bool ok = k.check(mem);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < warmup; ++i) {
+            cpu.run();
+        }
+        std::chrono::duration<double> warm = std::chrono::steady_clock::now() - start;
+        double per_run = warmup > 0 ? warm.count() / warmup : 0;
+        int runs = per_run > 0 ? (int)ceil(BENCH_SUITE_REP_SECONDS / per_run) : 1;
+
+        std::vector<double> ips, cps;
+        for (int r = 0; r < reps; ++r) {
+            uint64_t i0 = cpu.get_instruction_count();
+            uint64_t c0 = cpu.timestamp();
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < runs; ++i) {
+                cpu.run();
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            ips.push_back((cpu.get_instruction_count() - i0) / elapsed.count());
+            cps.push_back((cpu.timestamp() - c0) / elapsed.count());
+        }
+        ok = ok && k.check(mem);
+
+        fprintf(out, "    { \"kernel\": \"%s\", \"mode\": \"%s\", \"ok\": %s, \"instructions\": %llu, \"cycles\": %llu, "
+                "\"runs_per_rep\": %d,\n      ", k.prog.name, mode_name, ok ? "true" : "false",
+                (unsigned long long)instructions, (unsigned long long)cycles, runs);
+        print_stats(out, "instructions_per_second", summarize(ips));
+        fprintf(out, ",\n      ");
+        print_stats(out, "cycles_per_second", summarize(cps));
+        fprintf(out, " }");
+        return ok;
+    }
+
+    bool bench_suite(FILE *out, int reps, int warmup, const char *kernel, const char *mode)
+    {
+        reps = reps > 0 ? reps : 1;
+        warmup = warmup > 0 ? warmup : 0;
+
+        fprintf(out, "{\n  \"suite\": \"vnes_bench\",\n  \"version\": %d,\n", BENCH_SUITE_VERSION);
+#ifdef NDEBUG
+        fprintf(out, "  \"asserts\": false,\n");
+#else
+        fprintf(out, "  \"asserts\": true,\n");
+#endif
+        fprintf(out, "  \"reps\": %d,\n  \"warmup\": %d,\n  \"results\": [\n", reps, warmup);
+
+        bool ok = true;
+        bool first = true;
+        for (size_t i = 0; i < arr_len(g_bench_kernels); ++i) {
+            if (kernel != nullptr && strcmp(kernel, g_bench_kernels[i].prog.name) != 0) {
+                continue;
+            }
+            for (size_t m = 0; m < arr_len(g_suite_modes); ++m) {
+                if (mode != nullptr && strcmp(mode, g_suite_modes[m].name) != 0) {
+                    continue;
+                }
+                fprintf(out, first ? "" : ",\n");
+                first = false;
+                ok = bench_kernel_run(out, g_bench_kernels[i], g_suite_modes[m].name, g_suite_modes[m].mode,
+                                      reps, warmup) && ok;
+                fflush(out);
+            }
+        }
+        fprintf(out, "\n  ]\n}\n");
+        return ok;
+    }
+
+    void bench_suite_test()
+    {
+        // every kernel computes what it should on every backend, in as many
+        // instructions and cycles as on the reference switch
+        for (size_t i = 0; i < arr_len(g_bench_kernels); ++i) {
+            const bench_kernel& k = g_bench_kernels[i];
+            uint64_t instructions = 0, cycles = 0;
+            for (size_t m = 0; m < arr_len(g_suite_modes); ++m) {
+                memory mem;
+                cpu_6502 cpu(mem);
+                cpu.set_dispatch_mode(g_suite_modes[m].mode);
+                cpu.load_code_segment(k.prog.base, k.prog.code, k.prog.size);
+                if (k.setup != nullptr) {
+                    k.setup(mem);
+                }
+                cpu.run();
+                assert(k.check(mem));
+                assert(m == 0 || (cpu.get_instruction_count() == instructions && cpu.timestamp() == cycles));
+                instructions = cpu.get_instruction_count();
+                cycles = cpu.timestamp();
+
+                // and again on what the first run left behind
+                cpu.run();
+                assert(k.check(mem));
+                assert(cpu.get_instruction_count() == 2 * instructions);
+            }
+            (void)instructions;
+            (void)cycles;
+        }
+    }
+
+}
@@ -0,0 +1,86 @@
+#include "block_cache.hpp"
+#include <algorithm>
+
+
+namespace nes {
+
+    decoded_block* block_cache::insert(std::unique_ptr<decoded_block> block)
+    {
+        uint16_t start = block->start;
+        if (this->blocks_[start]) {
+            this->retire(start);
+        }
+
+        uint32_t first_page = start >> NES_PAGE_SHIFT;
+        uint32_t last_page = (block->end - 1) >> NES_PAGE_SHIFT;
+        for (uint32_t page = first_page; page <= last_page; ++page) {
+            this->page_blocks_[page].push_back(start);
+            this->mem_.watch_page(page);
+        }
+
+        block->valid = true;
+        this->blocks_[start] = std::move(block);
+        return this->blocks_[start].get();
+    }
+
+    void block_cache::retire(uint16_t start)
+    {
+        std::unique_ptr<decoded_block>& block = this->blocks_[start];
+
+        uint32_t first_page = start >> NES_PAGE_SHIFT;
+        uint32_t last_page = (block->end - 1) >> NES_PAGE_SHIFT;
+        for (uint32_t page = first_page; page <= last_page; ++page) {
+            std::vector<uint16_t>& list = this->page_blocks_[page];
+            list.erase(std::find(list.begin(), list.end(), start));
+            this->mem_.unwatch_page(page);
+        }
+
+        block->valid = false;
+        this->retired_.push_back(std::move(block));
+    }
+
+    void block_cache::invalidate(uint16_t addr)
+    {
+        std::vector<uint16_t>& list = this->page_blocks_[addr >> NES_PAGE_SHIFT];
+
+        for (size_t i = list.size(); i > 0; --i) {
+            uint16_t start = list[i - 1];
+            const decoded_block *block = this->blocks_[start].get();
+            if (block->start <= addr && addr < block->end) {
+                this->retire(start);
+            }
+        }
+    }
+
+    void block_cache::invalidate_page(uint16_t page)
+    {
+        std::vector<uint16_t>& list = this->page_blocks_[page];
+
+        while (!list.empty()) {
+            this->retire(list.back());
+        }
+    }
+
+    void block_cache::flush()
+    {
+        for (size_t page = 0; page < NES_PAGE_COUNT; ++page) {
+            this->invalidate_page((uint16_t)page);
+        }
+        this->collect();
+    }
+
+    void block_cache::collect()
+    {
+        this->retired_.clear();
+    }
+
+    size_t block_cache::size() const
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < this->blocks_.size(); ++i) {
+            n += this->blocks_[i] ? 1 : 0;
+        }
+        return n;
+    }
+
+}
@@ -0,0 +1,85 @@
+#ifndef block_cache_hpp
+#define block_cache_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "memory.hpp"
+
+#define NES_MAX_BLOCK_OPS 32
+
+
+namespace nes {
+
+    class cpu_6502;
+
+    // addressing resolve + operation of one opcode, PC already points past the operand
+    typedef uint8_t (*decoded_handler)(cpu_6502& cpu, uint16_t operand);
+
+    struct decoded_op {
+        decoded_handler handler;
+        uint16_t operand;
+        uint8_t cycles;
+        uint8_t len;
+    };
+
+    struct decoded_block {
+        uint16_t start;
+        uint32_t end;       // one past the last byte
+        bool valid;
+        std::vector<decoded_op> ops;
+    };
+
+    /*
+        Pre-decoded basic blocks keyed by start PC.
+        Every page a block covers is watched in memory, a write into
+        [start, end) of a block marks it invalid and drops it from the cache.
+        The block itself is only freed by collect() so a running block
+        can notice it was invalidated under its feet.
+    */
+    class block_cache {
+
+        memory& mem_;
+        std::vector<std::unique_ptr<decoded_block>> blocks_;
+        std::vector<uint16_t> page_blocks_[NES_PAGE_COUNT];
+        std::vector<std::unique_ptr<decoded_block>> retired_;
+
+        void retire(uint16_t start);
+
+    public:
+        block_cache() = delete;
+        block_cache(const block_cache&) = delete;
+        block_cache(block_cache&&) = delete;
+        block_cache& operator=(const block_cache&) = delete;
+        block_cache& operator=(block_cache&&) = delete;
+
+        block_cache(memory& m)
+        :mem_(m), blocks_(NES_MAX_RAM)
+        {
+        }
+
+        ~block_cache()
+        {
+            this->flush();
+        }
+
+        decoded_block* lookup(uint16_t pc) const
+        {
+            return this->blocks_[pc].get();
+        }
+
+        decoded_block* insert(std::unique_ptr<decoded_block> block);
+
+        void invalidate(uint16_t addr);
+        void invalidate_page(uint16_t page);
+        void flush();
+        void collect();
+
+        size_t size() const;
+    };
+
+}
+
+
+#endif /* block_cache_hpp */
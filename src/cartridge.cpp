@@ -0,0 +1,308 @@
+#include "cartridge.hpp"
+#include <cassert>
+#include <cstring>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define NES_HAVE_MMAP 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define NES_HAVE_MMAP 0
+#include <new>
+#endif
+
+
+namespace nes {
+
+    // NES 2.0 ROM size: banks, or 2^E * (MM * 2 + 1) bytes when the MSB nibble is $F;
+    // UINT64_MAX for an exponent size past limit
+    static uint64_t rom_size(uint8_t lsb, uint8_t msb, size_t unit, size_t limit)
+    {
+        if (msb == 0x0f) {
+            uint8_t exponent = lsb >> 2;
+            uint64_t multiplier = (lsb & 0x3) * 2 + 1;
+            if (exponent >= 64 || multiplier > ((uint64_t)limit >> exponent)) {
+                return UINT64_MAX;
+            }
+            return multiplier << exponent;
+        }
+        return (uint64_t)(msb << 8 | lsb) * unit;
+    }
+
+    // NES 2.0 RAM size: 64 << shift, 0 is none
+    static size_t shift_size(uint8_t shift)
+    {
+        return shift ? (size_t)64 << shift : 0;
+    }
+
+    int cartridge::parse()
+    {
+        const uint8_t *h = this->image_;
+        if (this->image_size_ < NES_HEADER_SIZE || memcmp(h, "NES\x1a", 4) != 0) {
+            return ROM_ERROR_HEADER;
+        }
+
+        this->nes2_ = (h[7] & 0x0c) == 0x08;
+        this->battery_ = h[6] & 0x02;
+        if (h[6] & 0x08) {
+            this->mirroring_ = mirroring::four_screen;
+        }
+        else {
+            this->mirroring_ = h[6] & 0x01 ? mirroring::vertical : mirroring::horizontal;
+        }
+
+        uint64_t prg_size, chr_size;
+        if (this->nes2_) {
+            this->mapper_ = (h[6] >> 4) | (h[7] & 0xf0) | (h[8] & 0x0f) << 8;
+            this->submapper_ = h[8] >> 4;
+            prg_size = rom_size(h[4], h[9] & 0x0f, NES_PRG_BANK_SIZE, this->image_size_);
+            chr_size = rom_size(h[5], h[9] >> 4, NES_CHR_BANK_SIZE, this->image_size_);
+            this->prg_ram_size_ = shift_size(h[10] & 0x0f);
+            this->prg_nvram_size_ = shift_size(h[10] >> 4);
+            this->chr_ram_size_ = shift_size(h[11] & 0x0f) + shift_size(h[11] >> 4);
+        }
+        else {
+            // "DiskDude!" and friends: junk in bytes 7-15, only the low mapper nibble is real
+            bool junk = h[12] | h[13] | h[14] | h[15];
+            this->mapper_ = (h[6] >> 4) | (junk ? 0 : h[7] & 0xf0);
+            this->submapper_ = 0;
+            prg_size = (uint64_t)h[4] * NES_PRG_BANK_SIZE;
+            chr_size = (uint64_t)h[5] * NES_CHR_BANK_SIZE;
+
+            size_t ram = (junk || h[8] == 0 ? 1 : h[8]) * 0x2000;
+            this->prg_ram_size_ = this->battery_ ? 0 : ram;
+            this->prg_nvram_size_ = this->battery_ ? ram : 0;
+            this->chr_ram_size_ = chr_size == 0 ? NES_CHR_BANK_SIZE : 0;
+        }
+
+        uint64_t offset = NES_HEADER_SIZE;
+        if (h[6] & 0x04) {
+            this->trainer_ = h + offset;
+            offset += NES_TRAINER_SIZE;
+        }
+
+        // one at a time, a sum of them could wrap
+        uint64_t left = offset > this->image_size_ ? 0 : this->image_size_ - offset;
+        if (prg_size == 0 || prg_size > left || chr_size > left - prg_size) {
+            return ROM_ERROR_SIZE;
+        }
+
+        this->prg_ = h + offset;
+        this->prg_size_ = (size_t)prg_size;
+        this->chr_ = chr_size ? h + offset + prg_size : nullptr;
+        this->chr_size_ = (size_t)chr_size;
+
+        return 0;
+    }
+
+    int cartridge::load(const char *path)
+    {
+        this->unload();
+
+#if NES_HAVE_MMAP
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return ROM_ERROR_OPEN;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < NES_HEADER_SIZE) {
+            close(fd);
+            return ROM_ERROR_HEADER;
+        }
+
+        void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            return ROM_ERROR_MAP;
+        }
+        this->image_ = (const uint8_t *)p;
+        this->image_size_ = (size_t)st.st_size;
+#else
+        // no mmap: one read into an owned buffer
+        FILE *f = fopen(path, "rb");
+        if (f == nullptr) {
+            return ROM_ERROR_OPEN;
+        }
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        if (size < NES_HEADER_SIZE) {
+            fclose(f);
+            return ROM_ERROR_HEADER;
+        }
+
+        uint8_t *buf = new(std::nothrow) uint8_t[size];
+        if (buf == nullptr || fread(buf, 1, size, f) != (size_t)size) {
+            delete[] buf;
+            fclose(f);
+            return ROM_ERROR_MAP;
+        }
+        fclose(f);
+        this->image_ = buf;
+        this->image_size_ = (size_t)size;
+#endif
+        this->mapped_ = true;
+
+        int err = this->parse();
+        if (err != 0) {
+            this->unload();
+        }
+        return err;
+    }
+
+    int cartridge::load(const uint8_t *image, size_t size)
+    {
+        this->unload();
+
+        this->image_ = image;
+        this->image_size_ = size;
+
+        int err = this->parse();
+        if (err != 0) {
+            this->unload();
+        }
+        return err;
+    }
+
+    void cartridge::unload()
+    {
+        if (this->mapped_) {
+#if NES_HAVE_MMAP
+            munmap((void *)this->image_, this->image_size_);
+#else
+            delete[] this->image_;
+#endif
+        }
+
+        this->image_ = nullptr;
+        this->image_size_ = 0;
+        this->mapped_ = false;
+        this->trainer_ = nullptr;
+        this->prg_ = nullptr;
+        this->prg_size_ = 0;
+        this->chr_ = nullptr;
+        this->chr_size_ = 0;
+        this->prg_ram_size_ = 0;
+        this->prg_nvram_size_ = 0;
+        this->chr_ram_size_ = 0;
+        this->mapper_ = 0;
+        this->submapper_ = 0;
+        this->mirroring_ = mirroring::horizontal;
+        this->battery_ = false;
+        this->nes2_ = false;
+    }
+
+    void cartridge::debug_print() const
+    {
+        static const char * const mirroring_names[] = {
+            "horizontal", "vertical", "four screen", "single low", "single high",
+        };
+
+        std::cout << "------------------------" << std::endl
+                  << "[DEBUG cartridge]" << std::endl
+                  << "------------------------" << std::endl
+                  << (this->nes2_ ? "NES 2.0" : "iNES")
+                  << " mapper: " << std::dec << this->mapper_ << "." << (unsigned int)this->submapper_ << std::endl
+                  << "PRG: " << this->prg_size_ / 1024 << "K"
+                  << " CHR: " << this->chr_size_ / 1024 << "K"
+                  << " CHR RAM: " << this->chr_ram_size_ / 1024 << "K" << std::endl
+                  << "PRG RAM: " << this->prg_ram_size_ / 1024 << "K"
+                  << " NVRAM: " << this->prg_nvram_size_ / 1024 << "K"
+                  << (this->trainer_ ? " trainer" : "") << std::endl
+                  << "mirroring: " << mirroring_names[(int)this->mirroring_] << std::endl;
+    }
+
+    void cartridge::test()
+    {
+        static uint8_t image[NES_HEADER_SIZE + 2 * NES_PRG_BANK_SIZE + NES_CHR_BANK_SIZE];
+        memset(image, 0, sizeof(image));
+        memcpy(image, "NES\x1a", 4);
+
+        // iNES, 32K PRG, 8K CHR, MMC3, vertical, battery
+        image[4] = 2;
+        image[5] = 1;
+        image[6] = 0x40 | 0x02 | 0x01;
+        image[NES_HEADER_SIZE] = 0xa9;
+        image[NES_HEADER_SIZE + 2 * NES_PRG_BANK_SIZE] = 0x3c;
+
+        cartridge cart;
+        int err = cart.load(image, sizeof(image));
+        assert(err == 0);
+        assert(!cart.nes2());
+        assert(cart.mapper() == 4);
+        assert(cart.prg_size() == 2 * NES_PRG_BANK_SIZE && cart.prg()[0] == 0xa9);
+        assert(cart.chr_size() == NES_CHR_BANK_SIZE && cart.chr()[0] == 0x3c);
+        assert(cart.get_mirroring() == mirroring::vertical);
+        assert(cart.battery() && cart.prg_nvram_size() == 0x2000);
+
+        // NES 2.0, mapper 257.1, exponent-multiplier PRG size 2^15 * 1, CHR RAM
+        image[5] = 0;
+        image[6] = 0x10 | 0x08;
+        image[7] = 0x08;
+        image[8] = 0x11;
+        image[4] = 15 << 2;
+        image[9] = 0x0f;
+        image[11] = 0x07;
+        err = cart.load(image, sizeof(image));
+        assert(err == 0);
+        assert(cart.nes2());
+        assert(cart.mapper() == 0x101 && cart.submapper() == 1);
+        assert(cart.prg_size() == 0x8000);
+        assert(cart.chr() == nullptr && cart.chr_ram_size() == 0x2000);
+        assert(cart.get_mirroring() == mirroring::four_screen);
+
+        // truncated image and bad magic
+        image[9] = 0;
+        image[4] = 4;
+        err = cart.load(image, sizeof(image));
+        assert(err == ROM_ERROR_SIZE);
+        image[0] = 'X';
+        err = cart.load(image, sizeof(image));
+        assert(err == ROM_ERROR_HEADER);
+        image[0] = 'N';
+
+        // NES 2.0 exponent 2^63 * 3 for PRG: added to the offset it would wrap to a size that fits
+        image[7] = 0x08;
+        image[4] = 63 << 2 | 1;
+        image[9] = 0x0f;
+        err = cart.load(image, sizeof(image));
+        assert(err == ROM_ERROR_SIZE);
+        // and a PRG that fits with a CHR that wraps
+        image[4] = 15 << 2;
+        image[5] = 62 << 2 | 3;
+        image[9] = 0xff;
+        err = cart.load(image, sizeof(image));
+        assert(err == ROM_ERROR_SIZE);
+        image[5] = 1;
+        image[9] = 0;
+
+#if NES_HAVE_MMAP
+        // through a file, the banks have to come out of the mapping
+        image[4] = 2;
+        image[5] = 1;
+        image[6] = 0x01;
+        image[7] = 0;
+        image[8] = 0;
+        image[11] = 0;
+        char path[] = "/tmp/vnes_cart_XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        ssize_t written = write(fd, image, sizeof(image));
+        assert(written == (ssize_t)sizeof(image));
+        close(fd);
+        (void)written;
+
+        err = cart.load(path);
+        unlink(path);
+        assert(err == 0);
+        assert(cart.prg() != image + NES_HEADER_SIZE && cart.prg()[0] == 0xa9);
+        assert(cart.chr()[0] == 0x3c);
+#endif
+        (void)err;
+    }
+
+}
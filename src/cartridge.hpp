@@ -0,0 +1,158 @@
+#ifndef cartridge_hpp
+#define cartridge_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include "utils.hpp"
+
+#define NES_HEADER_SIZE 16
+#define NES_TRAINER_SIZE 512
+#define NES_PRG_BANK_SIZE 0x4000
+#define NES_CHR_BANK_SIZE 0x2000
+
+#define ROM_ERROR_OPEN -1
+#define ROM_ERROR_MAP -2
+#define ROM_ERROR_HEADER -3
+#define ROM_ERROR_SIZE -4
+
+
+namespace nes {
+
+    enum class mirroring : uint8_t {
+        horizontal,
+        vertical,
+        four_screen,
+        single_low,
+        single_high,
+    };
+
+    /*
+        iNES / NES 2.0 image.
+
+        load() maps the file read only and never copies it, prg() and
+        chr() point straight into the mapping, so pages are only faulted
+        in when a bank is touched and the page cache is shared between
+        processes running the same ROM set.
+    */
+    class cartridge {
+
+        const uint8_t *image_{nullptr};
+        size_t image_size_{0};
+        bool mapped_{false};
+
+        const uint8_t *trainer_{nullptr};
+        const uint8_t *prg_{nullptr};
+        size_t prg_size_{0};
+        const uint8_t *chr_{nullptr};
+        size_t chr_size_{0};
+
+        size_t prg_ram_size_{0};
+        size_t prg_nvram_size_{0};
+        size_t chr_ram_size_{0};
+
+        uint16_t mapper_{0};
+        uint8_t submapper_{0};
+        mirroring mirroring_{mirroring::horizontal};
+        bool battery_{false};
+        bool nes2_{false};
+
+        int parse();
+        void unload();
+
+    public:
+        cartridge(const cartridge&) = delete;
+        cartridge(cartridge&&) = delete;
+        cartridge& operator=(const cartridge&) = delete;
+        cartridge& operator=(cartridge&&) = delete;
+
+        cartridge() noexcept
+        {
+        }
+
+        ~cartridge()
+        {
+            this->unload();
+        }
+
+        // 0 or ROM_ERROR_*
+        int load(const char *path);
+
+        // parses an image owned by the caller, it has to outlive the cartridge
+        int load(const uint8_t *image, size_t size);
+
+        const uint8_t* prg() const
+        {
+            return this->prg_;
+        }
+
+        size_t prg_size() const
+        {
+            return this->prg_size_;
+        }
+
+        // nullptr when the board has CHR RAM
+        const uint8_t* chr() const
+        {
+            return this->chr_;
+        }
+
+        size_t chr_size() const
+        {
+            return this->chr_size_;
+        }
+
+        const uint8_t* trainer() const
+        {
+            return this->trainer_;
+        }
+
+        size_t prg_ram_size() const
+        {
+            return this->prg_ram_size_;
+        }
+
+        size_t prg_nvram_size() const
+        {
+            return this->prg_nvram_size_;
+        }
+
+        size_t chr_ram_size() const
+        {
+            return this->chr_ram_size_;
+        }
+
+        uint16_t mapper() const
+        {
+            return this->mapper_;
+        }
+
+        uint8_t submapper() const
+        {
+            return this->submapper_;
+        }
+
+        mirroring get_mirroring() const
+        {
+            return this->mirroring_;
+        }
+
+        bool battery() const
+        {
+            return this->battery_;
+        }
+
+        bool nes2() const
+        {
+            return this->nes2_;
+        }
+
+        void debug_print() const;
+
+        static void test();
+    };
+
+}
+
+
+#endif /* cartridge_hpp */
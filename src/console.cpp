@@ -0,0 +1,683 @@
+#include "console.hpp"
+#include "utils.hpp"
+#include <cassert>
+#include <cstring>
+
+
+namespace nes {
+
+    console::console() noexcept
+    :cpu_(mem_), apu_(mem_)
+    {
+        this->cpu_.set_pc_limit(NES_MAX_RAM);
+        // BRK is an ordinary instruction to a game
+        this->cpu_.set_flight_recorder(&this->recorder_, false);
+    }
+
+    console::~console()
+    {
+        this->detach();
+    }
+
+    void console::detach()
+    {
+        this->mem_.unmap(0x0800, 0x1800);
+        this->mem_.unmap(0x2000, 0x2000);
+        this->mem_.unmap(0x4000, NES_PAGE_SIZE);
+        this->ppu_.reset();
+        this->mapper_.reset();
+    }
+
+    int console::attach()
+    {
+        this->mapper_ = mapper::create(this->cart_, this->mem_);
+        if (!this->mapper_) {
+            return CONSOLE_ERROR_MAPPER;
+        }
+        this->ppu_.reset(new ppu(*this->mapper_));
+        this->ppu_->set_thread(this->ppu_thread_.get());
+
+        // 2K of RAM mirrored up to $1FFF, the PPU's 8 registers up to $3FFF.
+        // PPU and mapper registers come through here first to catch the PPU up.
+        uint8_t *ram = this->mem_.map_offset_addr(0);
+        for (uint16_t addr = 0x0800; addr < 0x2000; addr += 0x0800) {
+            this->mem_.map_memory(addr, 0x0800, ram);
+        }
+        this->mem_.map_handler(0x2000, 0x2000, this);
+        this->mem_.map_handler(0x4000, NES_PAGE_SIZE, this);
+        this->mem_.map_handler(NES_PRG_ROM_ADDR, 0x10000 - NES_PRG_ROM_ADDR, this, false);
+
+        this->state_serial_ = 0;
+        this->power_up();
+        return 0;
+    }
+
+    void console::set_ppu_thread(bool on)
+    {
+        if (on == (this->ppu_thread_ != nullptr)) {
+            return;
+        }
+        if (on) {
+            this->ppu_thread_.reset(new ppu_thread());
+        }
+        if (this->ppu_) {
+            this->ppu_->set_thread(on ? this->ppu_thread_.get() : nullptr);
+        }
+        if (!on) {
+            this->ppu_thread_.reset();
+        }
+    }
+
+    int console::load(const char *path)
+    {
+        this->detach();
+        int err = this->cart_.load(path);
+        return err ? err : this->attach();
+    }
+
+    int console::load(const uint8_t *image, size_t size)
+    {
+        this->detach();
+        int err = this->cart_.load(image, size);
+        return err ? err : this->attach();
+    }
+
+    void console::power_up()
+    {
+        this->mem_.bzero(0, 0x0800);
+        this->clock_base_ = this->cpu_.timestamp();
+        this->frame_end_ = NES_LINES_PER_FRAME * NES_DOTS_PER_LINE;
+        this->runs_ = 0;
+        this->ppu_->reset();
+        this->apu_.reset();
+        // writes $4015 and $4017
+        this->cpu_.power_up();
+        this->strobe_ = false;
+        this->halted_ = false;
+    }
+
+    // the earliest of the frame end, vblank, the APU's and the mapper's IRQ
+    uint64_t console::next_event() const
+    {
+        const ppu& p = *this->ppu_;
+        uint64_t event = this->frame_end_;
+        uint64_t vblank = p.line_timestamp(NES_VBLANK_LINE);
+        event = vblank < event ? vblank : event;
+
+        uint64_t apu_irq = this->apu_.next_irq();
+        if (apu_irq != UINT64_MAX) {
+            apu_irq *= 3;
+            event = apu_irq < event ? apu_irq : event;
+        }
+
+        // the IRQ counter is clocked by rendered lines, as long as nothing
+        // turns rendering off (which would end the run anyway)
+        int n = this->mapper_->scanlines_to_irq();
+        if (n > 0 && p.rendering()) {
+            for (int y = p.line(); ; y = (y + 1) % NES_LINES_PER_FRAME) {
+                uint64_t t = p.line_timestamp(y);
+                if (t >= event) {
+                    break;
+                }
+                if ((y < NES_SCREEN_HEIGHT || y == NES_PRERENDER_LINE) && --n == 0) {
+                    event = t;
+                    break;
+                }
+            }
+        }
+
+        // an IRQ held off by I is polled every line, CLI takes it within one
+        if (this->lockstep_ || this->mapper_->irq() || this->apu_.irq()) {
+            event = p.timestamp() < event ? p.timestamp() : event;
+        }
+        return event;
+    }
+
+    bool console::run_frame()
+    {
+        if (this->halted_) {
+            return false;
+        }
+
+        ppu& p = *this->ppu_;
+        this->frame_end_ = p.timestamp() + (uint64_t)(NES_LINES_PER_FRAME - p.line()) * NES_DOTS_PER_LINE;
+
+        for (;;) {
+            this->sync_ppu();
+            this->sync_apu();
+            if (p.timestamp() >= this->frame_end_) {
+                break;
+            }
+
+            if (p.take_nmi()) {
+                this->cpu_.nmi();
+            }
+            else if (this->mapper_->irq() || this->apu_.irq()) {
+                this->cpu_.irq();
+            }
+
+            // 3 dots per CPU cycle, the run may overshoot by an instruction
+            uint64_t event = this->next_event();
+            uint64_t now = this->cpu_dot();
+            int cycles = event > now ? (int)((event - now + 2) / 3) : 1;
+            this->runs_++;
+            while (cycles > 0) {
+                // BRK is an ordinary instruction here, it only stops execute()
+                uint8_t status = this->cpu_.execute(cycles);
+                if (status == (uint8_t)ERROR_UNKNOWN_INSTRUCTION) {
+                    this->halted_ = true;
+                    return false;
+                }
+                if (status == (uint8_t)DEBUG_BREAK) {
+                    // the next run_frame() goes on from here, to the end of this frame
+                    return false;
+                }
+            }
+        }
+
+        this->apu_.end_frame(this->cpu_cycle());
+        return true;
+    }
+
+    uint8_t console::read(uint16_t addr)
+    {
+        if (addr < 0x4000) {
+            this->sync_ppu();
+            return this->ppu_->read(addr);
+        }
+        if (addr == NES_JOYPAD1_ADDR || addr == NES_JOYPAD2_ADDR) {
+            int port = addr & 1;
+            if (this->strobe_) {
+                return 0x40 | (this->buttons_[port] & 1);
+            }
+            uint8_t bit = this->shift_[port] & 1;
+            // official pads read 1 once all 8 buttons are out
+            this->shift_[port] = this->shift_[port] >> 1 | 0x80;
+            return 0x40 | bit;
+        }
+        if (addr == NES_APU_STATUS_ADDR) {
+            this->sync_apu();
+            return this->apu_.read(addr);
+        }
+        return 0;
+    }
+
+    void console::write(uint16_t addr, uint8_t v)
+    {
+        if (addr < 0x4000) {
+            this->sync_ppu();
+            this->ppu_->write(addr, v);
+            // PPUCTRL can raise an NMI in vblank, PPUMASK starts or stops the IRQ counter
+            if ((addr & 0x07) <= 1) {
+                this->cpu_.end_run();
+            }
+        }
+        else if (addr >= NES_PRG_ROM_ADDR) {
+            this->sync_ppu();
+            int irq = this->mapper_->scanlines_to_irq();
+            this->mapper_->write(addr, v);
+            if (this->mapper_->scanlines_to_irq() != irq) {
+                this->cpu_.end_run();
+            }
+        }
+        else if (addr == NES_OAM_DMA_ADDR) {
+            this->sync_ppu();
+            for (int i = 0; i < 256; ++i) {
+                this->ppu_->write(0x2004, this->mem_.read<uint8_t>((uint16_t)(v << 8 | i)));
+            }
+            this->cpu_.stall(NES_OAM_DMA_CYCLES);
+        }
+        else if (addr == NES_JOYPAD1_ADDR) {
+            this->strobe_ = v & 1;
+            if (this->strobe_) {
+                this->shift_[0] = this->buttons_[0];
+                this->shift_[1] = this->buttons_[1];
+            }
+        }
+        else if (addr <= NES_APU_FRAME_ADDR) {
+            this->sync_apu();
+            uint64_t irq = this->apu_.next_irq();
+            this->apu_.write(addr, v);
+            if (this->apu_.next_irq() != irq) {
+                this->cpu_.end_run();
+            }
+        }
+    }
+
+    // FNV-1a of the board and the last PRG page, the vectors are in it
+    uint32_t console::machine_id() const
+    {
+        uint8_t board[12];
+        uint32_t prg = (uint32_t)this->cart_.prg_size();
+        uint32_t chr = (uint32_t)this->cart_.chr_size();
+        uint32_t mapper = this->cart_.mapper();
+        memcpy(board, &prg, 4);
+        memcpy(board + 4, &chr, 4);
+        memcpy(board + 8, &mapper, 4);
+
+        uint32_t h = 0x811c9dc5;
+        for (size_t i = 0; i < sizeof(board); ++i) {
+            h = (h ^ board[i]) * 0x01000193;
+        }
+        const uint8_t *last = this->cart_.prg() + prg - NES_PAGE_SIZE;
+        for (size_t i = 0; prg >= NES_PAGE_SIZE && i < NES_PAGE_SIZE; ++i) {
+            h = (h ^ last[i]) * 0x01000193;
+        }
+        return h;
+    }
+
+    void console::write_state(std::vector<uint8_t>& out, const state_header& h, bool incremental)
+    {
+        state_writer w(out);
+        w.header(h);
+        this->mem_.save_state(w, incremental);
+        this->cpu_.save_state(w);
+        this->mapper_->save_state(w);
+        this->ppu_->save_state(w);
+        this->apu_.save_state(w);
+
+        w.begin(NES_STATE_CONSOLE);
+        w.put(this->clock_base_);
+        w.put(this->frame_end_);
+        w.put(this->runs_);
+        w.put(this->halted_);
+        w.bytes(this->buttons_, sizeof(this->buttons_));
+        w.bytes(this->shift_, sizeof(this->shift_));
+        w.put(this->strobe_);
+        w.end();
+    }
+
+    int console::read_state(state_reader& r)
+    {
+        static const char *chunks[] = { "MEM ", "CPU ", "MAP ", "PPU ", "APU ", NES_STATE_CONSOLE };
+        state_reader body;
+        for (size_t i = 0; i < arr_len(chunks); ++i) {
+            if (!r.find(chunks[i], body)) {
+                return STATE_ERROR_FORMAT;
+            }
+        }
+
+        // banks first, they decide which pages the memory chunk lands in
+        int err;
+        if ((err = this->mapper_->load_state(r)) != 0 ||
+            (err = this->mem_.load_state(r)) != 0 ||
+            (err = this->cpu_.load_state(r)) != 0 ||
+            (err = this->ppu_->load_state(r)) != 0 ||
+            (err = this->apu_.load_state(r)) != 0) {
+            // half loaded, nothing can be built on it
+            this->state_serial_ = 0;
+            return err;
+        }
+
+        r.find(NES_STATE_CONSOLE, body);
+        body.get(this->clock_base_);
+        body.get(this->frame_end_);
+        body.get(this->runs_);
+        body.get(this->halted_);
+        body.bytes(this->buttons_, sizeof(this->buttons_));
+        body.bytes(this->shift_, sizeof(this->shift_));
+        body.get(this->strobe_);
+        if (!body.ok()) {
+            this->state_serial_ = 0;
+            return STATE_ERROR_FORMAT;
+        }
+        return 0;
+    }
+
+    void console::save_state(std::vector<uint8_t>& out, bool incremental)
+    {
+        // the first snapshot turns tracking on, every page starts out dirty
+        if (!this->mem_.tracking_dirty()) {
+            this->mem_.track_dirty(true);
+        }
+        incremental = incremental && this->state_serial_ != 0;
+
+        state_header h;
+        h.version = NES_STATE_VERSION;
+        h.flags = incremental ? STATE_FLAG_INCREMENTAL : 0;
+        h.serial = ++this->state_count_;
+        h.base = this->state_serial_;
+        h.machine = this->machine_id();
+        this->write_state(out, h, incremental);
+
+        this->mem_.clear_dirty();
+        this->state_serial_ = h.serial;
+    }
+
+    void console::snapshot(std::vector<uint8_t>& out)
+    {
+        state_header h;
+        h.version = NES_STATE_VERSION;
+        h.flags = 0;
+        h.serial = 0;
+        h.base = 0;
+        h.machine = this->machine_id();
+        this->write_state(out, h, false);
+    }
+
+    int console::load_state(const uint8_t *data, size_t size)
+    {
+        state_reader r(data, size);
+        state_header h;
+        int err = r.header(h);
+        if (err != 0) {
+            return err;
+        }
+        if (h.machine != this->machine_id()) {
+            return STATE_ERROR_MACHINE;
+        }
+        if ((h.flags & STATE_FLAG_INCREMENTAL) &&
+            (h.base != this->state_serial_ || !this->mem_.tracking_dirty() || this->mem_.dirty_pages() != 0)) {
+            return STATE_ERROR_BASE;
+        }
+
+        if ((err = this->read_state(r)) != 0) {
+            return err;
+        }
+        if (!this->mem_.tracking_dirty()) {
+            this->mem_.track_dirty(true);
+        }
+        this->mem_.clear_dirty();
+        this->state_serial_ = h.serial;
+        this->state_count_ = h.serial > this->state_count_ ? h.serial : this->state_count_;
+        return 0;
+    }
+
+    int console::restore(const uint8_t *data, size_t size)
+    {
+        state_reader r(data, size);
+        state_header h;
+        int err = r.header(h);
+        if (err != 0) {
+            return err;
+        }
+        if (h.machine != this->machine_id()) {
+            return STATE_ERROR_MACHINE;
+        }
+        if (h.flags & STATE_FLAG_INCREMENTAL) {
+            return STATE_ERROR_BASE;
+        }
+
+        if ((err = this->read_state(r)) != 0) {
+            return err;
+        }
+        if (this->mem_.tracking_dirty()) {
+            this->mem_.track_dirty(true);
+        }
+        return 0;
+    }
+
+    void console::test()
+    {
+        static uint8_t image[NES_HEADER_SIZE + 2 * NES_PRG_BANK_SIZE + NES_CHR_BANK_SIZE];
+        memset(image, 0, sizeof(image));
+        memcpy(image, "NES\x1a", 4);
+        image[4] = 2;
+        image[5] = 1;
+
+        static const uint8_t program[] = {
+            0x78,                   // reset: SEI
+            0xa2, 0xff,             // LDX #$FF
+            0x9a,                   // TXS
+            0xa9, 0x40,             // LDA #$40
+            0x8d, 0x17, 0x40,       // STA $4017, no frame IRQ
+            0xa9, 0x80,             // LDA #$80
+            0x8d, 0x00, 0x20,       // STA $2000
+            0x58,                   // CLI
+            0x4c, 0x0f, 0x80,       // loop: JMP loop
+            0xe6, 0x00,             // nmi: INC $00
+            0xa9, 0x01,             // LDA #$01
+            0x8d, 0x16, 0x40,       // STA $4016
+            0xa9, 0x00,             // LDA #$00
+            0x8d, 0x16, 0x40,       // STA $4016
+            0xad, 0x16, 0x40,       // LDA $4016
+            0x85, 0x01,             // STA $01
+            0x20, 0x40, 0x80,       // JSR sub
+            0x40,                   // RTI
+        };
+        static const uint8_t sub[] = {
+            0xe6, 0x02,             // sub: INC $02
+            0x60,                   // RTS
+        };
+
+        uint8_t *prg = image + NES_HEADER_SIZE;
+        memcpy(prg, program, sizeof(program));
+        memcpy(prg + 0x40, sub, sizeof(sub));
+        prg[0x7ffa] = 0x12;
+        prg[0x7ffb] = 0x80;
+        prg[0x7ffc] = 0x00;
+        prg[0x7ffd] = 0x80;
+
+        console nes;
+        int err = nes.load(image, sizeof(image));
+        assert(err == 0);
+        (void)err;
+
+        nes.set_buttons(0, BUTTON_A);
+        for (int i = 0; i < 3; ++i) {
+            bool ok = nes.run_frame();
+            assert(ok);
+            (void)ok;
+        }
+
+        memory& mem = nes.get_memory();
+        assert(nes.get_ppu().frame_count() == 3);
+        assert(mem.read<uint8_t>(0x0000) == 3 && mem.read<uint8_t>(0x0800) == 3);
+        assert(mem.read<uint8_t>(0x0001) == 0x41);
+        assert(mem.read<uint8_t>(0x0002) == 3);
+        assert(nes.get_cpu().get_registers().SP == 0xff);
+        (void)mem;
+
+        test_sync();
+    }
+
+    /*
+        MMC3 IRQ every 33 lines, each one moves the X scroll, so the frame
+        depends on where the IRQs land. Catch-up must draw what stopping
+        at every line draws, under the interpreter and the JIT.
+    */
+    void console::test_sync()
+    {
+        static uint8_t image[NES_HEADER_SIZE + 2 * NES_PRG_BANK_SIZE + NES_CHR_BANK_SIZE];
+        memset(image, 0, sizeof(image));
+        memcpy(image, "NES\x1a", 4);
+        image[4] = 2;
+        image[5] = 1;
+        image[6] = 0x40;
+
+        static const uint8_t program[] = {
+            0x78,                   // reset: SEI
+            0xa2, 0xff,             // LDX #$FF
+            0x9a,                   // TXS
+            0xa9, 0x40,             // LDA #$40
+            0x8d, 0x17, 0x40,       // STA $4017
+            0xa2, 0x00,             // LDX #$00
+            0xa9, 0x20,             // LDA #$20
+            0x8d, 0x06, 0x20,       // STA $2006
+            0xa9, 0x00,             // LDA #$00
+            0x8d, 0x06, 0x20,       // STA $2006
+            0xa0, 0x04,             // LDY #$04
+            0x8e, 0x07, 0x20,       // fill: STX $2007
+            0xe8,                   // INX
+            0xd0, 0xfa,             // BNE fill
+            0x88,                   // DEY
+            0xd0, 0xf7,             // BNE fill
+            0xa9, 0x3f,             // LDA #$3F
+            0x8d, 0x06, 0x20,       // STA $2006
+            0xa9, 0x00,             // LDA #$00
+            0x8d, 0x06, 0x20,       // STA $2006
+            0xa2, 0x00,             // LDX #$00
+            0x8e, 0x07, 0x20,       // palette: STX $2007
+            0xe8,                   // INX
+            0xe0, 0x20,             // CPX #$20
+            0xd0, 0xf8,             // BNE palette
+            0xa9, 0x1e,             // LDA #$1E
+            0x8d, 0x01, 0x20,       // STA $2001
+            0xa9, 0x20,             // LDA #$20
+            0x8d, 0x00, 0xc0,       // STA $C000
+            0x8d, 0x01, 0xc0,       // STA $C001
+            0x8d, 0x01, 0xe0,       // STA $E001
+            0xa9, 0x80,             // LDA #$80
+            0x8d, 0x00, 0x20,       // STA $2000
+            0x58,                   // CLI
+            0x4c, 0x4a, 0xe0,       // loop: JMP loop
+            0xe6, 0x00,             // nmi: INC $00
+            0xa9, 0x00,             // LDA #$00
+            0x8d, 0x05, 0x20,       // STA $2005
+            0x8d, 0x05, 0x20,       // STA $2005
+            0x40,                   // RTI
+            0x8d, 0x00, 0xe0,       // irq: STA $E000
+            0x8d, 0x01, 0xe0,       // STA $E001
+            0xe6, 0x01,             // INC $01
+            0xa5, 0x01,             // LDA $01
+            0x0a, 0x0a, 0x0a,       // ASL A x3
+            0x8d, 0x05, 0x20,       // STA $2005
+            0x8d, 0x05, 0x20,       // STA $2005
+            0x40,                   // RTI
+        };
+
+        uint8_t *prg = image + NES_HEADER_SIZE;
+        memcpy(prg + 0x6000, program, sizeof(program));
+        static const uint8_t vectors[] = { 0x4d, 0xe0, 0x00, 0xe0, 0x58, 0xe0 };
+        memcpy(prg + 0x7ffa, vectors, sizeof(vectors));
+        uint32_t seed = 0x9e3779b9;
+        for (int i = 0; i < NES_CHR_BANK_SIZE; ++i) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            prg[2 * NES_PRG_BANK_SIZE + i] = (uint8_t)seed;
+        }
+
+        static const dispatch_mode modes[] = { dispatch_mode::switch_case, dispatch_mode::jit };
+        const int frames = 8;
+        uint32_t hashes[frames] = {0};
+        uint64_t runs[2] = {0};
+
+        for (int lockstep = 1; lockstep >= 0; --lockstep) {
+            for (size_t m = 0; m < arr_len(modes); ++m) {
+                console nes;
+                int err = nes.load(image, sizeof(image));
+                assert(err == 0);
+                (void)err;
+                nes.get_cpu().set_dispatch_mode(modes[m]);
+                nes.set_lockstep(lockstep);
+
+                for (int f = 0; f < frames; ++f) {
+                    bool ok = nes.run_frame();
+                    assert(ok);
+                    (void)ok;
+                    uint32_t hash = frame_hash(nes.frame());
+                    if (lockstep && m == 0) {
+                        hashes[f] = hash;
+                    }
+                    assert(hash == hashes[f]);
+                    (void)hash;
+                }
+
+                memory& mem = nes.get_memory();
+                assert(mem.read<uint8_t>(0x0000) == frames);
+                // 241 clocked lines a frame, one IRQ per 33
+                assert(mem.read<uint8_t>(0x0001) >= 7 * (frames - 1));
+                (void)mem;
+                runs[lockstep] = nes.get_runs();
+            }
+        }
+
+        // lockstep stops at all 262 lines, catch-up at vblank, the IRQs and the frame end
+        assert(runs[1] >= (uint64_t)frames * NES_LINES_PER_FRAME);
+        assert(runs[0] * 10 < runs[1]);
+        (void)runs;
+        (void)hashes;
+
+        test_state(image, sizeof(image));
+    }
+
+    /*
+        A full state, a few frames, an incremental one on top of it: both
+        loaded into another console running elsewhere must carry on with
+        the same frames, registers and clock as the one they came from.
+    */
+    void console::test_state(const uint8_t *image, size_t size)
+    {
+        const int frames = 3;
+        console a;
+        int err = a.load(image, size);
+        assert(err == 0);
+        a.get_cpu().set_dispatch_mode(dispatch_mode::jit);
+        for (int f = 0; f < 5; ++f) {
+            a.run_frame();
+        }
+
+        std::vector<uint8_t> full, none, delta;
+        a.save_state(full, true);
+        assert(a.state_serial() != 0 && !(full[6] & STATE_FLAG_INCREMENTAL));
+        // no writes since, nothing in it but the non-memory chunks
+        a.save_state(none, true);
+        assert(none[6] & STATE_FLAG_INCREMENTAL);
+        size_t empty = none.size();
+
+        for (int f = 0; f < 2; ++f) {
+            a.run_frame();
+        }
+        a.save_state(delta, true);
+        // zero page and stack at most, out of 2K RAM and 8K PRG RAM; the
+        // stack only if the frames left something different on it
+        assert(delta.size() == empty + (2 + NES_PAGE_SIZE) || delta.size() == empty + 2 * (2 + NES_PAGE_SIZE));
+        assert(full.size() > empty + 40 * NES_PAGE_SIZE);
+        (void)empty;
+
+        uint32_t hashes[frames];
+        for (int f = 0; f < frames; ++f) {
+            a.run_frame();
+            hashes[f] = frame_hash(a.frame());
+        }
+        uint64_t clock = a.get_cpu().timestamp();
+        uint8_t irqs = a.get_memory().read<uint8_t>(0x0001);
+
+        // the delta needs the exact memory it was taken against
+        err = a.load_state(delta.data(), delta.size());
+        assert(err == STATE_ERROR_BASE);
+
+        for (int target = 0; target < 2; ++target) {
+            console b;
+            console& c = target ? b : a;
+            if (target) {
+                err = b.load(image, size);
+                assert(err == 0);
+                b.run_frame();
+            }
+            err = c.load_state(full.data(), full.size());
+            assert(err == 0);
+            // each delta on top of the one before
+            err = c.load_state(delta.data(), delta.size());
+            assert(err == STATE_ERROR_BASE);
+            err = c.load_state(none.data(), none.size());
+            assert(err == 0);
+            err = c.load_state(delta.data(), delta.size());
+            assert(err == 0);
+            for (int f = 0; f < frames; ++f) {
+                c.run_frame();
+                assert(frame_hash(c.frame()) == hashes[f]);
+            }
+            assert(c.get_cpu().timestamp() == clock);
+            assert(c.get_memory().read<uint8_t>(0x0001) == irqs);
+            assert(c.get_memory().read<uint8_t>(0x0800) == c.get_memory().read<uint8_t>(0x0000));
+        }
+        (void)hashes;
+        (void)clock;
+        (void)irqs;
+
+        // cut short, another cartridge
+        err = a.load_state(full.data(), full.size() - 1);
+        assert(err == STATE_ERROR_FORMAT);
+        std::vector<uint8_t> other(image, image + size);
+        other[NES_HEADER_SIZE + 2 * NES_PRG_BANK_SIZE - 1] ^= 1;
+        console d;
+        err = d.load(other.data(), other.size());
+        assert(err == 0);
+        err = d.load_state(full.data(), full.size());
+        assert(err == STATE_ERROR_MACHINE);
+        (void)err;
+    }
+
+}
@@ -0,0 +1,238 @@
+#ifndef console_hpp
+#define console_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include "memory.hpp"
+#include "cpu_6502.hpp"
+#include "flight_recorder.hpp"
+#include "cartridge.hpp"
+#include "mapper.hpp"
+#include "ppu.hpp"
+#include "ppu_thread.hpp"
+#include "apu.hpp"
+#include "state.hpp"
+
+#define NES_OAM_DMA_ADDR 0x4014
+#define NES_JOYPAD1_ADDR 0x4016
+#define NES_JOYPAD2_ADDR 0x4017
+#define NES_OAM_DMA_CYCLES 513
+
+#define CONSOLE_ERROR_MAPPER -10
+
+// chunk holding the console's own fields
+#define NES_STATE_CONSOLE "NES "
+
+#define BUTTON_A      0x01
+#define BUTTON_B      0x02
+#define BUTTON_SELECT 0x04
+#define BUTTON_START  0x08
+#define BUTTON_UP     0x10
+#define BUTTON_DOWN   0x20
+#define BUTTON_LEFT   0x40
+#define BUTTON_RIGHT  0x80
+
+
+namespace nes {
+
+    /*
+        A whole NES: CPU, PPU, cartridge board and the I/O page.
+
+        The CPU cycle count is the master clock and every chip keeps its
+        own timestamp. The CPU runs freely up to the next event (vblank,
+        a predicted mapper or APU IRQ, the end of the frame) and the PPU
+        and APU are only caught up to the CPU's timestamp when the CPU
+        touches their registers, OAM DMA or the mapper, or when the event
+        is due. The APU turns each frame's audio into samples at its end.
+        Writes that move the next event end the CPU's run early.
+        Interrupts are taken between runs. Owns everything it runs, so
+        any number of consoles can live side by side. With a PPU thread
+        the pictures are drawn on it while the CPU goes on, see
+        ppu_thread.
+    */
+    class console : public mmio_handler {
+
+        memory mem_;
+        cpu_6502 cpu_;
+        apu apu_;
+        cartridge cart_;
+        std::unique_ptr<mapper> mapper_;
+        std::unique_ptr<ppu> ppu_;
+        std::unique_ptr<ppu_thread> ppu_thread_;
+        flight_recorder recorder_;
+
+        // CPU timestamp at power up, the PPU's dot 0
+        uint64_t clock_base_{0};
+        uint64_t frame_end_{0};
+        uint64_t runs_{0};
+        bool lockstep_{false};
+        bool halted_{false};
+
+        uint8_t buttons_[2]{0};
+        uint8_t shift_[2]{0};
+        bool strobe_{false};
+
+        // the last state saved or loaded, the memory's dirty pages count from it
+        uint32_t state_serial_{0};
+        uint32_t state_count_{0};
+
+        int attach();
+        void detach();
+
+        uint32_t machine_id() const;
+
+        // the chunks of a state after its header, shared by save_state() and snapshot()
+        void write_state(std::vector<uint8_t>& out, const state_header& h, bool incremental);
+        // header checked, the chunks into the machine; nothing changes when
+        // one is missing, state_serial_ is 0 when it fails half way
+        int read_state(state_reader& r);
+
+        // CPU cycles since power up
+        uint64_t cpu_cycle() const
+        {
+            return this->cpu_.timestamp() - this->clock_base_;
+        }
+
+        // the CPU's timestamp in PPU dots
+        uint64_t cpu_dot() const
+        {
+            return 3 * this->cpu_cycle();
+        }
+
+        // the PPU up to now, lines of the next frame wait for the next run_frame()
+        void sync_ppu()
+        {
+            uint64_t dot = this->cpu_dot();
+            this->ppu_->catch_up(dot < this->frame_end_ ? dot : this->frame_end_ - 1);
+        }
+
+        void sync_apu()
+        {
+            this->apu_.catch_up(this->cpu_cycle());
+        }
+
+        uint64_t next_event() const;
+
+    public:
+        console(const console&) = delete;
+        console(console&&) = delete;
+        console& operator=(const console&) = delete;
+        console& operator=(console&&) = delete;
+
+        console() noexcept;
+        ~console();
+
+        // 0, ROM_ERROR_* or CONSOLE_ERROR_MAPPER
+        int load(const char *path);
+        int load(const uint8_t *image, size_t size);
+
+        void power_up();
+
+        // false once the CPU hit an unknown opcode, or when it stopped for a
+        // debugger (not halted() then), in the middle of the frame
+        bool run_frame();
+
+        // stop the CPU at every line as well, same output, for comparison
+        void set_lockstep(bool lockstep)
+        {
+            this->lockstep_ = lockstep;
+        }
+
+        // CPU runs between events since power up
+        uint64_t get_runs() const
+        {
+            return this->runs_;
+        }
+
+        uint8_t read(uint16_t addr) override;
+        void write(uint16_t addr, uint8_t v) override;
+
+        // BUTTON_* bits of controller port 0 or 1
+        void set_buttons(int port, uint8_t buttons)
+        {
+            this->buttons_[port & 1] = buttons;
+        }
+
+        // draw on a thread of its own, same pictures; survives load()
+        void set_ppu_thread(bool on);
+
+        // the last run_frame()'s picture, with a PPU thread once it is drawn
+        const uint8_t* frame() const
+        {
+            return this->ppu_->frame();
+        }
+
+        // with a PPU thread the one before, the thread may still be drawing
+        // the last one meanwhile; nullptr without
+        const uint8_t* previous_frame() const
+        {
+            return this->ppu_->previous_frame();
+        }
+
+        cpu_6502& get_cpu()
+        {
+            return this->cpu_;
+        }
+
+        // the CPU's last instructions, dumped when it halts
+        flight_recorder& get_flight_recorder()
+        {
+            return this->recorder_;
+        }
+
+        ppu& get_ppu()
+        {
+            return *this->ppu_;
+        }
+
+        apu& get_apu()
+        {
+            return this->apu_;
+        }
+
+        memory& get_memory()
+        {
+            return this->mem_;
+        }
+
+        bool halted() const
+        {
+            return this->halted_;
+        }
+
+        // the whole machine into out, between run_frame() calls. Incremental
+        // states hold the memory pages written since the last state saved or
+        // loaded, the first one is always full.
+        void save_state(std::vector<uint8_t>& out, bool incremental = false);
+
+        // 0, STATE_ERROR_FORMAT, STATE_ERROR_VERSION, STATE_ERROR_MACHINE for
+        // another cartridge or STATE_ERROR_BASE for an incremental state whose
+        // base is not the last state and memory untouched since
+        int load_state(const uint8_t *data, size_t size);
+
+        // a full state like save_state() for rewind and the like, which leaves
+        // the dirty pages and state_serial() alone: incremental states the
+        // caller saves keep chaining on their base
+        void snapshot(std::vector<uint8_t>& out);
+
+        // loads a snapshot() or a full state, errors as load_state(); the
+        // serial stays and every page counts as written, so the next
+        // incremental state holds all of memory
+        int restore(const uint8_t *data, size_t size);
+
+        // serial of the last state saved or loaded, 0 for none
+        uint32_t state_serial() const
+        {
+            return this->state_serial_;
+        }
+
+        static void test();
+        static void test_sync();
+        static void test_state(const uint8_t *image, size_t size);
+    };
+
+}
+
+
+#endif /* console_hpp */
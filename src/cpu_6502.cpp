@@ -1,5 +1,7 @@
 #include "cpu_6502.hpp"
+#include "state.hpp"
 #include <cassert>
+#include <limits>
 
 namespace nes {
     
@@ -11,20 +13,20 @@ namespace nes {
         << "Y: " << std::hex << static_cast<unsigned int>(r.Y) << std::endl
         << "SP: " << std::hex << static_cast<unsigned int>(r.SP) << std::endl
         << "PC: " << std::hex << static_cast<unsigned int>(r.PC) << std::endl
-        << "P: " << to_binary_string(r.P) << std::endl
+        << "P: " << to_binary_string((uint8_t)r.P) << std::endl
         << "cf: " << static_cast<unsigned int>(r.P.carry_flag)
-        << " zf: " << static_cast<unsigned int>(r.P.zero_flag)
+        << " zf: " << static_cast<unsigned int>(r.P.zero_flag())
         << " id: " << static_cast<unsigned int>(r.P.interrupt_disable)
         << " dm: " << static_cast<unsigned int>(r.P.decimal_mode)
         << " bc: " << static_cast<unsigned int>(r.P.break_command)
         << " of: " << static_cast<unsigned int>(r.P.overflow_flag)
-        << " nf: " << static_cast<unsigned int>(r.P.negative_flag);
+        << " nf: " << static_cast<unsigned int>(r.P.negative_flag());
     }
     
     
-    void cpu_6502::cross_page_cycles()
+    void cpu_6502::cross_page_cycles(uint16_t base)
     {
-        if ((this->op_address_ >> 8) != (this->reg_.PC >> 8)) {
+        if ((this->op_address_ >> 8) != (base >> 8)) {
             this->add_cycles_ = 1;
         }
         else {
@@ -32,126 +34,206 @@ namespace nes {
         }
     }
 
+    void cpu_6502::take_branch()
+    {
+        this->cross_page_cycles(this->reg_.PC);
+        this->add_cycles_++;
+        this->reg_.PC = this->op_address_;
+    }
+
     void cpu_6502::implied_addressing()
     {
-        this->add_cycles_ = 0;
+        this->implied_resolve(0);
     }
     
     void cpu_6502::accumulator_addressing()
     {
-        this->add_cycles_ = 0;
+        this->accumulator_resolve(0);
     }
     
     void cpu_6502::immediate_addressing()
     {
-        this->op_val_ = this->mem_.read<uint8_t>(this->reg_.PC);
+        uint16_t operand = this->mem_.read<uint8_t>(this->reg_.PC);
         this->reg_.PC++;
-        this->add_cycles_ = 0;
+        this->immediate_resolve(operand);
     }
     
     void cpu_6502::zero_page_addressing()
     {
-        this->op_address_ = this->mem_.read<uint8_t>(this->reg_.PC);
-        this->op_val_ = this->mem_.read<uint8_t>(op_address_);
+        uint16_t operand = this->mem_.read<uint8_t>(this->reg_.PC);
         this->reg_.PC++;
-        this->add_cycles_ = 0;
+        this->zero_page_resolve(operand);
     }
     
     void cpu_6502::zero_page_x_addressing()
     {
-        uint16_t addr = this->mem_.read<uint8_t>(this->reg_.PC) + this->reg_.X;
-        this->op_address_ = addr & 0xff;
-        this->op_val_ = this->mem_.read<uint8_t>(op_address_);
+        uint16_t operand = this->mem_.read<uint8_t>(this->reg_.PC);
         this->reg_.PC++;
-        this->add_cycles_ = 0;
+        this->zero_page_x_resolve(operand);
     }
     
     void cpu_6502::zero_page_y_addressing()
     {
-        uint16_t addr = this->mem_.read<uint8_t>(this->reg_.PC) + this->reg_.Y;
-        this->op_address_ = addr & 0xff;
-        this->op_val_ = this->mem_.read<uint8_t>(op_address_);
+        uint16_t operand = this->mem_.read<uint8_t>(this->reg_.PC);
         this->reg_.PC++;
-        this->add_cycles_ = 0;
+        this->zero_page_y_resolve(operand);
     }
     
     void cpu_6502::relative_addressing()
     {
-        this->op_address_ = this->mem_.read<uint8_t>(this->reg_.PC);
+        uint16_t operand = this->mem_.read<uint8_t>(this->reg_.PC);
         this->reg_.PC++;
-        if (this->op_address_ & 0x80) { 
-            this->op_address_ -= 0x100; 
-        }
-        this->op_address_ += this->reg_.PC++;
-        this->cross_page_cycles();
+        this->relative_resolve(operand);
     }
     
     void cpu_6502::absolute_addressing()
     {
-        this->op_address_ = this->mem_.read<uint16_t>(this->reg_.PC);
-        this->op_val_ = this->mem_.read<uint8_t>(op_address_);
+        uint16_t operand = this->mem_.read<uint16_t>(this->reg_.PC);
         this->reg_.PC += 2;
-        this->add_cycles_ = 0;
+        this->absolute_resolve(operand);
     }
     
     void cpu_6502::absolute_x_addressing()
     {
-        this->op_address_ = this->mem_.read<uint16_t>(this->reg_.PC) + this->reg_.X;
-        this->op_val_ = this->mem_.read<uint8_t>(op_address_);
+        uint16_t operand = this->mem_.read<uint16_t>(this->reg_.PC);
         this->reg_.PC += 2;
-        this->cross_page_cycles();
+        this->absolute_x_resolve(operand);
     }
     
     void cpu_6502::absolute_y_addressing()
     {
-        this->op_address_ = this->mem_.read<uint16_t>(this->reg_.PC) + this->reg_.Y;
-        this->op_val_ = this->mem_.read<uint8_t>(op_address_);
+        uint16_t operand = this->mem_.read<uint16_t>(this->reg_.PC);
         this->reg_.PC += 2;
-        this->cross_page_cycles();
+        this->absolute_y_resolve(operand);
     }
     
     void cpu_6502::indirect_addressing()
     {
-        uint16_t addr = this->mem_.read<uint16_t>(this->reg_.PC);
+        uint16_t operand = this->mem_.read<uint16_t>(this->reg_.PC);
+        this->reg_.PC += 2;
+        this->indirect_resolve(operand);
+    }
+    
+    void cpu_6502::indirect_x_addressing()
+    {
+        uint16_t operand = this->mem_.read<uint8_t>(this->reg_.PC);
+        this->reg_.PC++;
+        this->indirect_x_resolve(operand);
+    }
+    
+    void cpu_6502::indirect_y_addressing()
+    {
+        uint16_t operand = this->mem_.read<uint8_t>(this->reg_.PC);
+        this->reg_.PC++;
+        this->indirect_y_resolve(operand);
+    }
+
+    // *_resolve: effective address from an already fetched operand, PC points past it.
+    // The value is only read by the ops that use it, see load_operand()
+
+    void cpu_6502::implied_resolve(uint16_t)
+    {
+        this->add_cycles_ = 0;
+    }
+    
+    void cpu_6502::accumulator_resolve(uint16_t)
+    {
+        this->add_cycles_ = 0;
+    }
+    
+    void cpu_6502::immediate_resolve(uint16_t operand)
+    {
+        // the operand byte itself, right before PC
+        this->op_address_ = this->reg_.PC - 1;
+        this->add_cycles_ = 0;
+    }
+    
+    void cpu_6502::zero_page_resolve(uint16_t operand)
+    {
+        this->op_address_ = operand;
+        this->add_cycles_ = 0;
+    }
+    
+    void cpu_6502::zero_page_x_resolve(uint16_t operand)
+    {
+        uint16_t addr = operand + this->reg_.X;
+        this->op_address_ = addr & 0xff;
+        this->add_cycles_ = 0;
+    }
+    
+    void cpu_6502::zero_page_y_resolve(uint16_t operand)
+    {
+        uint16_t addr = operand + this->reg_.Y;
+        this->op_address_ = addr & 0xff;
+        this->add_cycles_ = 0;
+    }
+    
+    void cpu_6502::relative_resolve(uint16_t operand)
+    {
+        this->op_address_ = operand;
+        if (this->op_address_ & 0x80) { 
+            this->op_address_ -= 0x100; 
+        }
+        this->op_address_ += this->reg_.PC;
+        this->add_cycles_ = 0;
+    }
+    
+    void cpu_6502::absolute_resolve(uint16_t operand)
+    {
+        this->op_address_ = operand;
+        this->add_cycles_ = 0;
+    }
+    
+    void cpu_6502::absolute_x_resolve(uint16_t operand)
+    {
+        this->op_address_ = operand + this->reg_.X;
+        this->cross_page_cycles(operand);
+    }
+    
+    void cpu_6502::absolute_y_resolve(uint16_t operand)
+    {
+        this->op_address_ = operand + this->reg_.Y;
+        this->cross_page_cycles(operand);
+    }
+    
+    void cpu_6502::indirect_resolve(uint16_t operand)
+    {
+        uint16_t addr = operand;
         if ((addr & 0xff) == 0xff) {
             this->op_address_ = (this->mem_.read<uint8_t>(addr & 0xff00) << 8) + this->mem_.read<uint8_t>(addr);
         } else {
             this->op_address_ = this->mem_.read<uint16_t>(addr);
         }
 
-        this->reg_.PC += 2;
         this->add_cycles_ = 0;
     }
     
-    void cpu_6502::indirect_x_addressing()
+    void cpu_6502::indirect_x_resolve(uint16_t operand)
     {
-        uint8_t addr = this->mem_.read<uint8_t>(this->reg_.PC);
+        uint8_t addr = (uint8_t)operand;
         this->op_address_ = (this->mem_.read<uint8_t>((addr + this->reg_.X + 1) & 0xff) << 8) | this->mem_.read<uint8_t>((addr + this->reg_.X) & 0xff);
-        this->op_val_ = this->mem_.read<uint8_t>(this->op_address_);
-        this->reg_.PC++;
         this->add_cycles_ = 0;
     }
     
-    void cpu_6502::indirect_y_addressing()
+    void cpu_6502::indirect_y_resolve(uint16_t operand)
     {
-        uint8_t addr = this->mem_.read<uint8_t>(this->reg_.PC);
-        this->op_address_ = (((this->mem_.read<uint8_t>((addr + 1) & 0xff) << 8) | this->mem_.read<uint8_t>(addr)) + this->reg_.Y) & 0xffff;
-        this->op_val_ = this->mem_.read<uint8_t>(this->op_address_);
-        this->reg_.PC++;
-        this->cross_page_cycles();
+        uint8_t addr = (uint8_t)operand;
+        uint16_t base = (this->mem_.read<uint8_t>((addr + 1) & 0xff) << 8) | this->mem_.read<uint8_t>(addr);
+        this->op_address_ = (base + this->reg_.Y) & 0xffff;
+        this->cross_page_cycles(base);
     }
     
     void cpu_6502::NOP()
     {
     }
 
+    // BRK skips a padding byte and pushes P with B set
     void cpu_6502::BRK()
     {
-        this->push(this->reg_.PC - 1);
-        this->push(this->reg_.P);
-        this->reg_.P.no_effect = 1;
-        this->reg_.P.break_command = 1;
-        this->reg_.PC = this->mem_.read<uint16_t>(0xfffa);
+        this->push((uint16_t)(this->reg_.PC + 1));
+        this->push((uint8_t)((uint8_t)this->reg_.P | FLAG_BREAK | FLAG_EFFECT));
+        this->reg_.P.interrupt_disable = 1;
+        this->reg_.PC = this->mem_.read<uint16_t>(g_irq_vector);
     }
 
     void cpu_6502::TAX()
@@ -203,6 +285,8 @@ namespace nes {
 
     void cpu_6502::INC()
     {
+        this->add_cycles_ = 0;
+        this->load_operand();
         uint8_t t = this->op_val_ + 1;
         this->mem_.write(t, this->op_address_);
         this->set_nzf(t);
@@ -222,6 +306,8 @@ namespace nes {
 
     void cpu_6502::DEC()
     {
+        this->add_cycles_ = 0;
+        this->load_operand();
         uint8_t t = this->op_val_ - 1;
         this->mem_.write(t, this->op_address_);
         this->set_nzf(t);
@@ -229,190 +315,179 @@ namespace nes {
 
     void cpu_6502::ORA()
     {
+        this->load_operand();
         this->reg_.A |= this->op_val_;
         this->set_nzf(this->reg_.A);
     }
 
     void cpu_6502::AND()
     {
+        this->load_operand();
         this->reg_.A &= this->op_val_;
         this->set_nzf(this->reg_.A);
     }
 
     void cpu_6502::EOR()
     {
+        this->load_operand();
         this->reg_.A ^= this->op_val_;
         this->set_nzf(this->reg_.A);
     }
 
     void cpu_6502::ASL()
     {
-        this->reg_.P.carry_flag = this->op_val_ & 0x80 ? 1 : 0;
-        this->op_val_ <<= 1;
+        this->add_cycles_ = 0;
+        this->load_operand();
+        this->op_val_ = alu_asl(this->op_val_, this->reg_.P.carry_flag);
         this->mem_.write(this->op_val_, this->op_address_);
         this->set_nzf(this->op_val_);
     }
 
     void cpu_6502::ASLA()
     {
-        this->reg_.P.carry_flag = this->reg_.A & 0x80 ? 1 : 0;
-        this->reg_.A <<= 1;
+        this->reg_.A = alu_asl(this->reg_.A, this->reg_.P.carry_flag);
         this->set_nzf(this->reg_.A);
     }
 
     void cpu_6502::ROL()
     {
-        uint8_t old_carry = this->reg_.P.carry_flag;
-        this->reg_.P.carry_flag = this->op_val_ & 0x80 ? 1 : 0;
-        this->op_val_ <<= 1;
-        this->op_val_ |= old_carry ? 1 : 0;
+        this->add_cycles_ = 0;
+        this->load_operand();
+        this->op_val_ = alu_rol(this->op_val_, this->reg_.P.carry_flag);
         this->mem_.write(this->op_val_, this->op_address_);
         this->set_nzf(this->op_val_);
     }
 
     void cpu_6502::ROLA()
     {
-        uint8_t old_carry = this->reg_.P.carry_flag;
-        this->reg_.P.carry_flag = this->reg_.A & 0x80 ? 1 : 0;
-        this->reg_.A <<= 1;
-        this->reg_.A |= old_carry ? 1 : 0;
+        this->reg_.A = alu_rol(this->reg_.A, this->reg_.P.carry_flag);
         this->set_nzf(this->reg_.A);
     }
 
     void cpu_6502::ROR()
     {
-        uint8_t old_carry = this->reg_.P.carry_flag;
-        this->reg_.P.carry_flag = this->op_val_ & 0x80 ? 1 : 0;
-        this->op_val_ <<= 1;
-        this->op_val_ |= (old_carry ? 1 : 0) << 7;
+        this->add_cycles_ = 0;
+        this->load_operand();
+        this->op_val_ = alu_ror(this->op_val_, this->reg_.P.carry_flag);
         this->mem_.write(this->op_val_, this->op_address_);
         this->set_nzf(this->op_val_);
     }
 
     void cpu_6502::RORA()
     {
-        uint8_t old_carry = this->reg_.P.carry_flag;
-        this->reg_.P.carry_flag = this->reg_.A & 0x80 ? 1 : 0;
-        this->reg_.A <<= 1;
-        this->reg_.A |= (old_carry ? 1 : 0) << 7;
+        this->reg_.A = alu_ror(this->reg_.A, this->reg_.P.carry_flag);
         this->set_nzf(this->reg_.A);
     }
 
     void cpu_6502::LSR()
     {
-        this->reg_.P.carry_flag = this->op_val_ & 0x01;
-        this->op_val_ >>= 1;
+        this->add_cycles_ = 0;
+        this->load_operand();
+        this->op_val_ = alu_lsr(this->op_val_, this->reg_.P.carry_flag);
         this->mem_.write(this->op_val_, this->op_address_);
         this->set_nzf(this->op_val_);
     }
 
     void cpu_6502::LSRA()
     {
-        this->reg_.P.carry_flag = this->reg_.A & 0x01;
-        this->reg_.A >>= 1;
+        this->reg_.A = alu_lsr(this->reg_.A, this->reg_.P.carry_flag);
         this->set_nzf(this->reg_.A);
     }
     
     void cpu_6502::ADC()
     {
-        uint16_t tmp = this->op_val_ + this->reg_.A + this->reg_.P.carry_flag;
-        this->reg_.P.carry_flag = tmp & 0xff00 ? 1 : 0;
-        this->reg_.P.overflow_flag = ((this->op_val_ ^ tmp) & (this->reg_.A ^ tmp)) & 0x80 ? 1 : 0;
-        this->reg_.A = (uint8_t)(tmp & 0xff);
+        this->load_operand();
+        this->reg_.A = alu_adc(this->reg_.A, this->op_val_, this->reg_.P.carry_flag, this->reg_.P.overflow_flag);
         this->set_nzf(this->reg_.A);
     }
 
     void cpu_6502::SBC()
     {
-        uint16_t tmp = this->reg_.A - this->op_val_ - (1 - this->reg_.P.carry_flag);
-        this->reg_.P.carry_flag = (tmp & 0xff00) == 0;
-        this->reg_.P.overflow_flag = ((this->reg_.A ^ this->op_val_) & (this->reg_.A ^ tmp)) & 0x80 ? 1 : 0;
-        this->reg_.A = (uint8_t)(tmp & 0xff);
+        this->load_operand();
+        this->reg_.A = alu_sbc(this->reg_.A, this->op_val_, this->reg_.P.carry_flag, this->reg_.P.overflow_flag);
         this->set_nzf(this->reg_.A);
     }
 
     void cpu_6502::BMI()
     {
-        if (this->reg_.P.negative_flag == 1) {
-            this->reg_.PC = this->op_address_;
+        if (this->reg_.P.negative_flag() == 1) {
+            this->take_branch();
         }
     }
 
     void cpu_6502::BCS()
     {
         if (this->reg_.P.carry_flag == 1) {
-            this->reg_.PC = this->op_address_;
+            this->take_branch();
         }
     }
 
     void cpu_6502::BEQ()
     {
-        if (this->reg_.P.zero_flag == 1) {
-            this->reg_.PC = this->op_address_;
+        if (this->reg_.P.zero_flag() == 1) {
+            this->take_branch();
         }
     }
 
     void cpu_6502::BVS()
     {
         if (this->reg_.P.overflow_flag == 1) {
-            this->reg_.PC = this->op_address_;
+            this->take_branch();
         }
     }
 
     void cpu_6502::BPL()
     {
-        if (this->reg_.P.negative_flag == 0) {
-            this->reg_.PC = this->op_address_;
+        if (this->reg_.P.negative_flag() == 0) {
+            this->take_branch();
         }
     }
 
     void cpu_6502::BCC()
     {
         if (this->reg_.P.carry_flag == 0) {
-            this->reg_.PC = this->op_address_;
+            this->take_branch();
         }
     }
 
     void cpu_6502::BNE()
     {
-        if (this->reg_.P.zero_flag == 0) {
-            this->reg_.PC = this->op_address_;
+        if (this->reg_.P.zero_flag() == 0) {
+            this->take_branch();
         }
     }
 
     void cpu_6502::BVC()
     {
         if (this->reg_.P.overflow_flag == 0) {
-            this->reg_.PC = this->op_address_;
+            this->take_branch();
         }
     }
 
     void cpu_6502::BIT()
     {
-        this->reg_.P.overflow_flag = this->op_val_ & 0x40 ? 1 : 0;
-        this->reg_.P.negative_flag = this->op_val_ & 0x80 ? 1 : 0;
-        this->reg_.P.zero_flag = this->op_val_ & this->reg_.A ? 0 : 1;
+        this->load_operand();
+        this->reg_.P.overflow_flag = alu_bit_overflow(this->op_val_);
+        this->reg_.P.n_result = this->op_val_;
+        this->reg_.P.z_result = this->op_val_ & this->reg_.A;
     }
 
     void cpu_6502::CMP()
     {
-        int tmp = this->reg_.A - this->op_val_;
-        this->reg_.P.carry_flag = tmp >= 0 ? 1 : 0;
-        this->set_nzf((uint8_t)tmp);
+        this->load_operand();
+        this->set_nzf(alu_cmp(this->reg_.A, this->op_val_, this->reg_.P.carry_flag));
     }
 
     void cpu_6502::CPX()
     {
-        int tmp = this->reg_.X - this->op_val_;
-        this->reg_.P.carry_flag = tmp >= 0 ? 1 : 0;
-        this->set_nzf((uint8_t)tmp);
+        this->load_operand();
+        this->set_nzf(alu_cmp(this->reg_.X, this->op_val_, this->reg_.P.carry_flag));
     }
 
     void cpu_6502::CPY()
     {
-        int tmp = this->reg_.Y - this->op_val_;
-        this->reg_.P.carry_flag = tmp >= 0 ? 1 : 0;
-        this->set_nzf((uint8_t)tmp);
+        this->load_operand();
+        this->set_nzf(alu_cmp(this->reg_.Y, this->op_val_, this->reg_.P.carry_flag));
     }
 
     void cpu_6502::PHA()
@@ -422,7 +497,7 @@ namespace nes {
 
     void cpu_6502::PHP()
     {
-        this->push((uint8_t)this->reg_.P | 0x30);
+        this->push((uint8_t)((uint8_t)this->reg_.P | FLAG_BREAK | FLAG_EFFECT));
     }
 
     void cpu_6502::PLA()
@@ -454,41 +529,47 @@ namespace nes {
 
     void cpu_6502::JSR()
     {
-        this->push(this->reg_.PC - 1);
+        this->push((uint16_t)(this->reg_.PC - 1));
         this->reg_.PC = this->op_address_;
     }
 
     // load && store
     void cpu_6502::LDA()
     {
+        this->load_operand();
         this->reg_.A = this->op_val_;
         this->set_nzf(this->reg_.A);
     }
 
     void cpu_6502::LDX()
     {
+        this->load_operand();
         this->reg_.X = this->op_val_;
         this->set_nzf(this->reg_.X);
     }
 
     void cpu_6502::LDY()
     {
+        this->load_operand();
         this->reg_.Y = this->op_val_;
         this->set_nzf(this->reg_.Y);
     }
     
     void cpu_6502::STA()
     {
+        this->add_cycles_ = 0;
         this->mem_.write(this->reg_.A, this->op_address_);
     }
 
     void cpu_6502::STX()
     {
+        this->add_cycles_ = 0;
         this->mem_.write(this->reg_.X, this->op_address_);
     }
 
     void cpu_6502::STY()
     {
+        this->add_cycles_ = 0;
         this->mem_.write(this->reg_.Y, this->op_address_);
     }
 
@@ -529,8 +610,10 @@ namespace nes {
     
     void cpu_6502::load_code_segment(uint16_t segment_base_addr, const uint8_t *buf, size_t size)
     {
-        uint8_t *ptr = this->mem_.map_offset_addr(segment_base_addr);
-        memcpy(ptr, buf, size);
+        // through the memory map, the pages need not be contiguous on the host
+        for (size_t i = 0; i < size; ++i) {
+            this->mem_.write(buf[i], (uint16_t)(segment_base_addr + i));
+        }
         this->mem_.set_code_segment_offset(segment_base_addr, segment_base_addr + (uint16_t)size);
     }
     
@@ -542,9 +625,64 @@ namespace nes {
                   << "------------------------" << std::endl
                   << this->reg_ << std::endl;
     }
+
+    void cpu_6502::debug_print_asm(uint16_t addr) const
+    {
+        uint8_t bytes[3];
+        for (int i = 0; i < 3; ++i) {
+            bytes[i] = this->mem_.peek((uint16_t)(addr + i));
+        }
+        char text[NES_DISASM_SIZE];
+        disassemble(addr, bytes, sizeof(bytes), text);
+        std::cout << std::setw(4) << std::hex << addr << ": " << text << std::endl;
+    }
+
+    size_t cpu_6502::trace(char out[NES_TRACE_SIZE]) const
+    {
+        uint8_t bytes[3];
+        for (int i = 0; i < 3; ++i) {
+            bytes[i] = this->mem_.peek((uint16_t)(this->reg_.PC + i));
+        }
+        trace_regs r = { this->reg_.PC, this->reg_.A, this->reg_.X, this->reg_.Y, (uint8_t)this->reg_.P,
+                         this->reg_.SP, this->timestamp() };
+        return trace_format(r, bytes, out);
+    }
+
+    void cpu_6502::dissassembly(const uint8_t *buf, size_t size)
+    {
+        uint16_t pc = this->mem_.get_code_segment_offset().start;
+        char text[NES_DISASM_SIZE];
+        for (size_t i = 0; i < size; ) {
+            size_t len = disassemble((uint16_t)(pc + i), buf + i, size - i, text);
+            if (len == 0) {
+                // cut off operand
+                len = size - i;
+                text[0] = 0;
+            }
+            printf("%04X ", (unsigned)(uint16_t)(pc + i));
+            for (size_t k = 0; k < 3; ++k) {
+                if (k < len) {
+                    printf(" %02X", buf[i + k]);
+                }
+                else {
+                    printf("   ");
+                }
+            }
+            printf("  %s\n", text);
+            i += len;
+        }
+    }
     
-#define ERROR_UNKNOWN_INSTRUCTION -1
-#define BRK_INSTRUCTION -2
+#define NES_EVAL_OP(code, mode, op, cyc) \
+        case code: \
+            this->mode##_addressing(); this->op(); cycles -= g_opcode_info[code].cycles; \
+            if (ends_block(code) && this->recorder_) { \
+                this->record_block(cycles - this->add_cycles_); \
+            } \
+            break;
+#define NES_EVAL_TRAP(code, mode, op, cyc) \
+        case code: this->mode##_addressing(); this->op(); cycles -= g_opcode_info[code].cycles; return BRK_INSTRUCTION;
+#define NES_EVAL_ILL(code)
 
     uint8_t cpu_6502::eval(int& cycles)
     {
@@ -552,189 +690,20 @@ namespace nes {
         this->reg_.PC++;
  
         switch (opcode) {
-        case 0x00: this->implied_addressing();     this->BRK();  cycles -= 7; return BRK_INSTRUCTION; break;
-        case 0x01: this->indirect_x_addressing();  this->ORA();  cycles -= 6; break;
-        case 0x04: this->zero_page_addressing();    this->NOP();  cycles -= 1; break;
-        case 0x05: this->zero_page_addressing();    this->ORA();  cycles -= 3; break;
-        case 0x06: this->zero_page_addressing();    this->ASL();  cycles -= 5; break;
-        case 0x08: this->implied_addressing();     this->PHP();  cycles -= 3; break;
-        case 0x09: this->immediate_addressing();   this->ORA();  cycles -= 2; break;
-        case 0x0A: this->accumulator_addressing(); this->ASLA(); cycles -= 2; break;
-        case 0x0C: this->absolute_addressing();    this->NOP();  cycles -= 1; break;
-        case 0x0D: this->absolute_addressing();    this->ORA();  cycles -= 4; break;
-        case 0x0E: this->absolute_addressing();    this->ASL();  cycles -= 6; break;
-        case 0x10: this->relative_addressing();    this->BPL();  cycles -= 2; break;
-        case 0x11: this->indirect_y_addressing();  this->ORA();  cycles -= 5; break;
-        case 0x14: this->zero_page_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0x15: this->zero_page_x_addressing();  this->ORA();  cycles -= 4; break;
-        case 0x16: this->zero_page_x_addressing();  this->ASL();  cycles -= 6; break;
-        case 0x18: this->implied_addressing();     this->CLC();  cycles -= 2; break;
-        case 0x19: this->absolute_y_addressing();  this->ORA();  cycles -= 4; break;
-        case 0x1A: this->accumulator_addressing(); this->NOP();  cycles -= 1; break;
-        case 0x1C: this->absolute_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0x1D: this->absolute_x_addressing();  this->ORA();  cycles -= 4; break;
-        case 0x1E: this->absolute_x_addressing();  this->ASL();  cycles -= 7; break;
-        case 0x20: this->absolute_addressing();    this->JSR();  cycles -= 6; break;
-        case 0x21: this->indirect_x_addressing();  this->AND();  cycles -= 6; break;
-        case 0x24: this->zero_page_addressing();    this->BIT();  cycles -= 3; break;
-        case 0x25: this->zero_page_addressing();    this->AND();  cycles -= 3; break;
-        case 0x26: this->zero_page_addressing();    this->ROL();  cycles -= 5; break;
-        case 0x28: this->implied_addressing();     this->PLP();  cycles -= 3; break;
-        case 0x29: this->immediate_addressing();   this->AND();  cycles -= 2; break;
-        case 0x2A: this->accumulator_addressing(); this->ROLA(); cycles -= 2; break;
-        case 0x2C: this->absolute_addressing();    this->BIT();  cycles -= 4; break;
-        case 0x2D: this->absolute_addressing();    this->AND();  cycles -= 2; break;
-        case 0x2E: this->absolute_addressing();    this->ROL();  cycles -= 6; break;
-        case 0x30: this->relative_addressing();    this->BMI();  cycles -= 2; break;
-        case 0x31: this->indirect_y_addressing();  this->AND();  cycles -= 5; break;
-        case 0x34: this->zero_page_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0x35: this->zero_page_x_addressing();  this->AND();  cycles -= 4; break;
-        case 0x36: this->zero_page_x_addressing();  this->ROL();  cycles -= 6; break;
-        case 0x38: this->implied_addressing();     this->SEC();  cycles -= 2; break;
-        case 0x39: this->absolute_y_addressing();  this->AND();  cycles -= 4; break;
-        case 0x3A: this->accumulator_addressing(); this->NOP();  cycles -= 1; break;
-        case 0x3C: this->absolute_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0x3D: this->absolute_x_addressing();  this->AND();  cycles -= 4; break;
-        case 0x3E: this->absolute_x_addressing();  this->ROL();  cycles -= 7; break;
-        case 0x40: this->implied_addressing();     this->RTI();  cycles -= 6; break;
-        case 0x41: this->indirect_x_addressing();  this->EOR();  cycles -= 6; break;
-        case 0x44: this->zero_page_addressing();    this->NOP();  cycles -= 1; break;
-        case 0x45: this->zero_page_addressing();    this->EOR();  cycles -= 3; break;
-        case 0x46: this->zero_page_addressing();    this->LSR();  cycles -= 5; break;
-        case 0x48: this->implied_addressing();     this->PHA();  cycles -= 3; break;
-        case 0x49: this->immediate_addressing();   this->EOR();  cycles -= 2; break;
-        case 0x4A: this->accumulator_addressing(); this->LSRA(); cycles -= 2; break;
-        case 0x4C: this->absolute_addressing();    this->JMP();  cycles -= 3; break;
-        case 0x4D: this->absolute_addressing();    this->EOR();  cycles -= 4; break;
-        case 0x4E: this->absolute_addressing();    this->LSR();  cycles -= 6; break;
-        case 0x50: this->relative_addressing();    this->BVC();  cycles -= 2; break;
-        case 0x51: this->indirect_y_addressing();  this->EOR();  cycles -= 5; break;
-        case 0x54: this->zero_page_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0x55: this->zero_page_x_addressing();  this->EOR();  cycles -= 4; break;
-        case 0x56: this->zero_page_x_addressing();  this->LSR();  cycles -= 6; break;
-        case 0x59: this->absolute_y_addressing();  this->EOR();  cycles -= 4; break;
-        case 0x5A: this->accumulator_addressing(); this->NOP();  cycles -= 1; break;
-        case 0x5C: this->absolute_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0x5D: this->absolute_x_addressing();  this->EOR();  cycles -= 4; break;
-        case 0x5E: this->absolute_x_addressing();  this->LSR();  cycles -= 7; break;
-        case 0x60: this->implied_addressing();     this->RTS();  cycles -= 6; break;
-        case 0x61: this->indirect_x_addressing();  this->ADC();  cycles -= 6; break;
-        case 0x64: this->zero_page_addressing();    this->NOP();  cycles -= 1; break;
-        case 0x65: this->zero_page_addressing();    this->ADC();  cycles -= 3; break;
-        case 0x66: this->zero_page_addressing();    this->ROR();  cycles -= 5; break;
-        case 0x68: this->implied_addressing();     this->PLA();  cycles -= 4; break;
-        case 0x69: this->immediate_addressing();   this->ADC();  cycles -= 2; break;
-        case 0x6A: this->accumulator_addressing(); this->RORA(); cycles -= 2; break;
-        case 0x6C: this->indirect_addressing();    this->JMP();  cycles -= 5; break;
-        case 0x6D: this->absolute_addressing();    this->ADC();  cycles -= 4; break;
-        case 0x6E: this->absolute_addressing();    this->ROR();  cycles -= 6; break;
-        case 0x70: this->relative_addressing();    this->BVS();  cycles -= 2; break;
-        case 0x71: this->indirect_y_addressing();  this->ADC();  cycles -= 5; break;
-        case 0x74: this->zero_page_addressing();    this->NOP();  cycles -= 1; break;
-        case 0x75: this->zero_page_x_addressing();  this->ADC();  cycles -= 4; break;
-        case 0x76: this->zero_page_x_addressing();  this->ROR();  cycles -= 6; break;
-        case 0x78: this->implied_addressing();     this->SEI();  cycles -= 2; break;
-        case 0x79: this->absolute_y_addressing();  this->ADC();  cycles -= 4; break;
-        case 0x7A: this->accumulator_addressing(); this->NOP();  cycles -= 1; break;
-        case 0x7C: this->absolute_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0x7D: this->absolute_x_addressing();  this->ADC();  cycles -= 4; break;
-        case 0x7E: this->absolute_x_addressing();  this->ROR();  cycles -= 7; break;
-        case 0x80: this->immediate_addressing();   this->NOP();  cycles -= 1; break;
-        case 0x81: this->indirect_x_addressing();  this->STA();  cycles -= 6; break;
-        case 0x84: this->zero_page_addressing();    this->STY();  cycles -= 3; break;
-        case 0x85: this->zero_page_addressing();    this->STA();  cycles -= 3; break;
-        case 0x86: this->zero_page_addressing();    this->STX();  cycles -= 3; break;
-        case 0x88: this->implied_addressing();     this->DEY();  cycles -= 2; break;
-        case 0x8A: this->implied_addressing();     this->TXA();  cycles -= 2; break;
-        case 0x8C: this->absolute_addressing();    this->STY();  cycles -= 4; break;
-        case 0x8D: this->absolute_addressing();    this->STA();  cycles -= 4; break;
-        case 0x8E: this->absolute_addressing();    this->STX();  cycles -= 4; break;
-        case 0x90: this->relative_addressing();    this->BCC();  cycles -= 2; break;
-        case 0x91: this->indirect_y_addressing();  this->STA();  cycles -= 6; break;
-        case 0x94: this->zero_page_x_addressing();  this->STY();  cycles -= 4; break;
-        case 0x95: this->zero_page_x_addressing();  this->STA();  cycles -= 4; break;
-        case 0x96: this->zero_page_y_addressing();  this->STX();  cycles -= 4; break;
-        case 0x98: this->implied_addressing();     this->TYA();  cycles -= 2; break;
-        case 0x99: this->absolute_y_addressing();  this->STA();  cycles -= 5; break;
-        case 0x9A: this->implied_addressing();     this->TXS();  cycles -= 2; break;
-        case 0x9D: this->absolute_x_addressing();  this->STA();  cycles -= 5; break;
-        case 0xA0: this->immediate_addressing();   this->LDY();  cycles -= 2; break;
-        case 0xA1: this->indirect_x_addressing();  this->LDA();  cycles -= 6; break;
-        case 0xA2: this->immediate_addressing();   this->LDX();  cycles -= 2; break;
-        case 0xA4: this->zero_page_addressing();    this->LDY();  cycles -= 3; break;
-        case 0xA5: this->zero_page_addressing();    this->LDA();  cycles -= 3; break;
-        case 0xA6: this->zero_page_addressing();    this->LDX();  cycles -= 3; break;
-        case 0xA8: this->implied_addressing();     this->TAY();  cycles -= 3; break;
-        case 0xA9: this->immediate_addressing();   this->LDA();  cycles -= 2; break;
-        case 0xAA: this->implied_addressing();     this->TAX();  cycles -= 2; break;
-        case 0xAC: this->absolute_addressing();    this->LDY();  cycles -= 4; break;
-        case 0xAD: this->absolute_addressing();    this->LDA();  cycles -= 4; break;
-        case 0xAE: this->absolute_addressing();    this->LDX();  cycles -= 4; break;
-        case 0xB0: this->relative_addressing();    this->BCS();  cycles -= 2; break;
-        case 0xB1: this->indirect_y_addressing();  this->LDA();  cycles -= 5; break;
-        case 0xB4: this->zero_page_x_addressing();  this->LDY();  cycles -= 4; break;
-        case 0xB5: this->zero_page_x_addressing();  this->LDA();  cycles -= 4; break;
-        case 0xB6: this->zero_page_y_addressing();  this->LDX();  cycles -= 4; break;
-        case 0xB8: this->implied_addressing();     this->CLV();  cycles -= 2; break;
-        case 0xB9: this->absolute_y_addressing();  this->LDA();  cycles -= 4; break;
-        case 0xBA: this->implied_addressing();     this->TSX();  cycles -= 2; break;
-        case 0xBC: this->absolute_x_addressing();  this->LDY();  cycles -= 4; break;
-        case 0xBD: this->absolute_x_addressing();  this->LDA();  cycles -= 4; break;
-        case 0xBE: this->absolute_y_addressing();  this->LDX();  cycles -= 4; break;
-        case 0xC0: this->immediate_addressing();   this->CPY();  cycles -= 2; break;
-        case 0xC1: this->indirect_x_addressing();  this->CMP();  cycles -= 6; break;
-        case 0xC4: this->zero_page_addressing();    this->CPY();  cycles -= 3; break;
-        case 0xC5: this->zero_page_addressing();    this->CMP();  cycles -= 3; break;
-        case 0xC6: this->zero_page_addressing();    this->DEC();  cycles -= 5; break;
-        case 0xC8: this->implied_addressing();     this->INY();  cycles -= 2; break;
-        case 0xC9: this->immediate_addressing();   this->CMP();  cycles -= 2; break;
-        case 0xCA: this->implied_addressing();     this->DEX();  cycles -= 2; break;
-        case 0xCC: this->absolute_addressing();    this->CPY();  cycles -= 4; break;
-        case 0xCD: this->absolute_addressing();    this->CMP();  cycles -= 4; break;
-        case 0xCE: this->absolute_addressing();    this->DEC();  cycles -= 6; break;
-        case 0xD0: this->relative_addressing();    this->BNE();  cycles -= 2; break;
-        case 0xD1: this->indirect_y_addressing();  this->CMP();  cycles -= 5; break;
-        case 0xD4: this->zero_page_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0xD5: this->zero_page_x_addressing();  this->CMP();  cycles -= 5; break;
-        case 0xD6: this->zero_page_x_addressing();  this->DEC();  cycles -= 6; break;
-        case 0xD8: this->implied_addressing();     this->CLD();  cycles -= 2; break;
-        case 0xD9: this->absolute_y_addressing();  this->CMP();  cycles -= 4; break;
-        case 0xDA: this->accumulator_addressing(); this->NOP();  cycles -= 1; break;
-        case 0xDC: this->absolute_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0xDD: this->absolute_x_addressing();  this->CMP();  cycles -= 4; break;
-        case 0xDE: this->absolute_x_addressing();  this->DEC();  cycles -= 7; break;
-        case 0xE0: this->immediate_addressing();   this->CPX();  cycles -= 2; break;
-        case 0xE1: this->indirect_x_addressing();  this->SBC();  cycles -= 6; break;
-        case 0xE4: this->zero_page_addressing();    this->CPX();  cycles -= 3; break;
-        case 0xE5: this->zero_page_addressing();    this->SBC();  cycles -= 3; break;
-        case 0xE6: this->zero_page_addressing();    this->INC();  cycles -= 5; break;
-        case 0xE8: this->implied_addressing();     this->INX();  cycles -= 2; break;
-        case 0xE9: this->immediate_addressing();   this->SBC();  cycles -= 2; break;
-        case 0xEA: this->accumulator_addressing(); this->NOP();  cycles -= 2; break;
-        case 0xEC: this->absolute_addressing();    this->CPX();  cycles -= 4; break;
-        case 0xED: this->absolute_addressing();    this->SBC();  cycles -= 4; break;
-        case 0xEE: this->absolute_addressing();    this->INC();  cycles -= 6; break;
-        case 0xF0: this->relative_addressing();    this->BEQ();  cycles -= 2; break;
-        case 0xF1: this->indirect_y_addressing();  this->SBC();  cycles -= 5; break;
-        case 0xF4: this->zero_page_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0xF5: this->zero_page_x_addressing();  this->SBC();  cycles -= 4; break;
-        case 0xF6: this->zero_page_x_addressing();  this->INC();  cycles -= 6; break;
-        case 0xF8: this->implied_addressing();     this->SED();  cycles -= 2; break;
-        case 0xF9: this->absolute_y_addressing();  this->SBC();  cycles -= 4; break;
-        case 0xFA: this->accumulator_addressing(); this->NOP();  cycles -= 1; break;
-        case 0xFC: this->absolute_x_addressing();  this->NOP();  cycles -= 1; break;
-        case 0xFD: this->absolute_x_addressing();  this->SBC();  cycles -= 4; break;
-        case 0xFE: this->absolute_x_addressing();  this->INC();  cycles -= 7; break;
+        NES_OPCODE_TABLE(NES_EVAL_OP, NES_EVAL_TRAP, NES_EVAL_ILL)
 
         default:
-            std::cout << "error instruction: " << opcode << std::endl;
-            return ERROR_UNKNOWN_INSTRUCTION;
+            return this->illegal_instruction(opcode);
             break;
         }
         
         return 0;
     }
 
+#undef NES_EVAL_OP
+#undef NES_EVAL_TRAP
+#undef NES_EVAL_ILL
+
 
     void cpu_6502::toggle_frame_irq(uint8_t state)
     {
@@ -766,13 +735,13 @@ namespace nes {
     void cpu_6502::power_up()
     {
         //	P = 00110100
-        this->reg_.P.negative_flag = 0;
+        this->reg_.P.set_negative_flag(0);
         this->reg_.P.overflow_flag = 0;
         this->reg_.P.no_effect = 1;
         this->reg_.P.break_command = 1;
         this->reg_.P.decimal_mode = 0;
         this->reg_.P.interrupt_disable = 1;
-        this->reg_.P.zero_flag = 0;
+        this->reg_.P.set_zero_flag(0);
         this->reg_.P.carry_flag = 0;
 
         this->reg_.A = 0;
@@ -788,7 +757,74 @@ namespace nes {
 
         //TODO init LSFR
 
-        this->reg_.PC = this->mem_.read<uint16_t>(0xfffc);
+        this->reg_.PC = this->mem_.read<uint16_t>(g_reset_vector);
+        // the reset sequence, nestest.log starts at CYC:7
+        this->stall(7);
+    }
+
+    void cpu_6502::save_state(state_writer& w) const
+    {
+        w.begin("CPU ");
+        w.put(this->reg_.A);
+        w.put(this->reg_.X);
+        w.put(this->reg_.Y);
+        w.put(this->reg_.SP);
+        w.put(this->reg_.PC);
+        // the lazy N and Z bytes as they are, not the flags derived from them
+        w.put(this->reg_.P.carry_flag);
+        w.put(this->reg_.P.overflow_flag);
+        w.put(this->reg_.P.n_result);
+        w.put(this->reg_.P.z_result);
+        w.put(this->reg_.P.interrupt_disable);
+        w.put(this->reg_.P.decimal_mode);
+        w.put(this->reg_.P.break_command);
+        w.put(this->reg_.P.no_effect);
+        w.put(this->op_val_);
+        w.put(this->op_address_);
+        w.put(this->add_cycles_);
+        w.put(this->instructions_);
+        w.put(this->timestamp());
+        w.end();
+    }
+
+    int cpu_6502::load_state(const state_reader& r)
+    {
+        state_reader c;
+        if (!r.find("CPU ", c)) {
+            return STATE_ERROR_FORMAT;
+        }
+        registers reg = {0};
+        c.get(reg.A);
+        c.get(reg.X);
+        c.get(reg.Y);
+        c.get(reg.SP);
+        c.get(reg.PC);
+        c.get(reg.P.carry_flag);
+        c.get(reg.P.overflow_flag);
+        c.get(reg.P.n_result);
+        c.get(reg.P.z_result);
+        c.get(reg.P.interrupt_disable);
+        c.get(reg.P.decimal_mode);
+        c.get(reg.P.break_command);
+        c.get(reg.P.no_effect);
+        uint8_t op_val = c.get<uint8_t>();
+        uint16_t op_address = c.get<uint16_t>();
+        uint8_t add_cycles = c.get<uint8_t>();
+        uint64_t instructions = c.get<uint64_t>();
+        uint64_t clock = c.get<uint64_t>();
+        if (!c.ok()) {
+            return STATE_ERROR_FORMAT;
+        }
+
+        this->reg_ = reg;
+        this->op_val_ = op_val;
+        this->op_address_ = op_address;
+        this->add_cycles_ = add_cycles;
+        this->instructions_ = instructions;
+        this->clock_ = clock;
+        this->budget_ = 0;
+        this->live_cycles_ = &this->budget_;
+        return 0;
     }
 
 /*
@@ -807,30 +843,46 @@ namespace nes {
         this->reg_.P.interrupt_disable = 1;
         this->toggle_apu();
 
-        this->reg_.PC = this->mem_.read<uint16_t>(0xfffc);
+        this->reg_.PC = this->mem_.read<uint16_t>(g_reset_vector);
+        this->stall(7);
     }
 
-    void cpu_6502::interrupt()
+    // pushes PC and P with B clear, 7 cycles like BRK
+    void cpu_6502::interrupt(uint16_t vector)
     {
+        this->push(this->reg_.PC);
+        this->push((uint8_t)(((uint8_t)this->reg_.P & ~FLAG_BREAK) | FLAG_EFFECT));
+        this->reg_.P.interrupt_disable = 1;
+        this->reg_.PC = this->mem_.read<uint16_t>(vector);
+        this->stall(7);
+#if NES_PROFILER
+        if (this->profiler_) {
+            this->profiler_->interrupt(this->reg_.PC, vector == g_nmi_vector, this->reg_.SP, 7);
+        }
+#endif
+    }
+
+    void cpu_6502::nmi()
+    {
+        this->interrupt(g_nmi_vector);
+    }
+
+    bool cpu_6502::irq()
+    {
+        if (this->reg_.P.interrupt_disable) {
+            return false;
+        }
+        this->interrupt(g_irq_vector);
+        return true;
     }
     
     void cpu_6502::run()
     {
         this->reset_reg();
+        this->pc_limit_ = this->mem_.get_code_segment_offset().end;
 
-        int cpu_cycles = 1000, cycles = 1000;
-        int tmp = cycles;
-
-        while (this->reg_.PC < this->mem_.get_code_segment_offset().end) {
-            uint8_t status = this->eval(cycles);
-            cycles -= this->add_cycles_;
-
-            if (status != 0) {
-                break;
-            }
-        }
-        cpu_cycles += tmp - cycles;
-
+        int cycles = std::numeric_limits<int>::max();
+        this->execute(cycles);
     }
 
     void cpu_6502::reset_reg()
@@ -838,7 +890,7 @@ namespace nes {
         this->reg_.PC = this->mem_.get_code_segment_offset().start;
         this->reg_.SP = g_stack_offset.start & 0xff; //low addr
 
-        memset(&this->reg_.P, 0, sizeof(this->reg_.P));
+        this->reg_.P.set_flag(0);
         this->reg_.A = 0;
         this->reg_.X = 0;
         this->reg_.Y = 0;
@@ -851,6 +903,201 @@ namespace nes {
     }
 
     
+#define NES_LEGAL_OP(code, mode, op, cyc) code,
+#define NES_LEGAL_TRAP(code, mode, op, cyc)
+#define NES_LEGAL_ILL(code)
+
+    // reads are a function of the address, writes are folded into a hash
+    class test_io : public mmio_handler {
+    public:
+        uint32_t hash{0};
+
+        uint8_t read(uint16_t addr) override
+        {
+            return (uint8_t)(addr * 7 + 0xea);
+        }
+
+        void write(uint16_t addr, uint8_t v) override
+        {
+            this->hash = (this->hash ^ (addr << 8 | v)) * 16777619u;
+        }
+    };
+
+    // runs the same random memory image on a backend and on eval(), everything has to match;
+    // $4000 page is I/O, $8000 page is read only
+    static bool same_as_switch(dispatch_mode mode, uint32_t seed)
+    {
+        static const uint8_t legal[] = {
+            NES_OPCODE_TABLE(NES_LEGAL_OP, NES_LEGAL_TRAP, NES_LEGAL_ILL)
+        };
+
+        uint32_t rnd = seed * 2654435761u + 1;
+        registers start{0};
+        start.A = rnd >> 24;
+        start.X = rnd >> 16;
+        start.Y = rnd >> 8;
+        start.SP = 0xfd;
+        start.P.set_flag(rnd & 0xff);
+        start.PC = 0x0600;
+
+        memory mem[2];
+        for (uint32_t i = 0; i < NES_MAX_RAM; ++i) {
+            rnd = rnd * 1103515245u + 12345u;
+            uint8_t v = legal[(rnd >> 16) % arr_len(legal)];
+            mem[0].write(v, i);
+            mem[1].write(v, i);
+        }
+
+        test_io io[2];
+        uint8_t rom[2][NES_PAGE_SIZE];
+        for (int i = 0; i < 2; ++i) {
+            memcpy(rom[i], mem[i].map_offset_addr(0x8000), NES_PAGE_SIZE);
+            mem[i].map_memory(0x8000, NES_PAGE_SIZE, rom[i], false);
+            mem[i].map_handler(0x4000, NES_PAGE_SIZE, &io[i]);
+        }
+
+        cpu_6502 ref(mem[0]);
+        cpu_6502 cpu(mem[1]);
+        cpu.set_dispatch_mode(mode);
+        // random code runs into unknown opcodes all the time
+        ref.set_log(nullptr);
+        cpu.set_log(nullptr);
+
+        ref.set_registers(start);
+        cpu.set_registers(start);
+        int ref_cycles = 3000, cycles = 3000;
+        uint8_t ref_status = ref.execute(ref_cycles);
+        uint8_t status = cpu.execute(cycles);
+
+        const registers& a = ref.get_registers();
+        const registers& b = cpu.get_registers();
+        return ref_status == status
+            && ref_cycles == cycles
+            && ref.get_instruction_count() == cpu.get_instruction_count()
+            && a.A == b.A && a.X == b.X && a.Y == b.Y && a.SP == b.SP && a.PC == b.PC
+            && (uint8_t)a.P == (uint8_t)b.P
+            && io[0].hash == io[1].hash
+            && memcmp(rom[0], rom[1], NES_PAGE_SIZE) == 0
+            && memcmp(mem[0].map_offset_addr(0), mem[1].map_offset_addr(0), 0x4000) == 0
+            && memcmp(mem[0].map_offset_addr(0x4000 + NES_PAGE_SIZE), mem[1].map_offset_addr(0x4000 + NES_PAGE_SIZE),
+                      0x8000 - 0x4000 - NES_PAGE_SIZE) == 0
+            && memcmp(mem[0].map_offset_addr(0x8000 + NES_PAGE_SIZE), mem[1].map_offset_addr(0x8000 + NES_PAGE_SIZE),
+                      NES_MAX_RAM - 0x8000 - NES_PAGE_SIZE) == 0;
+    }
+
+    // every opcode on its own, in every backend, against the 6502's own counts;
+    // the operand is $04lo, X and Y are index
+    static int opcode_cycles(dispatch_mode mode, uint8_t op, uint8_t lo, uint8_t index)
+    {
+        memory mem;
+        cpu_6502 cpu(mem);
+        cpu.set_dispatch_mode(mode);
+        // everything else is BRK, so is the op after it and wherever it jumps to
+        const uint8_t operand[] = { lo, 0x04 };
+        mem.write(op, 0x0300);
+        for (int i = 1; i < g_opcode_info[op].len; ++i) {
+            mem.write(operand[i - 1], (uint16_t)(0x0300 + i));
+        }
+        mem.write((uint8_t)0xf0, 0x00f0);
+        mem.write((uint8_t)0x04, 0x00f1);
+
+        registers start{0};
+        start.X = index;
+        start.Y = index;
+        start.SP = 0xff;
+        start.P.set_flag(0);
+        start.PC = 0x0300;
+        cpu.set_registers(start);
+        cpu.set_pc_limit(0x10000);
+        int budget = 1000;
+        cpu.execute(budget);
+        return 1000 - budget;
+    }
+
+    static void opcode_cycles_test()
+    {
+        // 0 for the ILL rows
+        static const uint8_t cycles[256] = {
+            7, 6, 0, 0, 3, 3, 5, 0, 3, 2, 2, 0, 4, 4, 6, 0,
+            2, 5, 0, 0, 4, 4, 6, 0, 2, 4, 2, 0, 4, 4, 7, 0,
+            6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 4, 4, 6, 0,
+            2, 5, 0, 0, 4, 4, 6, 0, 2, 4, 2, 0, 4, 4, 7, 0,
+            6, 6, 0, 0, 3, 3, 5, 0, 3, 2, 2, 0, 3, 4, 6, 0,
+            2, 5, 0, 0, 4, 4, 6, 0, 2, 4, 2, 0, 4, 4, 7, 0,
+            6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 5, 4, 6, 0,
+            2, 5, 0, 0, 4, 4, 6, 0, 2, 4, 2, 0, 4, 4, 7, 0,
+            2, 6, 0, 0, 3, 3, 3, 0, 2, 0, 2, 0, 4, 4, 4, 0,
+            2, 6, 0, 0, 4, 4, 4, 0, 2, 5, 2, 0, 0, 5, 0, 0,
+            2, 6, 2, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0,
+            2, 5, 0, 0, 4, 4, 4, 0, 2, 4, 2, 0, 4, 4, 4, 0,
+            2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0,
+            2, 5, 0, 0, 4, 4, 6, 0, 2, 4, 2, 0, 4, 4, 7, 0,
+            2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0,
+            2, 5, 0, 0, 4, 4, 6, 0, 2, 4, 2, 0, 4, 4, 7, 0,
+        };
+        // the reads that pay a cycle when the index carries
+        static const uint8_t penalized[] = {
+            0x11, 0x19, 0x1c, 0x1d, 0x31, 0x39, 0x3c, 0x3d, 0x51, 0x59, 0x5c, 0x5d,
+            0x71, 0x79, 0x7c, 0x7d, 0xb1, 0xb9, 0xbc, 0xbd, 0xbe, 0xd1, 0xd9, 0xdc,
+            0xdd, 0xf1, 0xf9, 0xfc, 0xfd,
+        };
+        uint8_t penalty[256] = {0};
+        for (size_t i = 0; i < arr_len(penalized); ++i) {
+            penalty[penalized[i]] = 1;
+        }
+
+        const dispatch_mode modes[] = {
+            dispatch_mode::switch_case,
+            dispatch_mode::call_table,
+            dispatch_mode::threaded,
+            dispatch_mode::block_cache,
+            dispatch_mode::jit,
+        };
+        int brk[arr_len(modes)];
+        for (size_t m = 0; m < arr_len(modes); ++m) {
+            brk[m] = opcode_cycles(modes[m], 0x00, 0, 0);
+            assert(brk[m] == 7);
+        }
+
+        for (int op = 0; op < 256; ++op) {
+            const opcode_info& info = g_opcode_info[op];
+            assert(info.known == (cycles[op] != 0));
+            if (!info.known) {
+                continue;
+            }
+            assert(info.cycles == cycles[op] && info.page_penalty == penalty[op]);
+            // the branches are below
+            if (info.trap || info.mode == addressing_mode::relative) {
+                continue;
+            }
+            for (size_t m = 0; m < arr_len(modes); ++m) {
+                for (int cross = 0; cross < 2; ++cross) {
+                    // $04F0 and $0510
+                    int spent = opcode_cycles(modes[m], (uint8_t)op, 0xf0, cross ? 0x20 : 0) - brk[m];
+                    assert(spent == cycles[op] + (cross & penalty[op]));
+                    (void)spent;
+                }
+            }
+        }
+
+        // from $0302: BEQ is not taken with Z clear, BNE to $0312 and to $02F2
+        for (size_t m = 0; m < arr_len(modes); ++m) {
+            int not_taken = opcode_cycles(modes[m], 0xf0, 0x10, 0) - brk[m];
+            int taken = opcode_cycles(modes[m], 0xd0, 0x10, 0) - brk[m];
+            int crossed = opcode_cycles(modes[m], 0xd0, 0xf0, 0) - brk[m];
+            assert(not_taken == 2 && taken == 3 && crossed == 4);
+            (void)not_taken;
+            (void)taken;
+            (void)crossed;
+        }
+        (void)cycles;
+        (void)penalty;
+    }
+
+#undef NES_LEGAL_OP
+#undef NES_LEGAL_TRAP
+#undef NES_LEGAL_ILL
+
     void cpu_6502::test()
     {
         
@@ -872,14 +1119,62 @@ namespace nes {
         };
         
         
-        this->load_code_segment(0, code1, sizeof(code1));
-        this->run();
-        assert(this->reg_.A == 0x08);
-        assert(this->reg_.X == 0x00);
-        assert(this->reg_.Y == 0x00);
-        assert(this->reg_.SP == 0xff);
-        assert(this->reg_.PC == 0x0f);
-        
+        // patches the operand of the LDX that follows it
+        uint8_t code3[] = {
+            0xa9, 0x05,
+            0x8d, 0x06, 0x00,
+            0xa2, 0x01
+        };
+
+        const dispatch_mode modes[] = {
+            dispatch_mode::switch_case,
+            dispatch_mode::call_table,
+            dispatch_mode::threaded,
+            dispatch_mode::block_cache,
+            dispatch_mode::jit,
+        };
+
+        for (size_t i = 0; i < arr_len(modes); ++i) {
+            this->set_dispatch_mode(modes[i]);
+            this->load_code_segment(0, code1, sizeof(code1));
+            this->run();
+            assert(this->reg_.A == 0x08);
+            assert(this->reg_.X == 0x00);
+            assert(this->reg_.Y == 0x00);
+            assert(this->reg_.SP == 0xff);
+            assert(this->reg_.PC == 0x0f);
+
+            this->load_code_segment(0, code3, sizeof(code3));
+            this->run();
+            this->run();
+            assert(this->reg_.X == 0x05);
+
+            for (uint32_t seed = 0; seed < 200; ++seed) {
+                bool same = same_as_switch(modes[i], seed);
+                assert(same);
+                (void)same;
+            }
+        }
+        opcode_cycles_test();
+
+        // LDX $0201 at $FFFE straddles the end, the INXs after the wrap
+        // are blocks again
+        this->set_dispatch_mode(dispatch_mode::block_cache);
+        this->reset_mem();
+        this->reset_reg();
+        const uint8_t wrap[] = { 0xae, 0x01, 0x02, 0xe8, 0xe8, 0x00 };
+        for (size_t i = 0; i < sizeof(wrap); ++i) {
+            this->mem_.write(wrap[i], (uint16_t)(0xfffe + i));
+        }
+        this->mem_.write((uint8_t)0x40, 0x0201);
+        this->reg_.PC = 0xfffe;
+        this->set_pc_limit(0x10000);
+        int budget = 1000;
+        uint8_t status = this->execute(budget);
+        assert(status == (uint8_t)BRK_INSTRUCTION && this->reg_.X == 0x42 && this->cache_.size() == 1);
+        (void)status;
+        this->set_dispatch_mode(dispatch_mode::switch_case);
+
         
         this->debug_print_reg();
         //this->mem_.debug_dump_ram();
@@ -888,6 +1183,9 @@ namespace nes {
         this->reset_reg();
         
         this->load_code_segment(0, code2, sizeof(code2));
+        char line[NES_TRACE_SIZE];
+        this->trace(line);
+        assert(strncmp(line, "0000  A9 C0     LDA #$C0", 24) == 0);
         this->run();
         
         this->debug_print_reg();
@@ -11,6 +11,12 @@
 #include <string>
 #include "utils.hpp"
 #include "memory.hpp"
+#include "alu_6502.hpp"
+#include "opcode_table.hpp"
+#include "disasm.hpp"
+#include "profiler.hpp"
+#include "block_cache.hpp"
+#include "jit_x64.hpp"
 
 
 
@@ -23,15 +29,18 @@
 #define FLAG_OVERFLOW  (0x1 << 6)
 #define FLAG_NEGATIVE  (0x1 << 7)
 
+#define ERROR_UNKNOWN_INSTRUCTION -1
+#define BRK_INSTRUCTION -2
+// a breakpoint or request_break(), see set_breakpoints
+#define DEBUG_BREAK -3
+
 
 
 namespace nes {
-    
-    struct instruction_info {
-        std::string asm_name;
-        uint8_t len;
-    };
 
+    class tracer;
+    class flight_recorder;
+    
     struct registers {
         uint8_t A;
         uint8_t X;
@@ -50,37 +59,69 @@ namespace nes {
     +--------- Negative
 */
 
+        /*
+            N and Z are kept lazily as the bytes they were computed from,
+            ALU ops just store their result and the flags are only derived
+            when a branch, PHP, BRK or a debugger looks at them. The other
+            flags are whole bytes holding 0 or 1, no bit field updates.
+        */
         struct {
-            uint8_t carry_flag : 1;
-            uint8_t zero_flag : 1;
-            uint8_t interrupt_disable : 1;
-            uint8_t decimal_mode : 1;
-            uint8_t break_command : 1;
-            uint8_t no_effect : 1;
-            uint8_t overflow_flag : 1;
-            uint8_t negative_flag : 1;
+            uint8_t carry_flag;
+            uint8_t overflow_flag;
+            uint8_t n_result;       // N is bit 7
+            uint8_t z_result;       // Z is set when 0
+            uint8_t interrupt_disable;
+            uint8_t decimal_mode;
+            uint8_t break_command;
+            uint8_t no_effect;
+
+            uint8_t negative_flag() const
+            {
+                return this->n_result >> 7;
+            }
+
+            uint8_t zero_flag() const
+            {
+                return this->z_result == 0 ? 1 : 0;
+            }
+
+            void set_nz(uint8_t v)
+            {
+                this->n_result = v;
+                this->z_result = v;
+            }
+
+            void set_negative_flag(uint8_t v)
+            {
+                this->n_result = v ? 0x80 : 0;
+            }
+
+            void set_zero_flag(uint8_t v)
+            {
+                this->z_result = v ? 0 : 1;
+            }
 
             void set_flag(uint8_t v)
             {
                 this->carry_flag = v & 0x1;
-                this->zero_flag = v >> 1 & 0x1;
+                this->set_zero_flag(v & FLAG_ZERO);
                 this->interrupt_disable = v >> 2 & 0x1;
                 this->decimal_mode = v >> 3 & 0x1;
                 this->break_command = v >> 4 & 0x1;
                 this->no_effect = v >> 5 & 0x1;
                 this->overflow_flag = v >> 6 & 0x1;
-                this->negative_flag = v >> 7 & 0x1;
+                this->n_result = v & FLAG_NEGATIVE;
             }
 
             operator uint8_t() const
             {
-                return this->negative_flag << 7
+                return (this->n_result & FLAG_NEGATIVE)
                 | this->overflow_flag << 6
                 | this->no_effect << 5
                 | this->break_command << 4
                 | this->decimal_mode << 3
                 | this->interrupt_disable << 2
-                | this->zero_flag << 1
+                | this->zero_flag() << 1
                 | this->carry_flag
                 ;
             }
@@ -95,8 +136,24 @@ namespace nes {
 
     static const uint16_t g_frame_irq_state_address = 0x4017;
     static const uint16_t g_apu_state_address = 0x4015;
+
+    static const uint16_t g_nmi_vector = 0xfffa;
+    static const uint16_t g_reset_vector = 0xfffc;
+    static const uint16_t g_irq_vector = 0xfffe;
+
+    enum class dispatch_mode : uint8_t {
+        switch_case,    // cpu_6502::eval
+        call_table,     // 256-entry handler table
+        threaded,       // computed goto, falls back to call_table
+        block_cache,    // pre-decoded basic blocks
+        jit,            // x86-64 recompiler, falls back to block_cache
+    };
     
-    class cpu_6502 {
+    class cpu_6502 : public write_listener {
+
+        friend class jit_x64;
+
+        typedef uint8_t (*op_handler)(cpu_6502& cpu, int& cycles);
 
         registers reg_{0};
         memory& mem_;
@@ -106,10 +163,54 @@ namespace nes {
         uint16_t op_address_{0};
 
         uint8_t add_cycles_{0};
+
+        dispatch_mode dispatch_mode_{dispatch_mode::switch_case};
+        uint32_t pc_limit_{0x10000};
+        uint64_t instructions_{0};
+
+        // cycles since power up: clock_ plus what execute() has spent of budget_ so far
+        uint64_t clock_{0};
+        int budget_{0};
+        int *live_cycles_{&budget_};
+
+        block_cache cache_;
+        jit_x64 jit_;
+        tracer *tracer_{nullptr};
+        flight_recorder *recorder_{nullptr};
+        bool dump_on_brk_{true};
+        // unknown opcodes are reported here, nullptr for nowhere
+        std::ostream *log_{&std::cout};
+#if NES_PROFILER
+        profiler *profiler_{nullptr};
+#endif
+
+        // one bit per address, nullptr when there are no breakpoints
+        const uint8_t *breakpoints_{nullptr};
+        // the breakpoint execute() stopped at, passed over once when it goes on
+        int32_t break_pc_{-1};
+        bool break_requested_{false};
+
+        // whether to stop at PC, only called with breakpoints_ set
+        bool at_breakpoint()
+        {
+            uint16_t pc = this->reg_.PC;
+            bool hit = (this->breakpoints_[pc >> 3] >> (pc & 7) & 1) && pc != this->break_pc_;
+            this->break_pc_ = hit ? pc : -1;
+            return hit;
+        }
+
+        bool breakpoint(uint32_t addr) const
+        {
+            return this->breakpoints_ && addr < NES_MAX_RAM && (this->breakpoints_[addr >> 3] >> (addr & 7) & 1);
+        }
         
         // addressing modes
         
-        void cross_page_cycles();
+        // a cycle when op_address_ is on another page than base; the ops that write
+        // their operand take it back, see NES_PAGE_PENALTY
+        void cross_page_cycles(uint16_t base);
+        // a taken branch costs a cycle, and one more when the target is on another page
+        void take_branch();
 
         void implied_addressing();
         void accumulator_addressing();
@@ -124,6 +225,20 @@ namespace nes {
         void indirect_addressing();
         void indirect_x_addressing();
         void indirect_y_addressing();
+
+        void implied_resolve(uint16_t operand);
+        void accumulator_resolve(uint16_t operand);
+        void immediate_resolve(uint16_t operand);
+        void zero_page_resolve(uint16_t operand);
+        void zero_page_x_resolve(uint16_t operand);
+        void zero_page_y_resolve(uint16_t operand);
+        void relative_resolve(uint16_t operand);
+        void absolute_resolve(uint16_t operand);
+        void absolute_x_resolve(uint16_t operand);
+        void absolute_y_resolve(uint16_t operand);
+        void indirect_resolve(uint16_t operand);
+        void indirect_x_resolve(uint16_t operand);
+        void indirect_y_resolve(uint16_t operand);
        
         // transfer reg
 
@@ -213,28 +328,47 @@ namespace nes {
         void NOP();
         void BRK();
         
-        template<typename T>
-        void set_nf(T n)
-        {
-            this->reg_.P.negative_flag = get_bit(n, sizeof(T) * 8 - 1);
-        }
-        
-        template<typename T>
-        void set_zf(T n)
+        // memory operand of the current instruction, stores never read it
+        void load_operand()
         {
-            this->reg_.P.zero_flag = n == 0 ? 1 : 0;
+            this->op_val_ = this->mem_.read<uint8_t>(this->op_address_);
         }
-        
-        template<typename T>
-        void set_nzf(T n)
+
+        void set_nzf(uint8_t n)
         {
-            this->set_nf(n);
-            this->set_zf(n);
+            this->reg_.P.set_nz(n);
         }
         
         void reset_reg();
         void reset_mem();
 
+        // dispatch backends, see cpu_6502_dispatch.cpp
+
+        template<void (cpu_6502::*Addressing)(), void (cpu_6502::*Operation)(), int Cycles, uint8_t Status, bool Ends>
+        static uint8_t op_handler_impl(cpu_6502& cpu, int& cycles);
+        static uint8_t illegal_handler(cpu_6502& cpu, int& cycles);
+
+        template<void (cpu_6502::*Resolve)(uint16_t), void (cpu_6502::*Operation)(), uint8_t Status>
+        static uint8_t decoded_handler_impl(cpu_6502& cpu, uint16_t operand);
+        static uint8_t decoded_illegal_handler(cpu_6502& cpu, uint16_t opcode);
+
+        uint8_t illegal_instruction(uint8_t opcode);
+        // PC into the flight recorder as a block entry, cycles left as execute() counts them
+        void record_block(int cycles);
+        void interrupt(uint16_t vector);
+        uint8_t execute_switch(int& cycles);
+        uint8_t execute_table(int& cycles);
+        uint8_t execute_threaded(int& cycles);
+        uint8_t execute_cached(int& cycles);
+        uint8_t execute_jit(int& cycles);
+        // eval() with every instruction stored into tracer_'s buffer before it runs
+        uint8_t execute_traced(int& cycles);
+#if NES_PROFILER
+        uint8_t execute_profiled(int& cycles);
+#endif
+
+        decoded_block* decode_block(uint16_t pc);
+
     public:
         cpu_6502() = delete;
         cpu_6502(const cpu_6502&) = delete;
@@ -244,8 +378,29 @@ namespace nes {
 
         
         cpu_6502(memory& m) noexcept
-        :mem_(m)
+        :mem_(m), cache_(m), jit_(*this, m)
+        {
+            this->reg_.P.set_flag(0);
+            this->mem_.set_write_listener(this);
+        }
+
+        ~cpu_6502()
         {
+            this->cache_.flush();
+            this->jit_.flush();
+            this->mem_.set_write_listener(nullptr);
+        }
+
+        void on_watched_write(uint16_t addr) override
+        {
+            this->cache_.invalidate(addr);
+            this->jit_.invalidate(addr);
+        }
+
+        void on_watched_remap(uint16_t page) override
+        {
+            this->cache_.invalidate_page(page);
+            this->jit_.invalidate_page(page);
         }
         
 
@@ -253,47 +408,175 @@ namespace nes {
 
         void debug_print_reg() const;
         
-        template<typename T>
-        void debug_print_asm(uint16_t addr, const instruction_info& info, T t) const
+        // the instruction at addr as assembly on stdout
+        void debug_print_asm(uint16_t addr) const;
+
+        // nestest style line for the instruction at PC and the registers before it runs,
+        // see trace_format; instruction bytes are peeked, I/O is not touched
+        size_t trace(char out[NES_TRACE_SIZE]) const;
+
+        uint8_t eval(int& cycles);
+        void run();
+
+        // runs until cycles is spent, PC leaves [0, pc limit) or eval returns a status
+        uint8_t execute(int& cycles);
+
+        void set_dispatch_mode(dispatch_mode mode)
         {
-            std::string asm_str = info.asm_name;
-            std::cout << std::setw(4) << std::hex << addr << ": " << asm_str << " ";
-            std::cout << std::setw(4) << std::hex << t;
-            std::cout << std::endl;
+            if (mode == dispatch_mode::jit) {
+                this->jit_.prepare();
+            }
+            this->dispatch_mode_ = mode;
         }
-        
-        void debug_print_asm(uint16_t addr, const instruction_info& info) const
+
+        dispatch_mode get_dispatch_mode() const
         {
-            std::string asm_str = info.asm_name;
-            std::cout << std::setw(4) << std::hex << addr << ": " << asm_str << " ";
-            std::cout << std::endl;
+            return this->dispatch_mode_;
+        }
+
+        // every instruction is recorded before it runs, on eval() whatever the
+        // dispatch mode; nullptr to stop, the tracer is not flushed
+        void set_tracer(tracer *t)
+        {
+            this->tracer_ = t;
+        }
+
+        // the last blocks entered are kept in r and dumped when execute() stops
+        // on an unknown opcode, or BRK with dump_on_brk; every backend records
+        // where a run starts and what follows a branch, jump or return.
+        void set_flight_recorder(flight_recorder *r, bool dump_on_brk = true)
+        {
+            this->recorder_ = r;
+            this->dump_on_brk_ = dump_on_brk;
+        }
+
+        flight_recorder* get_flight_recorder() const
+        {
+            return this->recorder_;
+        }
+
+        // where an unknown opcode is reported, std::cout by default, nullptr
+        // to only get ERROR_UNKNOWN_INSTRUCTION back
+        void set_log(std::ostream *out)
+        {
+            this->log_ = out;
+        }
+
+#if NES_PROFILER
+        // every instruction and interrupt is counted in p, on eval() whatever
+        // the dispatch mode and ahead of a tracer; nullptr to stop
+        void set_profiler(profiler *p)
+        {
+            this->profiler_ = p;
+        }
+#endif
+
+        void set_pc_limit(uint32_t limit)
+        {
+            this->pc_limit_ = limit;
+        }
+
+        uint64_t get_instruction_count() const
+        {
+            return this->instructions_;
+        }
+
+        // CPU cycles since power up. Exact at instruction start from inside
+        // an I/O handler as well, whatever the dispatch mode.
+        uint64_t timestamp() const
+        {
+            return this->clock_ + (uint64_t)(int64_t)(this->budget_ - *this->live_cycles_);
+        }
+
+        // n cycles pass without instructions, DMA or interrupt entry
+        void stall(int n)
+        {
+            if (this->live_cycles_ == &this->budget_) {
+                this->clock_ += n;
+            }
+            else {
+                *this->live_cycles_ -= n;
+            }
+        }
+
+        // execute() returns after the current instruction (JIT: after the
+        // current store), for handlers whose write moved the next event
+        void end_run()
+        {
+            this->budget_ -= *this->live_cycles_;
+            *this->live_cycles_ = 0;
+        }
+
+        // execute() stops with DEBUG_BREAK after the current instruction (JIT:
+        // the current store, or block), for a debugger's watchpoints
+        void request_break()
+        {
+            this->break_requested_ = true;
+            this->end_run();
+        }
+
+        // execute() stops with DEBUG_BREAK before running an address whose
+        // bit is set in bits, 8 KiB the caller owns; nullptr for none. Only
+        // checked where blocks start, decoded and translated blocks end
+        // before breakpoints, the interpreters run the block cache when
+        // there are any. Call breakpoint_changed() for every bit flipped.
+        void set_breakpoints(const uint8_t *bits)
+        {
+            this->breakpoints_ = bits;
+        }
+
+        void breakpoint_changed(uint16_t addr)
+        {
+            this->on_watched_write(addr);
+        }
+
+        const registers& get_registers() const
+        {
+            return this->reg_;
+        }
+
+        void set_registers(const registers& r)
+        {
+            this->reg_ = r;
         }
-        
-                
-        uint8_t eval(int& cycles);
-        void run();
 
         void toggle_frame_irq(uint8_t state = 0x00);
         void toggle_apu(uint8_t state = 0x00);
 
+        // high byte first, the stack wraps within page 1
         template<typename T>
         void push(T v)
         {
-            this->mem_.write(v, g_stack_offset.start | this->reg_.SP);
-            this->reg_.SP -= sizeof(T);
+            for (int i = sizeof(T) - 1; i >= 0; --i) {
+                this->mem_.write((uint8_t)(v >> (i * 8)), g_stack_offset.end | this->reg_.SP);
+                this->reg_.SP--;
+            }
         }
 
         template<typename T>
         T pop()
         {
-            this->reg_.SP += sizeof(T);
-            return this->mem_.read<T>(g_stack_offset.start | this->reg_.SP);
+            T v = 0;
+            for (size_t i = 0; i < sizeof(T); ++i) {
+                this->reg_.SP++;
+                v |= (T)this->mem_.read<uint8_t>(g_stack_offset.end | this->reg_.SP) << (i * 8);
+            }
+            return v;
         }
 
         void power_up();
         void reset();
-        void interrupt();
 
+        // "CPU " chunk, registers and the cycle count, between execute() calls
+        void save_state(state_writer& w) const;
+        // 0 or STATE_ERROR_FORMAT
+        int load_state(const state_reader& r);
+        // edge triggered, taken whatever I is
+        void nmi();
+        // level triggered, false while I is set
+        bool irq();
+
+        // listing of size bytes of code on stdout, as if loaded at the code segment start
         void dissassembly(const uint8_t *buf, size_t size);
         void test();
     };
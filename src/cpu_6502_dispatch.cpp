@@ -0,0 +1,417 @@
+#include "cpu_6502.hpp"
+#include "trace.hpp"
+#include "flight_recorder.hpp"
+#include <cstdio>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NES_COMPUTED_GOTO 1
+#else
+#define NES_COMPUTED_GOTO 0
+#endif
+
+namespace nes {
+
+    template<void (cpu_6502::*Addressing)(), void (cpu_6502::*Operation)(), int Cycles, uint8_t Status, bool Ends>
+    uint8_t cpu_6502::op_handler_impl(cpu_6502& cpu, int& cycles)
+    {
+        (cpu.*Addressing)();
+        (cpu.*Operation)();
+        cycles -= Cycles + cpu.add_cycles_;
+        if (Ends && cpu.recorder_) {
+            cpu.record_block(cycles);
+        }
+        return Status;
+    }
+
+    uint8_t cpu_6502::illegal_handler(cpu_6502& cpu, int& cycles)
+    {
+        uint8_t opcode = cpu.mem_.read<uint8_t>(cpu.reg_.PC - 1);
+        cycles -= cpu.add_cycles_;
+        return cpu.illegal_instruction(opcode);
+    }
+
+    uint8_t cpu_6502::illegal_instruction(uint8_t opcode)
+    {
+        if (this->log_) {
+            *this->log_ << "error instruction: 0x" << std::hex << (int)opcode << std::dec << std::endl;
+        }
+        return ERROR_UNKNOWN_INSTRUCTION;
+    }
+
+    template<void (cpu_6502::*Resolve)(uint16_t), void (cpu_6502::*Operation)(), uint8_t Status>
+    uint8_t cpu_6502::decoded_handler_impl(cpu_6502& cpu, uint16_t operand)
+    {
+        (cpu.*Resolve)(operand);
+        (cpu.*Operation)();
+        return Status;
+    }
+
+    uint8_t cpu_6502::decoded_illegal_handler(cpu_6502& cpu, uint16_t opcode)
+    {
+        return cpu.illegal_instruction((uint8_t)opcode);
+    }
+
+    void cpu_6502::record_block(int cycles)
+    {
+        if (this->recorder_->repeat_block(this->reg_.PC)) {
+            return;
+        }
+        this->recorder_->record(this->reg_.PC, this->mem_.peek24(this->reg_.PC), this->reg_.A, this->reg_.X, this->reg_.Y,
+                                (uint8_t)this->reg_.P, this->reg_.SP, this->clock_ + (uint64_t)(int64_t)(this->budget_ - cycles), true);
+    }
+
+    uint8_t cpu_6502::execute(int& cycles)
+    {
+        this->budget_ = cycles;
+        this->live_cycles_ = &cycles;
+
+        dispatch_mode mode = this->dispatch_mode_;
+        if (this->breakpoints_ && mode < dispatch_mode::block_cache) {
+            mode = dispatch_mode::block_cache;
+        }
+        if (this->tracer_) {
+            mode = dispatch_mode::switch_case;
+        }
+#if NES_PROFILER
+        if (this->profiler_) {
+            mode = dispatch_mode::switch_case;
+        }
+#endif
+        flight_recorder *outer = this->recorder_ ? flight_recorder::activate(this->recorder_) : nullptr;
+        // the interpreters record after every instruction that ends a block,
+        // where they start is one more; the block cache and the JIT record the blocks they enter
+        if (this->recorder_ && mode < dispatch_mode::block_cache) {
+            this->record_block(cycles);
+        }
+
+        uint8_t status;
+        switch (mode) {
+        case dispatch_mode::block_cache: status = this->execute_cached(cycles); break;
+        case dispatch_mode::jit:         status = this->execute_jit(cycles); break;
+        case dispatch_mode::call_table:  status = this->execute_table(cycles); break;
+        case dispatch_mode::threaded:    status = this->execute_threaded(cycles); break;
+        default:
+#if NES_PROFILER
+            if (this->profiler_) {
+                status = this->execute_profiled(cycles);
+                break;
+            }
+#endif
+            if (this->tracer_) {
+                status = this->execute_traced(cycles);
+            }
+            else {
+                status = this->execute_switch(cycles);
+            }
+            break;
+        }
+
+        this->clock_ += (uint64_t)(int64_t)(this->budget_ - cycles);
+        this->budget_ = cycles;
+        this->live_cycles_ = &this->budget_;
+        if (this->break_requested_) {
+            this->break_requested_ = false;
+            status = status ? status : (uint8_t)DEBUG_BREAK;
+        }
+
+        if (this->recorder_) {
+            flight_recorder::activate(outer);
+            if (status == (uint8_t)ERROR_UNKNOWN_INSTRUCTION) {
+                char reason[40];
+                uint16_t pc = (uint16_t)(this->reg_.PC - 1);
+                snprintf(reason, sizeof(reason), "unknown opcode $%02X at $%04X", this->mem_.peek(pc), pc);
+                this->recorder_->dump(reason);
+            }
+            else if (status == (uint8_t)BRK_INSTRUCTION && this->dump_on_brk_) {
+                this->recorder_->dump("BRK");
+            }
+        }
+        return status;
+    }
+
+    uint8_t cpu_6502::execute_switch(int& cycles)
+    {
+        while (cycles > 0 && this->reg_.PC < this->pc_limit_) {
+            uint8_t status = this->eval(cycles);
+            cycles -= this->add_cycles_;
+            this->instructions_++;
+
+            if (status != 0) {
+                return status;
+            }
+        }
+        return 0;
+    }
+
+    uint8_t cpu_6502::execute_traced(int& cycles)
+    {
+        tracer& log = *this->tracer_;
+        // clock_ and budget_ stay put while execute() runs, an end_run() ends the loop as well
+        uint64_t start = this->clock_ + (uint64_t)(int64_t)this->budget_;
+        while (cycles > 0 && this->reg_.PC < this->pc_limit_) {
+            // straight into the buffer, it is only looked at again once this stretch of it is full
+            size_t room;
+            trace_record *at = log.reserve(room);
+            trace_record *end = at + room;
+            for (; at != end && cycles > 0 && this->reg_.PC < this->pc_limit_; ++at) {
+                if (this->breakpoints_ && this->at_breakpoint()) {
+                    log.commit(at);
+                    return (uint8_t)DEBUG_BREAK;
+                }
+                trace_store(at, this->reg_.PC, this->mem_.peek24(this->reg_.PC), this->reg_.A, this->reg_.X, this->reg_.Y,
+                            (uint8_t)this->reg_.P, this->reg_.SP, start - (uint64_t)(int64_t)cycles);
+
+                uint8_t status = this->eval(cycles);
+                cycles -= this->add_cycles_;
+                this->instructions_++;
+
+                if (status != 0) {
+                    log.commit(at + 1);
+                    return status;
+                }
+            }
+            log.commit(at);
+        }
+        return 0;
+    }
+
+#if NES_PROFILER
+
+    uint8_t cpu_6502::execute_profiled(int& cycles)
+    {
+        while (cycles > 0 && this->reg_.PC < this->pc_limit_) {
+            if (this->breakpoints_ && this->at_breakpoint()) {
+                return (uint8_t)DEBUG_BREAK;
+            }
+            uint16_t pc = this->reg_.PC;
+
+            // by the timestamp, which counts stalls inside the instruction (DMA)
+            // but not what end_run() takes off cycles
+            uint8_t opcode = this->mem_.peek(pc);
+            uint64_t start = this->timestamp();
+            uint8_t status = this->eval(cycles);
+            cycles -= this->add_cycles_;
+            this->instructions_++;
+            this->profiler_->count(pc, opcode, (int)(this->timestamp() - start), this->reg_.PC, this->reg_.SP);
+
+            if (status != 0) {
+                return status;
+            }
+        }
+        return 0;
+    }
+
+#endif
+
+#define NES_TABLE_OP(code, mode, op, cyc) \
+    &cpu_6502::op_handler_impl<&cpu_6502::mode##_addressing, &cpu_6502::op, cyc, 0, ends_block(code)>,
+#define NES_TABLE_TRAP(code, mode, op, cyc) \
+    &cpu_6502::op_handler_impl<&cpu_6502::mode##_addressing, &cpu_6502::op, cyc, (uint8_t)BRK_INSTRUCTION, false>,
+#define NES_TABLE_ILL(code) \
+    &cpu_6502::illegal_handler,
+
+    uint8_t cpu_6502::execute_table(int& cycles)
+    {
+        static const op_handler handlers[256] = {
+            NES_OPCODE_TABLE(NES_TABLE_OP, NES_TABLE_TRAP, NES_TABLE_ILL)
+        };
+
+        while (cycles > 0 && this->reg_.PC < this->pc_limit_) {
+            uint8_t opcode = this->mem_.read<uint8_t>(this->reg_.PC);
+            this->reg_.PC++;
+            this->instructions_++;
+
+            uint8_t status = handlers[opcode](*this, cycles);
+            if (status != 0) {
+                return status;
+            }
+        }
+        return 0;
+    }
+
+#undef NES_TABLE_OP
+#undef NES_TABLE_TRAP
+#undef NES_TABLE_ILL
+
+#if NES_COMPUTED_GOTO
+
+#define NES_LABEL_OP(code, mode, op, cyc)   &&op_##code,
+#define NES_LABEL_TRAP(code, mode, op, cyc) &&op_##code,
+#define NES_LABEL_ILL(code)                 &&op_illegal,
+
+#define NES_DISPATCH() \
+    if (cycles <= 0 || this->reg_.PC >= this->pc_limit_) { \
+        return 0; \
+    } \
+    this->instructions_++; \
+    goto *labels[this->mem_.read<uint8_t>(this->reg_.PC++)]
+
+#define NES_BODY_OP(code, mode, op, cyc) \
+    op_##code: \
+        this->mode##_addressing(); \
+        this->op(); \
+        cycles -= cyc + this->add_cycles_; \
+        if (ends_block(code) && this->recorder_) { \
+            this->record_block(cycles); \
+        } \
+        NES_DISPATCH();
+#define NES_BODY_TRAP(code, mode, op, cyc) \
+    op_##code: \
+        this->mode##_addressing(); \
+        this->op(); \
+        cycles -= cyc + this->add_cycles_; \
+        return BRK_INSTRUCTION;
+#define NES_BODY_ILL(code)
+
+    uint8_t cpu_6502::execute_threaded(int& cycles)
+    {
+        static const void* const labels[256] = {
+            NES_OPCODE_TABLE(NES_LABEL_OP, NES_LABEL_TRAP, NES_LABEL_ILL)
+        };
+
+        NES_DISPATCH();
+
+        NES_OPCODE_TABLE(NES_BODY_OP, NES_BODY_TRAP, NES_BODY_ILL)
+
+    op_illegal:
+        return illegal_handler(*this, cycles);
+    }
+
+#undef NES_LABEL_OP
+#undef NES_LABEL_TRAP
+#undef NES_LABEL_ILL
+#undef NES_DISPATCH
+#undef NES_BODY_OP
+#undef NES_BODY_TRAP
+#undef NES_BODY_ILL
+
+#else
+
+    uint8_t cpu_6502::execute_threaded(int& cycles)
+    {
+        return this->execute_table(cycles);
+    }
+
+#endif
+
+
+    struct decode_entry {
+        decoded_handler handler;
+        uint8_t len;
+        uint8_t cycles;
+    };
+
+#define NES_DECODE_OP(code, mode, op, cyc) \
+    { &cpu_6502::decoded_handler_impl<&cpu_6502::mode##_resolve, &cpu_6502::op, 0>, \
+      1 + NES_OPERAND_LEN(mode), cyc },
+#define NES_DECODE_TRAP(code, mode, op, cyc) \
+    { &cpu_6502::decoded_handler_impl<&cpu_6502::mode##_resolve, &cpu_6502::op, (uint8_t)BRK_INSTRUCTION>, \
+      1 + NES_OPERAND_LEN(mode), cyc },
+#define NES_DECODE_ILL(code) \
+    { &cpu_6502::decoded_illegal_handler, 1, 0 },
+
+    decoded_block* cpu_6502::decode_block(uint16_t pc)
+    {
+        static const decode_entry table[256] = {
+            NES_OPCODE_TABLE(NES_DECODE_OP, NES_DECODE_TRAP, NES_DECODE_ILL)
+        };
+
+        std::unique_ptr<decoded_block> block(new decoded_block());
+        block->start = pc;
+        block->ops.reserve(8);
+
+        uint32_t addr = pc;
+        while (block->ops.size() < NES_MAX_BLOCK_OPS && addr < this->pc_limit_) {
+            uint8_t opcode = this->mem_.read<uint8_t>(addr);
+            const decode_entry& entry = table[opcode];
+
+            if (addr + entry.len > NES_MAX_RAM || (addr != pc && this->breakpoint(addr))) {
+                break;
+            }
+
+            decoded_op op;
+            op.handler = entry.handler;
+            op.cycles = entry.cycles;
+            op.len = entry.len;
+            switch (entry.len) {
+            case 2:  op.operand = this->mem_.read<uint8_t>(addr + 1); break;
+            case 3:  op.operand = this->mem_.read<uint16_t>(addr + 1); break;
+            default: op.operand = entry.handler == &cpu_6502::decoded_illegal_handler ? opcode : 0; break;
+            }
+
+            block->ops.push_back(op);
+            addr += entry.len;
+
+            if (entry.handler == &cpu_6502::decoded_illegal_handler || ends_block(opcode)) {
+                break;
+            }
+        }
+
+        if (block->ops.empty()) {
+            return nullptr;
+        }
+        block->end = addr;
+
+        return this->cache_.insert(std::move(block));
+    }
+
+    uint8_t cpu_6502::execute_cached(int& cycles)
+    {
+        uint8_t status = 0;
+
+        while (status == 0 && cycles > 0 && this->reg_.PC < this->pc_limit_) {
+            if (this->breakpoints_ && this->at_breakpoint()) {
+                status = (uint8_t)DEBUG_BREAK;
+                break;
+            }
+
+            decoded_block *block = this->cache_.lookup(this->reg_.PC);
+            if (block == nullptr) {
+                block = this->decode_block(this->reg_.PC);
+                if (block == nullptr) {
+                    // opcode straddles the end of the address space, step
+                    // over it alone and go back to blocks after it
+                    status = this->eval(cycles);
+                    cycles -= this->add_cycles_;
+                    this->instructions_++;
+                    continue;
+                }
+            }
+
+            // block entries only, like the JIT
+            if (this->recorder_) {
+                this->record_block(cycles);
+            }
+
+            const decoded_op *op = block->ops.data();
+            const decoded_op *end = op + block->ops.size();
+            for (; op != end; ++op) {
+                this->reg_.PC += op->len;
+                this->instructions_++;
+
+                status = op->handler(*this, op->operand);
+                cycles -= op->cycles + this->add_cycles_;
+
+                if (status != 0 || !block->valid || cycles <= 0 || this->reg_.PC >= this->pc_limit_) {
+                    break;
+                }
+            }
+        }
+
+        this->cache_.collect();
+        return status;
+    }
+
+    uint8_t cpu_6502::execute_jit(int& cycles)
+    {
+        if (!this->jit_.available()) {
+            return this->execute_cached(cycles);
+        }
+        return this->jit_.execute(cycles);
+    }
+
+#undef NES_DECODE_OP
+#undef NES_DECODE_TRAP
+#undef NES_DECODE_ILL
+
+}
@@ -0,0 +1,1314 @@
+// the vector helpers are always inlined into one kernel, no ABI to keep
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+#include "cpu_6502_soa.hpp"
+#include <cassert>
+#include <limits>
+#include <memory>
+
+#define SOA_INLINE inline __attribute__((always_inline))
+
+// steps between fold_cycles(), 8 cycles each stay below 0xffff
+#define NES_SOA_FOLD_STEPS 0x1f00
+
+
+namespace nes {
+
+    typedef uint8_t soa_v8 __attribute__((vector_size(NES_SOA_LANES)));
+    typedef int8_t soa_m8 __attribute__((vector_size(NES_SOA_LANES)));
+    typedef uint16_t soa_v16 __attribute__((vector_size(NES_SOA_LANES * 2)));
+
+    /*
+        A group's registers as vectors, and the instruction it is stepping.
+
+        Cycles are not kept as 32 bit lanes: spent counts up from 0 and a
+        lane runs while spent < room, room being its budget clamped to 16
+        bits. fold_cycles() moves spent into soa_registers::cycles well
+        before a clamped lane could run out of room.
+    */
+    struct soa_group {
+        soa_v8 A, X, Y, SP;
+        soa_v8 C, V, N, Z, I, D, B, U;
+        soa_v8 add;
+        soa_v8 status;
+        soa_v16 PC;
+        soa_v16 spent;
+        soa_v16 room;
+
+        uint8_t *mem;
+        size_t stride;
+
+        soa_m8 m;           // lanes running the instruction
+        uint32_t bits;      // m, one bit per lane
+        uint16_t next;      // PC past the operand
+    };
+
+    // operand address, per lane
+    struct soa_ea {
+        soa_v16 addr;
+        bool uniform;       // known to be the same in every lane
+    };
+
+#define NES_SOA_LEN_OP(code, mode, op, cyc)   1 + NES_OPERAND_LEN(mode),
+#define NES_SOA_LEN_ILL(code)                 1,
+
+    static const uint8_t g_soa_lengths[256] = {
+        NES_OPCODE_TABLE(NES_SOA_LEN_OP, NES_SOA_LEN_OP, NES_SOA_LEN_ILL)
+    };
+
+#undef NES_SOA_LEN_OP
+#undef NES_SOA_LEN_ILL
+
+    // bit 7 of every byte
+    static SOA_INLINE uint32_t lane_bits(const soa_m8& m)
+    {
+#if defined(__SSE2__)
+        typedef char half __attribute__((vector_size(16)));
+        half lo, hi;
+        memcpy(&lo, &m, sizeof(lo));
+        memcpy(&hi, (const char *)&m + sizeof(lo), sizeof(hi));
+        return (uint32_t)__builtin_ia32_pmovmskb128(lo) | ((uint32_t)__builtin_ia32_pmovmskb128(hi) << 16);
+#else
+        // a carry free multiply gathers the top bits of eight bytes
+        uint64_t w[NES_SOA_LANES / 8];
+        memcpy(w, &m, sizeof(m));
+        uint32_t bits = 0;
+        for (int i = 0; i < NES_SOA_LANES / 8; ++i) {
+            bits |= (uint32_t)(((w[i] & 0x8080808080808080ull) * 0x0002040810204081ull) >> 56) << (i * 8);
+        }
+        return bits;
+#endif
+    }
+
+    static SOA_INLINE soa_v8 low_bytes(const soa_v16& v)
+    {
+        return __builtin_convertvector(v, soa_v8);
+    }
+
+    static SOA_INLINE soa_v16 widen(const soa_v8& v)
+    {
+        return __builtin_convertvector(v, soa_v16);
+    }
+
+    static SOA_INLINE soa_v8 splat8(uint8_t v)
+    {
+        soa_v8 r = {};
+        return r + v;
+    }
+
+    static SOA_INLINE soa_v16 splat16(uint16_t v)
+    {
+        soa_v16 r = {};
+        return r + v;
+    }
+
+    static SOA_INLINE soa_v8 sel8(const soa_m8& m, const soa_v8& a, const soa_v8& b)
+    {
+        soa_v8 mask = (soa_v8)m;
+        return (a & mask) | (b & ~mask);
+    }
+
+    static SOA_INLINE soa_v16 sel16(const soa_m8& m, const soa_v16& a, const soa_v16& b)
+    {
+        soa_v16 mask = widen((soa_v8)m);
+        mask |= mask << 8;
+        return (a & mask) | (b & ~mask);
+    }
+
+    // Masks from arithmetic: GCC turns compares of vectors wider than the
+    // target's registers into a loop over the elements
+
+    // 0xff where a != b
+    static SOA_INLINE soa_m8 ne8(const soa_v8& a, const soa_v8& b)
+    {
+        soa_v8 d = a ^ b;
+        return (soa_m8)-((d | -d) >> 7);
+    }
+
+    static SOA_INLINE soa_m8 eq8(const soa_v8& a, const soa_v8& b)
+    {
+        return ~ne8(a, b);
+    }
+
+    // 1 where v != 0
+    static SOA_INLINE soa_v8 nz16(const soa_v16& v)
+    {
+        return low_bytes((v | -v) >> 15);
+    }
+
+    static SOA_INLINE soa_m8 eq16(const soa_v16& a, const soa_v16& b)
+    {
+        return (soa_m8)(nz16(a ^ b) - 1);
+    }
+
+    // 0xff where a < b, the borrow out of a - b
+    static SOA_INLINE soa_m8 lt16(const soa_v16& a, const soa_v16& b)
+    {
+        soa_v16 borrow = ((~a & b) | (~(a ^ b) & (a - b))) >> 15;
+        return (soa_m8)-low_bytes(borrow);
+    }
+
+    // memory
+
+    static SOA_INLINE soa_v8 row(const soa_group& g, uint16_t addr)
+    {
+        soa_v8 v;
+        memcpy(&v, g.mem + (size_t)addr * g.stride, sizeof(v));
+        return v;
+    }
+
+    static SOA_INLINE void set_row(soa_group& g, uint16_t addr, const soa_v8& v)
+    {
+        memcpy(g.mem + (size_t)addr * g.stride, &v, sizeof(v));
+    }
+
+    // addr is the same in every running lane, a gets it
+    static SOA_INLINE bool same_addr(const soa_group& g, const soa_v16& addr, uint16_t& a)
+    {
+        a = addr[__builtin_ctz(g.bits)];
+        return (lane_bits(eq16(addr, splat16(a))) & g.bits) == g.bits;
+    }
+
+    static SOA_INLINE soa_v8 load(const soa_group& g, const soa_v16& addr)
+    {
+        uint16_t a;
+        if (same_addr(g, addr, a)) {
+            return row(g, a);
+        }
+        soa_v8 v = {};
+        for (uint32_t b = g.bits; b; b &= b - 1) {
+            int l = __builtin_ctz(b);
+            v[l] = g.mem[(size_t)addr[l] * g.stride + l];
+        }
+        return v;
+    }
+
+    static SOA_INLINE void store(soa_group& g, const soa_v16& addr, const soa_v8& v)
+    {
+        uint16_t a;
+        if (same_addr(g, addr, a)) {
+            set_row(g, a, sel8(g.m, v, row(g, a)));
+            return;
+        }
+        for (uint32_t b = g.bits; b; b &= b - 1) {
+            int l = __builtin_ctz(b);
+            g.mem[(size_t)addr[l] * g.stride + l] = v[l];
+        }
+    }
+
+    static SOA_INLINE soa_v8 fetch(const soa_group& g, const soa_ea& ea)
+    {
+        return ea.uniform ? row(g, ea.addr[0]) : load(g, ea.addr);
+    }
+
+    static SOA_INLINE void put(soa_group& g, const soa_ea& ea, const soa_v8& v)
+    {
+        if (ea.uniform) {
+            set_row(g, ea.addr[0], sel8(g.m, v, row(g, ea.addr[0])));
+        }
+        else {
+            store(g, ea.addr, v);
+        }
+    }
+
+    // registers
+
+    static SOA_INLINE void set_nz(soa_group& g, const soa_v8& v)
+    {
+        g.N = sel8(g.m, v, g.N);
+        g.Z = sel8(g.m, v, g.Z);
+    }
+
+    static SOA_INLINE soa_v8 pack_p(const soa_group& g)
+    {
+        soa_v8 zero = (soa_v8)eq8(g.Z, splat8(0)) & 1;
+        return (g.N & 0x80) | (g.V << 6) | (g.U << 5) | (g.B << 4) | (g.D << 3) | (g.I << 2) | (zero << 1) | g.C;
+    }
+
+    // registers::P::set_flag
+    static SOA_INLINE void unpack_p(soa_group& g, const soa_v8& v)
+    {
+        g.C = sel8(g.m, v & 1, g.C);
+        g.Z = sel8(g.m, ((v >> 1) & 1) ^ 1, g.Z);
+        g.I = sel8(g.m, (v >> 2) & 1, g.I);
+        g.D = sel8(g.m, (v >> 3) & 1, g.D);
+        g.B = sel8(g.m, (v >> 4) & 1, g.B);
+        g.U = sel8(g.m, (v >> 5) & 1, g.U);
+        g.V = sel8(g.m, (v >> 6) & 1, g.V);
+        g.N = sel8(g.m, v & 0x80, g.N);
+    }
+
+    static SOA_INLINE soa_v16 stack_addr(const soa_v8& sp)
+    {
+        return widen(sp) | 0x100;
+    }
+
+    static SOA_INLINE void push8(soa_group& g, const soa_v8& v)
+    {
+        store(g, stack_addr(g.SP), v);
+        g.SP = sel8(g.m, g.SP - 1, g.SP);
+    }
+
+    static SOA_INLINE void push16(soa_group& g, const soa_v16& v)
+    {
+        push8(g, low_bytes(v >> 8));
+        push8(g, low_bytes(v));
+    }
+
+    static SOA_INLINE soa_v8 pop8(soa_group& g)
+    {
+        g.SP = sel8(g.m, g.SP + 1, g.SP);
+        return load(g, stack_addr(g.SP));
+    }
+
+    static SOA_INLINE soa_v16 pop16(soa_group& g)
+    {
+        soa_v8 lo = pop8(g);
+        soa_v8 hi = pop8(g);
+        return widen(lo) | (widen(hi) << 8);
+    }
+
+    static SOA_INLINE void charge(soa_group& g, int cycles)
+    {
+        soa_v16 mask = widen((soa_v8)g.m);
+        mask |= mask << 8;
+        g.spent += (widen(g.add) + (uint16_t)cycles) & mask;
+    }
+
+    // addressing modes, cpu_6502::*_resolve per lane
+
+    static SOA_INLINE soa_ea uniform_ea(uint16_t addr)
+    {
+        soa_ea ea;
+        ea.addr = splat16(addr);
+        ea.uniform = true;
+        return ea;
+    }
+
+    static SOA_INLINE soa_ea lane_ea(const soa_v16& addr)
+    {
+        soa_ea ea;
+        ea.addr = addr;
+        ea.uniform = false;
+        return ea;
+    }
+
+    static SOA_INLINE void no_page_cycles(soa_group& g)
+    {
+        g.add = sel8(g.m, splat8(0), g.add);
+    }
+
+    // cpu_6502::cross_page_cycles, the address against the one it was indexed from
+    static SOA_INLINE void page_cycles(soa_group& g, const soa_v16& base, const soa_v16& addr)
+    {
+        soa_v8 cross = nz16((addr ^ base) >> 8);
+        g.add = sel8(g.m, cross, g.add);
+    }
+
+    static SOA_INLINE soa_ea resolve_implied(soa_group& g, uint16_t)
+    {
+        no_page_cycles(g);
+        return uniform_ea(0);
+    }
+
+    static SOA_INLINE soa_ea resolve_accumulator(soa_group& g, uint16_t)
+    {
+        no_page_cycles(g);
+        return uniform_ea(0);
+    }
+
+    static SOA_INLINE soa_ea resolve_immediate(soa_group& g, uint16_t)
+    {
+        no_page_cycles(g);
+        return uniform_ea((uint16_t)(g.next - 1));
+    }
+
+    static SOA_INLINE soa_ea resolve_zero_page(soa_group& g, uint16_t operand)
+    {
+        no_page_cycles(g);
+        return uniform_ea(operand);
+    }
+
+    static SOA_INLINE soa_ea resolve_zero_page_x(soa_group& g, uint16_t operand)
+    {
+        no_page_cycles(g);
+        return lane_ea(widen(g.X + (uint8_t)operand));
+    }
+
+    static SOA_INLINE soa_ea resolve_zero_page_y(soa_group& g, uint16_t operand)
+    {
+        no_page_cycles(g);
+        return lane_ea(widen(g.Y + (uint8_t)operand));
+    }
+
+    static SOA_INLINE soa_ea resolve_relative(soa_group& g, uint16_t operand)
+    {
+        no_page_cycles(g);
+        return uniform_ea((uint16_t)(g.next + (int8_t)operand));
+    }
+
+    static SOA_INLINE soa_ea resolve_absolute(soa_group& g, uint16_t operand)
+    {
+        no_page_cycles(g);
+        return uniform_ea(operand);
+    }
+
+    static SOA_INLINE soa_ea resolve_absolute_x(soa_group& g, uint16_t operand)
+    {
+        soa_v16 addr = splat16(operand) + widen(g.X);
+        page_cycles(g, splat16(operand), addr);
+        return lane_ea(addr);
+    }
+
+    static SOA_INLINE soa_ea resolve_absolute_y(soa_group& g, uint16_t operand)
+    {
+        soa_v16 addr = splat16(operand) + widen(g.Y);
+        page_cycles(g, splat16(operand), addr);
+        return lane_ea(addr);
+    }
+
+    // the high byte comes from the start of the page when the pointer is at its end
+    static SOA_INLINE soa_ea resolve_indirect(soa_group& g, uint16_t operand)
+    {
+        uint16_t hi_addr = (operand & 0xff) == 0xff ? (operand & 0xff00) : (uint16_t)(operand + 1);
+        no_page_cycles(g);
+        return lane_ea(widen(row(g, operand)) | (widen(row(g, hi_addr)) << 8));
+    }
+
+    static SOA_INLINE soa_ea resolve_indirect_x(soa_group& g, uint16_t operand)
+    {
+        soa_v8 ptr = g.X + (uint8_t)operand;
+        soa_v8 lo = load(g, widen(ptr));
+        soa_v8 hi = load(g, widen(ptr + 1));
+        no_page_cycles(g);
+        return lane_ea(widen(lo) | (widen(hi) << 8));
+    }
+
+    static SOA_INLINE soa_ea resolve_indirect_y(soa_group& g, uint16_t operand)
+    {
+        uint8_t ptr = (uint8_t)operand;
+        soa_v16 base = widen(row(g, ptr)) | (widen(row(g, (uint8_t)(ptr + 1))) << 8);
+        soa_v16 addr = base + widen(g.Y);
+        page_cycles(g, base, addr);
+        return lane_ea(addr);
+    }
+
+    // operations, the cpu_6502 members of the same name on the lanes in m
+
+    static SOA_INLINE void op_NOP(soa_group&, const soa_ea&)
+    {
+    }
+
+    static SOA_INLINE void op_BRK(soa_group& g, const soa_ea&)
+    {
+        push16(g, splat16((uint16_t)(g.next + 1)));
+        push8(g, pack_p(g) | (FLAG_BREAK | FLAG_EFFECT));
+        g.I = sel8(g.m, splat8(1), g.I);
+        g.PC = sel16(g.m, widen(row(g, g_irq_vector)) | (widen(row(g, g_irq_vector + 1)) << 8), g.PC);
+    }
+
+    static SOA_INLINE void op_TAX(soa_group& g, const soa_ea&)
+    {
+        g.X = sel8(g.m, g.A, g.X);
+        set_nz(g, g.A);
+    }
+
+    static SOA_INLINE void op_TAY(soa_group& g, const soa_ea&)
+    {
+        g.Y = sel8(g.m, g.A, g.Y);
+        set_nz(g, g.A);
+    }
+
+    static SOA_INLINE void op_TXA(soa_group& g, const soa_ea&)
+    {
+        g.A = sel8(g.m, g.X, g.A);
+        set_nz(g, g.X);
+    }
+
+    static SOA_INLINE void op_TYA(soa_group& g, const soa_ea&)
+    {
+        g.A = sel8(g.m, g.Y, g.A);
+        set_nz(g, g.Y);
+    }
+
+    static SOA_INLINE void op_TSX(soa_group& g, const soa_ea&)
+    {
+        g.X = sel8(g.m, g.SP, g.X);
+        set_nz(g, g.SP);
+    }
+
+    static SOA_INLINE void op_TXS(soa_group& g, const soa_ea&)
+    {
+        g.SP = sel8(g.m, g.X, g.SP);
+    }
+
+    static SOA_INLINE void op_INX(soa_group& g, const soa_ea&)
+    {
+        soa_v8 v = g.X + 1;
+        g.X = sel8(g.m, v, g.X);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_INY(soa_group& g, const soa_ea&)
+    {
+        soa_v8 v = g.Y + 1;
+        g.Y = sel8(g.m, v, g.Y);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_INC(soa_group& g, const soa_ea& ea)
+    {
+        no_page_cycles(g);
+        soa_v8 v = fetch(g, ea) + 1;
+        put(g, ea, v);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_DEX(soa_group& g, const soa_ea&)
+    {
+        soa_v8 v = g.X - 1;
+        g.X = sel8(g.m, v, g.X);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_DEY(soa_group& g, const soa_ea&)
+    {
+        soa_v8 v = g.Y - 1;
+        g.Y = sel8(g.m, v, g.Y);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_DEC(soa_group& g, const soa_ea& ea)
+    {
+        no_page_cycles(g);
+        soa_v8 v = fetch(g, ea) - 1;
+        put(g, ea, v);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_ORA(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 v = g.A | fetch(g, ea);
+        g.A = sel8(g.m, v, g.A);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_AND(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 v = g.A & fetch(g, ea);
+        g.A = sel8(g.m, v, g.A);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_EOR(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 v = g.A ^ fetch(g, ea);
+        g.A = sel8(g.m, v, g.A);
+        set_nz(g, v);
+    }
+
+    // the result of a shift or rotate of memory or A, and its carry
+    static SOA_INLINE void shifted_memory(soa_group& g, const soa_ea& ea, const soa_v8& v, const soa_v8& carry)
+    {
+        no_page_cycles(g);
+        put(g, ea, v);
+        g.C = sel8(g.m, carry, g.C);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void shifted_accumulator(soa_group& g, const soa_v8& v, const soa_v8& carry)
+    {
+        g.A = sel8(g.m, v, g.A);
+        g.C = sel8(g.m, carry, g.C);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_ASL(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 v = alu_asl(fetch(g, ea), carry);
+        shifted_memory(g, ea, v, carry);
+    }
+
+    static SOA_INLINE void op_ASLA(soa_group& g, const soa_ea&)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 v = alu_asl(g.A, carry);
+        shifted_accumulator(g, v, carry);
+    }
+
+    static SOA_INLINE void op_ROL(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 v = alu_rol(fetch(g, ea), carry);
+        shifted_memory(g, ea, v, carry);
+    }
+
+    static SOA_INLINE void op_ROLA(soa_group& g, const soa_ea&)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 v = alu_rol(g.A, carry);
+        shifted_accumulator(g, v, carry);
+    }
+
+    static SOA_INLINE void op_ROR(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 v = alu_ror(fetch(g, ea), carry);
+        shifted_memory(g, ea, v, carry);
+    }
+
+    static SOA_INLINE void op_RORA(soa_group& g, const soa_ea&)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 v = alu_ror(g.A, carry);
+        shifted_accumulator(g, v, carry);
+    }
+
+    static SOA_INLINE void op_LSR(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 v = alu_lsr(fetch(g, ea), carry);
+        shifted_memory(g, ea, v, carry);
+    }
+
+    static SOA_INLINE void op_LSRA(soa_group& g, const soa_ea&)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 v = alu_lsr(g.A, carry);
+        shifted_accumulator(g, v, carry);
+    }
+
+    static SOA_INLINE void op_ADC(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 overflow = g.V;
+        soa_v8 v = alu_adc(g.A, fetch(g, ea), carry, overflow);
+        g.A = sel8(g.m, v, g.A);
+        g.C = sel8(g.m, carry, g.C);
+        g.V = sel8(g.m, overflow, g.V);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_SBC(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 overflow = g.V;
+        soa_v8 v = alu_sbc(g.A, fetch(g, ea), carry, overflow);
+        g.A = sel8(g.m, v, g.A);
+        g.C = sel8(g.m, carry, g.C);
+        g.V = sel8(g.m, overflow, g.V);
+        set_nz(g, v);
+    }
+
+    // cpu_6502::take_branch, the target is the same in every lane
+    static SOA_INLINE void branch(soa_group& g, const soa_ea& ea, const soa_m8& taken)
+    {
+        uint16_t target = ea.addr[0];
+        soa_v8 cost = splat8((target >> 8) != (g.next >> 8) ? 2 : 1);
+        g.add = sel8(g.m & taken, cost, g.add);
+        g.PC = sel16(g.m & taken, ea.addr, g.PC);
+    }
+
+    static SOA_INLINE void op_BMI(soa_group& g, const soa_ea& ea)
+    {
+        branch(g, ea, (soa_m8)-(g.N >> 7));
+    }
+
+    static SOA_INLINE void op_BPL(soa_group& g, const soa_ea& ea)
+    {
+        branch(g, ea, (soa_m8)((g.N >> 7) - 1));
+    }
+
+    static SOA_INLINE void op_BCS(soa_group& g, const soa_ea& ea)
+    {
+        branch(g, ea, ne8(g.C, splat8(0)));
+    }
+
+    static SOA_INLINE void op_BCC(soa_group& g, const soa_ea& ea)
+    {
+        branch(g, ea, eq8(g.C, splat8(0)));
+    }
+
+    static SOA_INLINE void op_BEQ(soa_group& g, const soa_ea& ea)
+    {
+        branch(g, ea, eq8(g.Z, splat8(0)));
+    }
+
+    static SOA_INLINE void op_BNE(soa_group& g, const soa_ea& ea)
+    {
+        branch(g, ea, ne8(g.Z, splat8(0)));
+    }
+
+    static SOA_INLINE void op_BVS(soa_group& g, const soa_ea& ea)
+    {
+        branch(g, ea, ne8(g.V, splat8(0)));
+    }
+
+    static SOA_INLINE void op_BVC(soa_group& g, const soa_ea& ea)
+    {
+        branch(g, ea, eq8(g.V, splat8(0)));
+    }
+
+    static SOA_INLINE void op_BIT(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 v = fetch(g, ea);
+        g.V = sel8(g.m, alu_bit_overflow(v), g.V);
+        g.N = sel8(g.m, v, g.N);
+        g.Z = sel8(g.m, v & g.A, g.Z);
+    }
+
+    static SOA_INLINE void compare(soa_group& g, const soa_v8& reg, const soa_ea& ea)
+    {
+        soa_v8 carry = g.C;
+        soa_v8 v = alu_cmp(reg, fetch(g, ea), carry);
+        g.C = sel8(g.m, carry, g.C);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_CMP(soa_group& g, const soa_ea& ea)
+    {
+        compare(g, g.A, ea);
+    }
+
+    static SOA_INLINE void op_CPX(soa_group& g, const soa_ea& ea)
+    {
+        compare(g, g.X, ea);
+    }
+
+    static SOA_INLINE void op_CPY(soa_group& g, const soa_ea& ea)
+    {
+        compare(g, g.Y, ea);
+    }
+
+    static SOA_INLINE void op_PHA(soa_group& g, const soa_ea&)
+    {
+        push8(g, g.A);
+    }
+
+    static SOA_INLINE void op_PHP(soa_group& g, const soa_ea&)
+    {
+        push8(g, pack_p(g) | 0x30);
+    }
+
+    static SOA_INLINE void op_PLA(soa_group& g, const soa_ea&)
+    {
+        soa_v8 v = pop8(g);
+        g.A = sel8(g.m, v, g.A);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_PLP(soa_group& g, const soa_ea&)
+    {
+        unpack_p(g, (pop8(g) & 0xef) | 0x20);
+    }
+
+    static SOA_INLINE void op_RTS(soa_group& g, const soa_ea&)
+    {
+        g.PC = sel16(g.m, pop16(g) + 1, g.PC);
+    }
+
+    static SOA_INLINE void op_RTI(soa_group& g, const soa_ea&)
+    {
+        unpack_p(g, pop8(g) | FLAG_EFFECT);
+        g.PC = sel16(g.m, pop16(g), g.PC);
+    }
+
+    static SOA_INLINE void op_JMP(soa_group& g, const soa_ea& ea)
+    {
+        g.PC = sel16(g.m, ea.addr, g.PC);
+    }
+
+    static SOA_INLINE void op_JSR(soa_group& g, const soa_ea& ea)
+    {
+        push16(g, splat16((uint16_t)(g.next - 1)));
+        g.PC = sel16(g.m, ea.addr, g.PC);
+    }
+
+    static SOA_INLINE void op_LDA(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 v = fetch(g, ea);
+        g.A = sel8(g.m, v, g.A);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_LDX(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 v = fetch(g, ea);
+        g.X = sel8(g.m, v, g.X);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_LDY(soa_group& g, const soa_ea& ea)
+    {
+        soa_v8 v = fetch(g, ea);
+        g.Y = sel8(g.m, v, g.Y);
+        set_nz(g, v);
+    }
+
+    static SOA_INLINE void op_STA(soa_group& g, const soa_ea& ea)
+    {
+        no_page_cycles(g);
+        put(g, ea, g.A);
+    }
+
+    static SOA_INLINE void op_STX(soa_group& g, const soa_ea& ea)
+    {
+        no_page_cycles(g);
+        put(g, ea, g.X);
+    }
+
+    static SOA_INLINE void op_STY(soa_group& g, const soa_ea& ea)
+    {
+        no_page_cycles(g);
+        put(g, ea, g.Y);
+    }
+
+    static SOA_INLINE void op_CLC(soa_group& g, const soa_ea&)
+    {
+        g.C = sel8(g.m, splat8(0), g.C);
+    }
+
+    static SOA_INLINE void op_CLI(soa_group& g, const soa_ea&)
+    {
+        g.I = sel8(g.m, splat8(0), g.I);
+    }
+
+    static SOA_INLINE void op_CLD(soa_group& g, const soa_ea&)
+    {
+        g.D = sel8(g.m, splat8(0), g.D);
+    }
+
+    static SOA_INLINE void op_CLV(soa_group& g, const soa_ea&)
+    {
+        g.V = sel8(g.m, splat8(0), g.V);
+    }
+
+    static SOA_INLINE void op_SEC(soa_group& g, const soa_ea&)
+    {
+        g.C = sel8(g.m, splat8(1), g.C);
+    }
+
+    static SOA_INLINE void op_SEI(soa_group& g, const soa_ea&)
+    {
+        g.I = sel8(g.m, splat8(1), g.I);
+    }
+
+    static SOA_INLINE void op_SED(soa_group& g, const soa_ea&)
+    {
+        g.D = sel8(g.m, splat8(1), g.D);
+    }
+
+    // the group loop
+
+    static SOA_INLINE void load_group(soa_group& g, const soa_registers& r)
+    {
+        memcpy(&g.A, r.A, sizeof(g.A));
+        memcpy(&g.X, r.X, sizeof(g.X));
+        memcpy(&g.Y, r.Y, sizeof(g.Y));
+        memcpy(&g.SP, r.SP, sizeof(g.SP));
+        memcpy(&g.C, r.carry_flag, sizeof(g.C));
+        memcpy(&g.V, r.overflow_flag, sizeof(g.V));
+        memcpy(&g.N, r.n_result, sizeof(g.N));
+        memcpy(&g.Z, r.z_result, sizeof(g.Z));
+        memcpy(&g.I, r.interrupt_disable, sizeof(g.I));
+        memcpy(&g.D, r.decimal_mode, sizeof(g.D));
+        memcpy(&g.B, r.break_command, sizeof(g.B));
+        memcpy(&g.U, r.no_effect, sizeof(g.U));
+        memcpy(&g.add, r.add_cycles, sizeof(g.add));
+        memcpy(&g.status, r.status, sizeof(g.status));
+        memcpy(&g.PC, r.PC, sizeof(g.PC));
+        g.spent = splat16(0);
+        for (int l = 0; l < NES_SOA_LANES; ++l) {
+            int32_t c = r.cycles[l];
+            g.room[l] = (uint16_t)(c <= 0 ? 0 : c > 0xffff ? 0xffff : c);
+        }
+    }
+
+    static SOA_INLINE void fold_cycles(soa_registers& r, soa_group& g)
+    {
+        for (int l = 0; l < NES_SOA_LANES; ++l) {
+            r.cycles[l] -= g.spent[l];
+            int32_t c = r.cycles[l];
+            g.room[l] = (uint16_t)(c <= 0 ? 0 : c > 0xffff ? 0xffff : c);
+        }
+        g.spent = splat16(0);
+    }
+
+    static SOA_INLINE void store_group(soa_registers& r, const soa_group& g)
+    {
+        memcpy(r.A, &g.A, sizeof(g.A));
+        memcpy(r.X, &g.X, sizeof(g.X));
+        memcpy(r.Y, &g.Y, sizeof(g.Y));
+        memcpy(r.SP, &g.SP, sizeof(g.SP));
+        memcpy(r.carry_flag, &g.C, sizeof(g.C));
+        memcpy(r.overflow_flag, &g.V, sizeof(g.V));
+        memcpy(r.n_result, &g.N, sizeof(g.N));
+        memcpy(r.z_result, &g.Z, sizeof(g.Z));
+        memcpy(r.interrupt_disable, &g.I, sizeof(g.I));
+        memcpy(r.decimal_mode, &g.D, sizeof(g.D));
+        memcpy(r.break_command, &g.B, sizeof(g.B));
+        memcpy(r.no_effect, &g.U, sizeof(g.U));
+        memcpy(r.add_cycles, &g.add, sizeof(g.add));
+        memcpy(r.status, &g.status, sizeof(g.status));
+        memcpy(r.PC, &g.PC, sizeof(g.PC));
+        for (int l = 0; l < NES_SOA_LANES; ++l) {
+            r.cycles[l] -= g.spent[l];
+        }
+    }
+
+#define NES_SOA_OP(code, mode, op, cyc) \
+    case code: { \
+        soa_ea ea = resolve_##mode(g, operand); \
+        op_##op(g, ea); \
+        charge(g, cyc); \
+        break; \
+    }
+#define NES_SOA_TRAP(code, mode, op, cyc) \
+    case code: { \
+        soa_ea ea = resolve_##mode(g, operand); \
+        op_##op(g, ea); \
+        charge(g, cyc); \
+        g.status = sel8(g.m, splat8((uint8_t)BRK_INSTRUCTION), g.status); \
+        break; \
+    }
+#define NES_SOA_ILL(code)
+
+    static SOA_INLINE void run_group(soa_registers& r, uint8_t *mem, size_t stride, uint32_t pc_limit,
+                                     uint64_t& instructions, uint64_t& steps)
+    {
+        soa_group g;
+        load_group(g, r);
+        g.mem = mem;
+        g.stride = stride;
+
+        for (uint32_t folded = 0; ; ++folded) {
+            // a step spends at most 8 cycles, keep spent clear of the 16 bit room
+            if (folded == NES_SOA_FOLD_STEPS) {
+                fold_cycles(r, g);
+                folded = 0;
+            }
+
+            soa_m8 live = lt16(g.spent, g.room) & eq8(g.status, splat8(0));
+            if (pc_limit <= 0xffff) {
+                live &= lt16(g.PC, splat16((uint16_t)pc_limit));
+            }
+            uint32_t live_bits = lane_bits(live);
+            if (live_bits == 0) {
+                break;
+            }
+
+            uint16_t pc = g.PC[__builtin_ctz(live_bits)];
+            soa_m8 at = eq16(g.PC, splat16(pc)) & live;
+            uint32_t at_bits = lane_bits(at);
+            if (at_bits != live_bits) {
+                // diverged, the lanes furthest behind go first so the others can rejoin them
+                for (uint32_t b = live_bits; b; b &= b - 1) {
+                    uint16_t p = g.PC[__builtin_ctz(b)];
+                    pc = p < pc ? p : pc;
+                }
+                at = eq16(g.PC, splat16(pc)) & live;
+                at_bits = lane_bits(at);
+            }
+            int lead = __builtin_ctz(at_bits);
+
+            // lanes with other instruction bytes at this PC wait for a later step
+            soa_v8 bytes = row(g, pc);
+            uint8_t opcode = bytes[lead];
+            soa_m8 m = at & eq8(bytes, splat8(opcode));
+            uint8_t len = g_soa_lengths[opcode];
+            uint16_t operand = 0;
+            if (len > 1) {
+                bytes = row(g, (uint16_t)(pc + 1));
+                operand = bytes[lead];
+                m &= eq8(bytes, splat8((uint8_t)operand));
+            }
+            if (len > 2) {
+                bytes = row(g, (uint16_t)(pc + 2));
+                operand |= bytes[lead] << 8;
+                m &= eq8(bytes, splat8((uint8_t)(operand >> 8)));
+            }
+
+            g.m = m;
+            g.bits = lane_bits(m);
+            g.next = (uint16_t)(pc + len);
+            g.PC = sel16(m, splat16(g.next), g.PC);
+
+            switch (opcode) {
+            NES_OPCODE_TABLE(NES_SOA_OP, NES_SOA_TRAP, NES_SOA_ILL)
+            default:
+                // like execute_switch, charged the last page penalty again
+                charge(g, 0);
+                g.status = sel8(m, splat8((uint8_t)ERROR_UNKNOWN_INSTRUCTION), g.status);
+                break;
+            }
+
+            instructions += __builtin_popcount(g.bits);
+            steps++;
+        }
+
+        store_group(r, g);
+    }
+
+#undef NES_SOA_OP
+#undef NES_SOA_TRAP
+#undef NES_SOA_ILL
+
+    typedef void (*soa_kernel)(soa_registers& r, uint8_t *mem, size_t stride, uint32_t pc_limit,
+                               uint64_t& instructions, uint64_t& steps);
+
+    static void run_group_generic(soa_registers& r, uint8_t *mem, size_t stride, uint32_t pc_limit,
+                                  uint64_t& instructions, uint64_t& steps)
+    {
+        run_group(r, mem, stride, pc_limit, instructions, steps);
+    }
+
+#if NES_SOA_SIMD
+
+    __attribute__((target("avx2")))
+    static void run_group_avx2(soa_registers& r, uint8_t *mem, size_t stride, uint32_t pc_limit,
+                               uint64_t& instructions, uint64_t& steps)
+    {
+        run_group(r, mem, stride, pc_limit, instructions, steps);
+    }
+
+    __attribute__((target("avx512bw,avx512vl")))
+    static void run_group_avx512(soa_registers& r, uint8_t *mem, size_t stride, uint32_t pc_limit,
+                                 uint64_t& instructions, uint64_t& steps)
+    {
+        run_group(r, mem, stride, pc_limit, instructions, steps);
+    }
+
+#endif
+
+    static const soa_kernel g_soa_kernels[] = {
+        run_group_generic,
+#if NES_SOA_SIMD
+        run_group_avx2,
+        run_group_avx512,
+#else
+        run_group_generic,
+        run_group_generic,
+#endif
+    };
+
+    bool cpu_6502_soa::isa_supported(soa_isa isa)
+    {
+#if NES_SOA_SIMD
+        switch (isa) {
+            case soa_isa::avx2:   return __builtin_cpu_supports("avx2");
+            case soa_isa::avx512: return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+            default:              return true;
+        }
+#else
+        return isa == soa_isa::generic;
+#endif
+    }
+
+    const char* cpu_6502_soa::isa_name(soa_isa isa)
+    {
+        static const char * const names[] = { "generic", "avx2", "avx512" };
+        return names[(int)isa];
+    }
+
+    cpu_6502_soa::cpu_6502_soa(size_t lanes) noexcept
+    :lanes_(lanes ? (lanes + NES_SOA_LANES - 1) / NES_SOA_LANES * NES_SOA_LANES : NES_SOA_LANES),
+     groups_(lanes_ / NES_SOA_LANES),
+     mem_(lanes_ * NES_MAX_RAM, 0),
+     isa_(soa_isa::generic)
+    {
+        // as a fresh cpu_6502
+        registers r{0};
+        r.P.set_flag(0);
+        for (size_t l = 0; l < this->lanes_; ++l) {
+            this->set_registers(l, r);
+        }
+    }
+
+    void cpu_6502_soa::load_code_segment(uint16_t base, const uint8_t *buf, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i) {
+            uint8_t *row = &this->mem_[(size_t)(uint16_t)(base + i) * this->lanes_];
+            memset(row, buf[i], this->lanes_);
+        }
+        this->code_segment_.start = base;
+        this->code_segment_.end = (uint16_t)(base + size);
+    }
+
+    registers cpu_6502_soa::get_registers(size_t lane) const
+    {
+        const soa_registers& g = this->groups_[lane / NES_SOA_LANES];
+        size_t i = lane % NES_SOA_LANES;
+
+        registers r{0};
+        r.A = g.A[i];
+        r.X = g.X[i];
+        r.Y = g.Y[i];
+        r.SP = g.SP[i];
+        r.PC = g.PC[i];
+        r.P.carry_flag = g.carry_flag[i];
+        r.P.overflow_flag = g.overflow_flag[i];
+        r.P.n_result = g.n_result[i];
+        r.P.z_result = g.z_result[i];
+        r.P.interrupt_disable = g.interrupt_disable[i];
+        r.P.decimal_mode = g.decimal_mode[i];
+        r.P.break_command = g.break_command[i];
+        r.P.no_effect = g.no_effect[i];
+        return r;
+    }
+
+    void cpu_6502_soa::set_registers(size_t lane, const registers& r)
+    {
+        soa_registers& g = this->groups_[lane / NES_SOA_LANES];
+        size_t i = lane % NES_SOA_LANES;
+
+        g.A[i] = r.A;
+        g.X[i] = r.X;
+        g.Y[i] = r.Y;
+        g.SP[i] = r.SP;
+        g.PC[i] = r.PC;
+        g.carry_flag[i] = r.P.carry_flag;
+        g.overflow_flag[i] = r.P.overflow_flag;
+        g.n_result[i] = r.P.n_result;
+        g.z_result[i] = r.P.z_result;
+        g.interrupt_disable[i] = r.P.interrupt_disable;
+        g.decimal_mode[i] = r.P.decimal_mode;
+        g.break_command[i] = r.P.break_command;
+        g.no_effect[i] = r.P.no_effect;
+    }
+
+    void cpu_6502_soa::execute(int cycles)
+    {
+        soa_kernel kernel = g_soa_kernels[(int)this->isa_];
+
+        for (size_t i = 0; i < this->groups_.size(); ++i) {
+            soa_registers& g = this->groups_[i];
+            for (int l = 0; l < NES_SOA_LANES; ++l) {
+                g.cycles[l] = cycles;
+                g.status[l] = 0;
+            }
+            kernel(g, this->mem_.data() + i * NES_SOA_LANES, this->lanes_, this->pc_limit_,
+                   this->instructions_, this->steps_);
+        }
+    }
+
+    void cpu_6502_soa::run()
+    {
+        // cpu_6502::reset_reg
+        registers r{0};
+        r.P.set_flag(0);
+        r.P.break_command = 1;
+        r.PC = this->code_segment_.start;
+        r.SP = g_stack_offset.start & 0xff;
+        for (size_t l = 0; l < this->lanes_; ++l) {
+            this->set_registers(l, r);
+        }
+        this->pc_limit_ = this->code_segment_.end;
+
+        this->execute(std::numeric_limits<int>::max());
+    }
+
+    static uint32_t xorshift(uint32_t& x)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return x;
+    }
+
+    // runs every lane of soa and a cpu_6502 on a copy of each lane's memory and registers, they must agree
+    static void check_lanes(cpu_6502_soa& soa, int cycles, uint32_t pc_limit)
+    {
+        std::vector<registers> regs(soa.lanes());
+        std::vector<uint8_t> ram(soa.lanes() * NES_MAX_RAM);
+        for (size_t l = 0; l < soa.lanes(); ++l) {
+            regs[l] = soa.get_registers(l);
+            for (uint32_t a = 0; a < NES_MAX_RAM; ++a) {
+                ram[l * NES_MAX_RAM + a] = soa.read(l, (uint16_t)a);
+            }
+        }
+
+        soa.set_pc_limit(pc_limit);
+        soa.execute(cycles);
+
+        uint64_t instructions = 0;
+        for (size_t l = 0; l < soa.lanes(); ++l) {
+            memory mem;
+            memcpy(mem.map_offset_addr(0), &ram[l * NES_MAX_RAM], NES_MAX_RAM);
+            cpu_6502 cpu(mem);
+            cpu.set_log(nullptr);
+            cpu.set_registers(regs[l]);
+            cpu.set_pc_limit(pc_limit);
+            int left = cycles;
+            uint8_t status = cpu.execute(left);
+            instructions += cpu.get_instruction_count();
+
+            const registers& r = cpu.get_registers();
+            registers s = soa.get_registers(l);
+            assert(s.A == r.A && s.X == r.X && s.Y == r.Y && s.SP == r.SP && s.PC == r.PC);
+            assert((uint8_t)s.P == (uint8_t)r.P);
+            assert(soa.get_cycles(l) == left);
+            assert(soa.get_status(l) == status);
+            for (uint32_t a = 0; a < NES_MAX_RAM; ++a) {
+                assert(soa.read(l, (uint16_t)a) == mem.read<uint8_t>(a));
+            }
+            (void)status;
+            (void)r;
+            (void)s;
+        }
+        (void)instructions;
+    }
+
+    void cpu_6502_soa::test()
+    {
+        // the shared ALU against plain arithmetic, this is cpu_6502's ADC/SBC/CMP too
+        for (int a = 0; a < 256; ++a) {
+            for (int v = 0; v < 256; ++v) {
+                for (int c = 0; c < 2; ++c) {
+                    uint8_t carry = (uint8_t)c;
+                    uint8_t overflow = 0;
+                    int sum = a + v + c;
+                    uint8_t r = alu_adc((uint8_t)a, (uint8_t)v, carry, overflow);
+                    assert(r == (uint8_t)sum && carry == (sum > 0xff ? 1 : 0));
+                    assert(overflow == ((~(a ^ v) & (a ^ sum) & 0x80) ? 1 : 0));
+
+                    carry = (uint8_t)c;
+                    int diff = a - v - (1 - c);
+                    r = alu_sbc((uint8_t)a, (uint8_t)v, carry, overflow);
+                    assert(r == (uint8_t)diff && carry == (diff >= 0 ? 1 : 0));
+                    assert(overflow == (((a ^ v) & (a ^ diff) & 0x80) ? 1 : 0));
+
+                    r = alu_cmp((uint8_t)a, (uint8_t)v, carry);
+                    assert(r == (uint8_t)(a - v) && carry == (a >= v ? 1 : 0));
+                    (void)r;
+                    (void)sum;
+                    (void)diff;
+                }
+            }
+        }
+
+        soa_isa isas[] = { soa_isa::generic, soa_isa::avx2, soa_isa::avx512 };
+        uint32_t x = 0x2545f491;
+
+        // countdown loops: no divergence, every step runs every lane
+        static const uint8_t countdown[] = {
+            0xa0, 0x04,             // LDY #$04
+            0xa2, 0x00,             // outer: LDX #$00
+            0xca,                   // inner: DEX
+            0xd0, 0xfd,             // BNE inner
+            0x88,                   // DEY
+            0xd0, 0xf8,             // BNE outer
+        };
+        {
+            cpu_6502_soa soa(NES_SOA_LANES);
+            soa.load_code_segment(0x0600, countdown, sizeof(countdown));
+            soa.run();
+            assert(soa.get_instruction_count() == soa.get_step_count() * NES_SOA_LANES);
+            assert(soa.get_registers(5).PC == 0x0600 + sizeof(countdown));
+        }
+
+        // a data dependent loop count per lane, the branch splits and rejoins the group
+        static const uint8_t fill[] = {
+            0xa6, 0x00,             // LDX $00
+            0x8a,                   // loop: TXA
+            0x9d, 0x00, 0x02,       // STA $0200,X
+            0x7d, 0x00, 0x03,       // ADC $0300,X
+            0x85, 0x01,             // STA $01
+            0x20, 0x20, 0x06,       // JSR sub
+            0xca,                   // DEX
+            0xd0, 0xf1,             // BNE loop
+            0x00, 0x00,             // BRK
+        };
+        static const uint8_t sub[] = {
+            0x48,                   // sub: PHA
+            0x08,                   // PHP
+            0xb1, 0x01,             // LDA ($01),Y
+            0x30, 0x01,             // BMI +1
+            0xc8,                   // INY
+            0x28,                   // PLP
+            0x68,                   // PLA
+            0x60,                   // RTS
+        };
+        for (size_t i = 0; i < arr_len(isas); ++i) {
+            if (!isa_supported(isas[i])) {
+                continue;
+            }
+            cpu_6502_soa soa(2 * NES_SOA_LANES);
+            soa.set_isa(isas[i]);
+            soa.load_code_segment(0x0620, sub, sizeof(sub));
+            soa.load_code_segment(0x0600, fill, sizeof(fill));
+            for (size_t l = 0; l < soa.lanes(); ++l) {
+                soa.write(l, 0x00, (uint8_t)(xorshift(x) & 0x3f));
+                for (int a = 0; a < 0x100; ++a) {
+                    soa.write(l, (uint16_t)(0x0300 + a), (uint8_t)xorshift(x));
+                }
+                registers r = soa.get_registers(l);
+                r.PC = 0x0600;
+                r.SP = 0xff;
+                soa.set_registers(l, r);
+            }
+            check_lanes(soa, 100000, 0x10000);
+            assert(soa.get_instruction_count() < soa.get_step_count() * NES_SOA_LANES);
+            for (size_t l = 0; l < soa.lanes(); ++l) {
+                assert(soa.get_status(l) == (uint8_t)BRK_INSTRUCTION);
+            }
+        }
+
+        // random code, memory and registers in every lane, nothing in common
+        static bool legal[256];
+        for (int op = 0; op < 256; ++op) {
+            legal[op] = true;
+        }
+#define NES_SOA_NOTHING(code, mode, op, cyc)
+#define NES_SOA_ILLEGAL(code) legal[code] = false;
+        NES_OPCODE_TABLE(NES_SOA_NOTHING, NES_SOA_NOTHING, NES_SOA_ILLEGAL)
+#undef NES_SOA_NOTHING
+#undef NES_SOA_ILLEGAL
+
+        for (size_t i = 0; i < arr_len(isas); ++i) {
+            if (!isa_supported(isas[i])) {
+                continue;
+            }
+            cpu_6502_soa soa(2 * NES_SOA_LANES);
+            soa.set_isa(isas[i]);
+            for (size_t l = 0; l < soa.lanes(); ++l) {
+                for (uint32_t a = 0; a < NES_MAX_RAM; ++a) {
+                    uint8_t v = (uint8_t)xorshift(x);
+                    soa.write(l, (uint16_t)a, legal[v] ? v : 0xea);
+                }
+                registers r{0};
+                r.A = (uint8_t)xorshift(x);
+                r.X = (uint8_t)xorshift(x);
+                r.Y = (uint8_t)xorshift(x);
+                r.SP = (uint8_t)xorshift(x);
+                r.PC = (uint16_t)xorshift(x);
+                r.P.set_flag((uint8_t)xorshift(x));
+                soa.set_registers(l, r);
+            }
+            check_lanes(soa, 2000, 0x10000);
+        }
+
+        // the same random code everywhere, different registers: diverges and rejoins
+        {
+            cpu_6502_soa soa(NES_SOA_LANES);
+            uint16_t start = (uint16_t)xorshift(x);
+            for (uint32_t a = 0; a < NES_MAX_RAM; ++a) {
+                uint8_t v = (uint8_t)xorshift(x);
+                for (size_t l = 0; l < soa.lanes(); ++l) {
+                    soa.write(l, (uint16_t)a, legal[v] ? v : 0xea);
+                }
+            }
+            for (size_t l = 0; l < soa.lanes(); ++l) {
+                registers r{0};
+                r.A = (uint8_t)xorshift(x);
+                r.X = (uint8_t)(l & 3);
+                r.SP = 0xff;
+                r.PC = start;
+                r.P.set_flag((uint8_t)(xorshift(x) & 0xc3));
+                soa.set_registers(l, r);
+            }
+            check_lanes(soa, 5000, 0x10000);
+        }
+    }
+
+}
@@ -0,0 +1,166 @@
+#ifndef cpu_6502_soa_hpp
+#define cpu_6502_soa_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "cpu_6502.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define NES_SOA_SIMD 1
+#else
+#define NES_SOA_SIMD 0
+#endif
+
+// machines per group, one AVX2 register of lane bytes
+#define NES_SOA_LANES 32
+
+
+namespace nes {
+
+    // generic is the default: a step is mostly the scalar issue logic and
+    // the lane bytes already fill two SSE registers, bench-soa compares them
+    enum class soa_isa : uint8_t {
+        generic,    // the compiler's baseline, SSE2 on x86-64
+        avx2,
+        avx512,     // AVX-512BW/VL on the same 32 lane vectors
+    };
+
+    // registers of one group, an array per register, flags as in registers::P
+    struct soa_registers {
+        uint8_t A[NES_SOA_LANES];
+        uint8_t X[NES_SOA_LANES];
+        uint8_t Y[NES_SOA_LANES];
+        uint8_t SP[NES_SOA_LANES];
+        uint8_t carry_flag[NES_SOA_LANES];
+        uint8_t overflow_flag[NES_SOA_LANES];
+        uint8_t n_result[NES_SOA_LANES];
+        uint8_t z_result[NES_SOA_LANES];
+        uint8_t interrupt_disable[NES_SOA_LANES];
+        uint8_t decimal_mode[NES_SOA_LANES];
+        uint8_t break_command[NES_SOA_LANES];
+        uint8_t no_effect[NES_SOA_LANES];
+        uint8_t add_cycles[NES_SOA_LANES];
+        uint8_t status[NES_SOA_LANES];
+        uint16_t PC[NES_SOA_LANES];
+        int32_t cycles[NES_SOA_LANES];
+    };
+
+    /*
+        Many bare 6502s in lockstep, for fuzzing and search workloads.
+
+        Every machine (lane) has its own flat 64 KiB, like a cpu_6502 on a
+        default memory, and its own registers; both are kept structure of
+        arrays. Lanes run in groups of NES_SOA_LANES that issue one opcode
+        per step for all lanes at the same PC with the same instruction
+        bytes; the ALU semantics are the cpu_6502 ones from alu_6502.hpp
+        on byte vectors. Lanes that diverge are masked off and regrouped:
+        a group always steps the lowest PC among its running lanes, so
+        the lanes behind catch up to the ones ahead and reconverge.
+
+        Memory is address major, the byte at addr of lane l sits at
+        addr * lanes + l, so an access at the same address in every lane
+        is one vector load or store; per lane addresses gather and scatter.
+
+        Cycles, cross page penalties and BRK / unknown opcode stops match
+        cpu_6502's switch dispatch exactly.
+    */
+    class cpu_6502_soa {
+
+        size_t lanes_;
+        std::vector<soa_registers> groups_;
+        std::vector<uint8_t> mem_;
+
+        soa_isa isa_;
+        uint32_t pc_limit_{0x10000};
+        address_offset code_segment_{0x00, 0x00};
+        uint64_t instructions_{0};
+        uint64_t steps_{0};
+
+    public:
+        cpu_6502_soa() = delete;
+        cpu_6502_soa(const cpu_6502_soa&) = delete;
+        cpu_6502_soa(cpu_6502_soa&&) = delete;
+        cpu_6502_soa& operator=(const cpu_6502_soa&) = delete;
+        cpu_6502_soa& operator=(cpu_6502_soa&&) = delete;
+
+        // lanes is rounded up to whole groups
+        explicit cpu_6502_soa(size_t lanes) noexcept;
+
+        size_t lanes() const
+        {
+            return this->lanes_;
+        }
+
+        uint8_t read(size_t lane, uint16_t addr) const
+        {
+            return this->mem_[(size_t)addr * this->lanes_ + lane];
+        }
+
+        void write(size_t lane, uint16_t addr, uint8_t v)
+        {
+            this->mem_[(size_t)addr * this->lanes_ + lane] = v;
+        }
+
+        // into every lane, [base, base + size) becomes the code segment
+        void load_code_segment(uint16_t base, const uint8_t *buf, size_t size);
+
+        registers get_registers(size_t lane) const;
+        void set_registers(size_t lane, const registers& r);
+
+        // cycles left of the last execute(), can be <= 0
+        int get_cycles(size_t lane) const
+        {
+            return this->groups_[lane / NES_SOA_LANES].cycles[lane % NES_SOA_LANES];
+        }
+
+        // 0, or BRK_INSTRUCTION / ERROR_UNKNOWN_INSTRUCTION as uint8_t when the lane stopped on one
+        uint8_t get_status(size_t lane) const
+        {
+            return this->groups_[lane / NES_SOA_LANES].status[lane % NES_SOA_LANES];
+        }
+
+        void set_pc_limit(uint32_t limit)
+        {
+            this->pc_limit_ = limit;
+        }
+
+        void set_isa(soa_isa isa)
+        {
+            this->isa_ = isa;
+        }
+
+        soa_isa get_isa() const
+        {
+            return this->isa_;
+        }
+
+        static bool isa_supported(soa_isa isa);
+        static const char* isa_name(soa_isa isa);
+
+        // every lane runs until it spent cycles, PC left [0, pc limit) or it hit BRK or an unknown opcode
+        void execute(int cycles);
+
+        // cpu_6502::run() in every lane: registers reset to the code segment start, run to its end
+        void run();
+
+        // instructions summed over the lanes
+        uint64_t get_instruction_count() const
+        {
+            return this->instructions_;
+        }
+
+        // group steps, instructions / (steps * NES_SOA_LANES) is the lane utilisation
+        uint64_t get_step_count() const
+        {
+            return this->steps_;
+        }
+
+        static void test();
+    };
+
+}
+
+
+#endif /* cpu_6502_soa_hpp */
@@ -0,0 +1,320 @@
+#include "debugger.hpp"
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include "console.hpp"
+#include "bench.hpp"
+
+
+namespace nes {
+
+    debugger::debugger(cpu_6502& cpu, memory& mem) noexcept
+    :cpu_(cpu), mem_(mem), breaks_(NES_MAX_RAM / 8), reads_(NES_MAX_RAM / 8), writes_(NES_MAX_RAM / 8)
+    {
+        this->event_.kind = debug_stop::none;
+        this->mem_.set_access_trap(this);
+    }
+
+    debugger::~debugger()
+    {
+        this->clear();
+        this->mem_.set_access_trap(nullptr);
+    }
+
+    bool debugger::set_bit(std::vector<uint8_t>& bits, uint16_t addr, bool on)
+    {
+        uint8_t mask = (uint8_t)(1 << (addr & 7));
+        uint8_t& b = bits[addr >> 3];
+        if (((b & mask) != 0) == on) {
+            return false;
+        }
+        b ^= mask;
+        return true;
+    }
+
+    void debugger::set_breakpoint(uint16_t addr, bool on)
+    {
+        if (!set_bit(this->breaks_, addr, on)) {
+            return;
+        }
+        this->break_count_ += on ? 1 : -1;
+        this->cpu_.set_breakpoints(this->break_count_ ? this->breaks_.data() : nullptr);
+        // blocks get cut at the new one, or joined again
+        this->cpu_.breakpoint_changed(addr);
+    }
+
+    void debugger::watch_reads(uint16_t first, uint16_t last, bool on)
+    {
+        for (uint32_t addr = first; addr <= last; ++addr) {
+            if (!set_bit(this->reads_, (uint16_t)addr, on)) {
+                continue;
+            }
+            uint16_t page = (uint16_t)(addr >> NES_PAGE_SHIFT);
+            if (on && this->read_count_[page]++ == 0) {
+                this->mem_.trap_reads(page);
+            }
+            else if (!on && --this->read_count_[page] == 0) {
+                this->mem_.untrap_reads(page);
+            }
+        }
+    }
+
+    void debugger::watch_writes(uint16_t first, uint16_t last, bool on)
+    {
+        for (uint32_t addr = first; addr <= last; ++addr) {
+            if (!set_bit(this->writes_, (uint16_t)addr, on)) {
+                continue;
+            }
+            uint16_t page = (uint16_t)(addr >> NES_PAGE_SHIFT);
+            if (on && this->write_count_[page]++ == 0) {
+                this->mem_.trap_writes(page);
+            }
+            else if (!on && --this->write_count_[page] == 0) {
+                this->mem_.untrap_writes(page);
+            }
+        }
+    }
+
+    void debugger::clear()
+    {
+        for (uint32_t addr = 0; addr < NES_MAX_RAM; ++addr) {
+            if (bit(this->breaks_, (uint16_t)addr)) {
+                this->set_breakpoint((uint16_t)addr, false);
+            }
+        }
+        this->watch_reads(0, 0xffff, false);
+        this->watch_writes(0, 0xffff, false);
+        this->event_.kind = debug_stop::none;
+    }
+
+    // "C123" or "0300-03FF", false when it is not
+    static bool parse_range(const char *p, uint16_t& first, uint16_t& last)
+    {
+        char *end;
+        unsigned long a = strtoul(p, &end, 16);
+        if (end == p || a > 0xffff) {
+            return false;
+        }
+        unsigned long b = a;
+        if (*end == '-') {
+            p = end + 1;
+            b = strtoul(p, &end, 16);
+            if (end == p || b > 0xffff || b < a) {
+                return false;
+            }
+        }
+        while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n') {
+            ++end;
+        }
+        first = (uint16_t)a;
+        last = (uint16_t)b;
+        return *end == 0;
+    }
+
+    bool debugger::command(const char *cmd)
+    {
+        while (*cmd == ' ' || *cmd == '\t') {
+            ++cmd;
+        }
+        if (strncmp(cmd, "clear", 5) == 0) {
+            this->clear();
+            return true;
+        }
+
+        bool on = true;
+        if (strncmp(cmd, "delete ", 7) == 0) {
+            on = false;
+            cmd += 7;
+        }
+
+        static const struct {
+            const char *name;
+            debug_stop kind;
+        } kinds[] = {
+            { "break ", debug_stop::breakpoint },
+            { "read ",  debug_stop::read },
+            { "write ", debug_stop::write },
+        };
+        for (size_t i = 0; i < arr_len(kinds); ++i) {
+            size_t n = strlen(kinds[i].name);
+            uint16_t first, last;
+            if (strncmp(cmd, kinds[i].name, n) != 0 || !parse_range(cmd + n, first, last)) {
+                continue;
+            }
+            switch (kinds[i].kind) {
+            case debug_stop::breakpoint:
+                for (uint32_t addr = first; addr <= last; ++addr) {
+                    this->set_breakpoint((uint16_t)addr, on);
+                }
+                break;
+            case debug_stop::read:  this->watch_reads(first, last, on); break;
+            default:                this->watch_writes(first, last, on); break;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void debugger::hit(debug_stop kind, uint16_t addr, uint8_t v)
+    {
+        // the first one of the instruction is what stopped it
+        if (this->event_.kind == debug_stop::none) {
+            this->event_.kind = kind;
+            this->event_.addr = addr;
+            this->event_.value = v;
+            this->cpu_.request_break();
+        }
+    }
+
+    void debugger::on_trapped_read(uint16_t addr, uint8_t v)
+    {
+        if (bit(this->reads_, addr)) {
+            this->hit(debug_stop::read, addr, v);
+        }
+    }
+
+    void debugger::on_trapped_write(uint16_t addr, uint8_t v)
+    {
+        if (bit(this->writes_, addr)) {
+            this->hit(debug_stop::write, addr, v);
+        }
+    }
+
+    debug_event debugger::stopped()
+    {
+        debug_event e = this->event_;
+        uint16_t pc = this->cpu_.get_registers().PC;
+        if (e.kind == debug_stop::none) {
+            e.kind = this->breakpoint(pc) ? debug_stop::breakpoint : debug_stop::none;
+            e.addr = pc;
+            e.value = 0;
+        }
+        e.pc = pc;
+        this->event_.kind = debug_stop::none;
+        this->stops_++;
+        return e;
+    }
+
+    void debug_event_text(const debug_event& e, char out[64])
+    {
+        switch (e.kind) {
+        case debug_stop::breakpoint: snprintf(out, 64, "break %04X", e.addr); break;
+        case debug_stop::read:       snprintf(out, 64, "read %04X = %02X, at %04X", e.addr, e.value, e.pc); break;
+        case debug_stop::write:      snprintf(out, 64, "write %04X = %02X, at %04X", e.addr, e.value, e.pc); break;
+        default:                     snprintf(out, 64, "stop at %04X", e.pc); break;
+        }
+    }
+
+    void debugger::test()
+    {
+        static const uint8_t code[] = {
+            0xA2, 0x00,         // 0600 LDX #$00
+            0xE8,               // 0602 loop: INX
+            0x8E, 0x00, 0x03,   // 0603 STX $0300
+            0xAD, 0x00, 0x02,   // 0606 LDA $0200
+            0xE0, 0x05,         // 0609 CPX #$05
+            0xD0, 0xF5,         // 060B BNE loop
+            0xEA,               // 060D NOP
+        };
+        static const dispatch_mode modes[] = {
+            dispatch_mode::switch_case, dispatch_mode::call_table, dispatch_mode::threaded,
+            dispatch_mode::block_cache, dispatch_mode::jit,
+        };
+
+        for (dispatch_mode mode : modes) {
+            memory mem;
+            cpu_6502 cpu(mem);
+            cpu.set_dispatch_mode(mode);
+            cpu.load_code_segment(0x0600, code, sizeof(code));
+            mem.write((uint8_t)0x77, 0x0200);
+            debugger dbg(cpu, mem);
+
+            // the block's own start, where the JIT would loop, and the middle of it
+            bool ok = dbg.command("break 0602") && dbg.command(" break 0609");
+            assert(ok && dbg.breakpoint(0x0609) && !dbg.breakpoint(0x0606));
+            cpu.run();
+            for (int x = 0; x < 5; ++x) {
+                debug_event e = dbg.stopped();
+                assert(e.kind == debug_stop::breakpoint && e.pc == 0x0602 && cpu.get_registers().X == x);
+                int cycles = 1 << 20;
+                uint8_t status = cpu.execute(cycles);
+                e = dbg.stopped();
+                assert(status == (uint8_t)DEBUG_BREAK && e.kind == debug_stop::breakpoint && e.addr == 0x0609);
+                assert(cpu.get_registers().X == x + 1);
+                cycles = 1 << 20;
+                status = cpu.execute(cycles);
+                assert((status == (uint8_t)DEBUG_BREAK) == (x < 4));
+                (void)status;
+            }
+            assert(cpu.get_registers().PC == 0x060E && dbg.stops() == 10);
+
+            // alone at the start of a block that branches back to itself
+            dbg.set_breakpoint(0x0609, false);
+            cpu.run();
+            for (int x = 0; x < 5; ++x) {
+                debug_event e = dbg.stopped();
+                assert(e.kind == debug_stop::breakpoint && e.pc == 0x0602 && cpu.get_registers().X == x);
+                int cycles = 1 << 20;
+                uint8_t status = cpu.execute(cycles);
+                assert((status == (uint8_t)DEBUG_BREAK) == (x < 4));
+                (void)status;
+                (void)e;
+            }
+            assert(cpu.get_registers().PC == 0x060E && dbg.stops() == 15);
+
+            // watches stop after the instruction
+            ok = dbg.command("delete break 0602") && dbg.command("write 0300")
+                 && dbg.command("read 01F0-0200") && !dbg.command("write 0300-02FF") && !dbg.command("jump 0600");
+            assert(ok);
+            cpu.run();
+            for (int x = 1; x <= 5; ++x) {
+                debug_event e = dbg.stopped();
+                assert(e.kind == debug_stop::write && e.addr == 0x0300 && e.value == x && e.pc == 0x0606);
+                int cycles = 1 << 20;
+                uint8_t status = cpu.execute(cycles);
+                e = dbg.stopped();
+                assert(status == (uint8_t)DEBUG_BREAK && e.kind == debug_stop::read && e.value == 0x77 && e.pc == 0x0609);
+                assert(cpu.get_registers().A == 0x77);
+                cycles = 1 << 20;
+                status = cpu.execute(cycles);
+                assert((status == (uint8_t)DEBUG_BREAK) == (x < 5));
+                (void)status;
+                (void)e;
+            }
+            char text[64];
+            debug_event_text(dbg.stopped(), text);
+            assert(strcmp(text, "stop at 060E") == 0);
+
+            // and nothing is left trapped
+            dbg.clear();
+            assert(mem.read_map()[2] != nullptr && mem.write_map()[3] != nullptr);
+            cpu.run();
+            assert(cpu.get_registers().X == 5 && mem.read<uint8_t>(0x0300) == 5);
+            (void)ok;
+        }
+
+        // a console stopped at every OAM DMA makes the same frames as one left alone
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+        console plain;
+        console nes;
+        int err = plain.load(demo.data(), demo.size()) | nes.load(demo.data(), demo.size());
+        assert(err == 0);
+        (void)err;
+        debugger dbg(nes.get_cpu(), nes.get_memory());
+        dbg.command("write 4014");
+        const int frames = 30;
+        for (int f = 0; f < frames; ++f) {
+            plain.run_frame();
+            while (!nes.run_frame()) {
+                assert(!nes.halted());
+                debug_event e = dbg.stopped();
+                assert(e.kind == debug_stop::write && e.addr == 0x4014);
+                (void)e;
+            }
+        }
+        assert(dbg.stops() >= frames - 1);
+        assert(frame_hash(plain.frame()) == frame_hash(nes.frame()));
+    }
+
+}
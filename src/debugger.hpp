@@ -0,0 +1,112 @@
+#ifndef debugger_hpp
+#define debugger_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "memory.hpp"
+#include "cpu_6502.hpp"
+
+
+namespace nes {
+
+    enum class debug_stop : uint8_t {
+        none,
+        breakpoint,     // PC reached a breakpoint, the instruction has not run
+        read,           // an instruction read a watched address and ran to its end
+        write,
+    };
+
+    struct debug_event {
+        debug_stop kind;
+        uint16_t addr;      // the watched address, PC for breakpoints
+        uint8_t value;      // read or written
+        uint16_t pc;        // where the CPU stopped
+    };
+
+    /*
+        Breakpoints and watchpoints that cost nothing where there are
+        none. Breakpoints are a bitmap the CPU looks at where blocks
+        start, see cpu_6502::set_breakpoints. Watching an address traps
+        its page in the memory map, accesses to the page take the slow
+        path and the ones to watched addresses stop the CPU after the
+        instruction. Watches are per address, an access through a mirror
+        is not seen; the interpreters' opcode fetches are reads.
+
+        execute() and console::run_frame() stop on DEBUG_BREAK, stopped()
+        tells why and calling them again goes on from there.
+    */
+    class debugger : public access_trap {
+
+        cpu_6502& cpu_;
+        memory& mem_;
+
+        // a bit per address
+        std::vector<uint8_t> breaks_;
+        std::vector<uint8_t> reads_;
+        std::vector<uint8_t> writes_;
+        size_t break_count_{0};
+        uint16_t read_count_[NES_PAGE_COUNT]{0};
+        uint16_t write_count_[NES_PAGE_COUNT]{0};
+
+        debug_event event_;
+        uint64_t stops_{0};
+
+        static bool bit(const std::vector<uint8_t>& bits, uint16_t addr)
+        {
+            return bits[addr >> 3] >> (addr & 7) & 1;
+        }
+
+        // false when the bit was already so
+        static bool set_bit(std::vector<uint8_t>& bits, uint16_t addr, bool on);
+
+        void hit(debug_stop kind, uint16_t addr, uint8_t v);
+
+    public:
+        debugger(const debugger&) = delete;
+        debugger(debugger&&) = delete;
+        debugger& operator=(const debugger&) = delete;
+        debugger& operator=(debugger&&) = delete;
+
+        debugger(cpu_6502& cpu, memory& mem) noexcept;
+        ~debugger();
+
+        void set_breakpoint(uint16_t addr, bool on = true);
+        // [first, last]
+        void watch_reads(uint16_t first, uint16_t last, bool on = true);
+        void watch_writes(uint16_t first, uint16_t last, bool on = true);
+        void clear();
+
+        bool breakpoint(uint16_t addr) const
+        {
+            return bit(this->breaks_, addr);
+        }
+
+        // "break C123", "read 2002", "write 0300-03FF", "delete break C123",
+        // "delete read 2002", ... "clear"; hex addresses. False when cmd is
+        // none of them
+        bool command(const char *cmd);
+
+        // why the CPU stopped with DEBUG_BREAK, a breakpoint when no watch hit
+        debug_event stopped();
+
+        // stopped() calls
+        uint64_t stops() const
+        {
+            return this->stops_;
+        }
+
+        void on_trapped_read(uint16_t addr, uint8_t v) override;
+        void on_trapped_write(uint16_t addr, uint8_t v) override;
+
+        static void test();
+    };
+
+    // "break C123 at C123" and so on
+    void debug_event_text(const debug_event& e, char out[64]);
+
+}
+
+
+#endif /* debugger_hpp */
@@ -0,0 +1,207 @@
+#include "disasm.hpp"
+#include <cassert>
+#include <cstring>
+
+// where the registers start in a trace line, as in nestest.log
+#define NES_TRACE_REGS_COLUMN 48
+
+
+namespace nes {
+
+    static const char g_hex[] = "0123456789ABCDEF";
+
+    static char* put_hex8(char *p, uint8_t v)
+    {
+        p[0] = g_hex[v >> 4];
+        p[1] = g_hex[v & 0xf];
+        return p + 2;
+    }
+
+    static char* put_hex16(char *p, uint16_t v)
+    {
+        return put_hex8(put_hex8(p, (uint8_t)(v >> 8)), (uint8_t)v);
+    }
+
+    static char* put_str(char *p, const char *s)
+    {
+        while (*s) {
+            *p++ = *s++;
+        }
+        return p;
+    }
+
+    static char* put_dec(char *p, uint64_t v)
+    {
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = (char)('0' + v % 10);
+            v /= 10;
+        } while (v);
+        while (n) {
+            *p++ = digits[--n];
+        }
+        return p;
+    }
+
+    size_t disassemble(uint16_t pc, const uint8_t *bytes, size_t avail, char out[NES_DISASM_SIZE])
+    {
+        out[0] = 0;
+        if (avail == 0) {
+            return 0;
+        }
+        const opcode_info& info = g_opcode_info[bytes[0]];
+        if (avail < info.len) {
+            return 0;
+        }
+
+        char *p = out;
+        if (!info.known) {
+            p = put_hex8(put_str(p, ".DB $"), bytes[0]);
+            *p = 0;
+            return 1;
+        }
+        if (!info.official) {
+            *p++ = '*';
+        }
+        p = put_str(p, info.mnemonic);
+
+        uint16_t abs = info.len == 3 ? (uint16_t)(bytes[1] | bytes[2] << 8) : 0;
+        switch (info.mode) {
+        case addressing_mode::implied:
+            break;
+        case addressing_mode::accumulator:
+            p = put_str(p, " A");
+            break;
+        case addressing_mode::immediate:
+            p = put_hex8(put_str(p, " #$"), bytes[1]);
+            break;
+        case addressing_mode::zero_page:
+            p = put_hex8(put_str(p, " $"), bytes[1]);
+            break;
+        case addressing_mode::zero_page_x:
+            p = put_str(put_hex8(put_str(p, " $"), bytes[1]), ",X");
+            break;
+        case addressing_mode::zero_page_y:
+            p = put_str(put_hex8(put_str(p, " $"), bytes[1]), ",Y");
+            break;
+        case addressing_mode::relative:
+            p = put_hex16(put_str(p, " $"), (uint16_t)(pc + 2 + (int8_t)bytes[1]));
+            break;
+        case addressing_mode::absolute:
+            p = put_hex16(put_str(p, " $"), abs);
+            break;
+        case addressing_mode::absolute_x:
+            p = put_str(put_hex16(put_str(p, " $"), abs), ",X");
+            break;
+        case addressing_mode::absolute_y:
+            p = put_str(put_hex16(put_str(p, " $"), abs), ",Y");
+            break;
+        case addressing_mode::indirect:
+            p = put_str(put_hex16(put_str(p, " ($"), abs), ")");
+            break;
+        case addressing_mode::indirect_x:
+            p = put_str(put_hex8(put_str(p, " ($"), bytes[1]), ",X)");
+            break;
+        case addressing_mode::indirect_y:
+            p = put_str(put_hex8(put_str(p, " ($"), bytes[1]), "),Y");
+            break;
+        }
+        *p = 0;
+        return info.len;
+    }
+
+    size_t trace_format(const trace_regs& r, const uint8_t bytes[3], char out[NES_TRACE_SIZE])
+    {
+        char *p = put_hex16(out, r.PC);
+        *p++ = ' ';
+        *p++ = ' ';
+
+        size_t len = g_opcode_info[bytes[0]].len;
+        for (size_t i = 0; i < 3; ++i) {
+            if (i < len) {
+                p = put_hex8(p, bytes[i]);
+            }
+            else {
+                *p++ = ' ';
+                *p++ = ' ';
+            }
+            *p++ = ' ';
+        }
+
+        // the mnemonic starts at column 16, an unofficial one's '*' right before it
+        char text[NES_DISASM_SIZE];
+        disassemble(r.PC, bytes, 3, text);
+        if (text[0] != '*') {
+            *p++ = ' ';
+        }
+        p = put_str(p, text);
+        while (p < out + NES_TRACE_REGS_COLUMN) {
+            *p++ = ' ';
+        }
+
+        p = put_hex8(put_str(p, "A:"), r.A);
+        p = put_hex8(put_str(p, " X:"), r.X);
+        p = put_hex8(put_str(p, " Y:"), r.Y);
+        p = put_hex8(put_str(p, " P:"), r.P);
+        p = put_hex8(put_str(p, " SP:"), r.SP);
+        p = put_dec(put_str(p, " CYC:"), r.cycles);
+        *p = 0;
+        return (size_t)(p - out);
+    }
+
+    void disasm_test()
+    {
+        static const struct {
+            uint16_t pc;
+            uint8_t bytes[3];
+            size_t len;
+            const char *text;
+        } cases[] = {
+            { 0xc000, { 0x4c, 0xf5, 0xc5 }, 3, "JMP $C5F5" },
+            { 0xc000, { 0x6c, 0xff, 0x02 }, 3, "JMP ($02FF)" },
+            { 0xc000, { 0xa9, 0x12, 0x00 }, 2, "LDA #$12" },
+            { 0xc000, { 0xb1, 0x89, 0x00 }, 2, "LDA ($89),Y" },
+            { 0xc000, { 0x81, 0x80, 0x00 }, 2, "STA ($80,X)" },
+            { 0xc000, { 0xb6, 0x10, 0x00 }, 2, "LDX $10,Y" },
+            { 0xc000, { 0x1e, 0x34, 0x12 }, 3, "ASL $1234,X" },
+            { 0xc000, { 0x0a, 0x00, 0x00 }, 1, "ASL A" },
+            { 0xc000, { 0xea, 0x00, 0x00 }, 1, "NOP" },
+            { 0xc000, { 0x1a, 0x00, 0x00 }, 1, "*NOP" },
+            { 0xc000, { 0x04, 0xa9, 0x00 }, 2, "*NOP $A9" },
+            { 0xc000, { 0x02, 0x00, 0x00 }, 1, ".DB $02" },
+            // forward and backward across a page
+            { 0xc0fd, { 0xd0, 0x03, 0x00 }, 2, "BNE $C102" },
+            { 0xc002, { 0x10, 0xfb, 0x00 }, 2, "BPL $BFFF" },
+        };
+
+        char out[NES_DISASM_SIZE];
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+            size_t len = disassemble(cases[i].pc, cases[i].bytes, 3, out);
+            assert(len == cases[i].len && strcmp(out, cases[i].text) == 0);
+            (void)len;
+        }
+        assert(disassemble(0, cases[0].bytes, 2, out) == 0 && out[0] == 0);
+
+        // every opcode fits, whatever its operand
+        for (int op = 0; op < 256; ++op) {
+            uint8_t bytes[3] = { (uint8_t)op, 0xff, 0xff };
+            size_t len = disassemble(0xfffd, bytes, 3, out);
+            assert(len == g_opcode_info[op].len && strlen(out) < NES_DISASM_SIZE);
+            (void)len;
+        }
+
+        // the first line of nestest.log, less the PPU column
+        char line[NES_TRACE_SIZE];
+        trace_regs r = { 0xc000, 0x00, 0x00, 0x00, 0x24, 0xfd, 7 };
+        size_t n = trace_format(r, cases[0].bytes, line);
+        assert(strcmp(line, "C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:7") == 0);
+        assert(n == strlen(line));
+        uint8_t nop[3] = { 0x04, 0xa9, 0x00 };
+        r.cycles = ~0ull;
+        n = trace_format(r, nop, line);
+        assert(strncmp(line, "C000  04 A9    *NOP $A9", 23) == 0 && n < NES_TRACE_SIZE);
+        (void)n;
+    }
+
+}
@@ -0,0 +1,48 @@
+#ifndef disasm_hpp
+#define disasm_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include "opcode_table.hpp"
+
+// "*NOP $1234,X" and its terminator fit
+#define NES_DISASM_SIZE 16
+// a nestest style trace line and its terminator fit
+#define NES_TRACE_SIZE 112
+
+
+namespace nes {
+
+    /*
+        Both write into a caller's fixed size buffer straight from
+        g_opcode_info, no printf and no allocations, so they are cheap
+        enough to run once per instruction.
+    */
+
+    // the instruction in bytes as assembly, "LDA ($12),Y", unofficial opcodes
+    // with a leading '*', unknown ones as ".DB $02"; pc is where it sits, for
+    // branch targets. Returns its length, 0 and "" when avail is shorter.
+    size_t disassemble(uint16_t pc, const uint8_t *bytes, size_t avail, char out[NES_DISASM_SIZE]);
+
+    struct trace_regs {
+        uint16_t PC;
+        uint8_t A;
+        uint8_t X;
+        uint8_t Y;
+        uint8_t P;
+        uint8_t SP;
+        uint64_t cycles;
+    };
+
+    // "C000  4C F5 C5  JMP $C5F5    ...    A:00 X:00 Y:00 P:24 SP:FD CYC:7",
+    // the columns of nestest.log without the PPU position and the operand
+    // values; bytes holds the 3 bytes at PC. Returns the length of the line.
+    size_t trace_format(const trace_regs& r, const uint8_t bytes[3], char out[NES_TRACE_SIZE]);
+
+    void disasm_test();
+
+}
+
+
+#endif /* disasm_hpp */
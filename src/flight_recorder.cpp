@@ -0,0 +1,310 @@
+#include "flight_recorder.hpp"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <sstream>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "cpu_6502.hpp"
+
+
+namespace nes {
+
+    // the recorder execute() runs with on this thread, for the signal handlers
+    static thread_local flight_recorder *g_active_recorder = nullptr;
+
+    static const int g_fatal_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+    flight_recorder::flight_recorder(size_t records) noexcept
+    {
+        size_t n = 1;
+        while (n < records) {
+            n <<= 1;
+        }
+        this->ring_.resize(n);
+        this->blocks_.resize(n);
+        this->mask_ = n - 1;
+    }
+
+    flight_recorder::~flight_recorder()
+    {
+        if (g_active_recorder == this) {
+            g_active_recorder = nullptr;
+        }
+    }
+
+    size_t flight_recorder::snapshot(trace_record *out, size_t max) const
+    {
+        // the slot after the newest record is the one the writer fills next
+        uint64_t head = this->head_.load(std::memory_order_acquire);
+        uint64_t n = head < this->mask_ ? head : this->mask_;
+        n = n < max ? n : max;
+        uint64_t first = head - n;
+        for (uint64_t i = 0; i < n; ++i) {
+            out[i] = this->ring_[(first + i) & this->mask_];
+        }
+        return (size_t)n;
+    }
+
+    static char* put_text(char *p, const char *s)
+    {
+        while (*s) {
+            *p++ = *s++;
+        }
+        return p;
+    }
+
+    static char* put_number(char *p, uint64_t v)
+    {
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = (char)('0' + v % 10);
+            v /= 10;
+        } while (v);
+        while (n) {
+            *p++ = digits[--n];
+        }
+        return p;
+    }
+
+    // all of it, write() may take less; no stdio, this runs in signal handlers
+    static bool write_all(int fd, const char *p, size_t n)
+    {
+        while (n) {
+            ssize_t w = ::write(fd, p, n);
+            if (w <= 0) {
+                return false;
+            }
+            p += w;
+            n -= (size_t)w;
+        }
+        return true;
+    }
+
+    bool flight_recorder::dump(const char *reason)
+    {
+        if (this->fd_ < 0 || this->dumps_ >= NES_FLIGHT_DUMPS) {
+            return false;
+        }
+        this->dumps_++;
+
+        uint64_t head = this->head_.load(std::memory_order_acquire);
+        uint64_t n = head < this->ring_.size() ? head : this->ring_.size();
+
+        char line[NES_TRACE_SIZE + 64];
+        char *p = put_text(line, "flight recorder: ");
+        p = put_text(p, reason);
+        p = put_text(p, ", last ");
+        p = put_number(p, n);
+        p = put_text(p, " of ");
+        p = put_number(p, head);
+        p = put_text(p, " records\n");
+        if (!write_all(this->fd_, line, (size_t)(p - line))) {
+            return false;
+        }
+
+        for (uint64_t i = head - n; i < head; ++i) {
+            size_t len = trace_text(this->ring_[i & this->mask_], line);
+            uint32_t entered = this->blocks_[i & this->mask_];
+            if (entered) {
+                char *p = put_text(line + len, " ; block entry");
+                if (entered > 1) {
+                    p = put_number(put_text(p, " x"), entered);
+                }
+                len = (size_t)(p - line);
+            }
+            line[len++] = '\n';
+            if (!write_all(this->fd_, line, len)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    flight_recorder* flight_recorder::activate(flight_recorder *r)
+    {
+        flight_recorder *prev = g_active_recorder;
+        g_active_recorder = r;
+        return prev;
+    }
+
+    static void on_fatal_signal(int sig)
+    {
+        flight_recorder *r = g_active_recorder;
+        if (r) {
+            char reason[32];
+            *put_number(put_text(reason, "signal "), (uint64_t)sig) = 0;
+            r->dump(reason);
+        }
+        // the handler was reset on entry, this takes the default action
+        raise(sig);
+    }
+
+    void flight_recorder::install_signal_handlers()
+    {
+        static std::atomic<bool> installed{false};
+        if (installed.exchange(true)) {
+            return;
+        }
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_fatal_signal;
+        sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        for (int sig : g_fatal_signals) {
+            sigaction(sig, &sa, nullptr);
+        }
+    }
+
+    // what fd got since it was at offset from, at most size - 1 bytes
+    static size_t read_back(int fd, off_t from, char *buf, size_t size)
+    {
+        ssize_t n = pread(fd, buf, size - 1, from);
+        n = n < 0 ? 0 : n;
+        buf[n] = 0;
+        return (size_t)n;
+    }
+
+    void flight_recorder::test()
+    {
+        FILE *f = tmpfile();
+        assert(f != nullptr);
+        int fd = fileno(f);
+        static char text[(NES_TRACE_SIZE + 1) * 64];
+
+        // rounding, wrapping, the newest records oldest first
+        {
+            flight_recorder r(12);
+            assert(r.capacity() == 16);
+            trace_record out[32];
+            assert(r.snapshot(out, 32) == 0);
+            for (uint32_t i = 0; i < 40; ++i) {
+                r.record((uint16_t)(0x8000 + i), 0xea, (uint8_t)i, 0, 0, 0x24, 0xfd, 7 + i);
+            }
+            assert(r.records() == 40);
+            size_t n = r.snapshot(out, 32);
+            assert(n == 15 && out[0].pc == 0x8000 + 25 && out[14].pc == 0x8000 + 39);
+            assert(trace_cycles(out[14]) == 46 && out[14].A == 39 && out[14].bytes[0] == 0xea);
+            n = r.snapshot(out, 3);
+            assert(n == 3 && out[0].pc == 0x8000 + 37);
+
+            // a header and a line per record, then nothing after NES_FLIGHT_DUMPS
+            r.set_fd(fd);
+            off_t at = lseek(fd, 0, SEEK_END);
+            bool ok = r.dump("test");
+            assert(ok);
+            read_back(fd, at, text, sizeof(text));
+            assert(strncmp(text, "flight recorder: test, last 16 of 40 records\n8018  EA        NOP", 64) == 0);
+            assert(strstr(text, "8017  EA") == nullptr && strstr(text, "block entry") == nullptr);
+            assert(strstr(text, "8027  EA        NOP") != nullptr);
+            for (int i = 1; i < NES_FLIGHT_DUMPS; ++i) {
+                ok = r.dump("again");
+                assert(ok);
+            }
+            at = lseek(fd, 0, SEEK_END);
+            ok = r.dump("quiet");
+            assert(!ok && lseek(fd, 0, SEEK_END) == at);
+            r.clear();
+            assert(r.records() == 0 && r.snapshot(out, 32) == 0);
+            (void)ok;
+            (void)n;
+        }
+
+        // the CPU dumps on an unknown opcode, whatever the dispatch mode,
+        // every backend recording the entry of every block and marking
+        // those in the dump
+        static const uint8_t code[] = {
+            0xA2, 0x03,         // LDX #$03
+            0xCA,               // loop: DEX
+            0xD0, 0xFD,         // BNE loop
+            0xA9, 0x42,         // LDA #$42
+            0x02,               // unknown
+        };
+        static const dispatch_mode modes[] = {
+            dispatch_mode::switch_case, dispatch_mode::call_table, dispatch_mode::threaded,
+            dispatch_mode::block_cache, dispatch_mode::jit,
+        };
+        for (dispatch_mode mode : modes) {
+            memory mem;
+            cpu_6502 cpu(mem);
+            flight_recorder r;
+            r.set_fd(fd);
+            std::ostringstream log;
+            cpu.set_log(&log);
+            cpu.set_flight_recorder(&r);
+            cpu.set_dispatch_mode(mode);
+            cpu.load_code_segment(0x0600, code, sizeof(code));
+            off_t at = lseek(fd, 0, SEEK_END);
+            cpu.run();
+            assert(log.str() == "error instruction: 0x2\n");
+
+            trace_record out[16];
+            size_t n = r.snapshot(out, 16);
+            // the DEX loop is one record, entered twice in a row; the JIT stays in its block
+            assert(n == 3 && out[0].pc == 0x0600 && out[2].pc == 0x0605 && out[2].X == 0);
+            assert(out[1].pc == 0x0602 && out[1].X == 2 && trace_cycles(out[1]) - trace_cycles(out[0]) == 7);
+            read_back(fd, at, text, sizeof(text));
+            assert(strncmp(text, "flight recorder: unknown opcode $02 at $0607, ", 46) == 0);
+            char last[NES_TRACE_SIZE];
+            trace_text(out[n - 1], last);
+            const char *at_last = strstr(text, last);
+            assert(at_last != nullptr);
+            assert(strcmp(at_last + strlen(last), " ; block entry\n") == 0);
+            trace_text(out[1], last);
+            const char *at_loop = strstr(text, last);
+            assert(at_loop != nullptr);
+            const char *tail = mode == dispatch_mode::jit ? " ; block entry\n" : " ; block entry x2\n";
+            assert(strncmp(at_loop + strlen(last), tail, strlen(tail)) == 0);
+            (void)at_loop;
+            (void)tail;
+            (void)at_last;
+            assert(flight_recorder::activate(nullptr) == nullptr);
+            (void)n;
+        }
+
+        // BRK only when asked to
+        {
+            static const uint8_t brk[] = { 0xA9, 0x01, 0x00, 0xEA };
+            memory mem;
+            cpu_6502 cpu(mem);
+            flight_recorder r;
+            r.set_fd(fd);
+            cpu.load_code_segment(0x0600, brk, sizeof(brk));
+            cpu.set_flight_recorder(&r, false);
+            off_t at = lseek(fd, 0, SEEK_END);
+            cpu.run();
+            assert(r.records() == 1 && lseek(fd, 0, SEEK_END) == at);
+            cpu.set_flight_recorder(&r);
+            cpu.run();
+            read_back(fd, at, text, sizeof(text));
+            // the second run enters the same block again
+            assert(strncmp(text, "flight recorder: BRK, last 1 of 1 records\n0600", 46) == 0);
+        }
+
+        // a fatal signal dumps the active recorder before the process dies
+        fflush(stdout);
+        off_t at = lseek(fd, 0, SEEK_END);
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            flight_recorder r;
+            r.set_fd(fd);
+            r.record(0xc000, 0x4c, 0, 0, 0, 0x24, 0xfd, 7);
+            flight_recorder::install_signal_handlers();
+            flight_recorder::activate(&r);
+            raise(SIGSEGV);
+            _exit(0);
+        }
+        int wstatus = 0;
+        waitpid(pid, &wstatus, 0);
+        assert(WIFSIGNALED(wstatus) && WTERMSIG(wstatus) == SIGSEGV);
+        read_back(fd, at, text, sizeof(text));
+        assert(strncmp(text, "flight recorder: signal 11, last 1 of 1 records\nC000  4C", 56) == 0);
+
+        fclose(f);
+    }
+
+}
@@ -0,0 +1,133 @@
+#ifndef flight_recorder_hpp
+#define flight_recorder_hpp
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+#include "trace.hpp"
+
+// instructions held, a power of two
+#define NES_FLIGHT_RECORDS 1024
+// dumps a recorder writes before it goes quiet, a BRK loop would flood the log
+#define NES_FLIGHT_DUMPS 4
+
+
+namespace nes {
+
+    /*
+        Where the CPU has been lately, always on: a ring of
+        trace_records overwritten oldest first, no I/O and no formatting
+        while running. The records are plain memory: snapshot() and dump()
+        belong to the thread that runs the CPU, or to another one once
+        that CPU is stopped and the handoff synchronized (a join, a lock).
+
+        cpu_6502 dumps the ring on an unknown opcode or BRK; during
+        execute() the recorder is the thread's active one, and the
+        handlers install_signal_handlers() sets up dump it on a fatal
+        signal before the process dies. dump() only formats into a stack
+        buffer and write()s, so it is safe in a signal handler.
+
+        The CPU records only the blocks it enters, where execute()
+        starts and the instruction after every branch, jump or return,
+        whatever the dispatch mode. That costs a straight line of code
+        nothing but leaves the instructions in between out; dump() marks
+        those records "; block entry" so the gaps are not mistaken for
+        jumps. A block entered again right after itself, a loop on one
+        block, is counted on its first record rather than recorded
+        again, so a wait loop neither floods the ring nor pays for a
+        record per pass.
+    */
+    class flight_recorder {
+
+        std::vector<trace_record> ring_;
+        // times the block in ring_ was entered in a row, 0 where the record is not a block entry
+        std::vector<uint32_t> blocks_;
+        uint64_t mask_;
+        std::atomic<uint64_t> head_{0};
+        // pc of the newest record when it is a block entry, above 0xffff otherwise
+        uint32_t last_block_{0x10000};
+        int fd_{2};
+        int dumps_{0};
+
+    public:
+        flight_recorder(const flight_recorder&) = delete;
+        flight_recorder(flight_recorder&&) = delete;
+        flight_recorder& operator=(const flight_recorder&) = delete;
+        flight_recorder& operator=(flight_recorder&&) = delete;
+
+        // records is rounded up to a power of two
+        explicit flight_recorder(size_t records = NES_FLIGHT_RECORDS) noexcept;
+        ~flight_recorder();
+
+        // see trace_store; block for the first instruction of a block run without records
+        void record(uint16_t pc, uint32_t bytes, uint8_t a, uint8_t x, uint8_t y, uint8_t p, uint8_t sp,
+                    uint64_t cycles, bool block = false)
+        {
+            uint64_t head = this->head_.load(std::memory_order_relaxed);
+            trace_store(&this->ring_[head & this->mask_], pc, bytes, a, x, y, p, sp, cycles);
+            this->blocks_[head & this->mask_] = block;
+            this->last_block_ = block ? pc : 0x10000;
+            // a signal handler on this thread sees the record whole
+            this->head_.store(head + 1, std::memory_order_release);
+        }
+
+        // true when pc is the block entry recorded last, which then counts
+        // one more entry; the caller records it as a new block otherwise
+        bool repeat_block(uint16_t pc)
+        {
+            if (pc != this->last_block_) {
+                return false;
+            }
+            this->blocks_[(this->head_.load(std::memory_order_relaxed) - 1) & this->mask_]++;
+            return true;
+        }
+
+        // records ever made
+        uint64_t records() const
+        {
+            return this->head_.load(std::memory_order_acquire);
+        }
+
+        size_t capacity() const
+        {
+            return this->ring_.size();
+        }
+
+        // up to max of the newest records into out, oldest first, at most
+        // capacity() - 1 of them; not while another thread records
+        size_t snapshot(trace_record *out, size_t max) const;
+
+        // where dump() writes, stderr by default, -1 for nowhere
+        void set_fd(int fd)
+        {
+            this->fd_ = fd;
+        }
+
+        // a line with reason, then the ring as nestest.log lines, block
+        // entries marked with how many times in a row they were entered
+        // when more than once; false when there is no fd or
+        // NES_FLIGHT_DUMPS were written already
+        bool dump(const char *reason);
+
+        void clear()
+        {
+            this->head_.store(0, std::memory_order_release);
+            this->last_block_ = 0x10000;
+            this->dumps_ = 0;
+        }
+
+        // the recorder a fatal signal on this thread dumps, returns the one before
+        static flight_recorder* activate(flight_recorder *r);
+
+        // SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT dump the active
+        // recorder, then the default action runs; once per process
+        static void install_signal_handlers();
+
+        static void test();
+    };
+
+}
+
+
+#endif /* flight_recorder_hpp */
@@ -0,0 +1,1362 @@
+#include "jit_x64.hpp"
+#include <algorithm>
+#include "cpu_6502.hpp"
+#include "flight_recorder.hpp"
+
+#if NES_JIT_X64
+#include <sys/mman.h>
+#endif
+
+
+namespace nes {
+
+#if NES_JIT_X64
+
+    enum x64_reg {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15,
+    };
+
+    enum x64_cc {
+        CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+        CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G,
+    };
+
+    enum x64_alu {
+        ALU_ADD, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP,
+    };
+
+    enum x64_shift {
+        SHIFT_ROL = 0, SHIFT_ROR = 1, SHIFT_RCL = 2, SHIFT_RCR = 3, SHIFT_SHL = 4, SHIFT_SHR = 5,
+    };
+
+    struct x64_mem {
+        int base;
+        int index;      // -1: none
+        int scale;      // log2
+        int32_t disp;
+    };
+
+    static x64_mem x64_at(int base, int32_t disp)
+    {
+        x64_mem m = { base, -1, 0, disp };
+        return m;
+    }
+
+    static x64_mem x64_at(int base, int index, int scale)
+    {
+        x64_mem m = { base, index, scale, 0 };
+        return m;
+    }
+
+    // just enough of an x86-64 assembler for the translator below
+    class x64_emitter {
+
+        std::vector<uint8_t> buf_;
+
+        static bool is_imm8(int32_t v)
+        {
+            return v >= -128 && v <= 127;
+        }
+
+        void rex(bool w, int reg, int index, int base, bool byte_regs)
+        {
+            uint8_t r = 0x40 | (w ? 0x08 : 0) | ((reg >> 3) & 1) << 2 | ((index >> 3) & 1) << 1 | ((base >> 3) & 1);
+            if (r != 0x40 || byte_regs) {
+                this->byte(r);
+            }
+        }
+
+        void rex(bool w, int reg, const x64_mem& m, bool byte_reg)
+        {
+            this->rex(w, reg, m.index < 0 ? 0 : m.index, m.base, byte_reg && reg >= RSP && reg <= RDI);
+        }
+
+        void rex_rr(bool w, int reg, int rm, bool byte_regs)
+        {
+            bool need = byte_regs && ((reg >= RSP && reg <= RDI) || (rm >= RSP && rm <= RDI));
+            this->rex(w, reg, 0, rm, need);
+        }
+
+        void modrm_reg(int reg, int rm)
+        {
+            this->byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+        }
+
+        void operand(int reg, const x64_mem& m)
+        {
+            bool short_disp = is_imm8(m.disp);
+            uint8_t mod = short_disp ? 0x40 : 0x80;
+
+            if (m.index < 0) {
+                this->byte(mod | (reg & 7) << 3 | (m.base & 7));
+                if ((m.base & 7) == RSP) {
+                    this->byte(0x24);
+                }
+            }
+            else {
+                if (m.disp == 0 && (m.base & 7) != RBP) {
+                    mod = 0x00;
+                }
+                this->byte(mod | (reg & 7) << 3 | 0x04);
+                this->byte(m.scale << 6 | (m.index & 7) << 3 | (m.base & 7));
+                if (mod == 0x00) {
+                    return;
+                }
+            }
+
+            if (short_disp) {
+                this->byte((uint8_t)m.disp);
+            }
+            else {
+                this->imm32(m.disp);
+            }
+        }
+
+    public:
+        size_t pos() const
+        {
+            return this->buf_.size();
+        }
+
+        const std::vector<uint8_t>& code() const
+        {
+            return this->buf_;
+        }
+
+        void byte(uint8_t b)
+        {
+            this->buf_.push_back(b);
+        }
+
+        void imm16(uint16_t v)
+        {
+            this->byte(v & 0xff);
+            this->byte(v >> 8);
+        }
+
+        void imm32(uint32_t v)
+        {
+            for (int i = 0; i < 4; ++i) {
+                this->byte((v >> (i * 8)) & 0xff);
+            }
+        }
+
+        void imm64(uint64_t v)
+        {
+            for (int i = 0; i < 8; ++i) {
+                this->byte((v >> (i * 8)) & 0xff);
+            }
+        }
+
+        void movzx_r32_m8(int dst, const x64_mem& m)
+        {
+            this->rex(false, dst, m, false);
+            this->byte(0x0f);
+            this->byte(0xb6);
+            this->operand(dst, m);
+        }
+
+        void movzx_r32_r8(int dst, int src)
+        {
+            this->rex_rr(false, dst, src, true);
+            this->byte(0x0f);
+            this->byte(0xb6);
+            this->modrm_reg(dst, src);
+        }
+
+        void mov_m8_r8(const x64_mem& m, int src)
+        {
+            this->rex(false, src, m, true);
+            this->byte(0x88);
+            this->operand(src, m);
+        }
+
+        void mov_m8_imm8(const x64_mem& m, uint8_t imm)
+        {
+            this->rex(false, 0, m, false);
+            this->byte(0xc6);
+            this->operand(0, m);
+            this->byte(imm);
+        }
+
+        void mov_m16_imm16(const x64_mem& m, uint16_t imm)
+        {
+            this->byte(0x66);
+            this->rex(false, 0, m, false);
+            this->byte(0xc7);
+            this->operand(0, m);
+            this->imm16(imm);
+        }
+
+        void mov_m16_r16(const x64_mem& m, int src)
+        {
+            this->byte(0x66);
+            this->rex(false, src, m, false);
+            this->byte(0x89);
+            this->operand(src, m);
+        }
+
+        void mov_r32_imm32(int dst, uint32_t imm)
+        {
+            this->rex(false, 0, 0, dst, false);
+            this->byte(0xb8 | (dst & 7));
+            this->imm32(imm);
+        }
+
+        void mov_r64_imm64(int dst, uint64_t imm)
+        {
+            this->rex(true, 0, 0, dst, false);
+            this->byte(0xb8 | (dst & 7));
+            this->imm64(imm);
+        }
+
+        void mov_r32_r32(int dst, int src)
+        {
+            this->rex_rr(false, src, dst, false);
+            this->byte(0x89);
+            this->modrm_reg(src, dst);
+        }
+
+        void mov_r64_r64(int dst, int src)
+        {
+            this->rex_rr(true, src, dst, false);
+            this->byte(0x89);
+            this->modrm_reg(src, dst);
+        }
+
+        void mov_r64_m64(int dst, const x64_mem& m)
+        {
+            this->rex(true, dst, m, false);
+            this->byte(0x8b);
+            this->operand(dst, m);
+        }
+
+        void alu_r32_imm(x64_alu op, int dst, int32_t imm)
+        {
+            this->rex(false, 0, 0, dst, false);
+            this->byte(is_imm8(imm) ? 0x83 : 0x81);
+            this->modrm_reg(op, dst);
+            if (is_imm8(imm)) {
+                this->byte((uint8_t)imm);
+            }
+            else {
+                this->imm32(imm);
+            }
+        }
+
+        void alu_r32_r32(x64_alu op, int dst, int src)
+        {
+            this->rex_rr(false, src, dst, false);
+            this->byte(op << 3 | 0x01);
+            this->modrm_reg(src, dst);
+        }
+
+        void alu_r8_r8(x64_alu op, int dst, int src)
+        {
+            this->rex_rr(false, src, dst, true);
+            this->byte(op << 3);
+            this->modrm_reg(src, dst);
+        }
+
+        void alu_r64_imm(x64_alu op, int dst, int32_t imm)
+        {
+            this->rex(true, 0, 0, dst, false);
+            this->byte(is_imm8(imm) ? 0x83 : 0x81);
+            this->modrm_reg(op, dst);
+            if (is_imm8(imm)) {
+                this->byte((uint8_t)imm);
+            }
+            else {
+                this->imm32(imm);
+            }
+        }
+
+        void alu_m32_imm(x64_alu op, const x64_mem& m, int32_t imm)
+        {
+            this->rex(false, 0, m, false);
+            this->byte(is_imm8(imm) ? 0x83 : 0x81);
+            this->operand(op, m);
+            if (is_imm8(imm)) {
+                this->byte((uint8_t)imm);
+            }
+            else {
+                this->imm32(imm);
+            }
+        }
+
+        void alu_m32_r32(x64_alu op, const x64_mem& m, int src)
+        {
+            this->rex(false, src, m, false);
+            this->byte(op << 3 | 0x01);
+            this->operand(src, m);
+        }
+
+        void alu_m64_imm(x64_alu op, const x64_mem& m, int32_t imm)
+        {
+            this->rex(true, 0, m, false);
+            this->byte(is_imm8(imm) ? 0x83 : 0x81);
+            this->operand(op, m);
+            if (is_imm8(imm)) {
+                this->byte((uint8_t)imm);
+            }
+            else {
+                this->imm32(imm);
+            }
+        }
+
+        void alu_m8_imm8(x64_alu op, const x64_mem& m, uint8_t imm)
+        {
+            this->rex(false, 0, m, false);
+            this->byte(0x80);
+            this->operand(op, m);
+            this->byte(imm);
+        }
+
+        void alu_m8_r8(x64_alu op, const x64_mem& m, int src)
+        {
+            this->rex(false, src, m, true);
+            this->byte(op << 3);
+            this->operand(src, m);
+        }
+
+        void test_r64_r64(int a, int b)
+        {
+            this->rex_rr(true, b, a, false);
+            this->byte(0x85);
+            this->modrm_reg(b, a);
+        }
+
+        void test_m8_imm8(const x64_mem& m, uint8_t imm)
+        {
+            this->rex(false, 0, m, false);
+            this->byte(0xf6);
+            this->operand(0, m);
+            this->byte(imm);
+        }
+
+        void shift_r8_1(x64_shift op, int reg)
+        {
+            this->rex_rr(false, 0, reg, true);
+            this->byte(0xd0);
+            this->modrm_reg(op, reg);
+        }
+
+        void shift_r32_imm(x64_shift op, int reg, uint8_t imm)
+        {
+            this->rex(false, 0, 0, reg, false);
+            this->byte(0xc1);
+            this->modrm_reg(op, reg);
+            this->byte(imm);
+        }
+
+        void inc_r8(int reg)
+        {
+            this->rex_rr(false, 0, reg, true);
+            this->byte(0xfe);
+            this->modrm_reg(0, reg);
+        }
+
+        void dec_r8(int reg)
+        {
+            this->rex_rr(false, 0, reg, true);
+            this->byte(0xfe);
+            this->modrm_reg(1, reg);
+        }
+
+        void setcc(x64_cc cc, int reg)
+        {
+            this->rex_rr(false, 0, reg, true);
+            this->byte(0x0f);
+            this->byte(0x90 | cc);
+            this->modrm_reg(0, reg);
+        }
+
+        void cmov_r32_r32(x64_cc cc, int dst, int src)
+        {
+            this->rex_rr(false, dst, src, false);
+            this->byte(0x0f);
+            this->byte(0x40 | cc);
+            this->modrm_reg(dst, src);
+        }
+
+        size_t jcc(x64_cc cc)
+        {
+            this->byte(0x0f);
+            this->byte(0x80 | cc);
+            this->imm32(0);
+            return this->pos() - 4;
+        }
+
+        size_t jmp()
+        {
+            this->byte(0xe9);
+            this->imm32(0);
+            return this->pos() - 4;
+        }
+
+        void jmp_to(size_t target)
+        {
+            size_t at = this->jmp();
+            this->patch(at, target);
+        }
+
+        void patch(size_t at, size_t target)
+        {
+            int32_t rel = (int32_t)(target - (at + 4));
+            for (int i = 0; i < 4; ++i) {
+                this->buf_[at + i] = (rel >> (i * 8)) & 0xff;
+            }
+        }
+
+        void call(const void *fn)
+        {
+            this->mov_r64_imm64(RAX, (uint64_t)(uintptr_t)fn);
+            this->byte(0xff);
+            this->byte(0xd0);
+        }
+
+        void push(int reg)
+        {
+            this->rex(false, 0, 0, reg, false);
+            this->byte(0x50 | (reg & 7));
+        }
+
+        void pop(int reg)
+        {
+            this->rex(false, 0, 0, reg, false);
+            this->byte(0x58 | (reg & 7));
+        }
+
+        void cmc()
+        {
+            this->byte(0xf5);
+        }
+
+        void ret()
+        {
+            this->byte(0xc3);
+        }
+    };
+
+
+#define NES_JIT_MODES(X) \
+    X(implied) X(accumulator) X(immediate) X(zero_page) X(zero_page_x) X(zero_page_y) X(relative) \
+    X(absolute) X(absolute_x) X(absolute_y) X(indirect) X(indirect_x) X(indirect_y)
+
+#define NES_JIT_OPS(X) \
+    X(ADC) X(AND) X(ASL) X(ASLA) X(BCC) X(BCS) X(BEQ) X(BIT) X(BMI) X(BNE) X(BPL) X(BRK) \
+    X(BVC) X(BVS) X(CLC) X(CLD) X(CLI) X(CLV) X(CMP) X(CPX) X(CPY) X(DEC) X(DEX) X(DEY) X(EOR) \
+    X(INC) X(INX) X(INY) X(JMP) X(JSR) X(LDA) X(LDX) X(LDY) X(LSR) X(LSRA) X(NOP) X(ORA) \
+    X(PHA) X(PHP) X(PLA) X(PLP) X(ROL) X(ROLA) X(ROR) X(RORA) X(RTI) X(RTS) X(SBC) X(SEC) \
+    X(SED) X(SEI) X(STA) X(STX) X(STY) X(TAX) X(TAY) X(TSX) X(TXA) X(TXS) X(TYA) X(ILL)
+
+#define NES_JIT_ENUM_MODE(mode) jit_mode_##mode,
+#define NES_JIT_ENUM_OP(op) jit_op_##op,
+
+    enum jit_mode {
+        NES_JIT_MODES(NES_JIT_ENUM_MODE)
+    };
+
+    enum jit_op {
+        NES_JIT_OPS(NES_JIT_ENUM_OP)
+    };
+
+    struct jit_opcode {
+        uint8_t op;
+        uint8_t mode;
+        uint8_t len;
+        uint8_t cycles;
+        uint8_t page_penalty;
+    };
+
+#define NES_JIT_OPCODE(code, mode, op, cyc) \
+    { jit_op_##op, jit_mode_##mode, 1 + NES_OPERAND_LEN(mode), cyc, g_opcode_info[code].page_penalty },
+#define NES_JIT_ILL(code) { jit_op_ILL, jit_mode_implied, 1, 0, 0 },
+
+    static const jit_opcode g_jit_opcodes[256] = {
+        NES_OPCODE_TABLE(NES_JIT_OPCODE, NES_JIT_OPCODE, NES_JIT_ILL)
+    };
+
+    typedef uint32_t (*jit_step_fn)(jit_frame *frame);
+    typedef uint32_t (*jit_read_fn)(jit_frame *frame, uint32_t addr);
+    typedef void (*jit_write_fn)(jit_frame *frame, uint32_t addr, uint32_t value);
+
+    // fields of registers::P, one byte each
+    typedef decltype(registers::P) jit_status;
+    static const size_t p_carry = offsetof(jit_status, carry_flag);
+    static const size_t p_overflow = offsetof(jit_status, overflow_flag);
+    static const size_t p_n_result = offsetof(jit_status, n_result);
+    static const size_t p_z_result = offsetof(jit_status, z_result);
+    static const size_t p_interrupt = offsetof(jit_status, interrupt_disable);
+    static const size_t p_decimal = offsetof(jit_status, decimal_mode);
+
+    struct jit_exit {
+        size_t patch;
+        bool set_pc;
+        uint16_t pc;
+        uint32_t count;
+        bool keep_status;
+    };
+
+    // translation of one block, register use in the generated code:
+    //   rbx registers*, r12 read map, r13 jit_frame*, r15 write map
+    //   eax value, edx effective address, ecx/r8d/esi scratch
+    //   r14d temporary kept across helper calls, ebp saves edx in load()
+    class jit_translator {
+
+        x64_emitter& e_;
+        jit_step_fn step_;
+        jit_read_fn read_;
+        jit_write_fn write_;
+        std::vector<jit_exit> exits_;
+        int add_cycles_known_{-1};
+        size_t body_start_{0};
+        uint16_t block_start_{0};
+        bool loops_{true};
+
+        static x64_mem reg(size_t offset)
+        {
+            return x64_at(RBX, (int32_t)offset);
+        }
+
+        static x64_mem frame(size_t offset)
+        {
+            return x64_at(R13, (int32_t)offset);
+        }
+
+        static x64_mem flag(size_t offset)
+        {
+            return reg(offsetof(registers, P) + offset);
+        }
+
+    public:
+        jit_translator(x64_emitter& e, uint16_t start, jit_step_fn step, jit_read_fn read, jit_write_fn write)
+        :e_(e), step_(step), read_(read), write_(write), block_start_(start)
+        {
+        }
+
+        // back to the dispatcher instead of jumping to the block start, to see a breakpoint there
+        void no_loops()
+        {
+            this->loops_ = false;
+        }
+
+        void exit(size_t patch, bool set_pc, uint16_t pc, uint32_t count, bool keep_status = false)
+        {
+            jit_exit x = { patch, set_pc, pc, count, keep_status };
+            this->exits_.push_back(x);
+        }
+
+        void prologue()
+        {
+            this->e_.push(RBX);
+            this->e_.push(R12);
+            this->e_.push(R13);
+            this->e_.push(R14);
+            this->e_.push(RBP);
+            this->e_.push(R15);
+            // keep the stack 16 byte aligned for the helper calls
+            this->e_.alu_r64_imm(ALU_SUB, RSP, 8);
+            this->e_.mov_r64_r64(R13, RDI);
+            this->e_.mov_r64_m64(RBX, frame(offsetof(jit_frame, reg)));
+            this->e_.mov_r64_m64(R12, frame(offsetof(jit_frame, read_map)));
+            this->e_.mov_r64_m64(R15, frame(offsetof(jit_frame, write_map)));
+            this->body_start_ = this->e_.pos();
+        }
+
+        void epilogue()
+        {
+            std::vector<size_t> to_epilogue;
+
+            for (size_t i = 0; i < this->exits_.size(); ++i) {
+                const jit_exit& x = this->exits_[i];
+                this->e_.patch(x.patch, this->e_.pos());
+                if (x.set_pc) {
+                    this->e_.mov_m16_imm16(reg(offsetof(registers, PC)), x.pc);
+                }
+                if (x.count) {
+                    this->e_.alu_m64_imm(ALU_ADD, frame(offsetof(jit_frame, instructions)), x.count);
+                }
+                if (!x.keep_status) {
+                    this->e_.alu_r32_r32(ALU_XOR, RAX, RAX);
+                }
+                to_epilogue.push_back(this->e_.jmp());
+            }
+
+            for (size_t i = 0; i < to_epilogue.size(); ++i) {
+                this->e_.patch(to_epilogue[i], this->e_.pos());
+            }
+            this->e_.alu_r64_imm(ALU_ADD, RSP, 8);
+            this->e_.pop(R15);
+            this->e_.pop(RBP);
+            this->e_.pop(R14);
+            this->e_.pop(R13);
+            this->e_.pop(R12);
+            this->e_.pop(RBX);
+            this->e_.ret();
+        }
+
+        void set_add_cycles(int value)
+        {
+            if (this->add_cycles_known_ != value) {
+                this->e_.mov_m8_imm8(frame(offsetof(jit_frame, add_cycles)), (uint8_t)value);
+                this->add_cycles_known_ = value;
+            }
+        }
+
+        void forget_add_cycles()
+        {
+            this->add_cycles_known_ = -1;
+        }
+
+        void sub_cycles(int n)
+        {
+            this->e_.alu_m32_imm(ALU_SUB, frame(offsetof(jit_frame, cycles)), n);
+        }
+
+        // cross_page_cycles: effective address in edx against the base in base_reg, or
+        // against base when that is -1
+        void page_penalty(int base_reg, uint16_t base)
+        {
+            this->e_.mov_r32_r32(RCX, RDX);
+            if (base_reg >= 0) {
+                this->e_.alu_r32_r32(ALU_XOR, RCX, base_reg);
+                this->e_.shift_r32_imm(SHIFT_SHR, RCX, 8);
+            }
+            else {
+                this->e_.shift_r32_imm(SHIFT_SHR, RCX, 8);
+                this->e_.alu_r32_imm(ALU_CMP, RCX, base >> 8);
+            }
+            this->e_.setcc(CC_NE, RCX);
+            this->e_.movzx_r32_r8(RCX, RCX);
+            this->e_.alu_m32_r32(ALU_SUB, frame(offsetof(jit_frame, cycles)), RCX);
+            this->e_.mov_m8_r8(frame(offsetof(jit_frame, add_cycles)), RCX);
+            this->forget_add_cycles();
+        }
+
+        // effective address into edx, operand value into eax; the page penalty is
+        // only charged when penalty is set, see g_opcode_info
+        void operand(uint8_t mode, uint16_t operand, bool penalty, bool need_value)
+        {
+            switch (mode) {
+            case jit_mode_immediate:
+                this->e_.mov_r32_imm32(RAX, operand);
+                this->set_add_cycles(0);
+                return;
+            case jit_mode_zero_page:
+            case jit_mode_absolute:
+                this->e_.mov_r32_imm32(RDX, operand);
+                this->set_add_cycles(0);
+                break;
+            case jit_mode_zero_page_x:
+            case jit_mode_zero_page_y:
+                this->e_.movzx_r32_m8(RDX, reg(mode == jit_mode_zero_page_x ? offsetof(registers, X) : offsetof(registers, Y)));
+                this->e_.alu_r32_imm(ALU_ADD, RDX, operand);
+                this->e_.alu_r32_imm(ALU_AND, RDX, 0xff);
+                this->set_add_cycles(0);
+                break;
+            case jit_mode_absolute_x:
+            case jit_mode_absolute_y:
+                this->e_.movzx_r32_m8(RDX, reg(mode == jit_mode_absolute_x ? offsetof(registers, X) : offsetof(registers, Y)));
+                this->e_.alu_r32_imm(ALU_ADD, RDX, operand);
+                this->e_.alu_r32_imm(ALU_AND, RDX, 0xffff);
+                if (penalty) {
+                    this->page_penalty(-1, operand);
+                }
+                else {
+                    this->set_add_cycles(0);
+                }
+                break;
+            case jit_mode_indirect_x:
+                this->e_.movzx_r32_m8(RDX, reg(offsetof(registers, X)));
+                this->e_.alu_r32_imm(ALU_ADD, RDX, operand);
+                this->e_.alu_r32_imm(ALU_AND, RDX, 0xff);
+                this->load();
+                this->e_.mov_r32_r32(R14, RAX);
+                this->e_.alu_r32_imm(ALU_ADD, RDX, 1);
+                this->e_.alu_r32_imm(ALU_AND, RDX, 0xff);
+                this->load();
+                this->e_.shift_r32_imm(SHIFT_SHL, RAX, 8);
+                this->e_.alu_r32_r32(ALU_OR, RAX, R14);
+                this->e_.mov_r32_r32(RDX, RAX);
+                this->set_add_cycles(0);
+                break;
+            case jit_mode_indirect_y:
+                this->e_.mov_r32_imm32(RDX, operand);
+                this->load();
+                this->e_.mov_r32_r32(R14, RAX);
+                this->e_.mov_r32_imm32(RDX, (operand + 1) & 0xff);
+                this->load();
+                this->e_.shift_r32_imm(SHIFT_SHL, RAX, 8);
+                this->e_.alu_r32_r32(ALU_OR, RAX, R14);
+                this->e_.mov_r32_r32(RDX, RAX);
+                this->e_.movzx_r32_m8(RCX, reg(offsetof(registers, Y)));
+                this->e_.alu_r32_r32(ALU_ADD, RDX, RCX);
+                this->e_.alu_r32_imm(ALU_AND, RDX, 0xffff);
+                if (penalty) {
+                    this->page_penalty(RAX, 0);
+                }
+                else {
+                    this->set_add_cycles(0);
+                }
+                break;
+            default:
+                this->set_add_cycles(0);
+                return;
+            }
+
+            if (need_value) {
+                this->load();
+            }
+        }
+
+        // byte at the address in edx into eax, edx survives
+        void load()
+        {
+            this->e_.mov_r32_r32(RCX, RDX);
+            this->e_.shift_r32_imm(SHIFT_SHR, RCX, NES_PAGE_SHIFT);
+            this->e_.mov_r64_m64(RCX, x64_at(R12, RCX, 3));
+            this->e_.test_r64_r64(RCX, RCX);
+            size_t slow = this->e_.jcc(CC_E);
+            this->e_.mov_r32_r32(RSI, RDX);
+            this->e_.alu_r32_imm(ALU_AND, RSI, NES_PAGE_MASK);
+            this->e_.movzx_r32_m8(RAX, x64_at(RCX, RSI, 0));
+            size_t done = this->e_.jmp();
+
+            this->e_.patch(slow, this->e_.pos());
+            this->e_.mov_r32_r32(RBP, RDX);
+            this->e_.mov_r32_r32(RSI, RDX);
+            this->e_.mov_r64_r64(RDI, R13);
+            this->e_.call((const void *)this->read_);
+            this->e_.mov_r32_r32(RDX, RBP);
+
+            this->e_.patch(done, this->e_.pos());
+        }
+
+        // al to the address in edx, through write_helper unless the page is plain writable memory.
+        // The instruction's cycles are charged after the write so I/O sees the
+        // timestamp of the instruction start, like the interpreter.
+        void store(uint16_t next_pc, uint32_t count, int cycles)
+        {
+            this->e_.mov_r32_r32(RCX, RDX);
+            this->e_.shift_r32_imm(SHIFT_SHR, RCX, NES_PAGE_SHIFT);
+            this->e_.mov_r64_m64(RCX, x64_at(R15, RCX, 3));
+            this->e_.test_r64_r64(RCX, RCX);
+            size_t slow = this->e_.jcc(CC_E);
+            this->e_.mov_r32_r32(RSI, RDX);
+            this->e_.alu_r32_imm(ALU_AND, RSI, NES_PAGE_MASK);
+            this->e_.mov_m8_r8(x64_at(RCX, RSI, 0), RAX);
+            this->sub_cycles(cycles);
+            size_t done = this->e_.jmp();
+
+            this->e_.patch(slow, this->e_.pos());
+            this->e_.mov_r32_r32(RSI, RDX);
+            this->e_.movzx_r32_r8(RDX, RAX);
+            this->e_.mov_r64_r64(RDI, R13);
+            this->e_.call((const void *)this->write_);
+            this->sub_cycles(cycles);
+            this->e_.alu_m8_imm8(ALU_CMP, frame(offsetof(jit_frame, invalidated)), 0);
+            this->exit(this->e_.jcc(CC_NE), true, next_pc, count);
+
+            this->e_.patch(done, this->e_.pos());
+        }
+
+        // N and Z are kept as the result byte, see registers::P
+        void nz_flags_from(int reg8)
+        {
+            this->e_.mov_m8_r8(flag(p_n_result), reg8);
+            this->e_.mov_m8_r8(flag(p_z_result), reg8);
+        }
+
+        // host carry of the last ALU instruction, inverted for borrows
+        void carry_from_host(bool invert_carry)
+        {
+            this->e_.setcc(invert_carry ? CC_AE : CC_B, R8);
+            this->e_.mov_m8_r8(flag(p_carry), R8);
+        }
+
+        void load_carry()
+        {
+            this->e_.movzx_r32_m8(RCX, flag(p_carry));
+            this->e_.shift_r32_imm(SHIFT_SHR, RCX, 1);
+        }
+
+        void loop_back(uint32_t count)
+        {
+            if (!this->loops_) {
+                this->exit(this->e_.jmp(), true, this->block_start_, count);
+                return;
+            }
+            this->e_.alu_m64_imm(ALU_ADD, frame(offsetof(jit_frame, instructions)), count);
+            this->e_.alu_m32_imm(ALU_CMP, frame(offsetof(jit_frame, cycles)), 0);
+            this->exit(this->e_.jcc(CC_LE), true, this->block_start_, 0);
+            this->e_.jmp_to(this->body_start_);
+        }
+
+        void fallback(uint16_t pc, uint32_t count, bool ends)
+        {
+            this->e_.mov_m16_imm16(reg(offsetof(registers, PC)), pc);
+            this->e_.mov_r64_r64(RDI, R13);
+            this->e_.call((const void *)this->step_);
+            this->e_.alu_r32_r32(ALU_OR, RAX, RAX);
+            this->exit(this->e_.jcc(CC_NE), false, 0, count, true);
+            this->forget_add_cycles();
+            if (ends) {
+                this->exit(this->e_.jmp(), false, 0, count);
+                return;
+            }
+            this->e_.alu_m8_imm8(ALU_CMP, frame(offsetof(jit_frame, invalidated)), 0);
+            this->exit(this->e_.jcc(CC_NE), false, 0, count);
+        }
+
+        // returns true when the instruction ends the block
+        bool instruction(const jit_opcode& info, uint16_t pc, uint16_t operand, uint16_t next_pc, uint32_t count);
+    };
+
+    bool jit_translator::instruction(const jit_opcode& info, uint16_t pc, uint16_t operand, uint16_t next_pc,
+                                     uint32_t count)
+    {
+        static const size_t reg_a = offsetof(registers, A);
+        static const size_t reg_x = offsetof(registers, X);
+        static const size_t reg_y = offsetof(registers, Y);
+        static const size_t reg_sp = offsetof(registers, SP);
+
+        x64_emitter& e = this->e_;
+
+        switch (info.op) {
+        case jit_op_LDA:
+        case jit_op_LDX:
+        case jit_op_LDY:
+            this->operand(info.mode, operand, info.page_penalty, true);
+            e.mov_m8_r8(reg(info.op == jit_op_LDA ? reg_a : info.op == jit_op_LDX ? reg_x : reg_y), RAX);
+            this->nz_flags_from(RAX);
+            this->sub_cycles(info.cycles);
+            return false;
+
+        case jit_op_STA:
+        case jit_op_STX:
+        case jit_op_STY:
+            this->operand(info.mode, operand, info.page_penalty, false);
+            e.movzx_r32_m8(RAX, reg(info.op == jit_op_STA ? reg_a : info.op == jit_op_STX ? reg_x : reg_y));
+            this->store(next_pc, count, info.cycles);
+            return false;
+
+        case jit_op_TAX: case jit_op_TAY: case jit_op_TXA:
+        case jit_op_TYA: case jit_op_TSX: case jit_op_TXS: {
+            size_t src = info.op == jit_op_TAX || info.op == jit_op_TAY ? reg_a
+                       : info.op == jit_op_TXA || info.op == jit_op_TXS ? reg_x
+                       : info.op == jit_op_TYA ? reg_y : reg_sp;
+            size_t dst = info.op == jit_op_TAX || info.op == jit_op_TSX ? reg_x
+                       : info.op == jit_op_TAY ? reg_y
+                       : info.op == jit_op_TXS ? reg_sp : reg_a;
+            this->set_add_cycles(0);
+            e.movzx_r32_m8(RAX, reg(src));
+            e.mov_m8_r8(reg(dst), RAX);
+            if (info.op != jit_op_TXS) {
+                this->nz_flags_from(RAX);
+            }
+            this->sub_cycles(info.cycles);
+            return false;
+        }
+
+        case jit_op_INX: case jit_op_INY: case jit_op_DEX: case jit_op_DEY: {
+            size_t r = info.op == jit_op_INX || info.op == jit_op_DEX ? reg_x : reg_y;
+            this->set_add_cycles(0);
+            e.movzx_r32_m8(RAX, reg(r));
+            if (info.op == jit_op_INX || info.op == jit_op_INY) {
+                e.inc_r8(RAX);
+            }
+            else {
+                e.dec_r8(RAX);
+            }
+            e.mov_m8_r8(reg(r), RAX);
+            this->nz_flags_from(RAX);
+            this->sub_cycles(info.cycles);
+            return false;
+        }
+
+        case jit_op_INC:
+        case jit_op_DEC:
+            this->operand(info.mode, operand, info.page_penalty, true);
+            if (info.op == jit_op_INC) {
+                e.inc_r8(RAX);
+            }
+            else {
+                e.dec_r8(RAX);
+            }
+            this->nz_flags_from(RAX);
+            this->store(next_pc, count, info.cycles);
+            return false;
+
+        case jit_op_ORA:
+        case jit_op_AND:
+        case jit_op_EOR:
+            this->operand(info.mode, operand, info.page_penalty, true);
+            e.movzx_r32_m8(RCX, reg(reg_a));
+            e.alu_r8_r8(info.op == jit_op_ORA ? ALU_OR : info.op == jit_op_AND ? ALU_AND : ALU_XOR, RCX, RAX);
+            e.mov_m8_r8(reg(reg_a), RCX);
+            this->nz_flags_from(RCX);
+            this->sub_cycles(info.cycles);
+            return false;
+
+        case jit_op_ADC:
+        case jit_op_SBC:
+            this->operand(info.mode, operand, info.page_penalty, true);
+            this->load_carry();
+            if (info.op == jit_op_SBC) {
+                e.cmc();
+            }
+            e.movzx_r32_m8(RCX, reg(reg_a));
+            e.alu_r8_r8(info.op == jit_op_ADC ? ALU_ADC : ALU_SBB, RCX, RAX);
+            e.setcc(CC_O, RSI);
+            this->carry_from_host(info.op == jit_op_SBC);
+            e.mov_m8_r8(flag(p_overflow), RSI);
+            e.mov_m8_r8(reg(reg_a), RCX);
+            this->nz_flags_from(RCX);
+            this->sub_cycles(info.cycles);
+            return false;
+
+        case jit_op_CMP:
+        case jit_op_CPX:
+        case jit_op_CPY:
+            this->operand(info.mode, operand, info.page_penalty, true);
+            e.movzx_r32_m8(RCX, reg(info.op == jit_op_CMP ? reg_a : info.op == jit_op_CPX ? reg_x : reg_y));
+            e.alu_r8_r8(ALU_SUB, RCX, RAX);
+            this->carry_from_host(true);
+            this->nz_flags_from(RCX);
+            this->sub_cycles(info.cycles);
+            return false;
+
+        case jit_op_BIT:
+            this->operand(info.mode, operand, info.page_penalty, true);
+            e.mov_m8_r8(flag(p_n_result), RAX);
+            e.mov_r32_r32(RSI, RAX);
+            e.shift_r32_imm(SHIFT_SHR, RSI, 6);
+            e.alu_r32_imm(ALU_AND, RSI, 1);
+            e.mov_m8_r8(flag(p_overflow), RSI);
+            e.movzx_r32_m8(RCX, reg(reg_a));
+            e.alu_r32_r32(ALU_AND, RCX, RAX);
+            e.mov_m8_r8(flag(p_z_result), RCX);
+            this->sub_cycles(info.cycles);
+            return false;
+
+        case jit_op_ASLA:
+        case jit_op_LSRA:
+        case jit_op_ASL:
+        case jit_op_LSR: {
+            bool acc = info.op == jit_op_ASLA || info.op == jit_op_LSRA;
+            if (acc) {
+                this->set_add_cycles(0);
+                e.movzx_r32_m8(RAX, reg(reg_a));
+            }
+            else {
+                this->operand(info.mode, operand, info.page_penalty, true);
+            }
+            e.shift_r8_1(info.op == jit_op_ASLA || info.op == jit_op_ASL ? SHIFT_SHL : SHIFT_SHR, RAX);
+            this->carry_from_host(false);
+            if (acc) {
+                e.mov_m8_r8(reg(reg_a), RAX);
+            }
+            this->nz_flags_from(RAX);
+            if (acc) {
+                this->sub_cycles(info.cycles);
+            }
+            else {
+                this->store(next_pc, count, info.cycles);
+            }
+            return false;
+        }
+
+        case jit_op_ROLA:
+        case jit_op_ROL: {
+            bool acc = info.op == jit_op_ROLA;
+            if (acc) {
+                this->set_add_cycles(0);
+                e.movzx_r32_m8(RAX, reg(reg_a));
+            }
+            else {
+                this->operand(info.mode, operand, info.page_penalty, true);
+            }
+            e.movzx_r32_m8(RCX, flag(p_carry));
+            e.mov_r32_r32(RSI, RAX);
+            e.shift_r32_imm(SHIFT_SHR, RSI, 7);
+            e.shift_r8_1(SHIFT_SHL, RAX);
+            e.alu_r8_r8(ALU_OR, RAX, RCX);
+            if (acc) {
+                e.mov_m8_r8(reg(reg_a), RAX);
+            }
+            this->nz_flags_from(RAX);
+            e.mov_m8_r8(flag(p_carry), RSI);
+            if (acc) {
+                this->sub_cycles(info.cycles);
+            }
+            else {
+                this->store(next_pc, count, info.cycles);
+            }
+            return false;
+        }
+
+        case jit_op_CLC: case jit_op_CLD: case jit_op_CLI: case jit_op_CLV:
+        case jit_op_SEC: case jit_op_SEI: case jit_op_SED: {
+            size_t field = info.op == jit_op_CLC || info.op == jit_op_SEC ? p_carry
+                         : info.op == jit_op_CLI || info.op == jit_op_SEI ? p_interrupt
+                         : info.op == jit_op_CLD || info.op == jit_op_SED ? p_decimal : p_overflow;
+            bool set = info.op == jit_op_SEC || info.op == jit_op_SEI || info.op == jit_op_SED;
+            this->set_add_cycles(0);
+            e.mov_m8_imm8(flag(field), set ? 1 : 0);
+            this->sub_cycles(info.cycles);
+            return false;
+        }
+
+        case jit_op_NOP:
+            this->operand(info.mode, operand, info.page_penalty, false);
+            this->sub_cycles(info.cycles);
+            return false;
+
+        case jit_op_BPL: case jit_op_BMI: case jit_op_BVC: case jit_op_BVS:
+        case jit_op_BCC: case jit_op_BCS: case jit_op_BNE: case jit_op_BEQ: {
+            uint16_t offset = operand & 0x80 ? operand - 0x100 : operand;
+            uint16_t target = next_pc + offset;
+            // cpu_6502::take_branch, nothing extra when not taken
+            int taken_cycles = (target >> 8) != (next_pc >> 8) ? 2 : 1;
+            bool when_set = info.op == jit_op_BMI || info.op == jit_op_BVS || info.op == jit_op_BCS || info.op == jit_op_BEQ;
+
+            this->set_add_cycles(0);
+            this->sub_cycles(info.cycles);
+
+            // host condition for "flag set"
+            x64_cc set_cc = CC_NE;
+            if (info.op == jit_op_BPL || info.op == jit_op_BMI) {
+                e.test_m8_imm8(flag(p_n_result), FLAG_NEGATIVE);
+            }
+            else if (info.op == jit_op_BNE || info.op == jit_op_BEQ) {
+                e.alu_m8_imm8(ALU_CMP, flag(p_z_result), 0);
+                set_cc = CC_E;
+            }
+            else {
+                e.alu_m8_imm8(ALU_CMP, flag(info.op == jit_op_BVC || info.op == jit_op_BVS ? p_overflow : p_carry), 0);
+            }
+            x64_cc taken = when_set ? set_cc : (x64_cc)(set_cc ^ 1);
+
+            if (target == this->block_start_) {
+                size_t not_taken = e.jcc((x64_cc)(taken ^ 1));
+                e.mov_m8_imm8(frame(offsetof(jit_frame, add_cycles)), (uint8_t)taken_cycles);
+                this->sub_cycles(taken_cycles);
+                this->loop_back(count);
+                this->exit(not_taken, true, next_pc, count);
+            }
+            else {
+                e.mov_r32_imm32(RAX, next_pc);
+                e.mov_r32_imm32(RCX, target);
+                e.cmov_r32_r32(taken, RAX, RCX);
+                e.mov_m16_r16(reg(offsetof(registers, PC)), RAX);
+                e.setcc(taken, RCX);
+                e.movzx_r32_r8(RCX, RCX);
+                if (taken_cycles == 2) {
+                    e.shift_r32_imm(SHIFT_SHL, RCX, 1);
+                }
+                e.alu_m32_r32(ALU_SUB, frame(offsetof(jit_frame, cycles)), RCX);
+                e.mov_m8_r8(frame(offsetof(jit_frame, add_cycles)), RCX);
+                this->exit(e.jmp(), false, 0, count);
+            }
+            this->forget_add_cycles();
+            return true;
+        }
+
+        case jit_op_JMP:
+            if (info.mode != jit_mode_absolute) {
+                this->fallback(pc, count, true);
+                return true;
+            }
+            this->set_add_cycles(0);
+            this->sub_cycles(info.cycles);
+            if (operand == this->block_start_) {
+                this->loop_back(count);
+            }
+            else {
+                this->exit(e.jmp(), true, operand, count);
+            }
+            return true;
+
+        case jit_op_BRK: case jit_op_JSR: case jit_op_RTS: case jit_op_RTI: case jit_op_ILL:
+            this->fallback(pc, count, true);
+            return true;
+
+        default:
+            // stack ops and ROR run on the interpreter
+            this->fallback(pc, count, false);
+            return false;
+        }
+    }
+
+
+    uint32_t jit_x64::step_helper(jit_frame *frame)
+    {
+        cpu_6502& cpu = *frame->cpu;
+
+        cpu.add_cycles_ = frame->add_cycles;
+        uint8_t status = cpu.eval(frame->cycles);
+        frame->cycles -= cpu.add_cycles_;
+        frame->add_cycles = cpu.add_cycles_;
+        return status;
+    }
+
+    uint32_t jit_x64::read_helper(jit_frame *frame, uint32_t addr)
+    {
+        return frame->cpu->mem_.read<uint8_t>((uint16_t)addr);
+    }
+
+    void jit_x64::write_helper(jit_frame *frame, uint32_t addr, uint32_t value)
+    {
+        frame->cpu->mem_.write((uint8_t)value, (uint16_t)addr);
+        // cpu_6502::end_run(), leave the block right after this store
+        if (frame->cycles <= 0) {
+            frame->invalidated = 1;
+        }
+    }
+
+    jit_x64::jit_x64(cpu_6502& cpu, memory& m) noexcept
+    :cpu_(cpu), mem_(m)
+    {
+    }
+
+    bool jit_x64::prepare()
+    {
+        if (this->arena_) {
+            return true;
+        }
+        void *p = mmap(nullptr, NES_JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        this->arena_ = (uint8_t *)p;
+        this->blocks_.resize(NES_MAX_RAM);
+        return true;
+    }
+
+    jit_x64::~jit_x64()
+    {
+        if (this->arena_) {
+            this->flush();
+            munmap(this->arena_, NES_JIT_ARENA_SIZE);
+        }
+    }
+
+    jit_block_fn jit_x64::translate(uint16_t pc)
+    {
+        x64_emitter e;
+        jit_translator t(e, pc, &jit_x64::step_helper, &jit_x64::read_helper, &jit_x64::write_helper);
+        t.prologue();
+        if (this->cpu_.breakpoint(pc)) {
+            t.no_loops();
+        }
+
+        uint32_t addr = pc;
+        uint32_t count = 0;
+        while (true) {
+            if (count == NES_MAX_BLOCK_OPS || addr >= this->pc_limit_ || (count > 0 && this->cpu_.breakpoint(addr))) {
+                t.exit(e.jmp(), true, (uint16_t)addr, count);
+                break;
+            }
+
+            const jit_opcode& info = g_jit_opcodes[this->mem_.read<uint8_t>(addr)];
+            if (addr + info.len > NES_MAX_RAM) {
+                if (count == 0) {
+                    return nullptr;
+                }
+                t.exit(e.jmp(), true, (uint16_t)addr, count);
+                break;
+            }
+
+            uint16_t operand = 0;
+            if (info.len == 2) {
+                operand = this->mem_.read<uint8_t>(addr + 1);
+            }
+            else if (info.len == 3) {
+                operand = this->mem_.read<uint16_t>(addr + 1);
+            }
+
+            uint16_t next_pc = (uint16_t)(addr + info.len);
+            count++;
+            bool ends = t.instruction(info, (uint16_t)addr, operand, next_pc, count);
+            addr += info.len;
+            if (ends) {
+                break;
+            }
+
+            e.alu_m32_imm(ALU_CMP, x64_at(R13, offsetof(jit_frame, cycles)), 0);
+            t.exit(e.jcc(CC_LE), true, next_pc, count);
+        }
+
+        t.epilogue();
+
+        const std::vector<uint8_t>& code = e.code();
+        if (this->arena_used_ + code.size() > NES_JIT_ARENA_SIZE) {
+            this->flush();
+        }
+        uint8_t *dst = this->arena_ + this->arena_used_;
+        memcpy(dst, code.data(), code.size());
+        this->arena_used_ += (code.size() + 15) & ~(size_t)15;
+
+        jit_block& block = this->blocks_[pc];
+        block.fn = (jit_block_fn)(void *)dst;
+        block.end = addr;
+
+        uint32_t first_page = pc >> NES_PAGE_SHIFT;
+        uint32_t last_page = (addr - 1) >> NES_PAGE_SHIFT;
+        for (uint32_t page = first_page; page <= last_page; ++page) {
+            this->page_blocks_[page].push_back(pc);
+            this->mem_.watch_page(page);
+        }
+
+        return block.fn;
+    }
+
+    void jit_x64::retire(uint16_t start)
+    {
+        jit_block& block = this->blocks_[start];
+
+        uint32_t first_page = start >> NES_PAGE_SHIFT;
+        uint32_t last_page = (block.end - 1) >> NES_PAGE_SHIFT;
+        for (uint32_t page = first_page; page <= last_page; ++page) {
+            std::vector<uint16_t>& list = this->page_blocks_[page];
+            list.erase(std::find(list.begin(), list.end(), start));
+            this->mem_.unwatch_page(page);
+        }
+
+        block.fn = nullptr;
+        block.end = 0;
+    }
+
+    void jit_x64::invalidate(uint16_t addr)
+    {
+        std::vector<uint16_t>& list = this->page_blocks_[addr >> NES_PAGE_SHIFT];
+
+        for (size_t i = list.size(); i > 0; --i) {
+            uint16_t start = list[i - 1];
+            if (start <= addr && addr < this->blocks_[start].end) {
+                this->retire(start);
+                if (this->active_frame_) {
+                    this->active_frame_->invalidated = 1;
+                }
+            }
+        }
+    }
+
+    void jit_x64::invalidate_page(uint16_t page)
+    {
+        std::vector<uint16_t>& list = this->page_blocks_[page];
+
+        if (!list.empty() && this->active_frame_) {
+            this->active_frame_->invalidated = 1;
+        }
+        while (!list.empty()) {
+            this->retire(list.back());
+        }
+    }
+
+    void jit_x64::flush()
+    {
+        for (size_t page = 0; page < NES_PAGE_COUNT; ++page) {
+            while (!this->page_blocks_[page].empty()) {
+                this->retire(this->page_blocks_[page].back());
+            }
+        }
+        this->arena_used_ = 0;
+    }
+
+    uint8_t jit_x64::execute(int& cycles)
+    {
+        if (this->pc_limit_ != this->cpu_.pc_limit_) {
+            this->flush();
+            this->pc_limit_ = this->cpu_.pc_limit_;
+        }
+
+        registers& reg = this->cpu_.reg_;
+
+        jit_frame frame;
+        frame.cpu = &this->cpu_;
+        frame.reg = &reg;
+        frame.read_map = this->mem_.read_map();
+        frame.write_map = this->mem_.write_map();
+        frame.cycles = cycles;
+        frame.add_cycles = this->cpu_.add_cycles_;
+        frame.invalidated = 0;
+        frame.instructions = 0;
+        this->active_frame_ = &frame;
+        int *live_cycles = this->cpu_.live_cycles_;
+        this->cpu_.live_cycles_ = &frame.cycles;
+
+        flight_recorder *recorder = this->cpu_.recorder_;
+        uint32_t status = 0;
+        while (status == 0 && frame.cycles > 0 && reg.PC < this->pc_limit_) {
+            if (this->cpu_.breakpoints_ && this->cpu_.at_breakpoint()) {
+                status = (uint8_t)DEBUG_BREAK;
+                break;
+            }
+
+            jit_block_fn fn = this->blocks_[reg.PC].fn;
+            if (fn == nullptr) {
+                fn = this->translate(reg.PC);
+            }
+
+            // block entries only, the code in between runs without a look back
+            if (recorder) {
+                this->cpu_.record_block(frame.cycles);
+            }
+
+            frame.invalidated = 0;
+            if (fn == nullptr) {
+                status = step_helper(&frame);
+                frame.instructions++;
+            }
+            else {
+                status = fn(&frame);
+            }
+        }
+
+        this->active_frame_ = nullptr;
+        this->cpu_.live_cycles_ = live_cycles;
+        cycles = frame.cycles;
+        this->cpu_.add_cycles_ = frame.add_cycles;
+        this->cpu_.instructions_ += frame.instructions;
+        return (uint8_t)status;
+    }
+
+#else
+
+    jit_x64::jit_x64(cpu_6502& cpu, memory& m) noexcept
+    :cpu_(cpu), mem_(m)
+    {
+    }
+
+    jit_x64::~jit_x64()
+    {
+    }
+
+    bool jit_x64::prepare()
+    {
+        return false;
+    }
+
+    uint8_t jit_x64::execute(int& cycles)
+    {
+        return 0;
+    }
+
+    void jit_x64::invalidate(uint16_t addr)
+    {
+    }
+
+    void jit_x64::invalidate_page(uint16_t page)
+    {
+    }
+
+    void jit_x64::flush()
+    {
+    }
+
+#endif
+
+}
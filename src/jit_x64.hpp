@@ -0,0 +1,107 @@
+#ifndef jit_x64_hpp
+#define jit_x64_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "memory.hpp"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define NES_JIT_X64 1
+#else
+#define NES_JIT_X64 0
+#endif
+
+#define NES_JIT_ARENA_SIZE (4 << 20)
+
+
+namespace nes {
+
+    class cpu_6502;
+    struct registers;
+
+    // state shared between the C++ loop and the generated code
+    struct jit_frame {
+        cpu_6502 *cpu;
+        registers *reg;
+        uint8_t * const *read_map;
+        uint8_t * const *write_map;
+        int32_t cycles;
+        uint8_t add_cycles;
+        uint8_t invalidated;
+        uint64_t instructions;
+    };
+
+    typedef uint32_t (*jit_block_fn)(jit_frame *frame);
+
+    struct jit_block {
+        jit_block_fn fn;
+        uint32_t end;
+    };
+
+    /*
+        Translates 6502 basic blocks starting at reg_.PC into x86-64 code.
+
+        Loads, stores, ALU, flag, transfer and branch instructions are
+        emitted natively, everything else calls back into cpu_6502::eval.
+        Register, flag and cycle semantics (including cross_page_cycles)
+        follow the interpreter exactly, cpu_6502::test() runs it next to
+        the other backends.
+
+        Memory accesses go through the page table of memory: a direct
+        pointer is used inline, anything else calls back into memory.
+        Blocks watch the pages they were read from, a write into
+        [start, end) or a remap of the page drops the block like the
+        block cache does.
+    */
+    class jit_x64 {
+
+        cpu_6502& cpu_;
+        memory& mem_;
+
+        uint8_t *arena_{nullptr};
+        size_t arena_used_{0};
+
+        std::vector<jit_block> blocks_;
+        std::vector<uint16_t> page_blocks_[NES_PAGE_COUNT];
+        uint32_t pc_limit_{0};
+        jit_frame *active_frame_{nullptr};
+
+        jit_block_fn translate(uint16_t pc);
+        void retire(uint16_t start);
+
+        static uint32_t step_helper(jit_frame *frame);
+        static uint32_t read_helper(jit_frame *frame, uint32_t addr);
+        static void write_helper(jit_frame *frame, uint32_t addr, uint32_t value);
+
+    public:
+        jit_x64() = delete;
+        jit_x64(const jit_x64&) = delete;
+        jit_x64(jit_x64&&) = delete;
+        jit_x64& operator=(const jit_x64&) = delete;
+        jit_x64& operator=(jit_x64&&) = delete;
+
+        jit_x64(cpu_6502& cpu, memory& m) noexcept;
+        ~jit_x64();
+
+        // maps the code arena and the block table on the first call, a cpu
+        // that never runs the JIT doesn't pay for them; false without one
+        bool prepare();
+
+        bool available() const
+        {
+            return this->arena_ != nullptr;
+        }
+
+        uint8_t execute(int& cycles);
+
+        void invalidate(uint16_t addr);
+        void invalidate_page(uint16_t page);
+        void flush();
+    };
+
+}
+
+
+#endif /* jit_x64_hpp */
@@ -1,17 +1,483 @@
 #include <iostream>
 #include <vector>
 #include <unordered_map>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <memory>
 #include "memory.hpp"
 #include "cpu_6502.hpp"
+#include "disasm.hpp"
+#include "bench.hpp"
+#include "cartridge.hpp"
+#include "mapper.hpp"
+#include "ppu.hpp"
+#include "apu.hpp"
+#include "console.hpp"
+#include "work_pool.hpp"
+#include "batch.hpp"
+#include "cpu_6502_soa.hpp"
+#include "state.hpp"
+#include "rewind.hpp"
+#include "movie.hpp"
+#include "trace.hpp"
+#include "flight_recorder.hpp"
+#include "profiler.hpp"
+#include "debugger.hpp"
+#include "ppu_thread.hpp"
+#include "audio.hpp"
+#include "video.hpp"
 
 
 
 
+// "-" is the bench demo ROM, which has to outlive the console
+static int load_rom(nes::console& nes, const char *rom, std::vector<uint8_t>& demo)
+{
+    if (strcmp(rom, "-") == 0) {
+        nes::bench_demo_rom(demo);
+        return nes.load(demo.data(), demo.size());
+    }
+    return nes.load(rom);
+}
+
+// rom, batch style input file or "-", frames, movie, keyframe interval
+static int movie_record(int argc, const char * argv[])
+{
+    std::vector<uint8_t> demo;
+    std::vector<uint8_t> buttons;
+    std::unique_ptr<nes::console> nes(new nes::console());
+    int err = load_rom(*nes, argv[2], demo);
+    err = err ? err : nes::batch_read_input(argv[3], buttons);
+    if (err != 0) {
+        std::cout << "can not record: " << err << std::endl;
+        return 1;
+    }
+
+    nes::movie m(argc > 6 ? (uint32_t)atoi(argv[6]) : NES_MOVIE_INTERVAL);
+    m.start(*nes);
+    // the input holds its last value once it runs out, like batch jobs
+    size_t pairs = buttons.size() / 2;
+    int frames = atoi(argv[4]);
+    for (int f = 0; f < frames; ++f) {
+        size_t i = (size_t)f < pairs ? f : pairs - 1;
+        if (!m.record(*nes, pairs ? buttons[2 * i] : 0, pairs ? buttons[2 * i + 1] : 0)) {
+            break;
+        }
+    }
+    err = m.save(argv[5]);
+    if (err != 0) {
+        std::cout << "can not write " << argv[5] << ": " << err << std::endl;
+        return 1;
+    }
+    printf("%u frames, %zu keyframes, last frame %08x\n", m.frames(), m.keyframes(), nes::frame_hash(nes->frame()));
+    return 0;
+}
+
+// rom, movie, the frame to seek to or the whole movie
+static int movie_play(int argc, const char * argv[])
+{
+    std::vector<uint8_t> demo;
+    std::unique_ptr<nes::console> nes(new nes::console());
+    nes::movie m;
+    int err = load_rom(*nes, argv[2], demo);
+    err = err ? err : m.load(argv[3]);
+    if (err != 0) {
+        std::cout << "can not play " << argv[3] << ": " << err << std::endl;
+        return 1;
+    }
+    nes->get_cpu().set_dispatch_mode(nes::dispatch_mode::jit);
+
+    // a seek replays from the keyframe before frame, a whole playback checks every keyframe
+    bool seek = argc > 4;
+    uint32_t frame = seek ? (uint32_t)atoi(argv[4]) : m.frames();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    err = m.seek(*nes, seek ? frame : 0);
+    if (err == 0 && !seek) {
+        err = m.play(*nes, 0, frame);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (err != 0) {
+        std::cout << "playback failed: " << err << std::endl;
+        return 1;
+    }
+    printf("frame %u of %u in %.3f s, last frame %08x\n", frame, m.frames(), elapsed.count(),
+           nes::frame_hash(nes->frame()));
+    if (!seek && elapsed.count() > 0) {
+        printf("%.1f frames/s\n", frame / elapsed.count());
+    }
+    return 0;
+}
+
+// rom, frames, trace file, hex PC to start at instead of the reset vector (C000 for nestest)
+static int trace_rom(int argc, const char * argv[])
+{
+    std::vector<uint8_t> demo;
+    std::unique_ptr<nes::console> nes(new nes::console());
+    int err = load_rom(*nes, argv[2], demo);
+    if (err != 0) {
+        std::cout << "can not load " << argv[2] << ": " << err << std::endl;
+        return 1;
+    }
+    nes::tracer t;
+    err = t.open(argv[4]);
+    if (err != 0) {
+        std::cout << "can not write " << argv[4] << ": " << err << std::endl;
+        return 1;
+    }
+    if (argc > 5) {
+        nes::registers r = nes->get_cpu().get_registers();
+        r.PC = (uint16_t)strtoul(argv[5], nullptr, 16);
+        nes->get_cpu().set_registers(r);
+    }
+
+    nes->get_cpu().set_tracer(&t);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int frames = atoi(argv[3]);
+    int done = 0;
+    while (done < frames && nes->run_frame()) {
+        done++;
+    }
+    nes->get_cpu().set_tracer(nullptr);
+    bool ok = t.flush();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%d frames, %llu instructions in %.3f s\n", done, (unsigned long long)t.records(), elapsed.count());
+    t.close();
+    return ok ? 0 : 1;
+}
+
+// rom, frames, WAV file or nothing for the null sink; runs at the NES frame
+// rate, the way a frontend would, with the sink on the audio thread's clock
+static int audio_rom(int argc, const char * argv[])
+{
+    std::vector<uint8_t> demo;
+    std::unique_ptr<nes::console> nes(new nes::console());
+    int err = load_rom(*nes, argv[2], demo);
+    if (err != 0) {
+        std::cout << "can not load " << argv[2] << ": " << err << std::endl;
+        return 1;
+    }
+    nes::null_sink null;
+    nes::wav_sink wav;
+    nes::audio_sink *sink = &null;
+    int rate = nes->get_apu().get_sample_rate();
+    if (argc > 4) {
+        err = wav.open(argv[4], rate);
+        if (err != 0) {
+            std::cout << "can not write " << argv[4] << ": " << err << std::endl;
+            return 1;
+        }
+        sink = &wav;
+    }
+
+    nes::audio_output out(rate, rate);
+    out.start(*sink);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> frame(1.0 / NES_FRAME_RATE);
+    int frames = atoi(argv[3]);
+    int done = 0;
+    while (done < frames && nes->run_frame()) {
+        out.push(nes->get_apu().samples(), nes->get_apu().sample_count());
+        done++;
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(frame * done));
+    }
+    out.stop();
+    wav.close();
+    printf("%d frames, ratio %.5f, fill %zu of %zu, %llu dropped, %llu underruns\n", done, out.ratio(), out.fill(),
+           out.capacity(), (unsigned long long)out.dropped(), (unsigned long long)out.underruns());
+    return 0;
+}
+
+// rom, frames, Y4M file or "null", PNG of the last picture; the pictures
+// go from the PPU's frame_buffers through the palette conversion
+static int video_rom(int argc, const char * argv[])
+{
+    std::vector<uint8_t> demo;
+    std::unique_ptr<nes::console> nes(new nes::console());
+    int err = load_rom(*nes, argv[2], demo);
+    if (err != 0) {
+        std::cout << "can not load " << argv[2] << ": " << err << std::endl;
+        return 1;
+    }
+    nes::video_output out;
+    nes::null_video_sink null;
+    nes::y4m_sink y4m;
+    nes::png_sink png;
+    if (argc > 4 && strcmp(argv[4], "null") != 0) {
+        err = y4m.open(argv[4]);
+        if (err != 0) {
+            std::cout << "can not write " << argv[4] << ": " << err << std::endl;
+            return 1;
+        }
+        out.add_sink(y4m);
+    }
+    else {
+        out.add_sink(null);
+    }
+    out.add_sink(png);
+
+    int frames = atoi(argv[3]);
+    int done = 0;
+    bool ok = true;
+    while (done < frames && nes->run_frame()) {
+        done++;
+        if (done == frames && argc > 5) {
+            png.snapshot(argv[5]);
+        }
+        ok = out.poll(nes->get_ppu().buffers()) && ok;
+    }
+    y4m.close();
+    printf("%d frames, %llu written, %s pixels, %.2f us converting per frame\n", done,
+           (unsigned long long)out.frames(), nes::pixel_path_name(out.get_pixel_path()),
+           out.frames() ? out.convert_ns() / 1000.0 / out.frames() : 0.0);
+    if (png.pending() || png.error() != 0) {
+        std::cout << "can not write " << argv[5] << ": " << png.error() << std::endl;
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
+
+// debugger commands from argv[first] on, "@path" reads them from a file, one per line
+static bool debug_commands(nes::debugger& dbg, int argc, const char * argv[], int first)
+{
+    for (int i = first; i < argc; ++i) {
+        if (argv[i][0] != '@') {
+            if (!dbg.command(argv[i])) {
+                std::cout << "unknown debugger command: " << argv[i] << std::endl;
+                return false;
+            }
+            continue;
+        }
+        FILE *f = fopen(argv[i] + 1, "r");
+        if (f == nullptr) {
+            std::cout << "can not read " << argv[i] + 1 << std::endl;
+            return false;
+        }
+        char line[256];
+        bool ok = true;
+        while (ok && fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "#\r\n")] = 0;
+            if (line[strspn(line, " \t")] != 0 && !dbg.command(line)) {
+                std::cout << "unknown debugger command: " << line << std::endl;
+                ok = false;
+            }
+        }
+        fclose(f);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// rom, frames, debugger commands: every stop as a line, then the run goes on
+static int debug_rom(int argc, const char * argv[])
+{
+    std::vector<uint8_t> demo;
+    std::unique_ptr<nes::console> nes(new nes::console());
+    int err = load_rom(*nes, argv[2], demo);
+    if (err != 0) {
+        std::cout << "can not load " << argv[2] << ": " << err << std::endl;
+        return 1;
+    }
+    nes::debugger dbg(nes->get_cpu(), nes->get_memory());
+    if (!debug_commands(dbg, argc, argv, 4)) {
+        return 1;
+    }
+
+    int frames = atoi(argv[3]);
+    int done = 0;
+    while (done < frames) {
+        if (nes->run_frame()) {
+            done++;
+            continue;
+        }
+        if (nes->halted()) {
+            break;
+        }
+        char event[64];
+        char regs[NES_TRACE_SIZE];
+        nes::debug_event_text(dbg.stopped(), event);
+        nes->get_cpu().trace(regs);
+        printf("frame %d: %-28s %s\n", done, event, regs);
+    }
+    printf("%d frames, %llu stops\n", done, (unsigned long long)dbg.stops());
+    return 0;
+}
+
+#if NES_PROFILER
+// rom, frames, folded stacks file, rows of the report
+static int profile_rom(int argc, const char * argv[])
+{
+    std::vector<uint8_t> demo;
+    std::unique_ptr<nes::console> nes(new nes::console());
+    int err = load_rom(*nes, argv[2], demo);
+    if (err != 0) {
+        std::cout << "can not load " << argv[2] << ": " << err << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<nes::profiler> prof(new nes::profiler());
+    nes->get_cpu().set_profiler(prof.get());
+    int frames = atoi(argv[3]);
+    int done = 0;
+    while (done < frames && nes->run_frame()) {
+        done++;
+    }
+    nes->get_cpu().set_profiler(nullptr);
+
+    printf("%d frames, ", done);
+    prof->report(stdout, nes->get_memory(), argc > 5 ? (size_t)atoi(argv[5]) : 20);
+    err = prof->folded(argv[4]);
+    if (err != 0) {
+        std::cout << "can not write " << argv[4] << ": " << err << std::endl;
+        return 1;
+    }
+    return 0;
+}
+#endif
+
 int main(int argc, const char * argv[])
 {
+    nes::flight_recorder::install_signal_handlers();
+
+    if (argc > 1 && strcmp(argv[1], "bench-dispatch") == 0) {
+        nes::bench_dispatch();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-alu") == 0) {
+        nes::bench_alu();
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "bench-startup") == 0) {
+        nes::bench_startup(argv[2]);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-fps") == 0) {
+        const char *rom = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : nullptr;
+        nes::bench_fps(rom, argc > 3 ? atoi(argv[3]) : 600);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-apu") == 0) {
+        nes::bench_apu(argc > 2 ? atoi(argv[2]) : 60);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-batch") == 0) {
+        nes::bench_batch(argc > 2 ? atoi(argv[2]) : 16, argc > 3 ? atoi(argv[3]) : 300);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-state") == 0) {
+        const char *rom = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : nullptr;
+        nes::bench_state(rom, argc > 3 ? atoi(argv[3]) : 600);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-rewind") == 0) {
+        const char *rom = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : nullptr;
+        nes::bench_rewind(rom, argc > 3 ? atoi(argv[3]) : 3600);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-soa") == 0) {
+        nes::bench_soa(argc > 2 ? (size_t)atoi(argv[2]) : 64);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-trace") == 0) {
+        const char *rom = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : nullptr;
+        nes::bench_trace(rom, argc > 3 ? atoi(argv[3]) : 300);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-flight") == 0) {
+        const char *rom = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : nullptr;
+        nes::bench_flight(rom, argc > 3 ? atoi(argv[3]) : 300);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-ppu-thread") == 0) {
+        const char *rom = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : nullptr;
+        nes::bench_ppu_thread(rom, argc > 3 ? atoi(argv[3]) : 600);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-video") == 0) {
+        const char *rom = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : nullptr;
+        nes::bench_video(rom, argc > 3 ? atoi(argv[3]) : 120);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-suite") == 0) {
+        return nes::bench_suite(stdout, argc > 2 ? atoi(argv[2]) : 10, 3, nullptr, nullptr) ? 0 : 2;
+    }
+    if (argc > 2 && strcmp(argv[1], "batch") == 0) {
+        std::vector<nes::batch_job> jobs;
+        int line;
+        int err = nes::batch_parse(argv[2], jobs, line);
+        if (err != 0) {
+            std::cout << "can not read " << argv[2] << " line " << line << ": " << err << std::endl;
+            return 1;
+        }
+        nes::work_pool pool(argc > 3 ? atoi(argv[3]) : 0);
+        std::vector<nes::batch_result> results;
+        double seconds = nes::batch_run(jobs, pool, results);
+        nes::batch_report(jobs, results, pool, seconds);
+        return 0;
+    }
+    if (argc > 5 && strcmp(argv[1], "movie-record") == 0) {
+        return movie_record(argc, argv);
+    }
+    if (argc > 3 && strcmp(argv[1], "movie-play") == 0) {
+        return movie_play(argc, argv);
+    }
+    if (argc > 4 && strcmp(argv[1], "trace") == 0) {
+        return trace_rom(argc, argv);
+    }
+#if NES_PROFILER
+    if (argc > 4 && strcmp(argv[1], "profile") == 0) {
+        return profile_rom(argc, argv);
+    }
+#endif
+    if (argc > 3 && strcmp(argv[1], "video") == 0) {
+        return video_rom(argc, argv);
+    }
+    if (argc > 3 && strcmp(argv[1], "audio") == 0) {
+        return audio_rom(argc, argv);
+    }
+    if (argc > 3 && strcmp(argv[1], "debug") == 0) {
+        return debug_rom(argc, argv);
+    }
+    if (argc > 2 && strcmp(argv[1], "info") == 0) {
+        nes::cartridge cart;
+        int err = cart.load(argv[2]);
+        if (err != 0) {
+            std::cout << "can not load " << argv[2] << ": " << err << std::endl;
+            return 1;
+        }
+        cart.debug_print();
+        return 0;
+    }
+
     nes::memory mem;
     nes::cpu_6502 cpu(mem);
     cpu.test();
+    nes::disasm_test();
+    nes::tracer::test();
+    nes::flight_recorder::test();
+    nes::debugger::test();
+#if NES_PROFILER
+    nes::profiler::test();
+#endif
+    nes::cartridge::test();
+    nes::mapper::test();
+    nes::ppu::test();
+    nes::spsc_ring_test();
+    nes::ppu_thread::test();
+    nes::apu::test();
+    nes::audio_output::test();
+    nes::video_output::test();
+    nes::state_test();
+    nes::console::test();
+    nes::rewind_buffer::test();
+    nes::movie::test();
+    nes::work_pool::test();
+    nes::batch_test();
+    nes::cpu_6502_soa::test();
+    nes::bench_suite_test();
     
     return 0;
 }
@@ -0,0 +1,621 @@
+#include "mapper.hpp"
+#include "state.hpp"
+#include <cassert>
+#include <cstring>
+
+
+namespace nes {
+
+    mapper::mapper(cartridge& cart, memory& m) noexcept
+    :cart_(cart), mem_(m), mirroring_(cart.get_mirroring())
+    {
+        size_t prg_ram = cart.prg_ram_size() + cart.prg_nvram_size();
+        this->prg_ram_.resize(prg_ram < NES_PRG_RAM_SIZE ? NES_PRG_RAM_SIZE : prg_ram);
+        if (cart.chr() == nullptr) {
+            size_t chr_ram = cart.chr_ram_size();
+            this->chr_ram_.resize(chr_ram < NES_CHR_BANK_SIZE ? NES_CHR_BANK_SIZE : chr_ram);
+        }
+
+        this->mem_.map_memory(NES_PRG_RAM_ADDR, NES_PRG_RAM_SIZE, this->prg_ram_.data());
+        // only the register writes come to us, PRG reads stay on the page table
+        this->mem_.map_handler(NES_PRG_ROM_ADDR, NES_MAX_RAM - NES_PRG_ROM_ADDR, this, false);
+    }
+
+    mapper::~mapper()
+    {
+        this->mem_.unmap(NES_PRG_RAM_ADDR, NES_MAX_RAM - NES_PRG_RAM_ADDR);
+    }
+
+    void mapper::map_prg(uint16_t addr, size_t size, int bank)
+    {
+        size_t window = size;
+        int count = (int)this->prg_banks(size);
+        if (count == 0) {
+            // smaller ROM than the window, mirror what is there
+            size = this->cart_.prg_size();
+            count = 1;
+        }
+        bank %= count;
+        if (bank < 0) {
+            bank += count;
+        }
+
+        const uint8_t *host = this->cart_.prg() + (size_t)bank * size;
+        for (size_t at = 0; at < window; at += size) {
+            // rewriting the same bank is common, don't drop decoded code for it
+            if (this->mem_.map_offset_addr((uint16_t)(addr + at)) != host) {
+                this->mem_.map_rom((uint16_t)(addr + at), size < window - at ? size : window - at, host);
+            }
+        }
+    }
+
+    void mapper::map_chr(uint16_t addr, size_t size, int bank)
+    {
+        size_t bank_size = size;
+        int count = (int)this->chr_banks(size);
+        if (count == 0) {
+            // like PRG, whole 1K slots of it
+            bank_size = this->chr_size() & ~(size_t)(NES_CHR_SLOT_SIZE - 1);
+            count = 1;
+            if (bank_size == 0) {
+                return;
+            }
+        }
+        bank %= count;
+        if (bank < 0) {
+            bank += count;
+        }
+
+        uint8_t *ram = this->chr_ram_.empty() ? nullptr : this->chr_ram_.data() + (size_t)bank * bank_size;
+        const uint8_t *host = ram ? ram : this->cart_.chr() + (size_t)bank * bank_size;
+        int first = addr >> NES_CHR_SLOT_SHIFT;
+        for (size_t i = 0; i < (size >> NES_CHR_SLOT_SHIFT); ++i) {
+            size_t at = i * NES_CHR_SLOT_SIZE % bank_size;
+            this->chr_read_[first + i] = host + at;
+            this->chr_write_[first + i] = ram ? ram + at : nullptr;
+        }
+    }
+
+    void mapper::save_state(state_writer& w) const
+    {
+        w.begin("MAP ");
+        w.put(this->cart_.mapper());
+        w.put(this->mirroring_);
+        w.put(this->irq_);
+        w.put<uint32_t>((uint32_t)this->chr_ram_.size());
+        w.bytes(this->chr_ram_.data(), this->chr_ram_.size());
+        this->save_regs(w);
+        w.end();
+    }
+
+    int mapper::load_state(const state_reader& r)
+    {
+        state_reader c;
+        if (!r.find("MAP ", c) || c.get<uint16_t>() != this->cart_.mapper()) {
+            return STATE_ERROR_FORMAT;
+        }
+        mirroring m = c.get<mirroring>();
+        bool irq = c.get<bool>();
+        if (c.get<uint32_t>() != this->chr_ram_.size() || c.left() < this->chr_ram_.size()) {
+            return STATE_ERROR_FORMAT;
+        }
+        this->mirroring_ = m <= mirroring::single_high ? m : this->cart_.get_mirroring();
+        this->irq_ = irq;
+        c.bytes(this->chr_ram_.data(), this->chr_ram_.size());
+        this->load_regs(c);
+        return c.ok() ? 0 : STATE_ERROR_FORMAT;
+    }
+
+
+    // mapper 0, fixed 16K or 32K PRG and 8K CHR
+    class nrom : public mapper {
+    public:
+        nrom(cartridge& cart, memory& m) noexcept
+        :mapper(cart, m)
+        {
+        }
+
+        void reset() override
+        {
+            this->map_prg(0x8000, 0x4000, 0);
+            this->map_prg(0xc000, 0x4000, -1);
+            this->map_chr(0x0000, 0x2000, 0);
+        }
+
+        void write(uint16_t addr, uint8_t v) override
+        {
+        }
+    };
+
+    // mapper 2, switchable 16K at $8000, last bank fixed at $C000
+    class uxrom : public mapper {
+
+        uint8_t bank_{0};
+
+    protected:
+        void save_regs(state_writer& w) const override
+        {
+            w.put(this->bank_);
+        }
+
+        void load_regs(state_reader& c) override
+        {
+            this->write(NES_PRG_ROM_ADDR, c.get<uint8_t>());
+        }
+
+    public:
+        uxrom(cartridge& cart, memory& m) noexcept
+        :mapper(cart, m)
+        {
+        }
+
+        void reset() override
+        {
+            this->bank_ = 0;
+            this->map_prg(0x8000, 0x4000, 0);
+            this->map_prg(0xc000, 0x4000, -1);
+            this->map_chr(0x0000, 0x2000, 0);
+        }
+
+        void write(uint16_t addr, uint8_t v) override
+        {
+            this->bank_ = v;
+            this->map_prg(0x8000, 0x4000, v);
+        }
+    };
+
+    // mapper 3, fixed PRG, switchable 8K CHR
+    class cnrom : public mapper {
+
+        uint8_t bank_{0};
+
+    protected:
+        void save_regs(state_writer& w) const override
+        {
+            w.put(this->bank_);
+        }
+
+        void load_regs(state_reader& c) override
+        {
+            this->write(NES_PRG_ROM_ADDR, c.get<uint8_t>());
+        }
+
+    public:
+        cnrom(cartridge& cart, memory& m) noexcept
+        :mapper(cart, m)
+        {
+        }
+
+        void reset() override
+        {
+            this->bank_ = 0;
+            this->map_prg(0x8000, 0x4000, 0);
+            this->map_prg(0xc000, 0x4000, -1);
+            this->map_chr(0x0000, 0x2000, 0);
+        }
+
+        void write(uint16_t addr, uint8_t v) override
+        {
+            this->bank_ = v;
+            this->map_chr(0x0000, 0x2000, v);
+        }
+    };
+
+    /*
+        Mapper 1, MMC1 / SxROM.
+
+        Registers are loaded one bit per write through a 5 bit shift
+        register, the fifth write picks the register from A13-A14.
+        CHR bank 0 bit 4 selects the 256K outer PRG bank on 512K boards.
+    */
+    class mmc1 : public mapper {
+
+        uint8_t shift_{0x10};
+        uint8_t control_{0x0c};
+        uint8_t chr0_{0};
+        uint8_t chr1_{0};
+        uint8_t prg_{0};
+
+        void apply()
+        {
+            static const mirroring modes[] = {
+                mirroring::single_low, mirroring::single_high, mirroring::vertical, mirroring::horizontal,
+            };
+            this->mirroring_ = modes[this->control_ & 0x03];
+
+            if (this->control_ & 0x10) {
+                this->map_chr(0x0000, 0x1000, this->chr0_);
+                this->map_chr(0x1000, 0x1000, this->chr1_);
+            }
+            else {
+                this->map_chr(0x0000, 0x2000, this->chr0_ >> 1);
+            }
+
+            int outer = this->cart_.prg_size() > 0x40000 ? this->chr0_ & 0x10 : 0;
+            int bank = this->prg_ & 0x0f;
+            switch ((this->control_ >> 2) & 0x03) {
+                case 0:
+                case 1:
+                    this->map_prg(0x8000, 0x4000, outer | (bank & 0x0e));
+                    this->map_prg(0xc000, 0x4000, outer | (bank & 0x0e) | 1);
+                    break;
+                case 2:
+                    this->map_prg(0x8000, 0x4000, outer);
+                    this->map_prg(0xc000, 0x4000, outer | bank);
+                    break;
+                case 3:
+                    this->map_prg(0x8000, 0x4000, outer | bank);
+                    this->map_prg(0xc000, 0x4000, outer | 0x0f);
+                    break;
+            }
+        }
+
+    protected:
+        void save_regs(state_writer& w) const override
+        {
+            w.put(this->shift_);
+            w.put(this->control_);
+            w.put(this->chr0_);
+            w.put(this->chr1_);
+            w.put(this->prg_);
+        }
+
+        void load_regs(state_reader& c) override
+        {
+            c.get(this->shift_);
+            c.get(this->control_);
+            c.get(this->chr0_);
+            c.get(this->chr1_);
+            c.get(this->prg_);
+            this->apply();
+        }
+
+    public:
+        mmc1(cartridge& cart, memory& m) noexcept
+        :mapper(cart, m)
+        {
+        }
+
+        void reset() override
+        {
+            this->shift_ = 0x10;
+            this->control_ = 0x0c;
+            this->chr0_ = 0;
+            this->chr1_ = 0;
+            this->prg_ = 0;
+            this->apply();
+        }
+
+        void write(uint16_t addr, uint8_t v) override
+        {
+            if (v & 0x80) {
+                this->shift_ = 0x10;
+                this->control_ |= 0x0c;
+                this->apply();
+                return;
+            }
+
+            bool full = this->shift_ & 0x01;
+            this->shift_ = (this->shift_ >> 1) | (v & 0x01) << 4;
+            if (!full) {
+                return;
+            }
+
+            switch ((addr >> 13) & 0x03) {
+                case 0: this->control_ = this->shift_; break;
+                case 1: this->chr0_ = this->shift_; break;
+                case 2: this->chr1_ = this->shift_; break;
+                case 3: this->prg_ = this->shift_; break;
+            }
+            this->shift_ = 0x10;
+            this->apply();
+        }
+    };
+
+    /*
+        Mapper 4, MMC3 / TxROM.
+
+        Eight bank registers R0-R7 behind a select/data pair, 8K PRG and
+        2K/1K CHR windows. The IRQ counter is clocked once per rendered
+        scanline by the PPU (the A12 rise of the sprite fetches), it reloads
+        from the latch when it is zero or a reload was requested, and
+        raises the IRQ line when it reaches zero.
+    */
+    class mmc3 : public mapper {
+
+        uint8_t select_{0};
+        uint8_t r_[8]{0};
+        uint8_t irq_latch_{0};
+        uint8_t irq_counter_{0};
+        bool irq_reload_{false};
+        bool irq_enable_{false};
+
+        void apply()
+        {
+            if (this->select_ & 0x40) {
+                this->map_prg(0x8000, 0x2000, -2);
+                this->map_prg(0xc000, 0x2000, this->r_[6]);
+            }
+            else {
+                this->map_prg(0x8000, 0x2000, this->r_[6]);
+                this->map_prg(0xc000, 0x2000, -2);
+            }
+            this->map_prg(0xa000, 0x2000, this->r_[7]);
+            this->map_prg(0xe000, 0x2000, -1);
+
+            uint16_t inv = this->select_ & 0x80 ? 0x1000 : 0;
+            this->map_chr(inv ^ 0x0000, 0x0800, this->r_[0] >> 1);
+            this->map_chr(inv ^ 0x0800, 0x0800, this->r_[1] >> 1);
+            this->map_chr(inv ^ 0x1000, 0x0400, this->r_[2]);
+            this->map_chr(inv ^ 0x1400, 0x0400, this->r_[3]);
+            this->map_chr(inv ^ 0x1800, 0x0400, this->r_[4]);
+            this->map_chr(inv ^ 0x1c00, 0x0400, this->r_[5]);
+        }
+
+    protected:
+        void save_regs(state_writer& w) const override
+        {
+            w.put(this->select_);
+            w.bytes(this->r_, sizeof(this->r_));
+            w.put(this->irq_latch_);
+            w.put(this->irq_counter_);
+            w.put(this->irq_reload_);
+            w.put(this->irq_enable_);
+        }
+
+        void load_regs(state_reader& c) override
+        {
+            c.get(this->select_);
+            c.bytes(this->r_, sizeof(this->r_));
+            c.get(this->irq_latch_);
+            c.get(this->irq_counter_);
+            c.get(this->irq_reload_);
+            c.get(this->irq_enable_);
+            this->apply();
+        }
+
+    public:
+        mmc3(cartridge& cart, memory& m) noexcept
+        :mapper(cart, m)
+        {
+        }
+
+        void reset() override
+        {
+            static const uint8_t banks[] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+            this->select_ = 0;
+            memcpy(this->r_, banks, sizeof(this->r_));
+            this->irq_latch_ = 0;
+            this->irq_counter_ = 0;
+            this->irq_reload_ = false;
+            this->irq_enable_ = false;
+            this->irq_ = false;
+            this->apply();
+        }
+
+        void write(uint16_t addr, uint8_t v) override
+        {
+            switch (addr & 0xe001) {
+                case 0x8000:
+                    this->select_ = v;
+                    this->apply();
+                    break;
+                case 0x8001:
+                    this->r_[this->select_ & 0x07] = v;
+                    this->apply();
+                    break;
+                case 0xa000:
+                    if (this->cart_.get_mirroring() != mirroring::four_screen) {
+                        this->mirroring_ = v & 0x01 ? mirroring::horizontal : mirroring::vertical;
+                    }
+                    break;
+                case 0xa001:
+                    // PRG RAM protect, not emulated
+                    break;
+                case 0xc000:
+                    this->irq_latch_ = v;
+                    break;
+                case 0xc001:
+                    this->irq_counter_ = 0;
+                    this->irq_reload_ = true;
+                    break;
+                case 0xe000:
+                    this->irq_enable_ = false;
+                    this->irq_ = false;
+                    break;
+                case 0xe001:
+                    this->irq_enable_ = true;
+                    break;
+            }
+        }
+
+        void scanline() override
+        {
+            if (this->irq_counter_ == 0 || this->irq_reload_) {
+                this->irq_counter_ = this->irq_latch_;
+                this->irq_reload_ = false;
+            }
+            else {
+                this->irq_counter_--;
+            }
+
+            if (this->irq_counter_ == 0 && this->irq_enable_) {
+                this->irq_ = true;
+            }
+        }
+
+        int scanlines_to_irq() const override
+        {
+            if (!this->irq_enable_) {
+                return -1;
+            }
+            if (this->irq_counter_ == 0 || this->irq_reload_) {
+                return this->irq_latch_ ? this->irq_latch_ + 1 : 1;
+            }
+            return this->irq_counter_;
+        }
+    };
+
+
+    std::unique_ptr<mapper> mapper::create(cartridge& cart, memory& m)
+    {
+        std::unique_ptr<mapper> board;
+        switch (cart.mapper()) {
+            case 0: board.reset(new nrom(cart, m)); break;
+            case 1: board.reset(new mmc1(cart, m)); break;
+            case 2: board.reset(new uxrom(cart, m)); break;
+            case 3: board.reset(new cnrom(cart, m)); break;
+            case 4: board.reset(new mmc3(cart, m)); break;
+            default: return nullptr;
+        }
+        board->reset();
+        return board;
+    }
+
+    void mapper::test()
+    {
+        // 256K PRG and 64K CHR, every 8K PRG / 1K CHR bank starts with its number
+        static const size_t prg_size = 16 * NES_PRG_BANK_SIZE;
+        static const size_t chr_size = 8 * NES_CHR_BANK_SIZE;
+        static uint8_t image[NES_HEADER_SIZE + prg_size + chr_size];
+        memset(image, 0xff, sizeof(image));
+        memset(image, 0, NES_HEADER_SIZE);
+        memcpy(image, "NES\x1a", 4);
+        image[4] = prg_size / NES_PRG_BANK_SIZE;
+        image[5] = chr_size / NES_CHR_BANK_SIZE;
+        for (size_t i = 0; i < prg_size / 0x2000; ++i) {
+            image[NES_HEADER_SIZE + i * 0x2000] = (uint8_t)i;
+        }
+        for (size_t i = 0; i < chr_size / NES_CHR_SLOT_SIZE; ++i) {
+            image[NES_HEADER_SIZE + prg_size + i * NES_CHR_SLOT_SIZE] = (uint8_t)i;
+        }
+
+        memory mem;
+        cartridge cart;
+        int err;
+
+        // UxROM: $8000 switches, $C000 stays on the last bank
+        image[6] = 0x20;
+        err = cart.load(image, sizeof(image));
+        assert(err == 0);
+        {
+            std::unique_ptr<mapper> m = mapper::create(cart, mem);
+            assert(m && mem.read<uint8_t>(0x8000) == 0 && mem.read<uint8_t>(0xc000) == 30);
+            mem.write<uint8_t>(5, 0x8000);
+            assert(mem.read<uint8_t>(0x8000) == 10 && mem.read<uint8_t>(0xa000) == 11);
+            assert(mem.read<uint8_t>(0xc000) == 30);
+            // ROM is read only, PRG RAM is not
+            assert(mem.read<uint8_t>(0x8000) == 10);
+            mem.write<uint8_t>(0x42, 0x6000);
+            assert(mem.read<uint8_t>(0x6000) == 0x42 && m->prg_ram()[0] == 0x42);
+        }
+        // the board is gone, so is its mapping
+        mem.write<uint8_t>(0x13, 0x8000);
+        assert(mem.read<uint8_t>(0x8000) == 0x13);
+
+        // CNROM
+        image[6] = 0x30;
+        err = cart.load(image, sizeof(image));
+        assert(err == 0);
+        {
+            std::unique_ptr<mapper> m = mapper::create(cart, mem);
+            assert(m->chr_read(0x0000) == 0 && m->chr_read(0x1c00) == 7);
+            mem.write<uint8_t>(3, 0xffff);
+            assert(m->chr_read(0x0000) == 24 && m->chr_read(0x0401) == 0xff);
+            assert(!m->chr_write(0x0000, 1));
+        }
+
+        // MMC1: serial writes, PRG mode 3 by default, 4K CHR
+        image[6] = 0x10;
+        err = cart.load(image, sizeof(image));
+        assert(err == 0);
+        {
+            std::unique_ptr<mapper> m = mapper::create(cart, mem);
+            assert(mem.read<uint8_t>(0x8000) == 0 && mem.read<uint8_t>(0xc000) == 30);
+            auto serial = [&mem](uint16_t addr, uint8_t v) {
+                for (int i = 0; i < 5; ++i) {
+                    mem.write<uint8_t>((v >> i) & 1, addr);
+                }
+            };
+            serial(0xe000, 3);
+            assert(mem.read<uint8_t>(0x8000) == 6 && mem.read<uint8_t>(0xc000) == 30);
+            serial(0x8000, 0x10 | 0x08 | 0x02);
+            serial(0xa000, 5);
+            serial(0xc000, 9);
+            assert(m->get_mirroring() == mirroring::vertical);
+            assert(mem.read<uint8_t>(0x8000) == 0 && mem.read<uint8_t>(0xc000) == 6);
+            assert(m->chr_read(0x0000) == 20 && m->chr_read(0x1000) == 36);
+            // reset bit
+            mem.write<uint8_t>(0x80, 0x8000);
+            assert(mem.read<uint8_t>(0x8000) == 6 && mem.read<uint8_t>(0xc000) == 30);
+        }
+
+        // MMC3: PRG mode swap, CHR inversion, IRQ counter
+        image[6] = 0x40;
+        err = cart.load(image, sizeof(image));
+        assert(err == 0);
+        {
+            std::unique_ptr<mapper> m = mapper::create(cart, mem);
+            mem.write<uint8_t>(6, 0x8000);
+            mem.write<uint8_t>(9, 0x8001);
+            assert(mem.read<uint8_t>(0x8000) == 9 && mem.read<uint8_t>(0xc000) == 30);
+            assert(mem.read<uint8_t>(0xe000) == 31);
+            mem.write<uint8_t>(0x40 | 0x80 | 2, 0x8000);
+            mem.write<uint8_t>(50, 0x8001);
+            assert(mem.read<uint8_t>(0x8000) == 30 && mem.read<uint8_t>(0xc000) == 9);
+            assert(m->chr_read(0x0000) == 50 && m->chr_read(0x1000) == 0);
+
+            mem.write<uint8_t>(2, 0xc000);
+            mem.write<uint8_t>(0, 0xc001);
+            assert(m->scanlines_to_irq() == -1);
+            mem.write<uint8_t>(0, 0xe001);
+            assert(m->scanlines_to_irq() == 3);
+            m->scanline();
+            assert(!m->irq() && m->scanlines_to_irq() == 2);
+            m->scanline();
+            assert(!m->irq() && m->scanlines_to_irq() == 1);
+            m->scanline();
+            assert(m->irq() && m->scanlines_to_irq() == 3);
+            mem.write<uint8_t>(0, 0xe000);
+            assert(!m->irq() && m->scanlines_to_irq() == -1);
+        }
+
+        // NES 2.0 NROM with 8K PRG and 4K CHR, both mirrored across their windows
+        image[4] = 13 << 2;
+        image[5] = 12 << 2;
+        image[6] = 0x00;
+        image[7] = 0x08;
+        image[9] = 0xff;
+        image[NES_HEADER_SIZE] = 0x5a;
+        err = cart.load(image, sizeof(image));
+        assert(err == 0 && cart.prg_size() == 0x2000 && cart.chr_size() == 0x1000);
+        {
+            std::unique_ptr<mapper> m = mapper::create(cart, mem);
+            assert(mem.read<uint8_t>(0x8000) == 0x5a && mem.read<uint8_t>(0xa000) == 0x5a);
+            assert(mem.read<uint8_t>(0xc000) == 0x5a && mem.read<uint8_t>(0xe000) == 0x5a);
+            // the CHR is what follows the first 8K of PRG
+            assert(m->chr_read(0x0000) == 1 && m->chr_read(0x1000) == 1 && m->chr_read(0x1400) == 0xff);
+        }
+        image[NES_HEADER_SIZE] = 0;
+        image[7] = 0;
+        image[9] = 0;
+
+        // CHR RAM
+        image[4] = 2;
+        image[5] = 0;
+        image[6] = 0x00;
+        err = cart.load(image, NES_HEADER_SIZE + 2 * NES_PRG_BANK_SIZE);
+        assert(err == 0);
+        {
+            std::unique_ptr<mapper> m = mapper::create(cart, mem);
+            assert(m->chr_write(0x1234, 0x56) && m->chr_read(0x1234) == 0x56);
+            assert(mem.read<uint8_t>(0x8000) == 0 && mem.read<uint8_t>(0xc000) == 2);
+        }
+
+        image[6] = 0xf0;
+        err = cart.load(image, sizeof(image));
+        assert(err == 0 && mapper::create(cart, mem) == nullptr);
+        (void)err;
+    }
+
+}
@@ -0,0 +1,177 @@
+#ifndef mapper_hpp
+#define mapper_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "memory.hpp"
+#include "cartridge.hpp"
+
+#define NES_PRG_RAM_ADDR 0x6000
+#define NES_PRG_RAM_SIZE 0x2000
+#define NES_PRG_ROM_ADDR 0x8000
+#define NES_CHR_SLOT_SHIFT 10
+#define NES_CHR_SLOT_SIZE (1 << NES_CHR_SLOT_SHIFT)
+#define NES_CHR_SLOTS 8
+
+
+namespace nes {
+
+    /*
+        Cartridge board.
+
+        PRG banks are mapped into the CPU page table straight from the
+        cartridge image, CHR banks into eight 1K slot pointers the PPU
+        reads through. A bank switch only repoints those entries, nothing
+        is copied and reads never do bank arithmetic. Register writes to
+        $8000-$FFFF come in through the mmio_handler interface, reads of
+        PRG ROM never reach the mapper.
+    */
+    class mapper : public mmio_handler {
+
+    protected:
+        cartridge& cart_;
+        memory& mem_;
+
+        std::vector<uint8_t> prg_ram_;
+        std::vector<uint8_t> chr_ram_;
+
+        const uint8_t *chr_read_[NES_CHR_SLOTS]{nullptr};
+        uint8_t *chr_write_[NES_CHR_SLOTS]{nullptr};
+
+        mirroring mirroring_;
+        bool irq_{false};
+
+        size_t prg_banks(size_t size) const
+        {
+            return this->cart_.prg_size() / size;
+        }
+
+        size_t chr_banks(size_t size) const
+        {
+            return this->chr_size() / size;
+        }
+
+        // negative banks count from the end, -1 is the last one
+        void map_prg(uint16_t addr, size_t size, int bank);
+        void map_chr(uint16_t addr, size_t size, int bank);
+
+        // the board's registers, load_regs() maps the banks they select
+        virtual void save_regs(state_writer& w) const
+        {
+        }
+
+        virtual void load_regs(state_reader& c)
+        {
+        }
+
+    public:
+        mapper() = delete;
+        mapper(const mapper&) = delete;
+        mapper(mapper&&) = delete;
+        mapper& operator=(const mapper&) = delete;
+        mapper& operator=(mapper&&) = delete;
+
+        mapper(cartridge& cart, memory& m) noexcept;
+        virtual ~mapper();
+
+        // nullptr when the board is not supported
+        static std::unique_ptr<mapper> create(cartridge& cart, memory& m);
+
+        // power up banking, call once the mapper is created
+        virtual void reset() = 0;
+
+        uint8_t read(uint16_t addr) override
+        {
+            return 0;
+        }
+
+        // one PPU scanline with rendering enabled (MMC3 A12 counter)
+        virtual void scanline()
+        {
+        }
+
+        // scanline() calls until the IRQ line goes up, -1 for never
+        virtual int scanlines_to_irq() const
+        {
+            return -1;
+        }
+
+        bool irq() const
+        {
+            return this->irq_;
+        }
+
+        mirroring get_mirroring() const
+        {
+            return this->mirroring_;
+        }
+
+        // CHR ROM or RAM, every slot points somewhere into it
+        const uint8_t* chr_data() const
+        {
+            return this->cart_.chr() ? this->cart_.chr() : this->chr_ram_.data();
+        }
+
+        size_t chr_size() const
+        {
+            return this->cart_.chr() ? this->cart_.chr_size() : this->chr_ram_.size();
+        }
+
+        // CHR RAM, which chr_write() changes
+        bool chr_writable() const
+        {
+            return this->cart_.chr() == nullptr;
+        }
+
+        const uint8_t* chr_slot(int slot) const
+        {
+            return this->chr_read_[slot];
+        }
+
+        // all NES_CHR_SLOTS of them, repointed in place on bank switches
+        const uint8_t* const* chr_slots() const
+        {
+            return this->chr_read_;
+        }
+
+        uint8_t chr_read(uint16_t addr) const
+        {
+            return this->chr_read_[(addr >> NES_CHR_SLOT_SHIFT) & 7][addr & (NES_CHR_SLOT_SIZE - 1)];
+        }
+
+        // CHR RAM only, writes to CHR ROM are dropped
+        bool chr_write(uint16_t addr, uint8_t v)
+        {
+            uint8_t *slot = this->chr_write_[(addr >> NES_CHR_SLOT_SHIFT) & 7];
+            if (slot == nullptr) {
+                return false;
+            }
+            slot[addr & (NES_CHR_SLOT_SIZE - 1)] = v;
+            return true;
+        }
+
+        std::vector<uint8_t>& prg_ram()
+        {
+            return this->prg_ram_;
+        }
+
+        std::vector<uint8_t>& chr_ram()
+        {
+            return this->chr_ram_;
+        }
+
+        // "MAP " chunk: registers, mirroring, the IRQ line and CHR RAM,
+        // PRG RAM is CPU memory and saved with it
+        void save_state(state_writer& w) const;
+        // 0 or STATE_ERROR_FORMAT
+        int load_state(const state_reader& r);
+
+        static void test();
+    };
+
+}
+
+
+#endif /* mapper_hpp */
@@ -1,6 +1,7 @@
 
 
 #include "memory.hpp"
+#include "state.hpp"
 
 
 namespace nes {
@@ -29,14 +30,262 @@ namespace nes {
         std::cout << line << std::endl;
     }
     
+    void memory::map_memory(uint16_t addr, size_t size, uint8_t *host, bool writable)
+    {
+        size_t first = addr >> NES_PAGE_SHIFT;
+        size_t count = size >> NES_PAGE_SHIFT;
+
+        for (size_t i = 0; i < count && first + i < NES_PAGE_COUNT; ++i) {
+            size_t page = first + i;
+            if (writable || this->write_backing_[page]) {
+                this->aliases_stale_ = true;
+            }
+            // what the page shows changed, whatever was written to it
+            this->dirty_[page] = 1;
+            this->read_backing_[page] = host + i * NES_PAGE_SIZE;
+            this->write_backing_[page] = writable ? this->read_backing_[page] : nullptr;
+            if (writable) {
+                this->handler_[page] = nullptr;
+            }
+            this->update_read_map(page);
+            this->update_write_map(page);
+            this->remapped(page);
+        }
+    }
+
+    void memory::map_handler(uint16_t addr, size_t size, mmio_handler *handler, bool reads)
+    {
+        size_t first = addr >> NES_PAGE_SHIFT;
+        size_t count = size >> NES_PAGE_SHIFT;
+
+        for (size_t i = 0; i < count && first + i < NES_PAGE_COUNT; ++i) {
+            size_t page = first + i;
+            if (this->write_backing_[page]) {
+                this->aliases_stale_ = true;
+            }
+            this->handler_[page] = handler;
+            this->write_backing_[page] = nullptr;
+            if (reads) {
+                this->read_backing_[page] = nullptr;
+            }
+            this->update_read_map(page);
+            this->update_write_map(page);
+            this->remapped(page);
+        }
+    }
+
+    void memory::remapped(size_t page)
+    {
+        if (this->watch_count_[page] && this->listener_) {
+            this->listener_->on_watched_remap((uint16_t)page);
+        }
+    }
+
+    uint8_t memory::read_byte(uint16_t addr)
+    {
+        size_t page = addr >> NES_PAGE_SHIFT;
+        const uint8_t *backing = this->read_backing_[page];
+        mmio_handler *handler = this->handler_[page];
+        // unmapped reads see an empty bus
+        uint8_t v = backing ? backing[addr & NES_PAGE_MASK] : handler ? handler->read(addr) : 0;
+        if (this->read_trap_[page] && this->trap_) {
+            this->trap_->on_trapped_read(addr, v);
+        }
+        return v;
+    }
+
+    void memory::write_byte(uint16_t addr, uint8_t v)
+    {
+        size_t page = addr >> NES_PAGE_SHIFT;
+
+        if (this->write_backing_[page]) {
+            this->write_backing_[page][addr & NES_PAGE_MASK] = v;
+        }
+        else if (this->handler_[page]) {
+            this->handler_[page]->write(addr, v);
+        }
+        this->check_watch(addr);
+        if (this->write_trap_[page] && this->trap_) {
+            this->trap_->on_trapped_write(addr, v);
+        }
+    }
+
+    uint32_t memory::read_slow(uint16_t addr, size_t size)
+    {
+        uint32_t v = 0;
+        for (size_t i = 0; i < size; ++i) {
+            uint16_t a = (uint16_t)(addr + i);
+            const uint8_t *page = this->read_map_[a >> NES_PAGE_SHIFT];
+            v |= (uint32_t)(page ? page[a & NES_PAGE_MASK] : this->read_byte(a)) << (i * 8);
+        }
+        return v;
+    }
+
+    void memory::write_slow(uint16_t addr, uint32_t v, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i) {
+            uint16_t a = (uint16_t)(addr + i);
+            uint8_t *page = this->write_map_[a >> NES_PAGE_SHIFT];
+            if (page) {
+                page[a & NES_PAGE_MASK] = (uint8_t)(v >> (i * 8));
+            }
+            else {
+                this->write_byte(a, (uint8_t)(v >> (i * 8)));
+            }
+        }
+    }
+
+    void memory::notify_write(uint16_t begin, size_t size)
+    {
+        for (size_t i = 0; i < size && begin + i < NES_MAX_RAM; ++i) {
+            this->check_watch((uint16_t)(begin + i));
+        }
+    }
+
+    void memory::track_dirty(bool on)
+    {
+        this->track_dirty_ = on;
+        memset(this->dirty_, 1, sizeof(this->dirty_));
+        if (on && !this->shadow_) {
+            // without the copy every page stays dirty, full saves still work
+            this->shadow_ = new(std::nothrow) uint8_t[NES_MAX_RAM]();
+        }
+        else if (!on) {
+            delete[] this->shadow_;
+            this->shadow_ = nullptr;
+        }
+    }
+
+    void memory::clear_dirty()
+    {
+        memset(this->dirty_, 0, sizeof(this->dirty_));
+        for (size_t page = 0; this->shadow_ && page < NES_PAGE_COUNT; ++page) {
+            if (this->write_backing_[page]) {
+                memcpy(this->shadow_ + (page << NES_PAGE_SHIFT), this->write_backing_[page], NES_PAGE_SIZE);
+            }
+        }
+    }
+
+    void memory::update_aliases()
+    {
+        // a handful of writable pages in a console, every one of them on a bare memory
+        for (size_t page = 0; page < NES_PAGE_COUNT; ++page) {
+            this->alias_[page] = (uint16_t)page;
+            uint8_t *backing = this->write_backing_[page];
+            for (size_t q = 0; backing && q < page; ++q) {
+                if (this->write_backing_[q] == backing) {
+                    this->alias_[page] = this->alias_[q];
+                    break;
+                }
+            }
+        }
+        this->aliases_stale_ = false;
+    }
+
+    size_t memory::dirty_pages()
+    {
+        if (this->aliases_stale_) {
+            this->update_aliases();
+        }
+        uint8_t dirty[NES_PAGE_COUNT] = {0};
+        size_t count = 0;
+        for (size_t page = 0; page < NES_PAGE_COUNT; ++page) {
+            uint16_t alias = this->alias_[page];
+            if (this->write_backing_[page] && !dirty[alias] && this->dirty(page)) {
+                dirty[alias] = 1;
+                count++;
+            }
+        }
+        return count;
+    }
+
+    /*
+        "MEM " chunk: u8 page shift, u32 count, count times u16 page and
+        its bytes. A page is saved under the first page mapping its
+        backing and is dirty when any of its mirrors is.
+    */
+    void memory::save_state(state_writer& w, bool incremental)
+    {
+        if (this->aliases_stale_) {
+            this->update_aliases();
+        }
+        uint8_t dirty[NES_PAGE_COUNT] = {0};
+        for (size_t page = 0; page < NES_PAGE_COUNT; ++page) {
+            if (this->write_backing_[page] && !dirty[this->alias_[page]] && this->dirty(page)) {
+                dirty[this->alias_[page]] = 1;
+            }
+        }
+
+        uint32_t count = 0;
+        for (size_t page = 0; page < NES_PAGE_COUNT; ++page) {
+            if (this->write_backing_[page] && this->alias_[page] == page && (!incremental || dirty[page])) {
+                count++;
+            }
+        }
+
+        w.begin("MEM ");
+        w.put<uint8_t>(NES_PAGE_SHIFT);
+        w.put(count);
+        for (size_t page = 0; page < NES_PAGE_COUNT; ++page) {
+            if (this->write_backing_[page] && this->alias_[page] == page && (!incremental || dirty[page])) {
+                w.put<uint16_t>((uint16_t)page);
+                w.bytes(this->write_backing_[page], NES_PAGE_SIZE);
+            }
+        }
+        w.end();
+    }
+
+    int memory::load_state(const state_reader& r)
+    {
+        state_reader c;
+        if (!r.find("MEM ", c) || c.get<uint8_t>() != NES_PAGE_SHIFT) {
+            return STATE_ERROR_FORMAT;
+        }
+        uint32_t count = c.get<uint32_t>();
+        // all or nothing, check the size before the first page goes in
+        if (!c.ok() || c.left() != (size_t)count * (2 + NES_PAGE_SIZE)) {
+            return STATE_ERROR_FORMAT;
+        }
+
+        state_reader check = c;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint16_t page = check.get<uint16_t>();
+            // not writable here, the state is from another mapping
+            if (page >= NES_PAGE_COUNT || this->write_backing_[page] == nullptr) {
+                return STATE_ERROR_FORMAT;
+            }
+            check.skip(NES_PAGE_SIZE);
+        }
+
+        if (this->aliases_stale_) {
+            this->update_aliases();
+        }
+        uint8_t loaded[NES_PAGE_COUNT] = {0};
+        for (uint32_t i = 0; i < count; ++i) {
+            uint16_t page = c.get<uint16_t>();
+            c.bytes(this->write_backing_[page], NES_PAGE_SIZE);
+            loaded[this->alias_[page]] = 1;
+        }
+
+        // the same bytes through every mirror, decoded code on any of them is stale
+        for (size_t page = 0; page < NES_PAGE_COUNT; ++page) {
+            if (this->write_backing_[page] && loaded[this->alias_[page]]) {
+                this->remapped(page);
+            }
+        }
+        return 0;
+    }
+    
     void memory::bzero()
     {
         memset(this->internal_ram_addr_space_, 0, NES_MAX_RAM);
+        this->notify_write(0, NES_MAX_RAM);
     }
 
     void memory::bzero(uint16_t begin, uint16_t end)
     {
         memset(this->internal_ram_addr_space_ + begin, 0, end - begin);
+        this->notify_write(begin, end - begin);
     }
 
 }
\ No newline at end of file
@@ -14,8 +14,28 @@
 
 #define NES_MAX_RAM 0x10000
 
+// granularity of the memory map, 256 pages of 256 bytes by default
+#ifndef NES_PAGE_SHIFT
+#define NES_PAGE_SHIFT 8
+#endif
+#define NES_PAGE_SIZE (1 << NES_PAGE_SHIFT)
+#define NES_PAGE_MASK (NES_PAGE_SIZE - 1)
+#define NES_PAGE_COUNT (NES_MAX_RAM >> NES_PAGE_SHIFT)
+
+// the slow path stays out of line so the fast one is a load, a test and the access
+#if defined(__GNUC__) || defined(__clang__)
+#define NES_MEM_LIKELY(x) __builtin_expect(!!(x), 1)
+#define NES_MEM_COLD __attribute__((noinline, cold))
+#else
+#define NES_MEM_LIKELY(x) (x)
+#define NES_MEM_COLD
+#endif
+
 
 namespace nes {
+
+    class state_writer;
+    class state_reader;
     
     struct address_offset {
         uint16_t start;
@@ -23,12 +43,111 @@ namespace nes {
     };
     
     static const address_offset g_stack_offset = { 0x1ff, 0x100 };
+
+    // gets told about writes to watched pages, e.g. to drop decoded code
+    class write_listener {
+    public:
+        virtual ~write_listener() {}
+        virtual void on_watched_write(uint16_t addr) = 0;
+        // the whole page now maps to something else
+        virtual void on_watched_remap(uint16_t page) = 0;
+    };
+
+    // gets told about every access to a trapped page, for watchpoints
+    class access_trap {
+    public:
+        virtual ~access_trap() {}
+        virtual void on_trapped_read(uint16_t addr, uint8_t v) = 0;
+        virtual void on_trapped_write(uint16_t addr, uint8_t v) = 0;
+    };
+
+    // I/O registers, cartridge mappers, ... anything that is not plain memory
+    class mmio_handler {
+    public:
+        virtual ~mmio_handler() {}
+        virtual uint8_t read(uint16_t addr) = 0;
+        virtual void write(uint16_t addr, uint8_t v) = 0;
+    };
     
+    /*
+        Page table address space.
+
+        Every page holds a host pointer for reads and one for writes,
+        read<T>/write<T> go straight through them. A null entry sends the
+        access down the slow path: the page's mmio_handler, a read-only
+        page (writes go to the handler or are dropped) or a write-trapped
+        page. Pages with decoded code on them are write-trapped, so the
+        fast path never has to look at the watch counts. Watching is per
+        address, a write through a mirror of a code page is not seen.
+
+        Read and write trapped pages report every access, after it is
+        done, to the access_trap: a debugger's watchpoints cost nothing on
+        the pages it does not watch.
+
+        Dirty tracking costs the fast path nothing: clear_dirty() copies
+        the writable pages aside and a page is dirty when it no longer
+        matches its copy, or was remapped since. Save states hold the
+        writable pages, each backing page once however many mirrors map
+        it; clear_dirty() after a snapshot makes the next one hold only
+        the pages changed since.
+
+        By default all pages map the internal 64 KiB array.
+    */
     class memory {
         
         uint8_t *internal_ram_addr_space_{nullptr};
         address_offset code_segment_offset_{0x00, 0x00};
 
+        uint8_t *read_map_[NES_PAGE_COUNT]{nullptr};
+        uint8_t *write_map_[NES_PAGE_COUNT]{nullptr};
+        uint8_t *read_backing_[NES_PAGE_COUNT]{nullptr};
+        uint8_t *write_backing_[NES_PAGE_COUNT]{nullptr};
+        mmio_handler *handler_[NES_PAGE_COUNT]{nullptr};
+
+        write_listener *listener_{nullptr};
+        uint16_t watch_count_[NES_PAGE_COUNT]{0};
+
+        access_trap *trap_{nullptr};
+        uint16_t read_trap_[NES_PAGE_COUNT]{0};
+        uint16_t write_trap_[NES_PAGE_COUNT]{0};
+
+        bool track_dirty_{false};
+        // remapped since the last clear_dirty(), whatever the bytes say
+        uint8_t dirty_[NES_PAGE_COUNT]{0};
+        // every page as of the last clear_dirty(), while tracking
+        uint8_t *shadow_{nullptr};
+        // first page mapping the same backing, valid unless aliases_stale_
+        uint16_t alias_[NES_PAGE_COUNT]{0};
+        bool aliases_stale_{true};
+
+        void check_watch(uint16_t addr)
+        {
+            if (this->watch_count_[addr >> NES_PAGE_SHIFT] && this->listener_) {
+                this->listener_->on_watched_write(addr);
+            }
+        }
+
+        void update_read_map(size_t page)
+        {
+            this->read_map_[page] = this->read_trap_[page] ? nullptr : this->read_backing_[page];
+        }
+
+        void update_write_map(size_t page)
+        {
+            bool trap = this->watch_count_[page] || this->write_trap_[page];
+            this->write_map_[page] = trap ? nullptr : this->write_backing_[page];
+        }
+
+        void update_aliases();
+
+        void remapped(size_t page);
+
+        uint8_t read_byte(uint16_t addr);
+        void write_byte(uint16_t addr, uint8_t v);
+        // size bytes little endian, wrapping at 0xffff
+        NES_MEM_COLD uint32_t read_slow(uint16_t addr, size_t size);
+        NES_MEM_COLD void write_slow(uint16_t addr, uint32_t v, size_t size);
+
     public:
         memory(const memory&) = delete;
         memory(memory&&) = delete;
@@ -38,7 +157,9 @@ namespace nes {
         memory() noexcept 
         :internal_ram_addr_space_(new(std::nothrow) uint8_t[NES_MAX_RAM]())
         {
-
+            if (this->internal_ram_addr_space_) {
+                this->map_memory(0, NES_MAX_RAM, this->internal_ram_addr_space_);
+            }
         }
 
         ~memory()
@@ -46,6 +167,7 @@ namespace nes {
             if (internal_ram_addr_space_) {
                 delete[] internal_ram_addr_space_;
             }
+            delete[] this->shadow_;
         }
 
         const address_offset& get_code_segment_offset() const
@@ -60,24 +182,170 @@ namespace nes {
         }
 
         
+        // host address of a directly mapped byte, nullptr for I/O pages
         uint8_t* map_offset_addr(uint16_t offset)
         {
-            //TODO
-            return this->internal_ram_addr_space_ + offset;
+            uint8_t *page = this->read_backing_[offset >> NES_PAGE_SHIFT];
+            return page ? page + (offset & NES_PAGE_MASK) : nullptr;
+        }
+
+        // the byte without going through an I/O handler or a trap, 0 on I/O pages; for debuggers and tracers
+        uint8_t peek(uint16_t addr) const
+        {
+            const uint8_t *page = this->read_backing_[addr >> NES_PAGE_SHIFT];
+            return page ? page[addr & NES_PAGE_MASK] : 0;
+        }
+
+        // the 3 bytes from addr on in the low 24 bits, little endian, as peek() sees them
+        uint32_t peek24(uint16_t addr) const
+        {
+            const uint8_t *page = this->read_backing_[addr >> NES_PAGE_SHIFT];
+            if (page && (addr & NES_PAGE_MASK) <= NES_PAGE_SIZE - 4) {
+                uint32_t v;
+                memcpy(&v, page + (addr & NES_PAGE_MASK), 4);
+                return v & 0xffffff;
+            }
+            return this->peek(addr) | this->peek((uint16_t)(addr + 1)) << 8 | this->peek((uint16_t)(addr + 2)) << 16;
+        }
+
+        // [addr, addr + size) reads from host, writes too unless read only;
+        // writes to read only pages go to the page's handler if it has one
+        void map_memory(uint16_t addr, size_t size, uint8_t *host, bool writable = true);
+
+        // read only host memory, e.g. PRG ROM straight out of the cartridge image
+        void map_rom(uint16_t addr, size_t size, const uint8_t *host)
+        {
+            this->map_memory(addr, size, const_cast<uint8_t *>(host), false);
+        }
+
+        // back to the internal array
+        void unmap(uint16_t addr, size_t size)
+        {
+            this->map_memory(addr, size, this->internal_ram_addr_space_ + addr);
+        }
+
+        // reads and writes of [addr, addr + size) go to handler,
+        // with reads=false only the writes, reads stay on the mapped memory
+        void map_handler(uint16_t addr, size_t size, mmio_handler *handler, bool reads = true);
+
+        uint8_t * const * read_map() const
+        {
+            return this->read_map_;
+        }
+
+        uint8_t * const * write_map() const
+        {
+            return this->write_map_;
         }
     
         template<typename T, typename T2>
         T read(T2 offset)
         {
-            T b = *((T *)this->map_offset_addr(offset));
-            return b;
+            uint16_t addr = (uint16_t)offset;
+            const uint8_t *page = this->read_map_[addr >> NES_PAGE_SHIFT];
+
+            // anything else, also a value across a page boundary, is one out of line call
+            if (NES_MEM_LIKELY(page && (addr & NES_PAGE_MASK) <= NES_PAGE_SIZE - sizeof(T))) {
+                T v;
+                memcpy(&v, page + (addr & NES_PAGE_MASK), sizeof(T));
+                return v;
+            }
+            return (T)this->read_slow(addr, sizeof(T));
         }
         
         template<typename T, typename T2>
         void write(T v, T2 offset)
         {
-            *((T *)this->map_offset_addr(offset)) = v;
+            uint16_t addr = (uint16_t)offset;
+            uint8_t *page = this->write_map_[addr >> NES_PAGE_SHIFT];
+
+            if (NES_MEM_LIKELY(page && (addr & NES_PAGE_MASK) <= NES_PAGE_SIZE - sizeof(T))) {
+                memcpy(page + (addr & NES_PAGE_MASK), &v, sizeof(T));
+                return;
+            }
+            this->write_slow(addr, (uint32_t)v, sizeof(T));
+        }
+
+        void set_write_listener(write_listener *listener)
+        {
+            this->listener_ = listener;
+        }
+
+        // watched pages trap every write and report it to the listener
+        void watch_page(uint16_t page)
+        {
+            this->watch_count_[page]++;
+            this->update_write_map(page);
+        }
+
+        void unwatch_page(uint16_t page)
+        {
+            this->watch_count_[page]--;
+            this->update_write_map(page);
+        }
+
+        void set_access_trap(access_trap *trap)
+        {
+            this->trap_ = trap;
+        }
+
+        // trapped pages take the slow path and report each access to the
+        // access_trap; counted, every trap needs its untrap
+        void trap_reads(uint16_t page)
+        {
+            this->read_trap_[page]++;
+            this->update_read_map(page);
+        }
+
+        void untrap_reads(uint16_t page)
+        {
+            this->read_trap_[page]--;
+            this->update_read_map(page);
+        }
+
+        void trap_writes(uint16_t page)
+        {
+            this->write_trap_[page]++;
+            this->update_write_map(page);
+        }
+
+        void untrap_writes(uint16_t page)
+        {
+            this->write_trap_[page]--;
+            this->update_write_map(page);
+        }
+
+        // report writes that bypassed write<T>, e.g. memcpy into map_offset_addr
+        void notify_write(uint16_t begin, size_t size);
+
+        // every page starts out dirty
+        void track_dirty(bool on);
+
+        bool tracking_dirty() const
+        {
+            return this->track_dirty_;
+        }
+
+        // changed since the last clear_dirty(), always true without tracking
+        bool dirty(uint16_t page) const
+        {
+            if (!this->track_dirty_ || !this->shadow_ || this->dirty_[page] || !this->write_backing_[page]) {
+                return true;
+            }
+            return memcmp(this->write_backing_[page], this->shadow_ + ((size_t)page << NES_PAGE_SHIFT), NES_PAGE_SIZE) != 0;
         }
+
+        // writable pages dirty through any of their mirrors
+        size_t dirty_pages();
+
+        void clear_dirty();
+
+        // the writable pages, only the dirty ones when incremental
+        void save_state(state_writer& w, bool incremental);
+
+        // 0 or STATE_ERROR_FORMAT, decoded code on the loaded pages is dropped.
+        // Dirty flags are left alone, the caller knows what the state was taken against.
+        int load_state(const state_reader& r);
         
         void bzero();
 
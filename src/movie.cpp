@@ -0,0 +1,371 @@
+#include "movie.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include "rewind.hpp"
+#include "state.hpp"
+
+#define NES_MOVIE_HEADER_SIZE 28
+
+
+namespace nes {
+
+    static const char g_movie_magic[4] = { 'V', 'N', 'M', 'V' };
+
+    void movie::start(console& nes)
+    {
+        this->initial_.clear();
+        nes.save_state(this->initial_);
+        this->input_.clear();
+        this->keyframes_.clear();
+    }
+
+    bool movie::record(console& nes, uint8_t port0, uint8_t port1)
+    {
+        nes.set_buttons(0, port0);
+        nes.set_buttons(1, port1);
+        bool ok = nes.run_frame();
+        this->input_.push_back(port0);
+        this->input_.push_back(port1);
+
+        if (this->frames() % this->interval_ == 0) {
+            movie_keyframe kf;
+            kf.frame = this->frames();
+            kf.hash = frame_hash(nes.frame());
+            this->scratch_.clear();
+            nes.save_state(this->scratch_);
+            kf.size = (uint32_t)this->scratch_.size();
+
+            // against the initial state, any keyframe unpacks on its own
+            std::vector<uint8_t> base(this->initial_);
+            size_t n = std::max(base.size(), this->scratch_.size());
+            base.resize(n, 0);
+            this->scratch_.resize(n, 0);
+            rewind_buffer::xor_pack(base.data(), this->scratch_.data(), n, kf.packed);
+            this->keyframes_.push_back(std::move(kf));
+        }
+        return ok;
+    }
+
+    const movie_keyframe* movie::keyframe_before(uint32_t frame) const
+    {
+        auto it = std::upper_bound(this->keyframes_.begin(), this->keyframes_.end(), frame,
+                                   [](uint32_t f, const movie_keyframe& kf) { return f < kf.frame; });
+        return it == this->keyframes_.begin() ? nullptr : &*(it - 1);
+    }
+
+    const movie_keyframe* movie::keyframe_at(uint32_t frame) const
+    {
+        const movie_keyframe *kf = this->keyframe_before(frame);
+        return kf && kf->frame == frame ? kf : nullptr;
+    }
+
+    int movie::seek(console& nes, uint32_t frame)
+    {
+        if (frame > this->frames() || this->initial_.empty()) {
+            return MOVIE_ERROR_RANGE;
+        }
+
+        const movie_keyframe *kf = this->keyframe_before(frame);
+        this->scratch_ = this->initial_;
+        if (kf) {
+            size_t n = std::max(this->scratch_.size(), (size_t)kf->size);
+            this->scratch_.resize(n, 0);
+            if (!rewind_buffer::xor_unpack(kf->packed.data(), kf->packed.size(), this->scratch_.data(), n)) {
+                return MOVIE_ERROR_FORMAT;
+            }
+            this->scratch_.resize(kf->size);
+        }
+
+        int err = nes.load_state(this->scratch_.data(), this->scratch_.size());
+        return err ? err : this->play(nes, kf ? kf->frame : 0, frame);
+    }
+
+    int movie::play(console& nes, uint32_t from, uint32_t to)
+    {
+        if (from > to || to > this->frames()) {
+            return MOVIE_ERROR_RANGE;
+        }
+        for (uint32_t f = from; f < to; ++f) {
+            nes.set_buttons(0, this->input_[2 * (size_t)f]);
+            nes.set_buttons(1, this->input_[2 * (size_t)f + 1]);
+            // a recording that ran into a halt halts in the same frame here
+            nes.run_frame();
+            if ((f + 1) % this->interval_ == 0) {
+                const movie_keyframe *kf = this->keyframe_at(f + 1);
+                if (kf && frame_hash(nes.frame()) != kf->hash) {
+                    return MOVIE_ERROR_DESYNC;
+                }
+            }
+        }
+        return 0;
+    }
+
+    void movie::save(std::vector<uint8_t>& out) const
+    {
+        size_t index = NES_MOVIE_HEADER_SIZE + this->initial_.size() + this->input_.size();
+        for (const movie_keyframe& kf : this->keyframes_) {
+            index += 16 + kf.packed.size();
+        }
+
+        size_t base = out.size();
+        state_writer w(out);
+        w.bytes(g_movie_magic, sizeof(g_movie_magic));
+        w.put<uint16_t>(NES_MOVIE_VERSION);
+        w.put<uint16_t>(0);
+        w.put(this->interval_);
+        w.put(this->frames());
+        w.put<uint32_t>((uint32_t)this->keyframes_.size());
+        w.put<uint32_t>((uint32_t)index);
+        w.put<uint32_t>((uint32_t)this->initial_.size());
+        w.bytes(this->initial_.data(), this->initial_.size());
+        w.bytes(this->input_.data(), this->input_.size());
+
+        std::vector<uint32_t> offsets;
+        for (const movie_keyframe& kf : this->keyframes_) {
+            offsets.push_back((uint32_t)(out.size() - base));
+            w.put(kf.frame);
+            w.put(kf.hash);
+            w.put(kf.size);
+            w.put<uint32_t>((uint32_t)kf.packed.size());
+            w.bytes(kf.packed.data(), kf.packed.size());
+        }
+        assert(out.size() - base == index);
+        for (size_t i = 0; i < this->keyframes_.size(); ++i) {
+            w.put(this->keyframes_[i].frame);
+            w.put(offsets[i]);
+        }
+    }
+
+    int movie::save(const char *path) const
+    {
+        std::vector<uint8_t> out;
+        this->save(out);
+        FILE *f = fopen(path, "wb");
+        if (!f) {
+            return MOVIE_ERROR_OPEN;
+        }
+        size_t n = fwrite(out.data(), 1, out.size(), f);
+        return fclose(f) == 0 && n == out.size() ? 0 : MOVIE_ERROR_OPEN;
+    }
+
+    int movie::load(const uint8_t *data, size_t size)
+    {
+        if (size < NES_MOVIE_HEADER_SIZE || memcmp(data, g_movie_magic, sizeof(g_movie_magic)) != 0) {
+            return MOVIE_ERROR_FORMAT;
+        }
+        state_reader r(data + sizeof(g_movie_magic), size - sizeof(g_movie_magic));
+        if (r.get<uint16_t>() > NES_MOVIE_VERSION) {
+            return MOVIE_ERROR_VERSION;
+        }
+        r.get<uint16_t>();
+        uint32_t interval = r.get<uint32_t>();
+        uint32_t frames = r.get<uint32_t>();
+        uint32_t count = r.get<uint32_t>();
+        uint32_t index = r.get<uint32_t>();
+        uint32_t initial = r.get<uint32_t>();
+        if (interval == 0 || index > size || (size - index) / 8 < count ||
+            r.left() < (size_t)initial + 2 * (size_t)frames) {
+            return MOVIE_ERROR_FORMAT;
+        }
+
+        std::vector<uint8_t> start(initial);
+        std::vector<uint8_t> input(2 * (size_t)frames);
+        r.bytes(start.data(), start.size());
+        r.bytes(input.data(), input.size());
+
+        // the index leads to every keyframe, in frame order, all of them after the input
+        size_t first = NES_MOVIE_HEADER_SIZE + start.size() + input.size();
+        std::vector<movie_keyframe> keyframes(count);
+        state_reader table(data + index, size - index);
+        for (uint32_t i = 0; i < count; ++i) {
+            movie_keyframe& kf = keyframes[i];
+            uint32_t frame = table.get<uint32_t>();
+            uint32_t offset = table.get<uint32_t>();
+            if (offset < first || offset > index) {
+                return MOVIE_ERROR_FORMAT;
+            }
+            state_reader k(data + offset, index - offset);
+            kf.frame = k.get<uint32_t>();
+            kf.hash = k.get<uint32_t>();
+            kf.size = k.get<uint32_t>();
+            uint32_t packed = k.get<uint32_t>();
+            if (!k.ok() || kf.frame != frame || frame > frames || (i && frame <= keyframes[i - 1].frame) ||
+                packed > k.left()) {
+                return MOVIE_ERROR_FORMAT;
+            }
+            kf.packed.resize(packed);
+            k.bytes(kf.packed.data(), packed);
+        }
+
+        this->interval_ = interval;
+        this->initial_.swap(start);
+        this->input_.swap(input);
+        this->keyframes_.swap(keyframes);
+        return 0;
+    }
+
+    int movie::load(const char *path)
+    {
+        FILE *f = fopen(path, "rb");
+        if (!f) {
+            return MOVIE_ERROR_OPEN;
+        }
+        std::vector<uint8_t> data;
+        uint8_t buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            data.insert(data.end(), buf, buf + n);
+        }
+        fclose(f);
+        return this->load(data.data(), data.size());
+    }
+
+    /*
+        The NMI reads pad 0 and adds it to $00, which is also the X
+        scroll, so RAM and the picture depend on every frame's input.
+    */
+    void movie::test()
+    {
+        static const uint8_t program[] = {
+            0x78,                   // reset: SEI
+            0xa2, 0xff,             // LDX #$FF
+            0x9a,                   // TXS
+            0xa9, 0x40,             // LDA #$40
+            0x8d, 0x17, 0x40,       // STA $4017
+            0xa9, 0x3f,             // LDA #$3F
+            0x8d, 0x06, 0x20,       // STA $2006
+            0xa9, 0x00,             // LDA #$00
+            0x8d, 0x06, 0x20,       // STA $2006
+            0xa2, 0x00,             // LDX #$00
+            0x8e, 0x07, 0x20,       // palette: STX $2007
+            0xe8,                   // INX
+            0xe0, 0x20,             // CPX #$20
+            0xd0, 0xf8,             // BNE palette
+            0xa9, 0x1e,             // LDA #$1E
+            0x8d, 0x01, 0x20,       // STA $2001
+            0xa9, 0x80,             // LDA #$80
+            0x8d, 0x00, 0x20,       // STA $2000
+            0x4c, 0x27, 0x80,       // loop: JMP loop
+            0xa9, 0x01,             // nmi: LDA #$01
+            0x8d, 0x16, 0x40,       // STA $4016
+            0xa9, 0x00,             // LDA #$00
+            0x8d, 0x16, 0x40,       // STA $4016
+            0xa2, 0x08,             // LDX #$08
+            0xad, 0x16, 0x40,       // read: LDA $4016
+            0x4a,                   // LSR A
+            0x26, 0x01,             // ROL $01
+            0xca,                   // DEX
+            0xd0, 0xf7,             // BNE read
+            0xa5, 0x00,             // LDA $00
+            0x18,                   // CLC
+            0x65, 0x01,             // ADC $01
+            0x85, 0x00,             // STA $00
+            0x8d, 0x05, 0x20,       // STA $2005
+            0x8d, 0x05, 0x20,       // STA $2005
+            0x40,                   // RTI
+        };
+        std::vector<uint8_t> image(NES_HEADER_SIZE + 2 * NES_PRG_BANK_SIZE + NES_CHR_BANK_SIZE, 0);
+        memcpy(image.data(), "NES\x1a", 4);
+        image[4] = 2;
+        image[5] = 1;
+        uint8_t *prg = image.data() + NES_HEADER_SIZE;
+        memcpy(prg, program, sizeof(program));
+        static const uint8_t vectors[] = { 0x2a, 0x80, 0x00, 0x80, 0x00, 0x80 };
+        memcpy(prg + 0x7ffa, vectors, sizeof(vectors));
+        uint32_t seed = 0x6b43a9b5;
+        for (size_t i = 0; i < NES_CHR_BANK_SIZE; ++i) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            prg[2 * NES_PRG_BANK_SIZE + i] = (uint8_t)seed;
+        }
+
+        const uint32_t frames = 250;
+        std::vector<uint32_t> hashes;
+        std::vector<uint8_t> at_200;
+        std::vector<uint8_t> saved;
+        {
+            console nes;
+            int err = nes.load(image.data(), image.size());
+            assert(err == 0);
+            (void)err;
+            nes.run_frame();
+
+            movie m(60);
+            m.start(nes);
+            for (uint32_t f = 0; f < frames; ++f) {
+                bool ok = m.record(nes, (uint8_t)(f * 37 + (f >> 3)), 0);
+                assert(ok);
+                (void)ok;
+                hashes.push_back(frame_hash(nes.frame()));
+                if (f + 1 == 200) {
+                    nes.save_state(at_200);
+                }
+            }
+            assert(m.frames() == frames && m.keyframes() == 4);
+            m.save(saved);
+        }
+
+        movie m;
+        int err = m.load(saved.data(), saved.size());
+        assert(err == 0 && m.frames() == frames && m.interval() == 60 && m.keyframes() == 4);
+        assert(m.buttons(1, 0) == 37);
+
+        console nes;
+        err = nes.load(image.data(), image.size());
+        assert(err == 0);
+        // from the start, every keyframe checked on the way
+        err = m.seek(nes, 0);
+        assert(err == 0);
+        err = m.play(nes, 0, frames);
+        assert(err == 0 && frame_hash(nes.frame()) == hashes[frames - 1]);
+
+        // from the keyframe at 180, 20 frames played
+        err = m.seek(nes, 200);
+        assert(err == 0 && frame_hash(nes.frame()) == hashes[199]);
+        std::vector<uint8_t> now;
+        nes.save_state(now);
+        assert(now.size() == at_200.size());
+        assert(memcmp(now.data() + NES_STATE_HEADER_SIZE, at_200.data() + NES_STATE_HEADER_SIZE,
+                      now.size() - NES_STATE_HEADER_SIZE) == 0);
+        err = m.seek(nes, frames + 1);
+        assert(err == MOVIE_ERROR_RANGE);
+
+        // other input, the keyframe at 60 does not match any more
+        std::vector<uint8_t> edited(saved);
+        edited[NES_MOVIE_HEADER_SIZE + (edited[24] | edited[25] << 8 | edited[26] << 16) + 2 * 10] ^= BUTTON_RIGHT;
+        movie bad;
+        err = bad.load(edited.data(), edited.size());
+        assert(err == 0);
+        err = bad.seek(nes, 0);
+        assert(err == 0);
+        err = bad.play(nes, 0, frames);
+        assert(err == MOVIE_ERROR_DESYNC);
+
+        // a keyframe the index puts on the input, which reads as one
+        edited = saved;
+        size_t input = NES_MOVIE_HEADER_SIZE + (edited[24] | edited[25] << 8 | edited[26] << 16);
+        size_t index = edited[20] | edited[21] << 8 | edited[22] << 16;
+        memset(&edited[input], 0, 16);
+        memcpy(&edited[input], &edited[index], 4);
+        edited[index + 4] = (uint8_t)input;
+        edited[index + 5] = (uint8_t)(input >> 8);
+        edited[index + 6] = (uint8_t)(input >> 16);
+        edited[index + 7] = 0;
+        err = bad.load(edited.data(), edited.size());
+        assert(err == MOVIE_ERROR_FORMAT);
+
+        edited = saved;
+        edited[4] = NES_MOVIE_VERSION + 1;
+        err = bad.load(edited.data(), edited.size());
+        assert(err == MOVIE_ERROR_VERSION);
+
+        edited = saved;
+        edited.resize(saved.size() - 1);
+        err = bad.load(edited.data(), edited.size());
+        assert(err == MOVIE_ERROR_FORMAT);
+        (void)err;
+    }
+
+}
@@ -0,0 +1,119 @@
+#ifndef movie_hpp
+#define movie_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "console.hpp"
+
+#define NES_MOVIE_VERSION 1
+// a keyframe every 10 s of play
+#define NES_MOVIE_INTERVAL 600
+
+#define MOVIE_ERROR_OPEN -40
+#define MOVIE_ERROR_FORMAT -41
+#define MOVIE_ERROR_DESYNC -42
+#define MOVIE_ERROR_RANGE -43
+#define MOVIE_ERROR_VERSION -44
+
+
+namespace nes {
+
+    // the machine after frame frames, the picture of the last one hashes to hash
+    struct movie_keyframe {
+        uint32_t frame;
+        uint32_t hash;
+        uint32_t size;
+        std::vector<uint8_t> packed;    // XOR of the state against the initial one, see rewind_buffer
+    };
+
+    /*
+        Input movie: a save state to start from, two bytes of BUTTON_*
+        bits per frame (port 0, port 1) and a keyframe every interval
+        frames. File layout, little endian:
+
+            "VNMV" u16 version u16 0 u32 interval u32 frames
+            u32 keyframes u32 index offset u32 initial size
+            initial state, frames * 2 input bytes
+            keyframes: u32 frame u32 hash u32 state size u32 packed size, packed
+            index: u32 frame u32 offset for each keyframe
+
+        seek() starts from the last keyframe at or before the frame and
+        only plays the frames after it. Playback compares the picture at
+        every keyframe it passes with the recorded hash, so a long session
+        is verified as it replays.
+    */
+    class movie {
+
+        uint32_t interval_;
+        std::vector<uint8_t> initial_;
+        std::vector<uint8_t> input_;
+        std::vector<movie_keyframe> keyframes_;
+        std::vector<uint8_t> scratch_;
+
+        // the last keyframe at or before frame, nullptr for the initial state
+        const movie_keyframe* keyframe_before(uint32_t frame) const;
+        const movie_keyframe* keyframe_at(uint32_t frame) const;
+
+    public:
+        movie(const movie&) = delete;
+        movie(movie&&) = delete;
+        movie& operator=(const movie&) = delete;
+        movie& operator=(movie&&) = delete;
+
+        explicit movie(uint32_t interval = NES_MOVIE_INTERVAL) noexcept
+        :interval_(interval ? interval : NES_MOVIE_INTERVAL)
+        {
+        }
+
+        // a new recording from where nes is now
+        void start(console& nes);
+
+        // one frame with these buttons, false once the CPU halted
+        bool record(console& nes, uint8_t port0, uint8_t port1);
+
+        uint32_t frames() const
+        {
+            return (uint32_t)(this->input_.size() / 2);
+        }
+
+        uint32_t interval() const
+        {
+            return this->interval_;
+        }
+
+        size_t keyframes() const
+        {
+            return this->keyframes_.size();
+        }
+
+        // BUTTON_* bits of port at frame
+        uint8_t buttons(uint32_t frame, int port) const
+        {
+            return this->input_[2 * (size_t)frame + (port & 1)];
+        }
+
+        // nes after frame frames: 0, MOVIE_ERROR_RANGE, MOVIE_ERROR_DESYNC or STATE_ERROR_*
+        int seek(console& nes, uint32_t frame);
+
+        // plays frames [from, to) on nes, which has to be at frame from:
+        // 0, MOVIE_ERROR_RANGE, MOVIE_ERROR_DESYNC when a keyframe's picture differs
+        int play(console& nes, uint32_t from, uint32_t to);
+
+        void save(std::vector<uint8_t>& out) const;
+        // 0, MOVIE_ERROR_OPEN
+        int save(const char *path) const;
+
+        // 0, MOVIE_ERROR_FORMAT or MOVIE_ERROR_VERSION
+        int load(const uint8_t *data, size_t size);
+        // 0, MOVIE_ERROR_OPEN, MOVIE_ERROR_FORMAT or MOVIE_ERROR_VERSION
+        int load(const char *path);
+
+        static void test();
+    };
+
+}
+
+
+#endif /* movie_hpp */
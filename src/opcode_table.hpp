@@ -0,0 +1,390 @@
+#ifndef opcode_table_hpp
+#define opcode_table_hpp
+
+#include <cstdint>
+
+
+/*
+    One row per opcode, 0x00 - 0xFF in order.
+
+        OP(code, addressing, operation, cycles)     regular instruction
+        TRAP(code, addressing, operation, cycles)   stops the dispatch loop (BRK)
+        ILL(code)                                   unknown instruction
+
+    addressing expands to this->addressing##_addressing(), operation to this->operation().
+    Every backend, cpu_6502::eval included, and g_opcode_info below are
+    generated from this table.
+*/
+
+// operand bytes following the opcode, by addressing mode
+#define NES_OPERAND_LEN(mode) NES_OPERAND_LEN_##mode
+#define NES_OPERAND_LEN_implied     0
+#define NES_OPERAND_LEN_accumulator 0
+#define NES_OPERAND_LEN_immediate   1
+#define NES_OPERAND_LEN_zero_page   1
+#define NES_OPERAND_LEN_zero_page_x 1
+#define NES_OPERAND_LEN_zero_page_y 1
+#define NES_OPERAND_LEN_relative    1
+#define NES_OPERAND_LEN_absolute    2
+#define NES_OPERAND_LEN_absolute_x  2
+#define NES_OPERAND_LEN_absolute_y  2
+#define NES_OPERAND_LEN_indirect    2
+#define NES_OPERAND_LEN_indirect_x  1
+#define NES_OPERAND_LEN_indirect_y  1
+
+// 1 when indexing can carry into the next page and cost a cycle, see cross_page_cycles(); only
+// reads pay it, stores and read-modify-writes always spend that cycle and have it in their count;
+// a taken branch is timed on its own, see take_branch()
+#define NES_PAGE_PENALTY(mode) NES_PAGE_PENALTY_##mode
+#define NES_PAGE_PENALTY_implied     0
+#define NES_PAGE_PENALTY_accumulator 0
+#define NES_PAGE_PENALTY_immediate   0
+#define NES_PAGE_PENALTY_zero_page   0
+#define NES_PAGE_PENALTY_zero_page_x 0
+#define NES_PAGE_PENALTY_zero_page_y 0
+#define NES_PAGE_PENALTY_relative    0
+#define NES_PAGE_PENALTY_absolute    0
+#define NES_PAGE_PENALTY_absolute_x  1
+#define NES_PAGE_PENALTY_absolute_y  1
+#define NES_PAGE_PENALTY_indirect    0
+#define NES_PAGE_PENALTY_indirect_x  0
+#define NES_PAGE_PENALTY_indirect_y  1
+
+#define NES_OPCODE_TABLE(OP, TRAP, ILL) \
+    TRAP(0x00, implied,     BRK,  7) \
+      OP(0x01, indirect_x,  ORA,  6) \
+     ILL(0x02) \
+     ILL(0x03) \
+      OP(0x04, zero_page,   NOP,  3) \
+      OP(0x05, zero_page,   ORA,  3) \
+      OP(0x06, zero_page,   ASL,  5) \
+     ILL(0x07) \
+      OP(0x08, implied,     PHP,  3) \
+      OP(0x09, immediate,   ORA,  2) \
+      OP(0x0A, accumulator, ASLA, 2) \
+     ILL(0x0B) \
+      OP(0x0C, absolute,    NOP,  4) \
+      OP(0x0D, absolute,    ORA,  4) \
+      OP(0x0E, absolute,    ASL,  6) \
+     ILL(0x0F) \
+      OP(0x10, relative,    BPL,  2) \
+      OP(0x11, indirect_y,  ORA,  5) \
+     ILL(0x12) \
+     ILL(0x13) \
+      OP(0x14, zero_page_x, NOP,  4) \
+      OP(0x15, zero_page_x, ORA,  4) \
+      OP(0x16, zero_page_x, ASL,  6) \
+     ILL(0x17) \
+      OP(0x18, implied,     CLC,  2) \
+      OP(0x19, absolute_y,  ORA,  4) \
+      OP(0x1A, implied,     NOP,  2) \
+     ILL(0x1B) \
+      OP(0x1C, absolute_x,  NOP,  4) \
+      OP(0x1D, absolute_x,  ORA,  4) \
+      OP(0x1E, absolute_x,  ASL,  7) \
+     ILL(0x1F) \
+      OP(0x20, absolute,    JSR,  6) \
+      OP(0x21, indirect_x,  AND,  6) \
+     ILL(0x22) \
+     ILL(0x23) \
+      OP(0x24, zero_page,   BIT,  3) \
+      OP(0x25, zero_page,   AND,  3) \
+      OP(0x26, zero_page,   ROL,  5) \
+     ILL(0x27) \
+      OP(0x28, implied,     PLP,  4) \
+      OP(0x29, immediate,   AND,  2) \
+      OP(0x2A, accumulator, ROLA, 2) \
+     ILL(0x2B) \
+      OP(0x2C, absolute,    BIT,  4) \
+      OP(0x2D, absolute,    AND,  4) \
+      OP(0x2E, absolute,    ROL,  6) \
+     ILL(0x2F) \
+      OP(0x30, relative,    BMI,  2) \
+      OP(0x31, indirect_y,  AND,  5) \
+     ILL(0x32) \
+     ILL(0x33) \
+      OP(0x34, zero_page_x, NOP,  4) \
+      OP(0x35, zero_page_x, AND,  4) \
+      OP(0x36, zero_page_x, ROL,  6) \
+     ILL(0x37) \
+      OP(0x38, implied,     SEC,  2) \
+      OP(0x39, absolute_y,  AND,  4) \
+      OP(0x3A, implied,     NOP,  2) \
+     ILL(0x3B) \
+      OP(0x3C, absolute_x,  NOP,  4) \
+      OP(0x3D, absolute_x,  AND,  4) \
+      OP(0x3E, absolute_x,  ROL,  7) \
+     ILL(0x3F) \
+      OP(0x40, implied,     RTI,  6) \
+      OP(0x41, indirect_x,  EOR,  6) \
+     ILL(0x42) \
+     ILL(0x43) \
+      OP(0x44, zero_page,   NOP,  3) \
+      OP(0x45, zero_page,   EOR,  3) \
+      OP(0x46, zero_page,   LSR,  5) \
+     ILL(0x47) \
+      OP(0x48, implied,     PHA,  3) \
+      OP(0x49, immediate,   EOR,  2) \
+      OP(0x4A, accumulator, LSRA, 2) \
+     ILL(0x4B) \
+      OP(0x4C, absolute,    JMP,  3) \
+      OP(0x4D, absolute,    EOR,  4) \
+      OP(0x4E, absolute,    LSR,  6) \
+     ILL(0x4F) \
+      OP(0x50, relative,    BVC,  2) \
+      OP(0x51, indirect_y,  EOR,  5) \
+     ILL(0x52) \
+     ILL(0x53) \
+      OP(0x54, zero_page_x, NOP,  4) \
+      OP(0x55, zero_page_x, EOR,  4) \
+      OP(0x56, zero_page_x, LSR,  6) \
+     ILL(0x57) \
+      OP(0x58, implied,     CLI,  2) \
+      OP(0x59, absolute_y,  EOR,  4) \
+      OP(0x5A, implied,     NOP,  2) \
+     ILL(0x5B) \
+      OP(0x5C, absolute_x,  NOP,  4) \
+      OP(0x5D, absolute_x,  EOR,  4) \
+      OP(0x5E, absolute_x,  LSR,  7) \
+     ILL(0x5F) \
+      OP(0x60, implied,     RTS,  6) \
+      OP(0x61, indirect_x,  ADC,  6) \
+     ILL(0x62) \
+     ILL(0x63) \
+      OP(0x64, zero_page,   NOP,  3) \
+      OP(0x65, zero_page,   ADC,  3) \
+      OP(0x66, zero_page,   ROR,  5) \
+     ILL(0x67) \
+      OP(0x68, implied,     PLA,  4) \
+      OP(0x69, immediate,   ADC,  2) \
+      OP(0x6A, accumulator, RORA, 2) \
+     ILL(0x6B) \
+      OP(0x6C, indirect,    JMP,  5) \
+      OP(0x6D, absolute,    ADC,  4) \
+      OP(0x6E, absolute,    ROR,  6) \
+     ILL(0x6F) \
+      OP(0x70, relative,    BVS,  2) \
+      OP(0x71, indirect_y,  ADC,  5) \
+     ILL(0x72) \
+     ILL(0x73) \
+      OP(0x74, zero_page_x, NOP,  4) \
+      OP(0x75, zero_page_x, ADC,  4) \
+      OP(0x76, zero_page_x, ROR,  6) \
+     ILL(0x77) \
+      OP(0x78, implied,     SEI,  2) \
+      OP(0x79, absolute_y,  ADC,  4) \
+      OP(0x7A, implied,     NOP,  2) \
+     ILL(0x7B) \
+      OP(0x7C, absolute_x,  NOP,  4) \
+      OP(0x7D, absolute_x,  ADC,  4) \
+      OP(0x7E, absolute_x,  ROR,  7) \
+     ILL(0x7F) \
+      OP(0x80, immediate,   NOP,  2) \
+      OP(0x81, indirect_x,  STA,  6) \
+     ILL(0x82) \
+     ILL(0x83) \
+      OP(0x84, zero_page,   STY,  3) \
+      OP(0x85, zero_page,   STA,  3) \
+      OP(0x86, zero_page,   STX,  3) \
+     ILL(0x87) \
+      OP(0x88, implied,     DEY,  2) \
+     ILL(0x89) \
+      OP(0x8A, implied,     TXA,  2) \
+     ILL(0x8B) \
+      OP(0x8C, absolute,    STY,  4) \
+      OP(0x8D, absolute,    STA,  4) \
+      OP(0x8E, absolute,    STX,  4) \
+     ILL(0x8F) \
+      OP(0x90, relative,    BCC,  2) \
+      OP(0x91, indirect_y,  STA,  6) \
+     ILL(0x92) \
+     ILL(0x93) \
+      OP(0x94, zero_page_x, STY,  4) \
+      OP(0x95, zero_page_x, STA,  4) \
+      OP(0x96, zero_page_y, STX,  4) \
+     ILL(0x97) \
+      OP(0x98, implied,     TYA,  2) \
+      OP(0x99, absolute_y,  STA,  5) \
+      OP(0x9A, implied,     TXS,  2) \
+     ILL(0x9B) \
+     ILL(0x9C) \
+      OP(0x9D, absolute_x,  STA,  5) \
+     ILL(0x9E) \
+     ILL(0x9F) \
+      OP(0xA0, immediate,   LDY,  2) \
+      OP(0xA1, indirect_x,  LDA,  6) \
+      OP(0xA2, immediate,   LDX,  2) \
+     ILL(0xA3) \
+      OP(0xA4, zero_page,   LDY,  3) \
+      OP(0xA5, zero_page,   LDA,  3) \
+      OP(0xA6, zero_page,   LDX,  3) \
+     ILL(0xA7) \
+      OP(0xA8, implied,     TAY,  2) \
+      OP(0xA9, immediate,   LDA,  2) \
+      OP(0xAA, implied,     TAX,  2) \
+     ILL(0xAB) \
+      OP(0xAC, absolute,    LDY,  4) \
+      OP(0xAD, absolute,    LDA,  4) \
+      OP(0xAE, absolute,    LDX,  4) \
+     ILL(0xAF) \
+      OP(0xB0, relative,    BCS,  2) \
+      OP(0xB1, indirect_y,  LDA,  5) \
+     ILL(0xB2) \
+     ILL(0xB3) \
+      OP(0xB4, zero_page_x, LDY,  4) \
+      OP(0xB5, zero_page_x, LDA,  4) \
+      OP(0xB6, zero_page_y, LDX,  4) \
+     ILL(0xB7) \
+      OP(0xB8, implied,     CLV,  2) \
+      OP(0xB9, absolute_y,  LDA,  4) \
+      OP(0xBA, implied,     TSX,  2) \
+     ILL(0xBB) \
+      OP(0xBC, absolute_x,  LDY,  4) \
+      OP(0xBD, absolute_x,  LDA,  4) \
+      OP(0xBE, absolute_y,  LDX,  4) \
+     ILL(0xBF) \
+      OP(0xC0, immediate,   CPY,  2) \
+      OP(0xC1, indirect_x,  CMP,  6) \
+     ILL(0xC2) \
+     ILL(0xC3) \
+      OP(0xC4, zero_page,   CPY,  3) \
+      OP(0xC5, zero_page,   CMP,  3) \
+      OP(0xC6, zero_page,   DEC,  5) \
+     ILL(0xC7) \
+      OP(0xC8, implied,     INY,  2) \
+      OP(0xC9, immediate,   CMP,  2) \
+      OP(0xCA, implied,     DEX,  2) \
+     ILL(0xCB) \
+      OP(0xCC, absolute,    CPY,  4) \
+      OP(0xCD, absolute,    CMP,  4) \
+      OP(0xCE, absolute,    DEC,  6) \
+     ILL(0xCF) \
+      OP(0xD0, relative,    BNE,  2) \
+      OP(0xD1, indirect_y,  CMP,  5) \
+     ILL(0xD2) \
+     ILL(0xD3) \
+      OP(0xD4, zero_page_x, NOP,  4) \
+      OP(0xD5, zero_page_x, CMP,  4) \
+      OP(0xD6, zero_page_x, DEC,  6) \
+     ILL(0xD7) \
+      OP(0xD8, implied,     CLD,  2) \
+      OP(0xD9, absolute_y,  CMP,  4) \
+      OP(0xDA, implied,     NOP,  2) \
+     ILL(0xDB) \
+      OP(0xDC, absolute_x,  NOP,  4) \
+      OP(0xDD, absolute_x,  CMP,  4) \
+      OP(0xDE, absolute_x,  DEC,  7) \
+     ILL(0xDF) \
+      OP(0xE0, immediate,   CPX,  2) \
+      OP(0xE1, indirect_x,  SBC,  6) \
+     ILL(0xE2) \
+     ILL(0xE3) \
+      OP(0xE4, zero_page,   CPX,  3) \
+      OP(0xE5, zero_page,   SBC,  3) \
+      OP(0xE6, zero_page,   INC,  5) \
+     ILL(0xE7) \
+      OP(0xE8, implied,     INX,  2) \
+      OP(0xE9, immediate,   SBC,  2) \
+      OP(0xEA, implied,     NOP,  2) \
+     ILL(0xEB) \
+      OP(0xEC, absolute,    CPX,  4) \
+      OP(0xED, absolute,    SBC,  4) \
+      OP(0xEE, absolute,    INC,  6) \
+     ILL(0xEF) \
+      OP(0xF0, relative,    BEQ,  2) \
+      OP(0xF1, indirect_y,  SBC,  5) \
+     ILL(0xF2) \
+     ILL(0xF3) \
+      OP(0xF4, zero_page_x, NOP,  4) \
+      OP(0xF5, zero_page_x, SBC,  4) \
+      OP(0xF6, zero_page_x, INC,  6) \
+     ILL(0xF7) \
+      OP(0xF8, implied,     SED,  2) \
+      OP(0xF9, absolute_y,  SBC,  4) \
+      OP(0xFA, implied,     NOP,  2) \
+     ILL(0xFB) \
+      OP(0xFC, absolute_x,  NOP,  4) \
+      OP(0xFD, absolute_x,  SBC,  4) \
+      OP(0xFE, absolute_x,  INC,  7) \
+     ILL(0xFF)
+
+
+namespace nes {
+
+    enum class addressing_mode : uint8_t {
+        implied,
+        accumulator,
+        immediate,
+        zero_page,
+        zero_page_x,
+        zero_page_y,
+        relative,
+        absolute,
+        absolute_x,
+        absolute_y,
+        indirect,
+        indirect_x,
+        indirect_y,
+    };
+
+    struct opcode_info {
+        char mnemonic[4];       // "ASL" for ASLA as well, "???" when unknown
+        addressing_mode mode;
+        uint8_t len;            // opcode and operand bytes
+        uint8_t cycles;         // before the page penalty
+        uint8_t page_penalty;
+        uint8_t official;       // the undocumented NOPs are not
+        uint8_t known;          // 0 for ILL rows
+        uint8_t trap;           // stops the dispatch loop
+    };
+
+    static constexpr bool same_op(const char *a, const char *b)
+    {
+        return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && a[3] == b[3];
+    }
+
+    // the operations that write their operand back, ASLA and friends don't have one
+    static constexpr bool writes_operand(const char *op)
+    {
+        return same_op(op, "STA") || same_op(op, "STX") || same_op(op, "STY") || same_op(op, "INC") || same_op(op, "DEC") ||
+               same_op(op, "ASL") || same_op(op, "LSR") || same_op(op, "ROL") || same_op(op, "ROR");
+    }
+
+    // branches, jumps, returns and BRK leave the straight line, what runs after them starts a block
+    static constexpr bool ends_block(uint8_t opcode)
+    {
+        return (opcode & 0x1f) == 0x10 || opcode == 0x00 || opcode == 0x20 || opcode == 0x40 ||
+               opcode == 0x4C || opcode == 0x60 || opcode == 0x6C;
+    }
+
+#define NES_INFO_OP(code, mode, op, cyc) \
+    { { #op[0], #op[1], #op[2], 0 }, addressing_mode::mode, 1 + NES_OPERAND_LEN(mode), cyc, \
+      NES_PAGE_PENALTY(mode) && !writes_operand(#op), !(#op[0] == 'N' && #op[1] == 'O' && #op[2] == 'P' && code != 0xEA), 1, 0 },
+#define NES_INFO_TRAP(code, mode, op, cyc) \
+    { { #op[0], #op[1], #op[2], 0 }, addressing_mode::mode, 1 + NES_OPERAND_LEN(mode), cyc, \
+      NES_PAGE_PENALTY(mode), 1, 1, 1 },
+#define NES_INFO_ILL(code) \
+    { { '?', '?', '?', 0 }, addressing_mode::implied, 1, 0, 0, 0, 0, 0 },
+
+    // what there is to know about an opcode without running it, indexed by the opcode
+    static constexpr opcode_info g_opcode_info[256] = {
+        NES_OPCODE_TABLE(NES_INFO_OP, NES_INFO_TRAP, NES_INFO_ILL)
+    };
+
+#undef NES_INFO_OP
+#undef NES_INFO_TRAP
+#undef NES_INFO_ILL
+
+    static_assert(g_opcode_info[0x6c].len == 3 && g_opcode_info[0x6c].mode == addressing_mode::indirect,
+                  "opcode table out of order");
+    static_assert(g_opcode_info[0xea].official && !g_opcode_info[0x1a].official && !g_opcode_info[0xff].known,
+                  "opcode table out of order");
+    static_assert(g_opcode_info[0xbd].page_penalty && !g_opcode_info[0x9d].page_penalty && !g_opcode_info[0xfe].page_penalty,
+                  "page penalty on a write");
+    static_assert(ends_block(0xd0) && ends_block(0x6c) && !ends_block(0xea) && !ends_block(0x11),
+                  "block ends");
+
+}
+
+
+#endif /* opcode_table_hpp */
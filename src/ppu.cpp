@@ -0,0 +1,758 @@
+#include "ppu.hpp"
+#include "ppu_thread.hpp"
+#include "state.hpp"
+#include <cassert>
+#include <cstring>
+
+
+namespace nes {
+
+    void tile_cache::attach(const uint8_t *base, size_t size)
+    {
+        size_t tiles = size / NES_TILE_BYTES;
+        this->base_ = base;
+        this->pixels_.assign(tiles * NES_TILE_PIXELS, 0);
+        this->valid_.assign(tiles, 0);
+    }
+
+    void tile_cache::decode(size_t tile)
+    {
+        const uint8_t *chr = this->base_ + tile * NES_TILE_BYTES;
+        uint8_t *out = &this->pixels_[tile * NES_TILE_PIXELS];
+
+        for (int y = 0; y < 8; ++y) {
+            uint8_t lo = chr[y];
+            uint8_t hi = chr[y + 8];
+            for (int x = 0; x < 8; ++x) {
+                int bit = 7 - x;
+                out[y * 8 + x] = (lo >> bit & 1) | (hi >> bit & 1) << 1;
+            }
+        }
+        this->valid_[tile] = 1;
+        this->decodes_++;
+    }
+
+
+    uint32_t frame_hash(const uint8_t *frame)
+    {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT; ++i) {
+            h = (h ^ frame[i]) * 16777619u;
+        }
+        return h;
+    }
+
+    // random CHR, nametables, palette, OAM and scroll, one frame, hash of it and the sprite 0 flag
+    static uint32_t random_frame(mapper& m, memory& mem, pixel_path path, uint32_t seed)
+    {
+        ppu p(m);
+        p.set_pixel_path(path);
+        mem.map_handler(0x2000, 0x2000, &p);
+
+        uint32_t x = seed * 2654435761u + 1;
+        auto next = [&x]() {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            return (uint8_t)x;
+        };
+
+        mem.write<uint8_t>(0x00, 0x2006);
+        mem.write<uint8_t>(0x00, 0x2006);
+        // sparse CHR so there is transparency to get through
+        for (int i = 0; i < 0x3000; ++i) {
+            uint8_t v = next();
+            mem.write<uint8_t>(i < 0x2000 ? v & next() : v, 0x2007);
+        }
+        mem.write<uint8_t>(0x3f, 0x2006);
+        mem.write<uint8_t>(0x00, 0x2006);
+        for (int i = 0; i < 32; ++i) {
+            mem.write<uint8_t>(next(), 0x2007);
+        }
+        mem.write<uint8_t>(0x00, 0x2003);
+        for (int i = 0; i < 256; ++i) {
+            mem.write<uint8_t>(next(), 0x2004);
+        }
+
+        mem.write<uint8_t>(next(), 0x2005);
+        mem.write<uint8_t>(next(), 0x2005);
+        mem.write<uint8_t>(next() & 0x3b, 0x2000);
+        mem.write<uint8_t>(next() | PPUMASK_BG, 0x2001);
+
+        uint8_t status = 0;
+        for (int i = 0; i < NES_LINES_PER_FRAME; ++i) {
+            p.scanline();
+            if (i == NES_SCREEN_HEIGHT) {
+                status = mem.read<uint8_t>(0x2002);
+            }
+        }
+
+        mem.unmap(0x2000, 0x2000);
+        return frame_hash(p.frame()) ^ (status & PPUSTATUS_SPRITE0);
+    }
+
+    void ppu_raster::attach(const mapper& m)
+    {
+        this->chr_base_ = m.chr_data();
+        this->chr_ = m.chr_slots();
+        this->chr_copy_.clear();
+        this->tiles_.attach(m.chr_data(), m.chr_size());
+    }
+
+    void ppu_raster::copy(const ppu_raster& from, const mapper& m)
+    {
+        // CHR ROM never changes under the other thread, RAM does
+        if (m.chr_writable()) {
+            this->chr_copy_.assign(m.chr_data(), m.chr_data() + m.chr_size());
+            this->chr_base_ = this->chr_copy_.data();
+        }
+        else {
+            this->chr_copy_.clear();
+            this->chr_base_ = m.chr_data();
+        }
+        for (int i = 0; i < NES_CHR_SLOTS; ++i) {
+            this->set_slot(i, (size_t)(m.chr_slot(i) - m.chr_data()));
+        }
+        this->chr_ = this->slots_;
+        this->tiles_.attach(this->chr_base_, m.chr_size());
+
+        memcpy(this->oam_, from.oam_, sizeof(this->oam_));
+        memcpy(this->palette_, from.palette_, sizeof(this->palette_));
+        memcpy(this->vram_, from.vram_, sizeof(this->vram_));
+        this->set_mirroring(from.mirroring_);
+        this->set_pixel_path(from.path_);
+    }
+
+    void ppu_raster::set_mirroring(mirroring m)
+    {
+        static const uint8_t tables[][4] = {
+            { 0, 0, 1, 1 },     // horizontal
+            { 0, 1, 0, 1 },     // vertical
+            { 0, 1, 2, 3 },     // four screen
+            { 0, 0, 0, 0 },     // single low
+            { 1, 1, 1, 1 },     // single high
+        };
+        const uint8_t *table = tables[(int)m];
+        for (int i = 0; i < 4; ++i) {
+            this->nametable_[i] = this->vram_ + table[i] * 0x400;
+        }
+        this->mirroring_ = m;
+    }
+
+    ppu::ppu(mapper& m) noexcept
+    :mapper_(m)
+    {
+        this->raster_.attach(m);
+        this->raster_.set_mirroring(m.get_mirroring());
+        this->set_pixel_path(detect_pixel_path());
+        this->reset();
+    }
+
+    void ppu::reset()
+    {
+        this->ctrl_ = 0;
+        this->mask_ = 0;
+        this->status_ = 0;
+        this->oam_addr_ = 0;
+        this->latch_ = 0;
+        this->read_buffer_ = 0;
+        this->v_ = 0;
+        this->t_ = 0;
+        this->x_ = 0;
+        this->w_ = false;
+        this->nmi_ = false;
+        this->line_ = 0;
+        this->timestamp_ = 0;
+        this->update_mirroring();
+    }
+
+    void ppu::set_pixel_path(pixel_path path)
+    {
+        this->raster_.set_pixel_path(pixel_path_supported(path) ? path : pixel_path::scalar);
+        if (this->thread_) {
+            this->thread_->sync(this->raster_, this->mapper_);
+        }
+    }
+
+    void ppu::set_thread(ppu_thread *t)
+    {
+        if (this->thread_ && this->thread_ != t) {
+            // what it drew is the picture until the next frame is drawn here
+            memcpy(this->frames_.back(), this->thread_->frame(), NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT);
+            this->frames_.present();
+            this->presented_ = true;
+        }
+        this->thread_ = t;
+        if (t) {
+            t->sync(this->raster_, this->mapper_);
+        }
+    }
+
+    const uint8_t* ppu::frame() const
+    {
+        if (this->thread_) {
+            return this->thread_->frame();
+        }
+        return this->presented_ ? this->frames_.newest() : this->frames_.back();
+    }
+
+    const uint8_t* ppu::previous_frame() const
+    {
+        return this->thread_ ? this->thread_->previous_frame() : nullptr;
+    }
+
+    void ppu::update_mirroring()
+    {
+        mirroring m = this->mapper_.get_mirroring();
+        if (m == this->raster_.mirroring_) {
+            return;
+        }
+        this->raster_.set_mirroring(m);
+        if (this->thread_) {
+            this->thread_->write(ppu_event_kind::mirroring, this->timestamp_, 0, (uint8_t)m);
+        }
+    }
+
+    void ppu::save_state(state_writer& w) const
+    {
+        w.begin("PPU ");
+        w.put(this->ctrl_);
+        w.put(this->mask_);
+        w.put(this->status_);
+        w.put(this->oam_addr_);
+        w.put(this->latch_);
+        w.put(this->read_buffer_);
+        w.put(this->v_);
+        w.put(this->t_);
+        w.put(this->x_);
+        w.put(this->w_);
+        w.put(this->nmi_);
+        w.put<int16_t>((int16_t)this->line_);
+        w.put(this->frame_count_);
+        w.put(this->timestamp_);
+        // the mapper may have switched since line 0 took it over
+        w.put(this->raster_.mirroring_);
+        w.bytes(this->raster_.oam_, sizeof(this->raster_.oam_));
+        w.bytes(this->raster_.palette_, sizeof(this->raster_.palette_));
+        w.bytes(this->raster_.vram_, sizeof(this->raster_.vram_));
+        w.end();
+    }
+
+    int ppu::load_state(const state_reader& r)
+    {
+        state_reader c;
+        ppu_raster& d = this->raster_;
+        if (!r.find("PPU ", c) || c.left() != 32 + sizeof(d.oam_) + sizeof(d.palette_) + sizeof(d.vram_)) {
+            return STATE_ERROR_FORMAT;
+        }
+        c.get(this->ctrl_);
+        c.get(this->mask_);
+        c.get(this->status_);
+        c.get(this->oam_addr_);
+        c.get(this->latch_);
+        c.get(this->read_buffer_);
+        c.get(this->v_);
+        c.get(this->t_);
+        c.get(this->x_);
+        c.get(this->w_);
+        c.get(this->nmi_);
+        this->line_ = c.get<int16_t>();
+        c.get(this->frame_count_);
+        c.get(this->timestamp_);
+        mirroring m = c.get<mirroring>();
+        d.set_mirroring(m <= mirroring::single_high ? m : mirroring::four_screen);
+        c.bytes(d.oam_, sizeof(d.oam_));
+        c.bytes(d.palette_, sizeof(d.palette_));
+        c.bytes(d.vram_, sizeof(d.vram_));
+        // CHR RAM came back with the mapper
+        d.attach(this->mapper_);
+        if (this->thread_) {
+            this->thread_->sync(d, this->mapper_);
+        }
+        return 0;
+    }
+
+    uint8_t ppu::vram_read(uint16_t addr)
+    {
+        addr &= 0x3fff;
+        if (addr < 0x2000) {
+            return this->mapper_.chr_read(addr);
+        }
+        return this->raster_.read_vram(addr);
+    }
+
+    void ppu::vram_write(uint16_t addr, uint8_t v)
+    {
+        addr &= 0x3fff;
+        if (addr < 0x2000) {
+            if (!this->mapper_.chr_write(addr, v)) {
+                return;
+            }
+            this->raster_.tiles_.invalidate(this->raster_.pattern_addr(addr));
+            if (this->thread_) {
+                // the thread writes its copy through the slots as they are now
+                this->thread_->banks(this->timestamp_, this->mapper_);
+                this->thread_->write(ppu_event_kind::chr, this->timestamp_, addr, v);
+            }
+            return;
+        }
+        this->raster_.write_vram(addr, v);
+        if (this->thread_) {
+            this->thread_->write(ppu_event_kind::vram, this->timestamp_, addr, v);
+        }
+    }
+
+    uint8_t ppu::read(uint16_t addr)
+    {
+        switch (addr & 7) {
+            case 2: {
+                uint8_t v = (this->status_ & 0xe0) | (this->latch_ & 0x1f);
+                this->status_ &= ~PPUSTATUS_VBLANK;
+                this->w_ = false;
+                this->latch_ = v;
+                break;
+            }
+            case 4:
+                this->latch_ = this->raster_.oam_[this->oam_addr_];
+                break;
+            case 7: {
+                uint16_t a = this->v_ & 0x3fff;
+                if (a < 0x3f00) {
+                    this->latch_ = this->read_buffer_;
+                    this->read_buffer_ = this->vram_read(a);
+                }
+                else {
+                    // palette reads are not buffered, the buffer gets the nametable byte below
+                    this->latch_ = this->vram_read(a);
+                    this->read_buffer_ = this->vram_read(a - 0x1000);
+                }
+                this->v_ = (this->v_ + (this->ctrl_ & PPUCTRL_INCREMENT ? 32 : 1)) & 0x7fff;
+                break;
+            }
+        }
+        // write only registers read back the open bus
+        return this->latch_;
+    }
+
+    void ppu::write(uint16_t addr, uint8_t v)
+    {
+        this->latch_ = v;
+
+        switch (addr & 7) {
+            case 0:
+                // enabling NMI during vblank raises it right away
+                if (!(this->ctrl_ & PPUCTRL_NMI) && (v & PPUCTRL_NMI) && (this->status_ & PPUSTATUS_VBLANK)) {
+                    this->nmi_ = true;
+                }
+                this->ctrl_ = v;
+                this->t_ = (this->t_ & 0xf3ff) | (v & PPUCTRL_NAMETABLE) << 10;
+                break;
+            case 1:
+                this->mask_ = v;
+                break;
+            case 3:
+                this->oam_addr_ = v;
+                break;
+            case 4:
+                this->raster_.write_oam(this->oam_addr_, v);
+                if (this->thread_) {
+                    this->thread_->write(ppu_event_kind::oam, this->timestamp_, this->oam_addr_, v);
+                }
+                this->oam_addr_++;
+                break;
+            case 5:
+                if (!this->w_) {
+                    this->t_ = (this->t_ & 0xffe0) | v >> 3;
+                    this->x_ = v & 7;
+                }
+                else {
+                    this->t_ = (this->t_ & 0x0c1f) | (v & 0x07) << 12 | (v & 0xf8) << 2;
+                }
+                this->w_ = !this->w_;
+                break;
+            case 6:
+                if (!this->w_) {
+                    this->t_ = (this->t_ & 0x00ff) | (v & 0x3f) << 8;
+                }
+                else {
+                    this->t_ = (this->t_ & 0xff00) | v;
+                    this->v_ = this->t_;
+                }
+                this->w_ = !this->w_;
+                break;
+            case 7:
+                this->vram_write(this->v_, v);
+                this->v_ = (this->v_ + (this->ctrl_ & PPUCTRL_INCREMENT ? 32 : 1)) & 0x7fff;
+                break;
+        }
+    }
+
+    void ppu::increment_y()
+    {
+        if ((this->v_ & 0x7000) != 0x7000) {
+            this->v_ += 0x1000;
+            return;
+        }
+
+        this->v_ &= ~0x7000;
+        int y = (this->v_ & 0x03e0) >> 5;
+        if (y == 29) {
+            y = 0;
+            this->v_ ^= 0x0800;
+        }
+        else if (y == 31) {
+            y = 0;
+        }
+        else {
+            y++;
+        }
+        this->v_ = (this->v_ & ~0x03e0) | y << 5;
+    }
+
+    // 33 tiles from v into line, pixel values are palette << 2 | pattern, 0 is transparent
+    void ppu_raster::render_background(const ppu_line& l, uint8_t *line)
+    {
+        uint16_t v = l.v;
+        uint16_t table = l.ctrl & PPUCTRL_BG_TABLE ? 0x1000 : 0;
+        int fine_y = v >> 12;
+        bool planes = this->kernels_->expand_tiles != nullptr;
+
+        // the SIMD paths only gather the plane bytes here and expand them in bulk
+        uint8_t lo[NES_BG_TILES_PADDED];
+        uint8_t hi[NES_BG_TILES_PADDED];
+        uint8_t pal[NES_BG_TILES_PADDED];
+
+        for (int i = 0; i < NES_BG_TILES; ++i) {
+            const uint8_t *nt = this->nametable_[(v >> 10) & 3];
+            uint8_t tile = nt[v & 0x3ff];
+            uint8_t attr = nt[0x3c0 | (v >> 4 & 0x38) | (v >> 2 & 0x07)];
+            uint8_t p = (attr >> ((v >> 4 & 4) | (v & 2)) & 3) << 2;
+            uint16_t pattern = table + tile * NES_TILE_BYTES;
+
+            if (planes) {
+                const uint8_t *chr = this->pattern_addr(pattern);
+                lo[i] = chr[fine_y];
+                hi[i] = chr[fine_y + 8];
+                pal[i] = p;
+            }
+            else {
+                const uint8_t *row = this->pattern_row(pattern, fine_y);
+                for (int x = 0; x < 8; ++x) {
+                    line[i * 8 + x] = row[x] ? p | row[x] : 0;
+                }
+            }
+
+            if ((v & 0x001f) == 31) {
+                v &= ~0x001f;
+                v ^= 0x0400;
+            }
+            else {
+                v++;
+            }
+        }
+
+        if (planes) {
+            for (int i = NES_BG_TILES; i < NES_BG_TILES_PADDED; ++i) {
+                lo[i] = hi[i] = pal[i] = 0;
+            }
+            this->kernels_->expand_tiles(lo, hi, pal, line, NES_BG_TILES_PADDED);
+        }
+    }
+
+    /*
+        Sprite line: bits 0-1 pattern, 2-3 palette, 4 set, 6 behind the
+        background, 7 sprite 0. Drawn from the last of the (at most 8)
+        sprites on the line to the first, so the lowest OAM index wins.
+        Returns PPUSTATUS_OVERFLOW when there were more.
+    */
+    uint8_t ppu_raster::render_sprites(const ppu_line& l, uint8_t *line)
+    {
+        int y = l.y;
+        int height = l.ctrl & PPUCTRL_SPRITE_16 ? 16 : 8;
+        uint8_t status = 0;
+        int found[8];
+        int count = 0;
+
+        // OAM Y is one less than the first line the sprite shows on
+        for (int n = 0; n < 64; ++n) {
+            int row = y - this->oam_[n * 4] - 1;
+            if (row < 0 || row >= height) {
+                continue;
+            }
+            if (count == 8) {
+                status = PPUSTATUS_OVERFLOW;
+                break;
+            }
+            found[count++] = n;
+        }
+
+        for (int i = count - 1; i >= 0; --i) {
+            const uint8_t *s = this->oam_ + found[i] * 4;
+            int row = y - s[0] - 1;
+            uint8_t tile = s[1];
+            uint8_t attr = s[2];
+
+            if (attr & 0x80) {
+                row = height - 1 - row;
+            }
+
+            uint16_t pattern;
+            if (height == 16) {
+                pattern = (tile & 1) * 0x1000 + (tile & 0xfe) * NES_TILE_BYTES;
+                if (row >= 8) {
+                    pattern += NES_TILE_BYTES;
+                    row -= 8;
+                }
+            }
+            else {
+                pattern = (l.ctrl & PPUCTRL_SPRITE_TABLE ? 0x1000 : 0) + tile * NES_TILE_BYTES;
+            }
+
+            const uint8_t *pixels = this->pattern_row(pattern, row);
+            uint8_t bits = 0x10 | (attr & 3) << 2 | (attr & 0x20 ? 0x40 : 0) | (found[i] == 0 ? 0x80 : 0);
+            bool flip = attr & 0x40;
+
+            for (int x = 0; x < 8 && s[3] + x < NES_SCREEN_WIDTH; ++x) {
+                uint8_t p = pixels[flip ? 7 - x : x];
+                if (p) {
+                    line[s[3] + x] = bits | p;
+                }
+            }
+        }
+        return status;
+    }
+
+    uint8_t ppu_raster::render_line(const ppu_line& l, uint8_t *out)
+    {
+        uint8_t gray = l.mask & PPUMASK_GRAYSCALE ? 0x30 : 0x3f;
+
+        if (!(l.mask & (PPUMASK_BG | PPUMASK_SPRITES))) {
+            memset(out, this->palette_[0] & gray, NES_SCREEN_WIDTH);
+            return 0;
+        }
+
+        uint8_t bg[NES_BG_TILES_PADDED * 8];
+        uint8_t sprites[NES_SCREEN_WIDTH];
+        uint8_t status = 0;
+        memset(sprites, 0, sizeof(sprites));
+
+        if (l.mask & PPUMASK_BG) {
+            this->render_background(l, bg);
+            if (!(l.mask & PPUMASK_BG_LEFT)) {
+                memset(bg + l.x, 0, 8);
+            }
+        }
+        else {
+            memset(bg, 0, sizeof(bg));
+        }
+
+        if (l.mask & PPUMASK_SPRITES) {
+            status = this->render_sprites(l, sprites);
+            if (!(l.mask & PPUMASK_SPRITE_LEFT)) {
+                memset(sprites, 0, 8);
+            }
+        }
+
+        if (this->kernels_->compose(bg + l.x, sprites, this->palette_, gray, out)) {
+            status |= PPUSTATUS_SPRITE0;
+        }
+        return status;
+    }
+
+    uint8_t ppu_raster::line_status(const ppu_line& l, bool hit)
+    {
+        if (!(l.mask & PPUMASK_SPRITES)) {
+            return 0;
+        }
+
+        // the evaluation render_sprites does, sprite 0 is the only one a hit can come from
+        int height = l.ctrl & PPUCTRL_SPRITE_16 ? 16 : 8;
+        int count = 0;
+        for (int n = 0; n < 64; ++n) {
+            int row = l.y - this->oam_[n * 4] - 1;
+            if (row < 0 || row >= height) {
+                continue;
+            }
+            if (n == 0 && hit) {
+                uint8_t scratch[NES_SCREEN_WIDTH];
+                return this->render_line(l, scratch);
+            }
+            if (count == 8) {
+                return PPUSTATUS_OVERFLOW;
+            }
+            count++;
+        }
+        return 0;
+    }
+
+    void ppu::scanline()
+    {
+        int y = this->line_;
+
+        if (y == 0) {
+            this->update_mirroring();
+        }
+
+        if (y < NES_SCREEN_HEIGHT) {
+            ppu_line l = { this->v_, this->ctrl_, this->mask_, this->x_, (uint8_t)y };
+            if (this->thread_) {
+                this->status_ |= this->raster_.line_status(l, !(this->status_ & PPUSTATUS_SPRITE0));
+                this->thread_->banks(this->timestamp_, this->mapper_);
+                this->thread_->line(this->timestamp_, l);
+            }
+            else {
+                this->status_ |= this->raster_.render_line(l, this->frames_.back() + y * NES_SCREEN_WIDTH);
+                this->presented_ = false;
+                if (y == NES_SCREEN_HEIGHT - 1) {
+                    this->frames_.present();
+                    this->presented_ = true;
+                }
+            }
+            if (this->rendering()) {
+                this->increment_y();
+                this->v_ = (this->v_ & ~0x041f) | (this->t_ & 0x041f);
+                this->mapper_.scanline();
+            }
+        }
+        else if (y == NES_VBLANK_LINE) {
+            this->status_ |= PPUSTATUS_VBLANK;
+            if (this->ctrl_ & PPUCTRL_NMI) {
+                this->nmi_ = true;
+            }
+        }
+        else if (y == NES_PRERENDER_LINE) {
+            this->status_ &= ~(PPUSTATUS_VBLANK | PPUSTATUS_SPRITE0 | PPUSTATUS_OVERFLOW);
+            if (this->rendering()) {
+                this->v_ = this->t_;
+                this->mapper_.scanline();
+            }
+        }
+
+        this->timestamp_ += NES_DOTS_PER_LINE;
+        if (++this->line_ == NES_LINES_PER_FRAME) {
+            this->line_ = 0;
+            this->frame_count_++;
+        }
+    }
+
+    void ppu::test()
+    {
+        // NROM with CHR RAM
+        static uint8_t image[NES_HEADER_SIZE + NES_PRG_BANK_SIZE];
+        memset(image, 0, sizeof(image));
+        memcpy(image, "NES\x1a", 4);
+        image[4] = 1;
+        image[6] = 0x01;
+
+        cartridge cart;
+        int err = cart.load(image, sizeof(image));
+        assert(err == 0);
+        (void)err;
+
+        memory mem;
+        std::unique_ptr<mapper> m = mapper::create(cart, mem);
+        ppu p(*m);
+        // the background only goes through the tile cache on the scalar path
+        p.set_pixel_path(pixel_path::scalar);
+        mem.map_handler(0x2000, 0x2000, &p);
+
+        auto set_addr = [&mem](uint16_t addr) {
+            mem.write<uint8_t>(addr >> 8, 0x2006);
+            mem.write<uint8_t>(addr & 0xff, 0x2006);
+        };
+
+        // tile 1 is a solid color 3 square, tile 2 color 1 on its left half
+        set_addr(0x0010);
+        for (int i = 0; i < 16; ++i) {
+            mem.write<uint8_t>(0xff, 0x2007);
+        }
+        for (int i = 0; i < 16; ++i) {
+            mem.write<uint8_t>(i < 8 ? 0xf0 : 0x00, 0x2007);
+        }
+
+        set_addr(0x3f00);
+        mem.write<uint8_t>(0x0f, 0x2007);
+        mem.write<uint8_t>(0x11, 0x2007);
+        mem.write<uint8_t>(0x22, 0x2007);
+        mem.write<uint8_t>(0x33, 0x2007);
+        set_addr(0x3f11);
+        mem.write<uint8_t>(0x2a, 0x2007);
+
+        // buffered VRAM read, $3F10 mirrors $3F00
+        set_addr(0x0010);
+        mem.read<uint8_t>(0x2007);
+        assert(mem.read<uint8_t>(0x2007) == 0xff);
+        set_addr(0x3f10);
+        assert(mem.read<uint8_t>(0x2007) == 0x0f);
+
+        // top left tile of nametable 0, one sprite over it
+        set_addr(0x2000);
+        mem.write<uint8_t>(0x01, 0x2007);
+        mem.write<uint8_t>(0x02, 0x2007);
+        mem.write<uint8_t>(0x00, 0x2003);
+        mem.write<uint8_t>(3, 0x2004);
+        mem.write<uint8_t>(2, 0x2004);
+        mem.write<uint8_t>(0, 0x2004);
+        mem.write<uint8_t>(8, 0x2004);
+        for (int i = 4; i < 256; ++i) {
+            mem.write<uint8_t>(0xff, 0x2004);
+        }
+
+        set_addr(0x0000);
+        mem.write<uint8_t>(0x00, 0x2005);
+        mem.write<uint8_t>(0x00, 0x2005);
+        mem.write<uint8_t>(PPUCTRL_NMI, 0x2000);
+        mem.write<uint8_t>(PPUMASK_BG | PPUMASK_SPRITES | PPUMASK_BG_LEFT | PPUMASK_SPRITE_LEFT, 0x2001);
+
+        for (int i = 0; i < NES_LINES_PER_FRAME; ++i) {
+            p.scanline();
+            if (i == NES_VBLANK_LINE) {
+                assert(p.take_nmi());
+                assert((mem.read<uint8_t>(0x2002) & 0xc0) == (PPUSTATUS_VBLANK | PPUSTATUS_SPRITE0));
+                assert(!(mem.read<uint8_t>(0x2002) & PPUSTATUS_VBLANK));
+            }
+        }
+        assert(p.frame_count() == 1);
+
+        const uint8_t *f = p.frame();
+        assert(f[0] == 0x33 && f[7] == 0x33 && f[7 * NES_SCREEN_WIDTH + 7] == 0x33);
+        // the sprite starts on line 4 at x 8 and hides the left half of tile 2
+        assert(f[3 * NES_SCREEN_WIDTH + 8] == 0x11 && f[4 * NES_SCREEN_WIDTH + 8] == 0x2a);
+        assert(f[4 * NES_SCREEN_WIDTH + 12] == 0x0f && f[8 * NES_SCREEN_WIDTH] == 0x0f);
+        uint64_t decodes = p.tiles().decodes();
+
+        // rewriting CHR RAM only re-decodes the tile that changed
+        set_addr(0x0010);
+        mem.write<uint8_t>(0x00, 0x2007);
+        set_addr(0x0000);
+        mem.write<uint8_t>(0x00, 0x2005);
+        mem.write<uint8_t>(0x00, 0x2005);
+        for (int i = 0; i < NES_LINES_PER_FRAME; ++i) {
+            p.scanline();
+        }
+        // drawn into the next of the three pictures
+        assert(p.frame() != f && p.buffers().presented() == 2);
+        f = p.frame();
+        assert(f[0] == 0x22 && f[1] == 0x22 && f[NES_SCREEN_WIDTH] == 0x33);
+        assert(p.tiles().decodes() == decodes + 1);
+        (void)f;
+        (void)decodes;
+
+        mem.unmap(0x2000, 0x2000);
+
+        // every pixel path renders the same frames as the scalar one
+        static const pixel_path paths[] = { pixel_path::ssse3, pixel_path::avx2 };
+        for (size_t i = 0; i < arr_len(paths); ++i) {
+            if (!pixel_path_supported(paths[i])) {
+                std::cout << "pixel path " << pixel_path_name(paths[i]) << " not supported" << std::endl;
+                continue;
+            }
+            for (uint32_t seed = 0; seed < 32; ++seed) {
+                bool same = random_frame(*m, mem, pixel_path::scalar, seed) == random_frame(*m, mem, paths[i], seed);
+                assert(same);
+                (void)same;
+            }
+        }
+    }
+
+}
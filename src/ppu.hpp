@@ -0,0 +1,500 @@
+#ifndef ppu_hpp
+#define ppu_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include "memory.hpp"
+#include "mapper.hpp"
+#include "ppu_simd.hpp"
+
+#define NES_SCREEN_WIDTH 256
+#define NES_SCREEN_HEIGHT 240
+#define NES_DOTS_PER_LINE 341
+#define NES_LINES_PER_FRAME 262
+#define NES_VBLANK_LINE 241
+#define NES_PRERENDER_LINE 261
+
+#define NES_TILE_BYTES 16
+#define NES_TILE_PIXELS 64
+
+#define PPUCTRL_NAMETABLE   0x03
+#define PPUCTRL_INCREMENT   0x04
+#define PPUCTRL_SPRITE_TABLE 0x08
+#define PPUCTRL_BG_TABLE    0x10
+#define PPUCTRL_SPRITE_16   0x20
+#define PPUCTRL_NMI         0x80
+
+#define PPUMASK_GRAYSCALE   0x01
+#define PPUMASK_BG_LEFT     0x02
+#define PPUMASK_SPRITE_LEFT 0x04
+#define PPUMASK_BG          0x08
+#define PPUMASK_SPRITES     0x10
+
+#define PPUSTATUS_OVERFLOW  0x20
+#define PPUSTATUS_SPRITE0   0x40
+#define PPUSTATUS_VBLANK    0x80
+
+
+namespace nes {
+
+    /*
+        CHR in chunky form.
+
+        Every 16 byte 2-bitplane tile is decoded once into 64 bytes of
+        0-3 pixel values, the renderers then read 8 pixels of a row as
+        plain bytes. Tiles are decoded on first use; CHR RAM writes only
+        drop the tile they hit.
+    */
+    class tile_cache {
+
+        const uint8_t *base_{nullptr};
+        std::vector<uint8_t> pixels_;
+        std::vector<uint8_t> valid_;
+        uint64_t decodes_{0};
+
+        void decode(size_t tile);
+
+    public:
+        tile_cache(const tile_cache&) = delete;
+        tile_cache(tile_cache&&) = delete;
+        tile_cache& operator=(const tile_cache&) = delete;
+        tile_cache& operator=(tile_cache&&) = delete;
+
+        tile_cache() noexcept
+        {
+        }
+
+        // base/size is the whole CHR ROM or RAM
+        void attach(const uint8_t *base, size_t size);
+
+        // the 8 pixels of row y of the tile whose CHR bytes start at chr
+        const uint8_t* row(const uint8_t *chr, int y)
+        {
+            size_t tile = (size_t)(chr - this->base_) / NES_TILE_BYTES;
+            if (!this->valid_[tile]) {
+                this->decode(tile);
+            }
+            return &this->pixels_[tile * NES_TILE_PIXELS + y * 8];
+        }
+
+        // chr was written
+        void invalidate(const uint8_t *chr)
+        {
+            this->valid_[(size_t)(chr - this->base_) / NES_TILE_BYTES] = 0;
+        }
+
+        uint64_t decodes() const
+        {
+            return this->decodes_;
+        }
+    };
+
+    // FNV-1a of a 256 x 240 frame
+    uint32_t frame_hash(const uint8_t *frame);
+
+    /*
+        Three pictures between the PPU and whoever shows them, lock free.
+
+        The PPU draws into back() and present() swaps it with the middle
+        one, which then holds the newest picture; acquire() swaps the
+        middle one with front() when it is newer than what front() has.
+        Neither side waits or copies. A consumer that falls behind skips
+        to the newest picture, a fast one keeps the one it has until the
+        next present().
+    */
+    class frame_buffers {
+
+        std::vector<uint8_t> pictures_;
+        // the middle picture, FRESH until acquire() takes it
+        std::atomic<uint8_t> middle_{1};
+        // the producer's
+        uint8_t back_{0};
+        uint8_t newest_{1};
+        uint64_t presented_{0};
+        // the consumer's
+        uint8_t front_{2};
+        uint64_t acquired_{0};
+
+        static const uint8_t FRESH = 4;
+
+        uint8_t* picture(uint8_t i)
+        {
+            return &this->pictures_[i * NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT];
+        }
+
+        const uint8_t* picture(uint8_t i) const
+        {
+            return &this->pictures_[i * NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT];
+        }
+
+    public:
+        frame_buffers(const frame_buffers&) = delete;
+        frame_buffers(frame_buffers&&) = delete;
+        frame_buffers& operator=(const frame_buffers&) = delete;
+        frame_buffers& operator=(frame_buffers&&) = delete;
+
+        frame_buffers() noexcept
+        :pictures_(3 * NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT)
+        {
+        }
+
+        // producer: the picture being drawn
+        uint8_t* back()
+        {
+            return this->picture(this->back_);
+        }
+
+        const uint8_t* back() const
+        {
+            return this->picture(this->back_);
+        }
+
+        // producer: back() is whole, the next one is drawn elsewhere
+        void present()
+        {
+            this->newest_ = this->back_;
+            this->back_ = this->middle_.exchange(this->back_ | FRESH, std::memory_order_acq_rel) & 3;
+            this->presented_++;
+        }
+
+        // producer: what the last present() made the newest picture
+        const uint8_t* newest() const
+        {
+            return this->picture(this->newest_);
+        }
+
+        // consumer: false when nothing was presented since the last call
+        bool acquire()
+        {
+            if (!(this->middle_.load(std::memory_order_relaxed) & FRESH)) {
+                return false;
+            }
+            this->front_ = this->middle_.exchange(this->front_, std::memory_order_acq_rel) & 3;
+            this->acquired_++;
+            return true;
+        }
+
+        // consumer: the picture acquire() took, it stays put until the next one
+        const uint8_t* front()
+        {
+            return this->picture(this->front_);
+        }
+
+        uint64_t presented() const
+        {
+            return this->presented_;
+        }
+
+        uint64_t acquired() const
+        {
+            return this->acquired_;
+        }
+    };
+
+    class ppu_thread;
+
+    // the registers a visible line is drawn with, as they are at its start
+    struct ppu_line {
+        uint16_t v;
+        uint8_t ctrl;
+        uint8_t mask;
+        uint8_t x;
+        uint8_t y;
+    };
+
+    /*
+        The picture side of the PPU: OAM, palette, nametable RAM, the CHR
+        slots and the line renderer drawing from them.
+
+        The ppu's own raster reads the mapper's slots and CHR in place. A
+        ppu_thread's raster is a copy() with CHR and slots of its own,
+        kept in step by replaying the writes the CPU side makes, so the
+        two threads share nothing but the ring between them.
+    */
+    class ppu_raster {
+
+        friend class ppu;
+
+        tile_cache tiles_;
+        pixel_path path_{pixel_path::scalar};
+        const pixel_kernels *kernels_{nullptr};
+
+        // what the slots point into, the mapper's CHR or chr_copy_
+        const uint8_t *chr_base_{nullptr};
+        const uint8_t * const *chr_{nullptr};
+        const uint8_t *slots_[NES_CHR_SLOTS]{nullptr};
+        std::vector<uint8_t> chr_copy_;
+
+        uint8_t oam_[256]{0};
+        uint8_t palette_[32]{0};
+        uint8_t vram_[0x1000]{0};
+        uint8_t *nametable_[4]{nullptr};
+        mirroring mirroring_{mirroring::horizontal};
+
+        static uint8_t palette_index(uint16_t addr)
+        {
+            uint8_t i = addr & 0x1f;
+            // $3F10/$3F14/$3F18/$3F1C mirror the backdrop entries
+            return (i & 0x13) == 0x10 ? i & 0x0f : i;
+        }
+
+        const uint8_t* pattern_addr(uint16_t pattern) const
+        {
+            return this->chr_[pattern >> NES_CHR_SLOT_SHIFT] + (pattern & (NES_CHR_SLOT_SIZE - 1));
+        }
+
+        const uint8_t* pattern_row(uint16_t pattern, int y)
+        {
+            return this->tiles_.row(this->pattern_addr(pattern), y);
+        }
+
+        void render_background(const ppu_line& l, uint8_t *line);
+        uint8_t render_sprites(const ppu_line& l, uint8_t *line);
+
+    public:
+        ppu_raster(const ppu_raster&) = delete;
+        ppu_raster(ppu_raster&&) = delete;
+        ppu_raster& operator=(const ppu_raster&) = delete;
+        ppu_raster& operator=(ppu_raster&&) = delete;
+
+        ppu_raster() noexcept
+        {
+            this->set_pixel_path(pixel_path::scalar);
+            this->set_mirroring(mirroring::horizontal);
+        }
+
+        // draw from m's slots and CHR as they are at the time
+        void attach(const mapper& m);
+        // everything from, with a copy of m's CHR and slots
+        void copy(const ppu_raster& from, const mapper& m);
+
+        void set_pixel_path(pixel_path path)
+        {
+            this->path_ = path;
+            this->kernels_ = &get_pixel_kernels(path);
+        }
+
+        void set_mirroring(mirroring m);
+
+        // copies only: the slot now starts offset bytes into CHR, a CHR RAM write
+        void set_slot(int slot, size_t offset)
+        {
+            this->slots_[slot] = this->chr_base_ + offset;
+        }
+
+        void write_chr(uint16_t addr, uint8_t v)
+        {
+            const uint8_t *at = this->pattern_addr(addr);
+            this->chr_copy_[(size_t)(at - this->chr_base_)] = v;
+            this->tiles_.invalidate(at);
+        }
+
+        // nametables and palette, $2000-$3FFF
+        uint8_t read_vram(uint16_t addr) const
+        {
+            if (addr < 0x3f00) {
+                return this->nametable_[(addr >> 10) & 3][addr & 0x3ff];
+            }
+            return this->palette_[palette_index(addr)];
+        }
+
+        void write_vram(uint16_t addr, uint8_t v)
+        {
+            if (addr < 0x3f00) {
+                this->nametable_[(addr >> 10) & 3][addr & 0x3ff] = v;
+            }
+            else {
+                this->palette_[palette_index(addr)] = v & 0x3f;
+            }
+        }
+
+        void write_oam(uint8_t addr, uint8_t v)
+        {
+            this->oam_[addr] = v;
+        }
+
+        // draws line l into out, 256 palette indices; returns the
+        // PPUSTATUS_OVERFLOW and PPUSTATUS_SPRITE0 bits it raised
+        uint8_t render_line(const ppu_line& l, uint8_t *out);
+
+        // the same bits without the picture; only draws, to a scratch line,
+        // when sprite 0 is on it and hit is still to be looked for
+        uint8_t line_status(const ppu_line& l, bool hit);
+
+        const tile_cache& tiles() const
+        {
+            return this->tiles_;
+        }
+    };
+
+    /*
+        2C02, rendered a scanline at a time.
+
+        The CPU side registers $2000-$3FFF come in through mmio_handler.
+        scanline() runs one whole line: visible lines are drawn from the
+        current v/x scroll at once, then v is stepped the way the dot
+        based hardware would have by the end of the line. Mid-line
+        register writes take effect on the next line.
+
+        The PPU keeps its own timestamp in dots, the console catches it up
+        to the CPU's before any register access, see console.
+
+        With a ppu_thread set, visible lines only work out the status
+        bits the CPU can see and go to the thread with every write to
+        what is drawn, which draws them there; see set_thread.
+
+        The frame holds 6 bit palette indices, 256 x 240. Without a
+        thread lines go straight to the back picture of a frame_buffers,
+        which is presented once line 239 is drawn.
+    */
+    class ppu : public mmio_handler {
+
+        mapper& mapper_;
+        ppu_raster raster_;
+        ppu_thread *thread_{nullptr};
+
+        uint8_t ctrl_{0};
+        uint8_t mask_{0};
+        uint8_t status_{0};
+        uint8_t oam_addr_{0};
+        uint8_t latch_{0};
+        uint8_t read_buffer_{0};
+
+        // loopy registers
+        uint16_t v_{0};
+        uint16_t t_{0};
+        uint8_t x_{0};
+        bool w_{false};
+
+        bool nmi_{false};
+        int line_{0};
+        uint64_t frame_count_{0};
+        // dot line_ starts at, counted from reset
+        uint64_t timestamp_{0};
+
+        frame_buffers frames_;
+        // frames_.newest() is the picture until the next line is drawn
+        bool presented_{false};
+
+        void update_mirroring();
+
+        uint8_t vram_read(uint16_t addr);
+        void vram_write(uint16_t addr, uint8_t v);
+
+        void increment_y();
+
+    public:
+        ppu() = delete;
+        ppu(const ppu&) = delete;
+        ppu(ppu&&) = delete;
+        ppu& operator=(const ppu&) = delete;
+        ppu& operator=(ppu&&) = delete;
+
+        ppu(mapper& m) noexcept;
+
+        void reset();
+
+        // falls back to scalar when the CPU can't run path
+        void set_pixel_path(pixel_path path);
+
+        pixel_path get_pixel_path() const
+        {
+            return this->raster_.path_;
+        }
+
+        // draw on t from now on, nullptr to draw here again; t gets a copy
+        // of everything drawn from and keeps it in step. Lines already sent
+        // are drawn first either way.
+        void set_thread(ppu_thread *t);
+
+        ppu_thread* get_thread() const
+        {
+            return this->thread_;
+        }
+
+        uint8_t read(uint16_t addr) override;
+        void write(uint16_t addr, uint8_t v) override;
+
+        // one whole scanline, the current one is line()
+        void scanline();
+
+        int line() const
+        {
+            return this->line_;
+        }
+
+        uint64_t timestamp() const
+        {
+            return this->timestamp_;
+        }
+
+        // runs every line that starts at or before dot
+        void catch_up(uint64_t dot)
+        {
+            while (this->timestamp_ <= dot) {
+                this->scanline();
+            }
+        }
+
+        // dot the next line y (this one if y == line()) starts at
+        uint64_t line_timestamp(int y) const
+        {
+            int ahead = (y - this->line_ + NES_LINES_PER_FRAME) % NES_LINES_PER_FRAME;
+            return this->timestamp_ + (uint64_t)ahead * NES_DOTS_PER_LINE;
+        }
+
+        // background or sprites on, lines step v and clock the mapper
+        bool rendering() const
+        {
+            return this->mask_ & (PPUMASK_BG | PPUMASK_SPRITES);
+        }
+
+        // a vblank NMI was raised since the last call
+        bool take_nmi()
+        {
+            bool nmi = this->nmi_;
+            this->nmi_ = false;
+            return nmi;
+        }
+
+        // the last whole picture, or the one being drawn; with a thread,
+        // once it drew every line sent so far. The next frame may draw
+        // over it, fetch it again after running one
+        const uint8_t* frame() const;
+
+        // the pictures without a thread, a consumer thread may acquire()
+        // them while the PPU draws; a thread presents nothing here
+        frame_buffers& buffers()
+        {
+            return this->frames_;
+        }
+
+        // with a thread, the picture before the newest whole one, waiting
+        // for that one only; nullptr without
+        const uint8_t* previous_frame() const;
+
+        uint64_t frame_count() const
+        {
+            return this->frame_count_;
+        }
+
+        // the CPU side's, a thread decodes its tiles in its own
+        const tile_cache& tiles() const
+        {
+            return this->raster_.tiles();
+        }
+
+        // "PPU " chunk, everything but the picture, the next frame redraws it
+        void save_state(state_writer& w) const;
+        // 0 or STATE_ERROR_FORMAT, after the mapper's state
+        int load_state(const state_reader& r);
+
+        static void test();
+    };
+
+}
+
+
+#endif /* ppu_hpp */
@@ -0,0 +1,214 @@
+#include "ppu_simd.hpp"
+#include "ppu.hpp"
+#include <cstring>
+
+#if NES_PPU_SIMD
+#include <immintrin.h>
+#endif
+
+
+namespace nes {
+
+    static bool compose_scalar(const uint8_t *bg, const uint8_t *sprites, const uint8_t *palette, uint8_t gray, uint8_t *out)
+    {
+        bool hit = false;
+        for (int x = 0; x < NES_SCREEN_WIDTH; ++x) {
+            uint8_t color = bg[x];
+            uint8_t s = sprites[x];
+            if (s) {
+                if ((s & 0x80) && color && x != 255) {
+                    hit = true;
+                }
+                if (!color || !(s & 0x40)) {
+                    color = s & 0x1f;
+                }
+            }
+            out[x] = palette[color] & gray;
+        }
+        return hit;
+    }
+
+#if NES_PPU_SIMD
+
+    /*
+        Plane interleave: every tile's lo/hi byte is broadcast to its 8
+        lanes, ANDed with the per lane bit (bit 7 is the leftmost pixel)
+        and compared, which leaves 0/1 and 0/2 to OR together.
+    */
+    __attribute__((target("ssse3")))
+    static void expand_tiles_ssse3(const uint8_t *lo, const uint8_t *hi, const uint8_t *pal, uint8_t *line, int tiles)
+    {
+        const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+        const __m128i bits = _mm_setr_epi8((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                           (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+        const __m128i one = _mm_set1_epi8(1);
+        const __m128i two = _mm_set1_epi8(2);
+        const __m128i zero = _mm_setzero_si128();
+
+        for (int i = 0; i < tiles; i += 2) {
+            uint16_t l, h, p;
+            memcpy(&l, lo + i, 2);
+            memcpy(&h, hi + i, 2);
+            memcpy(&p, pal + i, 2);
+
+            __m128i lv = _mm_shuffle_epi8(_mm_cvtsi32_si128(l), spread);
+            __m128i hv = _mm_shuffle_epi8(_mm_cvtsi32_si128(h), spread);
+            __m128i pv = _mm_shuffle_epi8(_mm_cvtsi32_si128(p), spread);
+
+            __m128i px = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lv, bits), bits), one),
+                                      _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(hv, bits), bits), two));
+            px = _mm_or_si128(px, _mm_andnot_si128(_mm_cmpeq_epi8(px, zero), pv));
+            _mm_storeu_si128((__m128i *)(line + i * 8), px);
+        }
+    }
+
+    __attribute__((target("ssse3")))
+    static bool compose_ssse3(const uint8_t *bg, const uint8_t *sprites, const uint8_t *palette, uint8_t gray, uint8_t *out)
+    {
+        const __m128i pal_lo = _mm_loadu_si128((const __m128i *)palette);
+        const __m128i pal_hi = _mm_loadu_si128((const __m128i *)(palette + 16));
+        const __m128i gray_v = _mm_set1_epi8((char)gray);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i behind = _mm_set1_epi8(0x40);
+        const __m128i zero_bit = _mm_set1_epi8((char)0x80);
+        const __m128i high_half = _mm_set1_epi8(0x10);
+        const __m128i color_mask = _mm_set1_epi8(0x1f);
+        int hits = 0;
+
+        for (int x = 0; x < NES_SCREEN_WIDTH; x += 16) {
+            __m128i b = _mm_loadu_si128((const __m128i *)(bg + x));
+            __m128i s = _mm_loadu_si128((const __m128i *)(sprites + x));
+
+            __m128i b_clear = _mm_cmpeq_epi8(b, zero);
+            __m128i s_set = _mm_xor_si128(_mm_cmpeq_epi8(s, zero), _mm_set1_epi8(-1));
+            __m128i s_behind = _mm_cmpeq_epi8(_mm_and_si128(s, behind), behind);
+
+            // sprite wins where it is opaque, unless it is behind an opaque background
+            __m128i use_s = _mm_andnot_si128(_mm_andnot_si128(b_clear, s_behind), s_set);
+            __m128i color = _mm_or_si128(_mm_and_si128(use_s, _mm_and_si128(s, color_mask)), _mm_andnot_si128(use_s, b));
+
+            __m128i hit = _mm_andnot_si128(b_clear, _mm_cmpeq_epi8(_mm_and_si128(s, zero_bit), zero_bit));
+            hits |= _mm_movemask_epi8(hit) & (x == NES_SCREEN_WIDTH - 16 ? 0x7fff : 0xffff);
+
+            __m128i upper = _mm_cmpeq_epi8(_mm_and_si128(color, high_half), high_half);
+            __m128i v = _mm_or_si128(_mm_andnot_si128(upper, _mm_shuffle_epi8(pal_lo, color)),
+                                     _mm_and_si128(upper, _mm_shuffle_epi8(pal_hi, color)));
+            _mm_storeu_si128((__m128i *)(out + x), _mm_and_si128(v, gray_v));
+        }
+        return hits != 0;
+    }
+
+    // same as the SSSE3 kernels, 4 tiles / 32 pixels per step, pshufb works per 128 bit lane
+    __attribute__((target("avx2")))
+    static void expand_tiles_avx2(const uint8_t *lo, const uint8_t *hi, const uint8_t *pal, uint8_t *line, int tiles)
+    {
+        const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                                2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+        const __m256i bits = _mm256_setr_epi8((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                              (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                              (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                              (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+        const __m256i one = _mm256_set1_epi8(1);
+        const __m256i two = _mm256_set1_epi8(2);
+        const __m256i zero = _mm256_setzero_si256();
+
+        for (int i = 0; i < tiles; i += 4) {
+            uint32_t l, h, p;
+            memcpy(&l, lo + i, 4);
+            memcpy(&h, hi + i, 4);
+            memcpy(&p, pal + i, 4);
+
+            __m256i lv = _mm256_shuffle_epi8(_mm256_set1_epi32((int)l), spread);
+            __m256i hv = _mm256_shuffle_epi8(_mm256_set1_epi32((int)h), spread);
+            __m256i pv = _mm256_shuffle_epi8(_mm256_set1_epi32((int)p), spread);
+
+            __m256i px = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lv, bits), bits), one),
+                                         _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(hv, bits), bits), two));
+            px = _mm256_or_si256(px, _mm256_andnot_si256(_mm256_cmpeq_epi8(px, zero), pv));
+            _mm256_storeu_si256((__m256i *)(line + i * 8), px);
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static bool compose_avx2(const uint8_t *bg, const uint8_t *sprites, const uint8_t *palette, uint8_t gray, uint8_t *out)
+    {
+        const __m256i pal_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)palette));
+        const __m256i pal_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(palette + 16)));
+        const __m256i gray_v = _mm256_set1_epi8((char)gray);
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i behind = _mm256_set1_epi8(0x40);
+        const __m256i zero_bit = _mm256_set1_epi8((char)0x80);
+        const __m256i high_half = _mm256_set1_epi8(0x10);
+        const __m256i color_mask = _mm256_set1_epi8(0x1f);
+        uint32_t hits = 0;
+
+        for (int x = 0; x < NES_SCREEN_WIDTH; x += 32) {
+            __m256i b = _mm256_loadu_si256((const __m256i *)(bg + x));
+            __m256i s = _mm256_loadu_si256((const __m256i *)(sprites + x));
+
+            __m256i b_clear = _mm256_cmpeq_epi8(b, zero);
+            __m256i s_set = _mm256_xor_si256(_mm256_cmpeq_epi8(s, zero), _mm256_set1_epi8(-1));
+            __m256i s_behind = _mm256_cmpeq_epi8(_mm256_and_si256(s, behind), behind);
+
+            __m256i use_s = _mm256_andnot_si256(_mm256_andnot_si256(b_clear, s_behind), s_set);
+            __m256i color = _mm256_blendv_epi8(b, _mm256_and_si256(s, color_mask), use_s);
+
+            __m256i hit = _mm256_andnot_si256(b_clear, _mm256_cmpeq_epi8(_mm256_and_si256(s, zero_bit), zero_bit));
+            hits |= (uint32_t)_mm256_movemask_epi8(hit) & (x == NES_SCREEN_WIDTH - 32 ? 0x7fffffffu : 0xffffffffu);
+
+            __m256i upper = _mm256_cmpeq_epi8(_mm256_and_si256(color, high_half), high_half);
+            __m256i v = _mm256_blendv_epi8(_mm256_shuffle_epi8(pal_lo, color), _mm256_shuffle_epi8(pal_hi, color), upper);
+            _mm256_storeu_si256((__m256i *)(out + x), _mm256_and_si256(v, gray_v));
+        }
+        return hits != 0;
+    }
+
+#endif
+
+    static const pixel_kernels g_pixel_kernels[] = {
+        { nullptr, compose_scalar },
+#if NES_PPU_SIMD
+        { expand_tiles_ssse3, compose_ssse3 },
+        { expand_tiles_avx2, compose_avx2 },
+#else
+        { nullptr, compose_scalar },
+        { nullptr, compose_scalar },
+#endif
+    };
+
+    bool pixel_path_supported(pixel_path path)
+    {
+#if NES_PPU_SIMD
+        switch (path) {
+            case pixel_path::ssse3: return __builtin_cpu_supports("ssse3");
+            case pixel_path::avx2:  return __builtin_cpu_supports("avx2");
+            default:                return true;
+        }
+#else
+        return path == pixel_path::scalar;
+#endif
+    }
+
+    pixel_path detect_pixel_path()
+    {
+        if (pixel_path_supported(pixel_path::avx2)) {
+            return pixel_path::avx2;
+        }
+        if (pixel_path_supported(pixel_path::ssse3)) {
+            return pixel_path::ssse3;
+        }
+        return pixel_path::scalar;
+    }
+
+    const pixel_kernels& get_pixel_kernels(pixel_path path)
+    {
+        return g_pixel_kernels[(int)path];
+    }
+
+    const char* pixel_path_name(pixel_path path)
+    {
+        static const char * const names[] = { "scalar", "ssse3", "avx2" };
+        return names[(int)path];
+    }
+
+}
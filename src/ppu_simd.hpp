@@ -0,0 +1,55 @@
+#ifndef ppu_simd_hpp
+#define ppu_simd_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define NES_PPU_SIMD 1
+#else
+#define NES_PPU_SIMD 0
+#endif
+
+// 33 tiles cover 256 pixels at any fine X, the kernels work on groups of 4
+#define NES_BG_TILES 33
+#define NES_BG_TILES_PADDED 36
+
+
+namespace nes {
+
+    enum class pixel_path : uint8_t {
+        scalar,     // tile cache, one pixel at a time
+        ssse3,      // 16 pixels per step, pshufb palette lookup
+        avx2,       // 32 pixels per step
+    };
+
+    /*
+        Background and compose kernels of one pixel path.
+
+        expand_tiles turns pattern plane bytes into 8 pixels per tile,
+        palette << 2 | pattern, 0 where transparent. It is nullptr for the
+        scalar path, which reads decoded rows from the tile cache instead.
+
+        compose merges the fine X shifted background with the sprite line
+        (see ppu::render_sprites for its layout) and looks the 256 colors
+        up in the palette. Returns true on a sprite 0 hit.
+    */
+    struct pixel_kernels {
+        void (*expand_tiles)(const uint8_t *lo, const uint8_t *hi, const uint8_t *pal, uint8_t *line, int tiles);
+        bool (*compose)(const uint8_t *bg, const uint8_t *sprites, const uint8_t *palette, uint8_t gray, uint8_t *out);
+    };
+
+    // fastest path this CPU runs
+    pixel_path detect_pixel_path();
+
+    bool pixel_path_supported(pixel_path path);
+
+    const pixel_kernels& get_pixel_kernels(pixel_path path);
+
+    const char* pixel_path_name(pixel_path path);
+
+}
+
+
+#endif /* ppu_simd_hpp */
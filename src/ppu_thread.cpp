@@ -0,0 +1,365 @@
+#include "ppu_thread.hpp"
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include "console.hpp"
+#include "bench.hpp"
+#include "utils.hpp"
+
+
+namespace nes {
+
+    ppu_thread::ppu_thread() noexcept
+    :ring_(NES_PPU_EVENTS), pictures_(2 * NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT)
+    {
+        // every member is up before the thread looks at them
+        this->thread_ = std::thread([this]() {
+            this->run();
+        });
+    }
+
+    ppu_thread::~ppu_thread()
+    {
+        this->publish();
+        this->stop_.store(true);
+        {
+            std::lock_guard<std::mutex> guard(this->lock_);
+            this->sleeping_.store(false);
+            this->wake_.notify_one();
+        }
+        this->thread_.join();
+    }
+
+    void* ppu_thread::operator new(size_t size) noexcept
+    {
+        void *p = nullptr;
+        return posix_memalign(&p, alignof(ppu_thread), size) == 0 ? p : nullptr;
+    }
+
+    void ppu_thread::operator delete(void *p) noexcept
+    {
+        free(p);
+    }
+
+    void ppu_thread::run()
+    {
+        ppu_event batch[64];
+        int idle = 0;
+        for (;;) {
+            size_t n = this->ring_.pop(batch, arr_len(batch));
+            if (n != 0) {
+                for (size_t i = 0; i < n; ++i) {
+                    this->apply(batch[i]);
+                }
+                this->drawn_.store(this->ring_.popped(), std::memory_order_release);
+                idle = 0;
+                continue;
+            }
+            // pushes made before stop_ was set are seen after it
+            if (this->stop_.load()) {
+                if (this->ring_.empty()) {
+                    return;
+                }
+                continue;
+            }
+            if (++idle < NES_PPU_IDLE_SPINS) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // either push() sees sleeping_ or this sees its event
+            std::unique_lock<std::mutex> lock(this->lock_);
+            this->sleeping_.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (this->ring_.empty() && !this->stop_.load()) {
+                this->wake_.wait(lock, [this]() {
+                    return !this->sleeping_.load();
+                });
+            }
+            this->sleeping_.store(false);
+            idle = 0;
+        }
+    }
+
+    void ppu_thread::apply(const ppu_event& e)
+    {
+        switch (e.kind) {
+            case ppu_event_kind::line: {
+                ppu_line l = { e.addr, e.ctrl, e.mask, e.x, e.value };
+                this->raster_.render_line(l, this->picture(e.buffer) + e.value * NES_SCREEN_WIDTH);
+                break;
+            }
+            case ppu_event_kind::frame:
+                this->finished_.store(this->finished_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+                break;
+            case ppu_event_kind::vram:
+                this->raster_.write_vram(e.addr, e.value);
+                break;
+            case ppu_event_kind::chr:
+                this->raster_.write_chr(e.addr, e.value);
+                break;
+            case ppu_event_kind::oam:
+                this->raster_.write_oam((uint8_t)e.addr, e.value);
+                break;
+            case ppu_event_kind::bank:
+                this->raster_.set_slot(e.value, (size_t)e.addr << NES_CHR_SLOT_SHIFT);
+                break;
+            case ppu_event_kind::mirroring:
+                this->raster_.set_mirroring((mirroring)e.value);
+                break;
+        }
+    }
+
+    void ppu_thread::publish()
+    {
+        size_t sent = this->ring_.push(this->batch_, this->batched_);
+        if (sent != this->batched_) {
+            this->stalls_++;
+            do {
+                std::this_thread::yield();
+                sent += this->ring_.push(this->batch_ + sent, this->batched_ - sent);
+            } while (sent != this->batched_);
+        }
+        this->batched_ = 0;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (this->sleeping_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> guard(this->lock_);
+            this->sleeping_.store(false);
+            this->wake_.notify_one();
+        }
+    }
+
+    void ppu_thread::wait(const std::atomic<uint64_t>& counter, uint64_t target)
+    {
+        if (counter.load(std::memory_order_acquire) >= target) {
+            return;
+        }
+        this->waits_++;
+        while (counter.load(std::memory_order_acquire) < target) {
+            std::this_thread::yield();
+        }
+    }
+
+    void ppu_thread::write(ppu_event_kind kind, uint64_t dot, uint16_t addr, uint8_t v)
+    {
+        ppu_event e = { dot, addr, kind, v, 0, 0, 0, 0 };
+        this->push(e);
+    }
+
+    void ppu_thread::line(uint64_t dot, const ppu_line& l)
+    {
+        this->buffer_ = (uint8_t)(this->frames_ & 1);
+        ppu_event e = { dot, l.v, ppu_event_kind::line, l.y, l.ctrl, l.mask, l.x, this->buffer_ };
+        this->push(e);
+        if (l.y == NES_SCREEN_HEIGHT - 1) {
+            // the thread finishes the picture while the CPU runs vblank
+            this->write(ppu_event_kind::frame, dot, 0, 0);
+            this->frames_++;
+            this->publish();
+        }
+    }
+
+    void ppu_thread::banks(uint64_t dot, const mapper& m)
+    {
+        for (int i = 0; i < NES_CHR_SLOTS; ++i) {
+            const uint8_t *slot = m.chr_slot(i);
+            if (slot != this->sent_[i]) {
+                this->sent_[i] = slot;
+                this->write(ppu_event_kind::bank, dot, (uint16_t)((slot - m.chr_data()) >> NES_CHR_SLOT_SHIFT), (uint8_t)i);
+            }
+        }
+    }
+
+    void ppu_thread::sync(const ppu_raster& from, const mapper& m)
+    {
+        // the render thread is idle on an empty ring, the next batch publishes the copy
+        this->publish();
+        this->wait(this->drawn_, this->ring_.pushed());
+        this->raster_.copy(from, m);
+        for (int i = 0; i < NES_CHR_SLOTS; ++i) {
+            this->sent_[i] = m.chr_slot(i);
+        }
+    }
+
+    const uint8_t* ppu_thread::frame()
+    {
+        this->publish();
+        this->wait(this->drawn_, this->ring_.pushed());
+        return this->picture(this->buffer_);
+    }
+
+    const uint8_t* ppu_thread::previous_frame()
+    {
+        // frames_ - 2, black before there was one
+        this->wait(this->finished_, this->frames_ ? this->frames_ - 1 : 0);
+        return this->picture((uint8_t)(this->frames_ & 1));
+    }
+
+    // NROM with CHR RAM, or CNROM with 4 banks of CHR ROM
+    static void test_image(std::vector<uint8_t>& image, bool banks)
+    {
+        image.assign(NES_HEADER_SIZE + NES_PRG_BANK_SIZE + (banks ? 4 * NES_CHR_BANK_SIZE : 0), 0);
+        memcpy(image.data(), "NES\x1a", 4);
+        image[4] = 1;
+        image[5] = banks ? 4 : 0;
+        image[6] = banks ? 0x31 : 0x01;
+        uint32_t x = 0x9e3779b9;
+        for (size_t i = NES_HEADER_SIZE + NES_PRG_BANK_SIZE; i < image.size(); ++i) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            image[i] = (uint8_t)x & (uint8_t)(x >> 8);
+        }
+    }
+
+    // 3 frames with random writes to every register, VRAM, OAM and the CHR bank between
+    // lines; the hash of the pictures and of what $2002 said after each
+    static uint32_t random_frames(mapper& m, memory& mem, ppu_thread *t, uint32_t seed)
+    {
+        ppu p(m);
+        p.set_pixel_path(pixel_path::scalar);
+        p.set_thread(t);
+        m.write(NES_PRG_ROM_ADDR, 0);
+        mem.map_handler(0x2000, 0x2000, &p);
+
+        uint32_t x = seed * 2654435761u + 7;
+        auto next = [&x]() {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            return (uint8_t)x;
+        };
+        auto set_addr = [&mem](uint16_t addr) {
+            mem.write<uint8_t>(addr >> 8, 0x2006);
+            mem.write<uint8_t>(addr & 0xff, 0x2006);
+        };
+
+        set_addr(0x0000);
+        for (int i = 0; i < 0x3000; ++i) {
+            mem.write<uint8_t>(next() & next(), 0x2007);
+        }
+        set_addr(0x3f00);
+        for (int i = 0; i < 32; ++i) {
+            mem.write<uint8_t>(next(), 0x2007);
+        }
+        mem.write<uint8_t>(0x00, 0x2003);
+        for (int i = 0; i < 256; ++i) {
+            // sprites low enough to show up
+            mem.write<uint8_t>(i % 4 == 0 ? next() % 240 : next(), 0x2004);
+        }
+        mem.write<uint8_t>(PPUCTRL_BG_TABLE, 0x2000);
+        mem.write<uint8_t>(PPUMASK_BG | PPUMASK_SPRITES, 0x2001);
+
+        uint32_t h = 0;
+        for (int f = 0; f < 3; ++f) {
+            for (int y = 0; y < NES_LINES_PER_FRAME; ++y) {
+                switch (next() % 12) {
+                    case 0:
+                        mem.write<uint8_t>(next(), 0x2005);
+                        mem.write<uint8_t>(next(), 0x2005);
+                        break;
+                    case 1: mem.write<uint8_t>(next() & 0x3b, 0x2000); break;
+                    case 2: mem.write<uint8_t>(next() | PPUMASK_BG, 0x2001); break;
+                    case 3:
+                        mem.write<uint8_t>(next(), 0x2003);
+                        mem.write<uint8_t>(next(), 0x2004);
+                        break;
+                    case 4:
+                        set_addr((uint16_t)(0x2000 + (next() << 4 | (next() & 0x0f)) % 0x1000));
+                        mem.write<uint8_t>(next(), 0x2007);
+                        break;
+                    case 5:
+                        set_addr((uint16_t)(0x3f00 | (next() & 0x1f)));
+                        mem.write<uint8_t>(next(), 0x2007);
+                        break;
+                    case 6:
+                        set_addr((uint16_t)((next() << 8 | next()) & 0x1fff));
+                        mem.write<uint8_t>(next(), 0x2007);
+                        break;
+                    case 7: m.write(NES_PRG_ROM_ADDR, next() & 3); break;
+                }
+                p.scanline();
+                if (y == NES_SCREEN_HEIGHT) {
+                    h = (h ^ mem.read<uint8_t>(0x2002)) * 16777619u;
+                }
+            }
+            h = (h ^ frame_hash(p.frame())) * 16777619u;
+        }
+
+        p.set_thread(nullptr);
+        mem.unmap(0x2000, 0x2000);
+        return h;
+    }
+
+    void ppu_thread::test()
+    {
+        // every write lands on the same line as in the serial PPU
+        ppu_thread t;
+        for (int banks = 0; banks < 2; ++banks) {
+            std::vector<uint8_t> image;
+            test_image(image, banks != 0);
+            cartridge cart;
+            int err = cart.load(image.data(), image.size());
+            assert(err == 0);
+            (void)err;
+            memory mem;
+            std::unique_ptr<mapper> m = mapper::create(cart, mem);
+            for (uint32_t seed = 0; seed < 8; ++seed) {
+                bool same = random_frames(*m, mem, nullptr, seed) == random_frames(*m, mem, &t, seed);
+                assert(same);
+                (void)same;
+            }
+        }
+        assert(t.frames() == 2 * 8 * 3 && t.events() > t.frames() * NES_SCREEN_HEIGHT);
+
+        // on the heap as console has it, the cache line alignment holds
+        {
+            std::unique_ptr<ppu_thread> heap(new ppu_thread());
+            assert(heap && ((uintptr_t)heap.get() & (alignof(ppu_thread) - 1)) == 0);
+        }
+
+        // whole consoles: frame() after every frame, previous_frame() a frame late,
+        // a state loaded and the thread dropped in the middle of it all
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+        const int frames = 90;
+        std::vector<uint32_t> hashes;
+        console plain;
+        int err = plain.load(demo.data(), demo.size());
+        for (int f = 0; f < frames; ++f) {
+            plain.run_frame();
+            hashes.push_back(frame_hash(plain.frame()));
+        }
+
+        console a;
+        console b;
+        err |= a.load(demo.data(), demo.size()) | b.load(demo.data(), demo.size());
+        assert(err == 0);
+        a.set_ppu_thread(true);
+        b.set_ppu_thread(true);
+        std::vector<uint8_t> state;
+        for (int f = 0; f < frames; ++f) {
+            a.run_frame();
+            assert(frame_hash(a.frame()) == hashes[f]);
+            b.run_frame();
+            assert(f == 0 || frame_hash(b.previous_frame()) == hashes[f - 1]);
+            if (f == 29) {
+                a.save_state(state);
+            }
+            if (f == 59) {
+                err = a.load_state(state.data(), state.size());
+                assert(err == 0);
+                for (int k = 30; k < 60; ++k) {
+                    a.run_frame();
+                }
+                assert(frame_hash(a.frame()) == hashes[f]);
+                a.set_ppu_thread(false);
+                assert(frame_hash(a.frame()) == hashes[f]);
+            }
+        }
+        assert(frame_hash(b.frame()) == hashes[frames - 1] && frame_hash(a.frame()) == hashes[frames - 1]);
+        assert(a.get_ppu().get_thread() == nullptr && b.get_ppu().get_thread() != nullptr);
+        (void)err;
+    }
+
+}
@@ -0,0 +1,167 @@
+#ifndef ppu_thread_hpp
+#define ppu_thread_hpp
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ppu.hpp"
+#include "spsc_ring.hpp"
+
+// events in flight, a few frames of lines and writes
+#define NES_PPU_EVENTS 8192
+// events the CPU side collects before it publishes them
+#define NES_PPU_BATCH 64
+// empty polls before the render thread goes to sleep
+#define NES_PPU_IDLE_SPINS 4096
+
+
+namespace nes {
+
+    enum class ppu_event_kind : uint8_t {
+        line,           // draw a visible line
+        frame,          // the picture is whole
+        vram,           // nametable or palette write
+        chr,            // CHR RAM write
+        oam,
+        bank,           // a CHR slot moved
+        mirroring,
+    };
+
+    struct ppu_event {
+        uint64_t dot;           // where it takes effect, the start of the line it comes before
+        uint16_t addr;          // PPU or OAM address, v of a line, 1K bank of a slot
+        ppu_event_kind kind;
+        uint8_t value;          // written, y of a line, the slot, the mirroring
+        uint8_t ctrl;           // line only
+        uint8_t mask;
+        uint8_t x;
+        uint8_t buffer;         // picture the line goes to
+    };
+
+    /*
+        Draws what a ppu sends it on a thread of its own.
+
+        The CPU side ppu still runs every line, with its registers,
+        status bits and mapper clocks; it only stops drawing. The lines
+        and every write to what is drawn from go through an spsc_ring
+        in the order the CPU side made them, so the raster here replays
+        the same state at every line and the pictures are the serial
+        ones, a line or a frame later.
+
+        Pictures are double buffered: the render thread can finish frame
+        N in one while the CPU already runs frame N+1, whose lines go to
+        the other. frame() waits for every line sent, previous_frame()
+        only for the frame before.
+
+        Events are published NES_PPU_BATCH at a time and at the end of
+        every picture, so the ring's counters and the wake up check are
+        touched once per batch. The render thread spins on an empty ring
+        for a while, then sleeps until the next batch wakes it.
+    */
+    class ppu_thread {
+
+        spsc_ring<ppu_event> ring_;
+        ppu_raster raster_;
+        std::vector<uint8_t> pictures_;
+        std::thread thread_;
+
+        std::mutex lock_;
+        std::condition_variable wake_;
+        std::atomic<bool> sleeping_{false};
+        std::atomic<bool> stop_{false};
+
+        // events and frame events the render thread is done with
+        std::atomic<uint64_t> drawn_{0};
+        std::atomic<uint64_t> finished_{0};
+
+        // the CPU side's
+        ppu_event batch_[NES_PPU_BATCH];
+        size_t batched_{0};
+        uint64_t frames_{0};
+        uint8_t buffer_{0};
+        const uint8_t *sent_[NES_CHR_SLOTS]{nullptr};
+        uint64_t stalls_{0};
+        uint64_t waits_{0};
+
+        uint8_t* picture(uint8_t buffer)
+        {
+            return &this->pictures_[buffer * NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT];
+        }
+
+        void run();
+        void apply(const ppu_event& e);
+        void push(const ppu_event& e)
+        {
+            this->batch_[this->batched_++] = e;
+            if (this->batched_ == NES_PPU_BATCH) {
+                this->publish();
+            }
+        }
+
+        void publish();
+        void wait(const std::atomic<uint64_t>& counter, uint64_t target);
+
+    public:
+        ppu_thread(const ppu_thread&) = delete;
+        ppu_thread(ppu_thread&&) = delete;
+        ppu_thread& operator=(const ppu_thread&) = delete;
+        ppu_thread& operator=(ppu_thread&&) = delete;
+
+        // starts the render thread
+        ppu_thread() noexcept;
+        // draws what is left, then joins it
+        ~ppu_thread();
+
+        // the ring's counters sit on cache lines of their own, a plain new
+        // only aligns to 16 before C++17; nullptr when out of memory
+        static void* operator new(size_t size) noexcept;
+        static void operator delete(void *p) noexcept;
+
+        // the CPU side, in the order the ppu makes them
+        void write(ppu_event_kind kind, uint64_t dot, uint16_t addr, uint8_t v);
+        void line(uint64_t dot, const ppu_line& l);
+        // bank events for the slots m moved since the last call
+        void banks(uint64_t dot, const mapper& m);
+
+        // waits for everything sent, then draws from a copy of from and m
+        void sync(const ppu_raster& from, const mapper& m);
+
+        // the picture the last line sent went to, once it is drawn
+        const uint8_t* frame();
+        // the whole one before the newest whole one, once that is drawn
+        const uint8_t* previous_frame();
+
+        uint64_t events() const
+        {
+            return this->ring_.pushed() + this->batched_;
+        }
+
+        // frame events sent
+        uint64_t frames() const
+        {
+            return this->frames_;
+        }
+
+        // batches that found the ring full
+        uint64_t stalls() const
+        {
+            return this->stalls_;
+        }
+
+        // frame() and previous_frame() calls that found the thread behind
+        uint64_t waits() const
+        {
+            return this->waits_;
+        }
+
+        static void test();
+    };
+
+}
+
+
+#endif /* ppu_thread_hpp */
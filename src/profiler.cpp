@@ -0,0 +1,281 @@
+#include "profiler.hpp"
+
+#if NES_PROFILER
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include "memory.hpp"
+#include "cpu_6502.hpp"
+#include "disasm.hpp"
+#include "utils.hpp"
+
+#define NES_ADDRESSING_MODES 13
+
+
+namespace nes {
+
+    // in addressing_mode order
+    static const char * const g_mode_names[NES_ADDRESSING_MODES] = {
+        "implied", "accumulator", "immediate", "zero page", "zero page,X", "zero page,Y", "relative",
+        "absolute", "absolute,X", "absolute,Y", "indirect", "(indirect,X)", "(indirect),Y",
+    };
+
+    profiler::profiler() noexcept
+    :pc_count_(0x10000), pc_cycles_(0x10000)
+    {
+        this->nodes_.reserve(256);
+        this->clear();
+    }
+
+    void profiler::clear()
+    {
+        std::fill(this->pc_count_.begin(), this->pc_count_.end(), 0);
+        std::fill(this->pc_cycles_.begin(), this->pc_cycles_.end(), 0);
+        memset(this->op_count_, 0, sizeof(this->op_count_));
+        memset(this->op_cycles_, 0, sizeof(this->op_cycles_));
+        this->nodes_.clear();
+        this->nodes_.push_back(node{0, 0, 0, 0, 0, 1, 0});
+        this->depth_ = 0;
+        this->current_ = 0;
+    }
+
+    void profiler::call(uint16_t pc, char kind, uint8_t sp, uint64_t cycles)
+    {
+        uint32_t id = this->nodes_[this->current_].child;
+        while (id != 0 && (this->nodes_[id].pc != pc || this->nodes_[id].kind != kind)) {
+            id = this->nodes_[id].sibling;
+        }
+        if (id == 0 && this->nodes_.size() < NES_PROFILE_NODES && this->depth_ < NES_PROFILE_DEPTH) {
+            id = (uint32_t)this->nodes_.size();
+            node& parent = this->nodes_[this->current_];
+            node n = { pc, kind, this->current_, 0, parent.child, 0, 0 };
+            parent.child = id;
+            this->nodes_.push_back(n);
+        }
+        if (id == 0 || this->depth_ == NES_PROFILE_DEPTH) {
+            this->nodes_[this->current_].cycles += cycles;
+            return;
+        }
+
+        this->stack_[this->depth_++] = frame{ this->current_, sp };
+        this->current_ = id;
+        this->nodes_[id].calls++;
+        this->nodes_[id].cycles += cycles;
+    }
+
+    void profiler::ret(uint8_t sp)
+    {
+        // the stack grows down, frames opened below sp are gone
+        while (this->depth_ > 0 && this->stack_[this->depth_ - 1].sp < sp) {
+            this->current_ = this->stack_[--this->depth_].node;
+        }
+    }
+
+    void profiler::node_name(const node& n, char out[16])
+    {
+        const char *prefix;
+        switch (n.kind) {
+        case 's': prefix = "sub"; break;
+        case 'n': prefix = "nmi"; break;
+        case 'i': prefix = "irq"; break;
+        case 'b': prefix = "brk"; break;
+        default:  strcpy(out, "root"); return;
+        }
+        snprintf(out, 16, "%s_%04X", prefix, n.pc);
+    }
+
+    uint64_t profiler::instructions() const
+    {
+        uint64_t n = 0;
+        for (uint64_t v : this->op_count_) {
+            n += v;
+        }
+        return n;
+    }
+
+    uint64_t profiler::cycles() const
+    {
+        // interrupt entries are in the nodes only
+        uint64_t n = 0;
+        for (const node& v : this->nodes_) {
+            n += v.cycles;
+        }
+        return n;
+    }
+
+    void profiler::folded(FILE *out) const
+    {
+        uint32_t path[NES_PROFILE_DEPTH + 1];
+        char name[16];
+        for (uint32_t id = 0; id < this->nodes_.size(); ++id) {
+            if (this->nodes_[id].cycles == 0) {
+                continue;
+            }
+            size_t n = 0;
+            for (uint32_t at = id; at != 0; at = this->nodes_[at].parent) {
+                path[n++] = at;
+            }
+            fputs("root", out);
+            while (n > 0) {
+                node_name(this->nodes_[path[--n]], name);
+                fprintf(out, ";%s", name);
+            }
+            fprintf(out, " %llu\n", (unsigned long long)this->nodes_[id].cycles);
+        }
+    }
+
+    int profiler::folded(const char *path) const
+    {
+        FILE *f = fopen(path, "w");
+        if (f == nullptr) {
+            return PROFILE_ERROR_OPEN;
+        }
+        this->folded(f);
+        return fclose(f) == 0 ? 0 : PROFILE_ERROR_OPEN;
+    }
+
+    void profiler::report(FILE *out, const memory& mem, size_t top) const
+    {
+        uint64_t instructions = this->instructions();
+        uint64_t total = this->cycles();
+        double scale = total ? 100.0 / total : 0;
+        fprintf(out, "%llu instructions, %llu cycles, %zu call paths\n", (unsigned long long)instructions,
+                (unsigned long long)total, this->nodes_.size());
+
+        std::vector<uint32_t> order;
+        for (uint32_t pc = 0; pc < 0x10000; ++pc) {
+            if (this->pc_count_[pc] != 0) {
+                order.push_back(pc);
+            }
+        }
+        size_t n = std::min(top, order.size());
+        std::partial_sort(order.begin(), order.begin() + n, order.end(), [this](uint32_t a, uint32_t b) {
+            return this->pc_cycles_[a] > this->pc_cycles_[b];
+        });
+        fprintf(out, "\n%-22s%14s%8s%14s\n", "PC", "cycles", "%", "count");
+        for (size_t i = 0; i < n; ++i) {
+            uint16_t pc = (uint16_t)order[i];
+            uint8_t bytes[3] = { mem.peek(pc), mem.peek((uint16_t)(pc + 1)), mem.peek((uint16_t)(pc + 2)) };
+            char text[NES_DISASM_SIZE];
+            disassemble(pc, bytes, 3, text);
+            fprintf(out, "%04X  %-16s%14llu%8.2f%14llu\n", pc, text, (unsigned long long)this->pc_cycles_[pc],
+                    this->pc_cycles_[pc] * scale, (unsigned long long)this->pc_count_[pc]);
+        }
+
+        order.clear();
+        uint64_t mode_count[NES_ADDRESSING_MODES] = { 0 };
+        uint64_t mode_cycles[NES_ADDRESSING_MODES] = { 0 };
+        for (uint32_t op = 0; op < 256; ++op) {
+            if (this->op_count_[op] != 0) {
+                order.push_back(op);
+                mode_count[(size_t)g_opcode_info[op].mode] += this->op_count_[op];
+                mode_cycles[(size_t)g_opcode_info[op].mode] += this->op_cycles_[op];
+            }
+        }
+        n = std::min(top, order.size());
+        std::partial_sort(order.begin(), order.begin() + n, order.end(), [this](uint32_t a, uint32_t b) {
+            return this->op_cycles_[a] > this->op_cycles_[b];
+        });
+        fprintf(out, "\n%-22s%14s%8s%14s\n", "opcode", "cycles", "%", "count");
+        for (size_t i = 0; i < n; ++i) {
+            const opcode_info& info = g_opcode_info[order[i]];
+            char name[24];
+            snprintf(name, sizeof(name), "%02X %s %s", order[i], info.mnemonic, g_mode_names[(size_t)info.mode]);
+            fprintf(out, "%-22s%14llu%8.2f%14llu\n", name, (unsigned long long)this->op_cycles_[order[i]],
+                    this->op_cycles_[order[i]] * scale, (unsigned long long)this->op_count_[order[i]]);
+        }
+
+        fprintf(out, "\n%-22s%14s%8s%14s\n", "addressing", "cycles", "%", "count");
+        for (size_t m = 0; m < arr_len(g_mode_names); ++m) {
+            if (mode_count[m] != 0) {
+                fprintf(out, "%-22s%14llu%8.2f%14llu\n", g_mode_names[m], (unsigned long long)mode_cycles[m],
+                        mode_cycles[m] * scale, (unsigned long long)mode_count[m]);
+            }
+        }
+    }
+
+    // what f holds, from the start
+    static void read_back(FILE *f, char *text, size_t size)
+    {
+        fflush(f);
+        rewind(f);
+        size_t n = fread(text, 1, size - 1, f);
+        text[n] = 0;
+        fclose(f);
+    }
+
+    void profiler::test()
+    {
+        static const uint8_t code[] = {
+            0x20, 0x0C, 0x06,   // 0600 JSR a
+            0x20, 0x12, 0x06,   // 0603 JSR b
+            0x20, 0x14, 0x06,   // 0606 JSR c
+            0x4C, 0x1B, 0x06,   // 0609 JMP end
+            0x20, 0x12, 0x06,   // 060C a: JSR b
+            0xE8,               // 060F INX
+            0x60,               // 0610 RTS
+            0xEA,               // 0611 NOP
+            0xE8,               // 0612 b: INX
+            0x60,               // 0613 RTS
+            0x20, 0x18, 0x06,   // 0614 c: JSR d
+            0xEA,               // 0617 NOP, never run
+            0x68,               // 0618 d: PLA
+            0x68,               // 0619 PLA, c's return address is gone
+            0x60,               // 061A RTS, straight back to the root
+            0xEA,               // 061B end: NOP
+        };
+
+        // whatever the dispatch mode, the profiler runs eval()
+        memory mem;
+        cpu_6502 cpu(mem);
+        profiler prof;
+        cpu.set_dispatch_mode(dispatch_mode::jit);
+        cpu.set_profiler(&prof);
+        cpu.load_code_segment(0x0600, code, sizeof(code));
+        cpu.run();
+        assert(cpu.get_registers().X == 3);
+
+        assert(prof.instructions() == 16 && prof.cycles() == 73);
+        assert(prof.pc_count(0x0612) == 2 && prof.pc_cycles(0x0612) == 4 && prof.pc_count(0x0617) == 0);
+        assert(prof.opcode_count(0x20) == 5 && prof.opcode_cycles(0x20) == 30);
+        assert(prof.opcode_count(0x60) == 4 && prof.opcode_cycles(0x60) == 24);
+
+        static char text[4096];
+        FILE *f = tmpfile();
+        assert(f != nullptr);
+        prof.folded(f);
+        read_back(f, text, sizeof(text));
+        assert(strcmp(text,
+                      "root 23\n"
+                      "root;sub_060C 14\n"
+                      "root;sub_060C;sub_0612 8\n"
+                      "root;sub_0612 8\n"
+                      "root;sub_0614 6\n"
+                      "root;sub_0614;sub_0618 14\n") == 0);
+
+        // an NMI on top of b, its RTI back to b, b's RTS back to the root
+        prof.clear();
+        prof.count(0x0600, 0x20, 6, 0x0612, 0xfb);
+        prof.interrupt(0x0700, true, 0xf8, 7);
+        prof.count(0x0700, 0x40, 6, 0x0612, 0xfb);
+        prof.count(0x0612, 0x60, 6, 0x0603, 0xfd);
+        prof.count(0x0603, 0xea, 2, 0x0604, 0xfd);
+        f = tmpfile();
+        assert(f != nullptr);
+        prof.folded(f);
+        read_back(f, text, sizeof(text));
+        assert(strcmp(text, "root 8\nroot;sub_0612 6\nroot;sub_0612;nmi_0700 13\n") == 0);
+        assert(prof.cycles() == 27 && prof.instructions() == 4);
+
+        f = tmpfile();
+        assert(f != nullptr);
+        prof.report(f, mem, 4);
+        read_back(f, text, sizeof(text));
+        assert(strstr(text, "4 instructions, 27 cycles, 3 call paths") != nullptr);
+        assert(strstr(text, "0612  INX") != nullptr && strstr(text, "20 JSR absolute") != nullptr);
+    }
+
+}
+
+#endif /* NES_PROFILER */
@@ -0,0 +1,155 @@
+#ifndef profiler_hpp
+#define profiler_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// build with -DNES_PROFILER=0 (cmake -DVNES_PROFILER=OFF) and none of it is compiled
+#ifndef NES_PROFILER
+#define NES_PROFILER 1
+#endif
+
+// nested calls followed, deeper ones are counted in the deepest
+#define NES_PROFILE_DEPTH 64
+// distinct call paths, calls past them are counted in their caller
+#define NES_PROFILE_NODES (1 << 16)
+
+#define PROFILE_ERROR_OPEN -60
+
+
+#if NES_PROFILER
+
+namespace nes {
+
+    class memory;
+
+    /*
+        Where the guest spends its cycles. Every instruction adds its
+        cycles, DMA stalls included, to flat arrays indexed by PC and by
+        opcode, and to the call path it runs in; per addressing mode is
+        summed from the opcodes when reporting.
+
+        Call paths come from JSR, BRK and interrupts, each opening a
+        frame at the stack pointer it left behind, and RTS and RTI,
+        which close every frame at or below the stack pointer they
+        return to. A return address dropped with PLA, or a JSR emulated
+        with JMP, thus ends up in the right frame at the next return.
+        Paths are a tree of nodes in one vector, looked up on calls
+        only.
+
+        The CPU runs eval() while a profiler is set, see
+        cpu_6502::set_profiler.
+    */
+    class profiler {
+
+        struct node {
+            uint16_t pc;            // entry point
+            char kind;              // 's' JSR, 'n' NMI, 'i' IRQ, 'b' BRK, 0 the root
+            uint32_t parent;
+            uint32_t child;         // first one
+            uint32_t sibling;       // next one of the same parent
+            uint64_t calls;
+            uint64_t cycles;        // in the node itself, not in what it called
+        };
+
+        struct frame {
+            uint32_t node;
+            uint8_t sp;
+        };
+
+        std::vector<uint64_t> pc_count_;
+        std::vector<uint64_t> pc_cycles_;
+        uint64_t op_count_[256];
+        uint64_t op_cycles_[256];
+
+        std::vector<node> nodes_;
+        frame stack_[NES_PROFILE_DEPTH];
+        uint32_t depth_{0};
+        uint32_t current_{0};
+
+        void call(uint16_t pc, char kind, uint8_t sp, uint64_t cycles);
+        void ret(uint8_t sp);
+
+        // "sub_C123" and so on, "root" for the root
+        static void node_name(const node& n, char out[16]);
+
+    public:
+        profiler(const profiler&) = delete;
+        profiler(profiler&&) = delete;
+        profiler& operator=(const profiler&) = delete;
+        profiler& operator=(profiler&&) = delete;
+
+        profiler() noexcept;
+
+        // the instruction at pc ran for cycles, leaving pc_after and sp_after
+        void count(uint16_t pc, uint8_t opcode, int cycles, uint16_t pc_after, uint8_t sp_after)
+        {
+            this->pc_count_[pc]++;
+            this->pc_cycles_[pc] += (uint64_t)cycles;
+            this->op_count_[opcode]++;
+            this->op_cycles_[opcode] += (uint64_t)cycles;
+            this->nodes_[this->current_].cycles += (uint64_t)cycles;
+
+            // BRK, JSR, RTI and RTS
+            if ((opcode & 0x9f) == 0) {
+                if (opcode == 0x20 || opcode == 0x00) {
+                    this->call(pc_after, opcode ? 's' : 'b', sp_after, 0);
+                }
+                else {
+                    this->ret(sp_after);
+                }
+            }
+        }
+
+        // the CPU took an NMI or IRQ to pc, leaving sp, the entry took cycles
+        void interrupt(uint16_t pc, bool nmi, uint8_t sp, int cycles)
+        {
+            this->call(pc, nmi ? 'n' : 'i', sp, (uint64_t)cycles);
+        }
+
+        void clear();
+
+        uint64_t instructions() const;
+        uint64_t cycles() const;
+
+        uint64_t pc_count(uint16_t pc) const
+        {
+            return this->pc_count_[pc];
+        }
+
+        uint64_t pc_cycles(uint16_t pc) const
+        {
+            return this->pc_cycles_[pc];
+        }
+
+        uint64_t opcode_count(uint8_t opcode) const
+        {
+            return this->op_count_[opcode];
+        }
+
+        uint64_t opcode_cycles(uint8_t opcode) const
+        {
+            return this->op_cycles_[opcode];
+        }
+
+        // "root;sub_C123;nmi_C0A0 cycles" per call path with cycles of its
+        // own, what flamegraph.pl and speedscope read
+        void folded(FILE *out) const;
+        // 0 or PROFILE_ERROR_OPEN
+        int folded(const char *path) const;
+
+        // the top PCs, disassembled from mem as it is now, opcodes and
+        // addressing modes by cycles
+        void report(FILE *out, const memory& mem, size_t top) const;
+
+        static void test();
+    };
+
+}
+
+#endif /* NES_PROFILER */
+
+
+#endif /* profiler_hpp */
@@ -0,0 +1,320 @@
+#include "rewind.hpp"
+#include <cassert>
+#include <cstring>
+#include "bench.hpp"
+
+// equal bytes shorter than this stay inside a literal run
+#define REWIND_MIN_ZEROS 4
+
+
+namespace nes {
+
+    rewind_buffer::rewind_buffer(size_t bytes) noexcept
+    :ring_(bytes)
+    {
+    }
+
+    static void put_varint(std::vector<uint8_t>& out, size_t v)
+    {
+        while (v >= 0x80) {
+            out.push_back((uint8_t)(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back((uint8_t)v);
+    }
+
+    static bool get_varint(const uint8_t *&p, const uint8_t *end, size_t& v)
+    {
+        v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            uint8_t b = *p++;
+            v |= (size_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+        Pairs of varint zero run length, varint literal length and the
+        literal XOR bytes, until n bytes are covered. Equal stretches are
+        skipped 8 bytes at a time.
+    */
+    void rewind_buffer::xor_pack(const uint8_t *a, const uint8_t *b, size_t n, std::vector<uint8_t>& out)
+    {
+        size_t i = 0;
+        while (i < n) {
+            size_t start = i;
+            for (; i + 8 <= n; i += 8) {
+                uint64_t x, y;
+                memcpy(&x, a + i, 8);
+                memcpy(&y, b + i, 8);
+                if (x != y) {
+                    break;
+                }
+            }
+            while (i < n && a[i] == b[i]) {
+                ++i;
+            }
+            put_varint(out, i - start);
+
+            start = i;
+            while (i < n) {
+                if (a[i] != b[i]) {
+                    ++i;
+                    continue;
+                }
+                size_t j = i;
+                while (j < n && j - i < REWIND_MIN_ZEROS && a[j] == b[j]) {
+                    ++j;
+                }
+                if (j - i == REWIND_MIN_ZEROS || j == n) {
+                    break;
+                }
+                i = j;
+            }
+            put_varint(out, i - start);
+            for (size_t k = start; k < i; ++k) {
+                out.push_back(a[k] ^ b[k]);
+            }
+        }
+    }
+
+    bool rewind_buffer::xor_unpack(const uint8_t *p, size_t size, uint8_t *buf, size_t n)
+    {
+        const uint8_t *end = p + size;
+        size_t i = 0;
+        while (p < end) {
+            size_t zeros, literals;
+            if (!get_varint(p, end, zeros) || !get_varint(p, end, literals)) {
+                return false;
+            }
+            if (zeros > n - i || literals > n - i - zeros || literals > (size_t)(end - p)) {
+                return false;
+            }
+            i += zeros;
+            for (size_t k = 0; k < literals; ++k) {
+                buf[i + k] ^= p[k];
+            }
+            i += literals;
+            p += literals;
+        }
+        return i == n;
+    }
+
+    void rewind_buffer::drop_oldest()
+    {
+        this->used_ -= this->entries_.front().size;
+        this->entries_.pop_front();
+    }
+
+    void rewind_buffer::store(const std::vector<uint8_t>& delta)
+    {
+        size_t n = delta.size();
+        if (n > this->ring_.size()) {
+            // nothing older can be reached without this one
+            this->entries_.clear();
+            this->used_ = 0;
+            this->tail_ = 0;
+            return;
+        }
+
+        // the oldest deltas are the ones right after the newest
+        size_t at = this->tail_;
+        if (at + n > this->ring_.size()) {
+            // the end of the ring is skipped, so is what is in it
+            while (!this->entries_.empty() && this->entries_.front().offset >= at) {
+                this->drop_oldest();
+            }
+            at = 0;
+        }
+        while (!this->entries_.empty() && this->entries_.front().offset >= at && this->entries_.front().offset < at + n) {
+            this->drop_oldest();
+        }
+
+        memcpy(&this->ring_[at], delta.data(), n);
+        this->entries_.push_back(entry{at, n});
+        this->used_ += n;
+        this->tail_ = at + n;
+    }
+
+    void rewind_buffer::push(console& nes)
+    {
+        this->scratch_.clear();
+        nes.snapshot(this->scratch_);
+
+        if (!this->current_.empty()) {
+            // u32 size of the older state, then the XOR over the longer of the two
+            size_t prev = this->current_.size();
+            size_t size = this->scratch_.size();
+            size_t n = prev > size ? prev : size;
+            this->current_.resize(n, 0);
+            this->scratch_.resize(n, 0);
+
+            this->packed_.clear();
+            for (int i = 0; i < 4; ++i) {
+                this->packed_.push_back((uint8_t)(prev >> (i * 8)));
+            }
+            xor_pack(this->current_.data(), this->scratch_.data(), n, this->packed_);
+            this->scratch_.resize(size);
+            this->store(this->packed_);
+        }
+        this->current_.swap(this->scratch_);
+    }
+
+    bool rewind_buffer::pop(console& nes)
+    {
+        if (this->current_.empty()) {
+            return false;
+        }
+        if (nes.restore(this->current_.data(), this->current_.size()) != 0) {
+            this->clear();
+            return false;
+        }
+        if (this->entries_.empty()) {
+            this->current_.clear();
+            return true;
+        }
+
+        entry e = this->entries_.back();
+        this->entries_.pop_back();
+        this->used_ -= e.size;
+        this->tail_ = e.offset;
+
+        const uint8_t *p = &this->ring_[e.offset];
+        size_t prev = (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16 | (size_t)p[3] << 24;
+        size_t n = prev > this->current_.size() ? prev : this->current_.size();
+        this->current_.resize(n, 0);
+        if (!xor_unpack(p + 4, e.size - 4, this->current_.data(), n)) {
+            // the state just loaded is fine, what is behind it is not
+            this->clear();
+            return true;
+        }
+        this->current_.resize(prev);
+        return true;
+    }
+
+    void rewind_buffer::clear()
+    {
+        this->entries_.clear();
+        this->used_ = 0;
+        this->tail_ = 0;
+        this->current_.clear();
+    }
+
+    void rewind_buffer::test()
+    {
+        // packing round trips, runs across the 8 byte steps and both ends
+        uint8_t a[100], b[100];
+        for (size_t i = 0; i < sizeof(a); ++i) {
+            a[i] = (uint8_t)(i * 7);
+            b[i] = a[i];
+        }
+        b[0] ^= 1;
+        b[9] ^= 2;
+        b[11] ^= 3;
+        b[50] ^= 4;
+        b[99] ^= 5;
+        std::vector<uint8_t> packed;
+        xor_pack(a, b, sizeof(a), packed);
+        assert(packed.size() < 20);
+        uint8_t c[100];
+        memcpy(c, b, sizeof(c));
+        bool ok = xor_unpack(packed.data(), packed.size(), c, sizeof(c));
+        assert(ok && memcmp(a, c, sizeof(a)) == 0);
+        ok = xor_unpack(packed.data(), packed.size() - 1, c, sizeof(c));
+        assert(!ok);
+        packed.clear();
+        xor_pack(a, a, sizeof(a), packed);
+        assert(packed.size() == 2);
+        (void)ok;
+
+        std::vector<uint8_t> demo;
+        bench_demo_rom(demo);
+        const int frames = 150;
+        std::vector<std::vector<uint8_t>> states(frames);
+
+        // room for every frame, then for a few dozen
+        for (size_t room : { (size_t)1 << 20, (size_t)8192 }) {
+            console nes;
+            int err = nes.load(demo.data(), demo.size());
+            assert(err == 0);
+            (void)err;
+            rewind_buffer rb(room);
+            for (int f = 0; f < frames; ++f) {
+                nes.run_frame();
+                rb.push(nes);
+                states[f].clear();
+                nes.save_state(states[f]);
+            }
+            assert(rb.frames() <= (size_t)frames && rb.frames() > 10);
+            assert(room < 8192 * 2 || rb.frames() == (size_t)frames);
+            assert(rb.bytes() <= room + states[0].size() && rb.bytes_per_minute() > 0);
+
+            // back through every held frame, each one exactly as it was saved
+            size_t held = rb.frames();
+            std::vector<uint8_t> now;
+            for (size_t k = 0; k < held; ++k) {
+                bool popped = rb.pop(nes);
+                assert(popped);
+                (void)popped;
+                const std::vector<uint8_t>& want = states[frames - 1 - k];
+                now.clear();
+                nes.save_state(now);
+                assert(now.size() == want.size());
+                assert(memcmp(now.data() + NES_STATE_HEADER_SIZE, want.data() + NES_STATE_HEADER_SIZE,
+                              now.size() - NES_STATE_HEADER_SIZE) == 0);
+                (void)want;
+            }
+            bool popped = rb.pop(nes);
+            assert(rb.frames() == 0 && !popped);
+
+            // and forward again from there
+            rb.push(nes);
+            bool ran = nes.run_frame();
+            assert(ran && rb.frames() == 1);
+            (void)popped;
+            (void)ran;
+        }
+
+        // incremental saves chain across pushes, and across a pop as well
+        {
+            console a, b;
+            int err = a.load(demo.data(), demo.size());
+            err |= b.load(demo.data(), demo.size());
+            assert(err == 0);
+            rewind_buffer rb(1 << 20);
+            std::vector<uint8_t> full, delta, mine, theirs;
+            a.run_frame();
+            a.save_state(full, true);
+            for (int f = 0; f < 10; ++f) {
+                a.run_frame();
+                rb.push(a);
+            }
+            a.save_state(delta, true);
+            state_reader r(delta.data(), delta.size());
+            state_header h;
+            err = r.header(h);
+            assert(err == 0 && (h.flags & STATE_FLAG_INCREMENTAL) && h.base != 0);
+            err = b.load_state(full.data(), full.size());
+            err |= b.load_state(delta.data(), delta.size());
+            assert(err == 0);
+
+            bool popped = rb.pop(a);
+            popped = popped && rb.pop(a);
+            assert(popped);
+            delta.clear();
+            a.save_state(delta, true);
+            err = b.load_state(delta.data(), delta.size());
+            assert(err == 0);
+            a.snapshot(mine);
+            b.snapshot(theirs);
+            assert(mine.size() == theirs.size() && memcmp(mine.data() + NES_STATE_HEADER_SIZE, theirs.data() + NES_STATE_HEADER_SIZE,
+                                                          mine.size() - NES_STATE_HEADER_SIZE) == 0);
+            (void)err;
+            (void)popped;
+        }
+    }
+
+}
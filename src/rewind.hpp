@@ -0,0 +1,105 @@
+#ifndef rewind_hpp
+#define rewind_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include "console.hpp"
+
+#define NES_FRAMES_PER_MINUTE (60 * 60)
+
+
+namespace nes {
+
+    /*
+        Frame by frame rewind.
+
+        push() takes a console::snapshot() after every frame, a full state
+        that leaves the console's own save state serial and dirty pages
+        alone, and pop() goes back with console::restore().
+        The newest one is kept as it is, every older one only as the
+        delta that turns its successor back into it: the XOR of the two,
+        packed as zero runs and literal runs. Between two frames most of
+        a state does not move, so a delta is mostly one long zero run.
+
+        Deltas live in one byte ring of fixed size, the oldest ones are
+        overwritten first. pop() loads the newest state and steps the
+        newest one back a frame; rewinding n frames costs n pops, each
+        about the size of its delta.
+    */
+    class rewind_buffer {
+
+        struct entry {
+            size_t offset;
+            size_t size;
+        };
+
+        std::vector<uint8_t> ring_;
+        std::deque<entry> entries_;
+        size_t tail_{0};
+        size_t used_{0};
+
+        // the newest state, empty when there is none
+        std::vector<uint8_t> current_;
+        std::vector<uint8_t> scratch_;
+        std::vector<uint8_t> packed_;
+
+        void store(const std::vector<uint8_t>& delta);
+        void drop_oldest();
+
+    public:
+        rewind_buffer() = delete;
+        rewind_buffer(const rewind_buffer&) = delete;
+        rewind_buffer(rewind_buffer&&) = delete;
+        rewind_buffer& operator=(const rewind_buffer&) = delete;
+        rewind_buffer& operator=(rewind_buffer&&) = delete;
+
+        // bytes of deltas held, the newest full state comes on top
+        explicit rewind_buffer(size_t bytes) noexcept;
+
+        // call between frames
+        void push(console& nes);
+
+        // loads the newest state and forgets it, false when there is none
+        // left or it does not load (the history is cleared then)
+        bool pop(console& nes);
+
+        void clear();
+
+        // states pop() can go back through
+        size_t frames() const
+        {
+            return this->current_.empty() ? 0 : this->entries_.size() + 1;
+        }
+
+        // deltas plus the newest state
+        size_t bytes() const
+        {
+            return this->used_ + this->current_.size();
+        }
+
+        size_t capacity() const
+        {
+            return this->ring_.size();
+        }
+
+        // of the deltas held, 0 before the second push
+        double bytes_per_minute() const
+        {
+            return this->entries_.empty() ? 0 : (double)this->used_ / this->entries_.size() * NES_FRAMES_PER_MINUTE;
+        }
+
+        // the XOR of a and b, n bytes each, as zero and literal runs
+        static void xor_pack(const uint8_t *a, const uint8_t *b, size_t n, std::vector<uint8_t>& out);
+        // XORs a packed delta into buf, false when it does not cover exactly n bytes
+        static bool xor_unpack(const uint8_t *p, size_t size, uint8_t *buf, size_t n);
+
+        static void test();
+    };
+
+}
+
+
+#endif /* rewind_hpp */
@@ -0,0 +1,69 @@
+#include "spsc_ring.hpp"
+#include <cassert>
+#include <thread>
+
+
+namespace nes {
+
+    void spsc_ring_test()
+    {
+        spsc_ring<uint32_t> ring(5);
+        assert(ring.capacity() == 8 && ring.empty());
+
+        // fills up, wraps, batches stop at what there is
+        uint32_t items[12];
+        for (uint32_t i = 0; i < 12; ++i) {
+            items[i] = i;
+        }
+        size_t n = ring.push(items, 12);
+        assert(n == 8 && !ring.push(items[0]) && ring.size() == 8);
+        uint32_t out[12];
+        n = ring.pop(out, 3);
+        assert(n == 3 && out[0] == 0 && out[2] == 2);
+        n = ring.push(items + 8, 4);
+        assert(n == 3 && ring.size() == 8);
+        n = ring.pop(out, 12);
+        assert(n == 8 && out[0] == 3 && out[4] == 7 && out[7] == 10);
+        assert(!ring.pop(out[0]) && ring.pushed() == 11 && ring.popped() == 11);
+        (void)n;
+
+        // a producer and a consumer thread, everything arrives once and in order
+        static const uint32_t count = 1 << 20;
+        spsc_ring<uint32_t> shared(256);
+        std::thread producer([&shared]() {
+            uint32_t batch[7];
+            uint32_t next = 0;
+            while (next < count) {
+                size_t k = 0;
+                for (; k < 7 && next + k < count; ++k) {
+                    batch[k] = next + (uint32_t)k;
+                }
+                size_t sent = 0;
+                while (sent < k) {
+                    size_t n = shared.push(batch + sent, k - sent);
+                    if (n == 0) {
+                        std::this_thread::yield();
+                    }
+                    sent += n;
+                }
+                next += (uint32_t)k;
+            }
+        });
+        uint32_t expect = 0;
+        bool ordered = true;
+        while (expect < count) {
+            uint32_t got[16];
+            size_t k = shared.pop(got, 16);
+            for (size_t i = 0; i < k; ++i) {
+                ordered = ordered && got[i] == expect++;
+            }
+            if (k == 0) {
+                std::this_thread::yield();
+            }
+        }
+        producer.join();
+        assert(ordered && shared.empty());
+        (void)ordered;
+    }
+
+}
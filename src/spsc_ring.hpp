@@ -0,0 +1,138 @@
+#ifndef spsc_ring_hpp
+#define spsc_ring_hpp
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+// apart from each other so the two threads don't share a cache line
+#define NES_CACHE_LINE 64
+
+
+namespace nes {
+
+    /*
+        Lock-free ring between exactly one producer and one consumer
+        thread.
+
+        head_ counts the items ever pushed and is only written by the
+        producer, tail_ the ones popped and only written by the consumer;
+        each publishes with a release store what the other acquires.
+        Both keep a copy of the other's counter and only reload it when
+        the copy says the ring is full or empty, so a busy ring costs
+        one atomic store per push or pop batch. T is copied in and out,
+        plain data only.
+    */
+    template<class T>
+    class spsc_ring {
+
+        std::vector<T> slots_;
+        uint64_t mask_;
+
+        alignas(NES_CACHE_LINE) std::atomic<uint64_t> head_{0};
+        uint64_t tail_seen_{0};     // the producer's copy of tail_
+
+        alignas(NES_CACHE_LINE) std::atomic<uint64_t> tail_{0};
+        uint64_t head_seen_{0};     // the consumer's copy of head_
+
+    public:
+        spsc_ring(const spsc_ring&) = delete;
+        spsc_ring(spsc_ring&&) = delete;
+        spsc_ring& operator=(const spsc_ring&) = delete;
+        spsc_ring& operator=(spsc_ring&&) = delete;
+
+        // capacity is rounded up to a power of two
+        explicit spsc_ring(size_t capacity) noexcept
+        {
+            size_t n = 1;
+            while (n < capacity) {
+                n <<= 1;
+            }
+            this->slots_.resize(n);
+            this->mask_ = n - 1;
+        }
+
+        size_t capacity() const
+        {
+            return this->slots_.size();
+        }
+
+        // producer: as many of the n items as fit, in order
+        size_t push(const T *items, size_t n)
+        {
+            uint64_t head = this->head_.load(std::memory_order_relaxed);
+            if (head + n - this->tail_seen_ > this->slots_.size()) {
+                this->tail_seen_ = this->tail_.load(std::memory_order_acquire);
+            }
+            uint64_t room = this->slots_.size() - (head - this->tail_seen_);
+            n = n < room ? n : (size_t)room;
+            for (size_t i = 0; i < n; ++i) {
+                this->slots_[(head + i) & this->mask_] = items[i];
+            }
+            if (n != 0) {
+                this->head_.store(head + n, std::memory_order_release);
+            }
+            return n;
+        }
+
+        // producer: false when full
+        bool push(const T& item)
+        {
+            return this->push(&item, 1) == 1;
+        }
+
+        // consumer: up to max items, oldest first
+        size_t pop(T *out, size_t max)
+        {
+            uint64_t tail = this->tail_.load(std::memory_order_relaxed);
+            if (this->head_seen_ - tail < max) {
+                this->head_seen_ = this->head_.load(std::memory_order_acquire);
+            }
+            uint64_t ready = this->head_seen_ - tail;
+            size_t n = max < ready ? max : (size_t)ready;
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = this->slots_[(tail + i) & this->mask_];
+            }
+            if (n != 0) {
+                this->tail_.store(tail + n, std::memory_order_release);
+            }
+            return n;
+        }
+
+        // consumer: false when empty
+        bool pop(T& out)
+        {
+            return this->pop(&out, 1) == 1;
+        }
+
+        // items in the ring, exact from either side when the other one is idle
+        size_t size() const
+        {
+            uint64_t tail = this->tail_.load(std::memory_order_acquire);
+            return (size_t)(this->head_.load(std::memory_order_acquire) - tail);
+        }
+
+        bool empty() const
+        {
+            return this->size() == 0;
+        }
+
+        // items ever pushed and popped
+        uint64_t pushed() const
+        {
+            return this->head_.load(std::memory_order_acquire);
+        }
+
+        uint64_t popped() const
+        {
+            return this->tail_.load(std::memory_order_acquire);
+        }
+    };
+
+    void spsc_ring_test();
+
+}
+
+
+#endif /* spsc_ring_hpp */
@@ -0,0 +1,123 @@
+#include "state.hpp"
+#include <cassert>
+
+
+namespace nes {
+
+    static const char g_state_magic[4] = { 'V', 'N', 'S', 'T' };
+
+    void state_writer::header(const state_header& h)
+    {
+        this->bytes(g_state_magic, sizeof(g_state_magic));
+        this->put(h.version);
+        this->put(h.flags);
+        this->put<uint8_t>(0);
+        this->put(h.serial);
+        this->put(h.base);
+        this->put(h.machine);
+    }
+
+    void state_writer::begin(const char *tag)
+    {
+        assert(this->chunk_ == 0);
+        this->bytes(tag, 4);
+        this->put<uint32_t>(0);
+        this->chunk_ = this->out_.size();
+    }
+
+    void state_writer::end()
+    {
+        uint32_t size = (uint32_t)(this->out_.size() - this->chunk_);
+        for (int i = 0; i < 4; ++i) {
+            this->out_[this->chunk_ - 4 + i] = (uint8_t)(size >> (i * 8));
+        }
+        this->chunk_ = 0;
+    }
+
+    int state_reader::header(state_header& h)
+    {
+        if (this->left() < NES_STATE_HEADER_SIZE || memcmp(this->p_, g_state_magic, sizeof(g_state_magic)) != 0) {
+            return STATE_ERROR_FORMAT;
+        }
+        this->p_ += sizeof(g_state_magic);
+        h.version = this->get<uint16_t>();
+        h.flags = this->get<uint8_t>();
+        this->get<uint8_t>();
+        h.serial = this->get<uint32_t>();
+        h.base = this->get<uint32_t>();
+        h.machine = this->get<uint32_t>();
+        return h.version > NES_STATE_VERSION ? STATE_ERROR_VERSION : 0;
+    }
+
+    bool state_reader::find(const char *tag, state_reader& body) const
+    {
+        state_reader r = *this;
+        while (r.left() >= 8) {
+            const uint8_t *at = r.p_;
+            r.p_ += 4;
+            uint32_t size = r.get<uint32_t>();
+            if (size > r.left()) {
+                return false;
+            }
+            if (memcmp(at, tag, 4) == 0) {
+                body = state_reader(r.p_, size);
+                return true;
+            }
+            r.p_ += size;
+        }
+        return false;
+    }
+
+    void state_test()
+    {
+        std::vector<uint8_t> out;
+        state_writer w(out);
+        state_header h = { NES_STATE_VERSION, STATE_FLAG_INCREMENTAL, 7, 6, 0xdeadbeef };
+        w.header(h);
+        w.begin("ONE ");
+        w.put<uint8_t>(0x12);
+        w.put<int16_t>(-2);
+        w.put(true);
+        w.end();
+        w.begin("TWO ");
+        w.put<uint64_t>(0x0102030405060708ull);
+        w.bytes("abc", 3);
+        w.end();
+        assert(out.size() == NES_STATE_HEADER_SIZE + 8 + 4 + 8 + 11);
+
+        state_reader r(out.data(), out.size());
+        state_header rh;
+        int err = r.header(rh);
+        assert(err == 0 && rh.flags == STATE_FLAG_INCREMENTAL && rh.serial == 7 && rh.base == 6);
+        assert(rh.machine == 0xdeadbeef);
+
+        // chunks are found in any order
+        state_reader body;
+        bool found = r.find("TWO ", body);
+        assert(found && body.get<uint64_t>() == 0x0102030405060708ull);
+        char abc[3];
+        body.bytes(abc, 3);
+        assert(memcmp(abc, "abc", 3) == 0 && body.left() == 0 && body.ok());
+        found = r.find("ONE ", body);
+        assert(found && body.get<uint8_t>() == 0x12 && body.get<int16_t>() == -2 && body.get<bool>());
+        assert(body.ok());
+        // reading past the end of a chunk
+        assert(body.get<uint32_t>() == 0 && !body.ok());
+        found = r.find("NONE", body);
+        assert(!found);
+
+        // cut short, newer, not a state
+        state_reader cut(out.data(), out.size() - 1);
+        err = cut.header(rh);
+        assert(err == 0 && cut.find("ONE ", body) && !cut.find("TWO ", body));
+        out[4] = NES_STATE_VERSION + 1;
+        err = state_reader(out.data(), out.size()).header(rh);
+        assert(err == STATE_ERROR_VERSION);
+        out[0] = 'X';
+        err = state_reader(out.data(), out.size()).header(rh);
+        assert(err == STATE_ERROR_FORMAT);
+        (void)err;
+        (void)found;
+    }
+
+}
@@ -0,0 +1,173 @@
+#ifndef state_hpp
+#define state_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#define NES_STATE_VERSION 1
+#define NES_STATE_HEADER_SIZE 20
+
+// the memory pages are only the ones written since the base snapshot
+#define STATE_FLAG_INCREMENTAL 0x01
+
+#define STATE_ERROR_FORMAT -30
+#define STATE_ERROR_VERSION -31
+#define STATE_ERROR_MACHINE -32
+#define STATE_ERROR_BASE -33
+
+
+namespace nes {
+
+    /*
+        Save state layout, all integers little endian:
+
+            "VNST" u16 version u8 flags u8 0 u32 serial u32 base u32 machine
+            chunks of 4 byte tag, u32 size, size bytes
+
+        Every component writes its own chunk and looks it up by tag on
+        load, so a newer writer can add chunks older readers skip. An
+        incremental state (serial) holds the memory pages written since
+        the state base, it only loads on top of that one.
+    */
+    struct state_header {
+        uint16_t version;
+        uint8_t flags;
+        uint32_t serial;
+        uint32_t base;
+        uint32_t machine;
+    };
+
+    class state_writer {
+
+        std::vector<uint8_t>& out_;
+        size_t chunk_{0};
+
+    public:
+        state_writer() = delete;
+        state_writer(const state_writer&) = delete;
+        state_writer(state_writer&&) = delete;
+        state_writer& operator=(const state_writer&) = delete;
+        state_writer& operator=(state_writer&&) = delete;
+
+        // appends to out
+        explicit state_writer(std::vector<uint8_t>& out) noexcept
+        :out_(out)
+        {
+        }
+
+        // integers, bools and enums in sizeof(T) bytes
+        template<typename T>
+        void put(T v)
+        {
+            uint64_t u = (uint64_t)v;
+            for (size_t i = 0; i < sizeof(T); ++i) {
+                this->out_.push_back((uint8_t)(u >> (i * 8)));
+            }
+        }
+
+        void bytes(const void *p, size_t size)
+        {
+            // p may be the data() of an empty vector
+            if (size == 0) {
+                return;
+            }
+            const uint8_t *b = (const uint8_t *)p;
+            this->out_.insert(this->out_.end(), b, b + size);
+        }
+
+        void header(const state_header& h);
+
+        // chunks don't nest
+        void begin(const char *tag);
+        void end();
+    };
+
+    // a bounds checked cursor over a state, reads past the end give 0 and clear ok()
+    class state_reader {
+
+        const uint8_t *p_{nullptr};
+        const uint8_t *end_{nullptr};
+        bool ok_{true};
+
+    public:
+        state_reader() noexcept
+        {
+        }
+
+        state_reader(const uint8_t *data, size_t size) noexcept
+        :p_(data), end_(data + size)
+        {
+        }
+
+        template<typename T>
+        T get()
+        {
+            if (this->left() < sizeof(T)) {
+                this->ok_ = false;
+                this->p_ = this->end_;
+                return T();
+            }
+            uint64_t u = 0;
+            for (size_t i = 0; i < sizeof(T); ++i) {
+                u |= (uint64_t)this->p_[i] << (i * 8);
+            }
+            this->p_ += sizeof(T);
+            return (T)u;
+        }
+
+        template<typename T>
+        void get(T& v)
+        {
+            v = this->get<T>();
+        }
+
+        void bytes(void *p, size_t size)
+        {
+            if (size == 0) {
+                return;
+            }
+            if (this->left() < size) {
+                this->ok_ = false;
+                this->p_ = this->end_;
+                memset(p, 0, size);
+                return;
+            }
+            memcpy(p, this->p_, size);
+            this->p_ += size;
+        }
+
+        void skip(size_t size)
+        {
+            if (this->left() < size) {
+                this->ok_ = false;
+                size = this->left();
+            }
+            this->p_ += size;
+        }
+
+        // 0, STATE_ERROR_FORMAT or STATE_ERROR_VERSION, leaves the cursor on the first chunk
+        int header(state_header& h);
+
+        // the body of the first chunk tagged tag from here on, false if there is none
+        bool find(const char *tag, state_reader& body) const;
+
+        size_t left() const
+        {
+            return (size_t)(this->end_ - this->p_);
+        }
+
+        bool ok() const
+        {
+            return this->ok_;
+        }
+    };
+
+    void state_test();
+
+}
+
+
+#endif /* state_hpp */
@@ -0,0 +1,370 @@
+#include "trace.hpp"
+#include <cassert>
+#include <cstdlib>
+#include <cinttypes>
+#include "memory.hpp"
+#include "cpu_6502.hpp"
+
+// bits 4 and 5 of P only exist on the stack, logs disagree about them
+#define NES_TRACE_P_MASK 0xcf
+
+
+namespace nes {
+
+    static const char g_trace_magic[4] = { 'V', 'N', 'T', 'R' };
+
+    tracer::~tracer()
+    {
+        this->close();
+    }
+
+    int tracer::open(const char *path)
+    {
+        this->close();
+        FILE *f = fopen(path, "wb");
+        if (f == nullptr) {
+            return TRACE_ERROR_OPEN;
+        }
+        int err = this->open(f);
+        this->own_ = true;
+        return err;
+    }
+
+    int tracer::open(FILE *f)
+    {
+        this->close();
+        uint8_t header[NES_TRACE_HEADER_SIZE];
+        memcpy(header, g_trace_magic, sizeof(g_trace_magic));
+        header[4] = (uint8_t)NES_TRACE_VERSION;
+        header[5] = (uint8_t)(NES_TRACE_VERSION >> 8);
+        header[6] = (uint8_t)sizeof(trace_record);
+        header[7] = 0;
+        this->out_ = f;
+        this->own_ = false;
+        this->failed_ = fwrite(header, 1, sizeof(header), f) != sizeof(header);
+        return this->failed_ ? TRACE_ERROR_OPEN : 0;
+    }
+
+    void tracer::close()
+    {
+        if (this->out_ == nullptr) {
+            this->records_ = 0;
+            this->next_ = this->buf_.data();
+            return;
+        }
+        this->flush();
+        if (this->own_) {
+            fclose(this->out_);
+        }
+        else {
+            fflush(this->out_);
+        }
+        this->out_ = nullptr;
+        this->own_ = false;
+        this->records_ = 0;
+    }
+
+    bool tracer::flush()
+    {
+        size_t used = (size_t)(this->next_ - this->buf_.data());
+        if (this->out_ != nullptr && !this->failed_ && used != 0) {
+            this->failed_ = fwrite(this->buf_.data(), sizeof(trace_record), used, this->out_) != used;
+        }
+        this->records_ += used;
+        this->next_ = this->buf_.data();
+        return !this->failed_;
+    }
+
+    trace_reader::~trace_reader()
+    {
+        if (this->in_ != nullptr) {
+            fclose(this->in_);
+        }
+    }
+
+    int trace_reader::open(const char *path)
+    {
+        FILE *f = fopen(path, "rb");
+        if (f == nullptr) {
+            return TRACE_ERROR_OPEN;
+        }
+        return this->open(f);
+    }
+
+    int trace_reader::open(FILE *f)
+    {
+        if (this->in_ != nullptr) {
+            fclose(this->in_);
+        }
+        this->in_ = f;
+
+        uint8_t header[NES_TRACE_HEADER_SIZE];
+        if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, g_trace_magic, 4) != 0
+            || header[6] != sizeof(trace_record)) {
+            return TRACE_ERROR_FORMAT;
+        }
+        return (header[4] | header[5] << 8) > NES_TRACE_VERSION ? TRACE_ERROR_VERSION : 0;
+    }
+
+    size_t trace_reader::read(trace_record *out, size_t max)
+    {
+        return this->in_ ? fread(out, sizeof(trace_record), max, this->in_) : 0;
+    }
+
+    uint64_t trace_cycles(const trace_record& r)
+    {
+        uint64_t v = 0;
+        for (int i = 0; i < 6; ++i) {
+            v |= (uint64_t)r.cycles[i] << (i * 8);
+        }
+        return v;
+    }
+
+    size_t trace_text(const trace_record& r, char out[NES_TRACE_SIZE])
+    {
+        trace_regs regs = { r.pc, r.A, r.X, r.Y, r.P, r.SP, trace_cycles(r) };
+        return trace_format(regs, r.bytes, out);
+    }
+
+    static int hex_digit(char c)
+    {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        return -1;
+    }
+
+    // n hex digits at p, false when there are not
+    static bool parse_hex(const char *p, int n, uint32_t& v)
+    {
+        v = 0;
+        for (int i = 0; i < n; ++i) {
+            int d = hex_digit(p[i]);
+            if (d < 0) {
+                return false;
+            }
+            v = v << 4 | (uint32_t)d;
+        }
+        return true;
+    }
+
+    // the 2 hex digits after name, searched from p on
+    static bool parse_reg(const char *p, const char *name, uint8_t& v)
+    {
+        const char *at = strstr(p, name);
+        uint32_t x;
+        if (at == nullptr || !parse_hex(at + strlen(name), 2, x)) {
+            return false;
+        }
+        v = (uint8_t)x;
+        return true;
+    }
+
+    bool trace_parse(const char *line, trace_line& out)
+    {
+        uint32_t v;
+        if (strlen(line) < 16 || !parse_hex(line, 4, v)) {
+            return false;
+        }
+        out.regs.PC = (uint16_t)v;
+
+        out.len = 0;
+        memset(out.bytes, 0, sizeof(out.bytes));
+        for (size_t i = 0; i < 3 && parse_hex(line + 6 + 3 * i, 2, v); ++i) {
+            out.bytes[i] = (uint8_t)v;
+            out.len++;
+        }
+        if (out.len == 0) {
+            return false;
+        }
+
+        // past the disassembly, which never has a ':' in it
+        const char *regs = strstr(line + 16, "A:");
+        if (regs == nullptr || !parse_reg(regs, "A:", out.regs.A) || !parse_reg(regs, "X:", out.regs.X)
+            || !parse_reg(regs, "Y:", out.regs.Y) || !parse_reg(regs, "P:", out.regs.P)
+            || !parse_reg(regs, "SP:", out.regs.SP)) {
+            return false;
+        }
+        const char *cyc = strstr(regs, "CYC:");
+        out.regs.cycles = cyc ? strtoull(cyc + 4, nullptr, 10) : ~0ull;
+        return true;
+    }
+
+    void trace_compare(const trace_line& a, const trace_line& b, char out[64])
+    {
+        out[0] = 0;
+        bool bytes = a.len == b.len && memcmp(a.bytes, b.bytes, a.len) == 0;
+        const struct {
+            const char *name;
+            bool differs;
+        } fields[] = {
+            { " PC", a.regs.PC != b.regs.PC },
+            { " bytes", !bytes },
+            { " A", a.regs.A != b.regs.A },
+            { " X", a.regs.X != b.regs.X },
+            { " Y", a.regs.Y != b.regs.Y },
+            { " P", ((a.regs.P ^ b.regs.P) & NES_TRACE_P_MASK) != 0 },
+            { " SP", a.regs.SP != b.regs.SP },
+            { " CYC", a.regs.cycles != ~0ull && b.regs.cycles != ~0ull && a.regs.cycles != b.regs.cycles },
+        };
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+            if (fields[i].differs) {
+                strcat(out, fields[i].name);
+            }
+        }
+    }
+
+    // the start of nestest.log, the automated run from $C000 after power up
+    static void nestest_test()
+    {
+        static const char *const golden[] = {
+            "C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7",
+            "C5F5  A2 00     LDX #$00                        A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 30 CYC:10",
+            "C5F7  86 00     STX $00 = 00                    A:00 X:00 Y:00 P:26 SP:FD PPU:  0, 36 CYC:12",
+            "C5F9  86 10     STX $10 = 00                    A:00 X:00 Y:00 P:26 SP:FD PPU:  0, 45 CYC:15",
+            "C5FB  86 11     STX $11 = 00                    A:00 X:00 Y:00 P:26 SP:FD PPU:  0, 54 CYC:18",
+            "C5FD  20 2D C7  JSR $C72D                       A:00 X:00 Y:00 P:26 SP:FD PPU:  0, 63 CYC:21",
+            "C72D  EA        NOP                             A:00 X:00 Y:00 P:26 SP:FB PPU:  0, 81 CYC:27",
+            "C72E  38        SEC                             A:00 X:00 Y:00 P:26 SP:FB PPU:  0, 87 CYC:29",
+            "C72F  B0 04     BCS $C735                       A:00 X:00 Y:00 P:27 SP:FB PPU:  0, 93 CYC:31",
+            "C735  EA        NOP                             A:00 X:00 Y:00 P:27 SP:FB PPU:  0,102 CYC:34",
+            "C736  18        CLC                             A:00 X:00 Y:00 P:27 SP:FB PPU:  0,108 CYC:36",
+            "C737  B0 03     BCS $C73C                       A:00 X:00 Y:00 P:26 SP:FB PPU:  0,114 CYC:38",
+            "C739  4C 3C C7  JMP $C73C                       A:00 X:00 Y:00 P:26 SP:FB PPU:  0,120 CYC:40",
+            "C73C  EA        NOP                             A:00 X:00 Y:00 P:26 SP:FB PPU:  0,129 CYC:43",
+        };
+
+        // the bytes of the lines where they are, BRK after the last one
+        memory mem;
+        cpu_6502 cpu(mem);
+        trace_line want[arr_len(golden)];
+        for (size_t i = 0; i < arr_len(golden); ++i) {
+            bool ok = trace_parse(golden[i], want[i]);
+            assert(ok);
+            (void)ok;
+            for (size_t k = 0; k < want[i].len; ++k) {
+                mem.write(want[i].bytes[k], (uint16_t)(want[i].regs.PC + k));
+            }
+        }
+        mem.write((uint8_t)0x00, 0xfffc);
+        mem.write((uint8_t)0xc0, 0xfffd);
+
+        FILE *f = tmpfile();
+        assert(f != nullptr);
+        tracer t;
+        int err = t.open(f);
+        assert(err == 0);
+        cpu.power_up();
+        cpu.set_pc_limit(0x10000);
+        cpu.set_tracer(&t);
+        int budget = 1000;
+        uint8_t status = cpu.execute(budget);
+        cpu.set_tracer(nullptr);
+        assert(status == (uint8_t)BRK_INSTRUCTION && t.records() == arr_len(golden) + 1);
+        t.close();
+
+        rewind(f);
+        trace_reader in;
+        err = in.open(f);
+        assert(err == 0);
+        trace_record recs[arr_len(golden)];
+        size_t n = in.read(recs, arr_len(golden));
+        assert(n == arr_len(golden));
+        for (size_t i = 0; i < n; ++i) {
+            char line[NES_TRACE_SIZE];
+            char diff[64];
+            trace_line got;
+            trace_text(recs[i], line);
+            bool ok = trace_parse(line, got);
+            trace_compare(got, want[i], diff);
+            assert(ok && diff[0] == 0);
+            (void)ok;
+        }
+        (void)err;
+        (void)status;
+    }
+
+    void tracer::test()
+    {
+        // countdown with a subroutine, traced on the JIT backend which the tracer overrides
+        static const uint8_t code[] = {
+            0xa2, 0x03,             // LDX #$03
+            0x20, 0x0b, 0x06,       // loop: JSR sub
+            0xca,                   // DEX
+            0xd0, 0xfa,             // BNE loop
+            0x4c, 0x0d, 0x06,       // JMP end
+            0x8a,                   // sub: TXA
+            0x60,                   // RTS
+        };
+        FILE *f = tmpfile();
+        assert(f != nullptr);
+
+        memory mem;
+        cpu_6502 cpu(mem);
+        cpu.set_dispatch_mode(dispatch_mode::jit);
+        cpu.load_code_segment(0x0600, code, sizeof(code));
+        // small enough to flush in the middle
+        tracer t(4);
+        int err = t.open(f);
+        assert(err == 0);
+        cpu.set_tracer(&t);
+        cpu.run();
+        cpu.set_tracer(nullptr);
+        uint64_t count = cpu.get_instruction_count();
+        assert(count == 1 + 3 * 5 + 1 && t.records() == count);
+        t.close();
+        (void)count;
+
+        rewind(f);
+        trace_reader in;
+        err = in.open(f);
+        assert(err == 0);
+        std::vector<trace_record> recs(64);
+        size_t n = in.read(recs.data(), recs.size());
+        assert(n == count);
+        assert(recs[0].pc == 0x0600 && recs[0].bytes[0] == 0xa2 && recs[0].bytes[1] == 0x03);
+        assert(recs[1].pc == 0x0602 && recs[1].X == 3 && recs[2].pc == 0x060b && recs[2].SP == recs[1].SP - 2);
+        assert(recs[n - 1].pc == 0x0608 && recs[n - 1].X == 0);
+        assert(trace_cycles(recs[1]) == 2 && trace_cycles(recs[2]) == 8);
+
+        // text and back, and against a nestest.log line
+        char line[NES_TRACE_SIZE];
+        trace_text(recs[1], line);
+        assert(strncmp(line, "0602  20 0B 06  JSR $060B", 25) == 0);
+        trace_line a, b;
+        bool ok = trace_parse(line, a);
+        assert(ok && a.regs.PC == 0x0602 && a.len == 3 && a.regs.X == 3 && a.regs.cycles == 2);
+        char diff[64];
+        ok = trace_parse("C72C  6C 00 02  JMP ($0200) = DB7E              A:DB X:07 Y:CE P:E5 SP:F4 PPU: 14,255 CYC:1642", b)
+            && trace_parse("C72C  6C 00 02  JMP ($0200)                     A:DB X:07 Y:CE P:F5 SP:F4 CYC:1642", a);
+        assert(ok);
+        trace_compare(a, b, diff);
+        assert(diff[0] == 0);
+        a.regs.X = 8;
+        a.bytes[2] = 3;
+        trace_compare(a, b, diff);
+        assert(strcmp(diff, " bytes X") == 0);
+        ok = trace_parse("C72C  6C 00 02  JMP ($0200)", a);
+        assert(!ok);
+        (void)ok;
+        (void)err;
+        (void)n;
+
+        nestest_test();
+
+        // not a trace
+        f = tmpfile();
+        fputs("C000  4C F5 C5", f);
+        rewind(f);
+        trace_reader bad;
+        err = bad.open(f);
+        assert(err == TRACE_ERROR_FORMAT);
+    }
+
+}
@@ -0,0 +1,173 @@
+#ifndef trace_hpp
+#define trace_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include "disasm.hpp"
+
+#define NES_TRACE_VERSION 1
+#define NES_TRACE_HEADER_SIZE 8
+// records held before a write, 1 MiB
+#define NES_TRACE_RECORDS (1 << 16)
+
+#define TRACE_ERROR_OPEN -50
+#define TRACE_ERROR_FORMAT -51
+#define TRACE_ERROR_VERSION -52
+
+
+namespace nes {
+
+    // the machine right before the instruction at pc runs
+    struct trace_record {
+        uint16_t pc;
+        uint8_t bytes[3];       // opcode and what follows it, whatever the length
+        uint8_t A;
+        uint8_t X;
+        uint8_t Y;
+        uint8_t P;
+        uint8_t SP;
+        uint8_t cycles[6];      // little endian
+    };
+
+    static_assert(sizeof(trace_record) == 16, "trace records are 16 bytes on disk");
+
+    // bytes holds the 3 instruction bytes in its low 24 bits; the record is
+    // put together in two words, this runs once per instruction
+    inline void trace_store(trace_record *at, uint16_t pc, uint32_t bytes, uint8_t a, uint8_t x, uint8_t y, uint8_t p,
+                            uint8_t sp, uint64_t cycles)
+    {
+        uint64_t w[2];
+        w[0] = pc | (uint64_t)(bytes & 0xffffff) << 16 | (uint64_t)a << 40 | (uint64_t)x << 48 | (uint64_t)y << 56;
+        w[1] = p | (uint64_t)sp << 8 | cycles << 16;
+        memcpy(at, w, sizeof(w));
+    }
+
+    /*
+        Binary execution trace: "VNTR" u16 version u16 record size, then
+        one trace_record per instruction, as they are in memory on a
+        little endian host, which is all that is supported. Records pile up in a buffer that goes out in
+        one fwrite when it is full, nothing is formatted while tracing.
+
+        The CPU runs eval() while a tracer is set, whatever its dispatch
+        mode, see cpu_6502::set_tracer. trace_text() and vnes_trace turn
+        the records into nestest.log lines.
+    */
+    class tracer {
+
+        FILE *out_{nullptr};
+        bool own_{false};
+        std::vector<trace_record> buf_;
+        trace_record *next_;
+        trace_record *end_;
+        uint64_t records_{0};
+        bool failed_{false};
+
+    public:
+        tracer(const tracer&) = delete;
+        tracer(tracer&&) = delete;
+        tracer& operator=(const tracer&) = delete;
+        tracer& operator=(tracer&&) = delete;
+
+        explicit tracer(size_t records = NES_TRACE_RECORDS) noexcept
+        :buf_(records ? records : 1), next_(buf_.data()), end_(buf_.data() + buf_.size())
+        {
+        }
+
+        ~tracer();
+
+        // 0 or TRACE_ERROR_OPEN, a trace already open is closed first;
+        // with none open records are only counted, flush() drops them
+        int open(const char *path);
+        // writes to f from where it is, f stays open
+        int open(FILE *f);
+        void close();
+
+        // see trace_store
+        void record(uint16_t pc, uint32_t bytes, uint8_t a, uint8_t x, uint8_t y, uint8_t p, uint8_t sp,
+                    uint64_t cycles)
+        {
+            trace_store(this->next_, pc, bytes, a, x, y, p, sp, cycles);
+            if (++this->next_ == this->end_) {
+                this->flush();
+            }
+        }
+
+        // where the next records go and how many fit there, flushed first
+        // when the buffer is full; commit() takes the end of what was put
+        trace_record* reserve(size_t& room)
+        {
+            if (this->next_ == this->end_) {
+                this->flush();
+            }
+            room = (size_t)(this->end_ - this->next_);
+            return this->next_;
+        }
+
+        void commit(trace_record *end)
+        {
+            this->next_ = end;
+        }
+
+        // writes what is buffered, false once a write failed
+        bool flush();
+
+        uint64_t records() const
+        {
+            return this->records_ + (uint64_t)(this->next_ - this->buf_.data());
+        }
+
+        static void test();
+    };
+
+    // reads a trace a chunk of records at a time
+    class trace_reader {
+
+        FILE *in_{nullptr};
+
+    public:
+        trace_reader(const trace_reader&) = delete;
+        trace_reader(trace_reader&&) = delete;
+        trace_reader& operator=(const trace_reader&) = delete;
+        trace_reader& operator=(trace_reader&&) = delete;
+
+        trace_reader() noexcept
+        {
+        }
+
+        ~trace_reader();
+
+        // 0, TRACE_ERROR_OPEN, TRACE_ERROR_FORMAT or TRACE_ERROR_VERSION
+        int open(const char *path);
+        // reads f from where it is and closes it when done
+        int open(FILE *f);
+
+        // up to max records, 0 at the end
+        size_t read(trace_record *out, size_t max);
+    };
+
+    uint64_t trace_cycles(const trace_record& r);
+
+    // the record as a nestest.log line, see trace_format
+    size_t trace_text(const trace_record& r, char out[NES_TRACE_SIZE]);
+
+    // what a diff compares of a nestest.log line or of one trace_text wrote
+    struct trace_line {
+        trace_regs regs;
+        uint8_t bytes[3];
+        size_t len;
+    };
+
+    // false when line has no address, bytes or registers; CYC is optional,
+    // ~0 when missing, the PPU column and operand values are skipped
+    bool trace_parse(const char *line, trace_line& out);
+
+    // names of the fields that differ, "" when none; CYC only when both have one
+    void trace_compare(const trace_line& a, const trace_line& b, char out[64]);
+
+}
+
+
+#endif /* trace_hpp */
@@ -0,0 +1,507 @@
+#include "video.hpp"
+#include "bench.hpp"
+#include "console.hpp"
+#include "utils.hpp"
+#include <cassert>
+#include <cstring>
+#include <chrono>
+#include <thread>
+
+// 39375000 / 655171 is NES_FRAME_RATE exactly
+#define NES_Y4M_HEADER "YUV4MPEG2 W256 H240 F39375000:655171 Ip A8:7 C444\n"
+#define NES_Y4M_FRAME "FRAME\n"
+
+// most a stored deflate block holds
+#define PNG_STORED_BLOCK 65535
+
+
+namespace nes {
+
+    // 2C02 colors, 0xRRGGBB
+    static const uint32_t g_nes_palette[NES_PALETTE_SIZE] = {
+        0x666666, 0x002a88, 0x1412a7, 0x3b00a4, 0x5c007e, 0x6e0040, 0x6c0600, 0x561d00,
+        0x333500, 0x0b4800, 0x005200, 0x004f08, 0x00404d, 0x000000, 0x000000, 0x000000,
+        0xadadad, 0x155fd9, 0x4240ff, 0x7527fe, 0xa01acc, 0xb71e7b, 0xb53120, 0x994e00,
+        0x6b6d00, 0x388700, 0x0c9300, 0x008f32, 0x007c8d, 0x000000, 0x000000, 0x000000,
+        0xfffeff, 0x64b0ff, 0x9290ff, 0xc676ff, 0xf36aff, 0xfe6ecc, 0xfe8170, 0xea9e22,
+        0xbcbe00, 0x88d800, 0x5ce430, 0x45e082, 0x48cdde, 0x4f4f4f, 0x000000, 0x000000,
+        0xfffeff, 0xc0dfff, 0xd3d2ff, 0xe8c8ff, 0xfbc2ff, 0xfec4ea, 0xfeccc5, 0xf7d8a5,
+        0xe4e594, 0xcfef96, 0xbdf4ab, 0xb3f3cc, 0xb5ebf2, 0xb8b8b8, 0x000000, 0x000000,
+    };
+
+    enum {
+        TABLE_R, TABLE_G, TABLE_B, TABLE_565_LO, TABLE_565_HI, TABLE_Y, TABLE_U, TABLE_V,
+    };
+
+    size_t pixel_format_size(pixel_format fmt)
+    {
+        static const size_t sizes[] = { 1, 4, 2, 3 };
+        return sizes[(int)fmt];
+    }
+
+    const char* pixel_format_name(pixel_format fmt)
+    {
+        static const char * const names[] = { "indices", "rgba", "rgb565", "yuv444" };
+        return names[(int)fmt];
+    }
+
+    static uint8_t clamp_byte(double v)
+    {
+        return (uint8_t)(v < 0.0 ? 0 : v > 255.0 ? 255 : (int)(v + 0.5));
+    }
+
+    video_output::video_output() noexcept
+    {
+        this->set_pixel_path(detect_pixel_path());
+        this->set_palette(g_nes_palette);
+    }
+
+    void video_output::set_pixel_path(pixel_path path)
+    {
+        this->path_ = pixel_path_supported(path) ? path : pixel_path::scalar;
+        this->kernels_ = &get_convert_kernels(this->path_);
+    }
+
+    void video_output::set_palette(const uint32_t *rgb)
+    {
+        for (int i = 0; i < NES_PALETTE_SIZE; ++i) {
+            uint32_t c = rgb[i] & 0xffffff;
+            int r = (int)(c >> 16), g = (int)(c >> 8) & 0xff, b = (int)c & 0xff;
+            this->palette_[i] = c;
+            this->tables_[TABLE_R][i] = (uint8_t)r;
+            this->tables_[TABLE_G][i] = (uint8_t)g;
+            this->tables_[TABLE_B][i] = (uint8_t)b;
+            uint16_t p = (uint16_t)((r >> 3) << 11 | (g >> 2) << 5 | b >> 3);
+            this->tables_[TABLE_565_LO][i] = (uint8_t)p;
+            this->tables_[TABLE_565_HI][i] = (uint8_t)(p >> 8);
+            this->tables_[TABLE_Y][i] = clamp_byte(16.0 + (65.481 * r + 128.553 * g + 24.966 * b) / 255.0);
+            this->tables_[TABLE_U][i] = clamp_byte(128.0 + (-37.797 * r - 74.203 * g + 112.0 * b) / 255.0);
+            this->tables_[TABLE_V][i] = clamp_byte(128.0 + (112.0 * r - 93.786 * g - 18.214 * b) / 255.0);
+        }
+    }
+
+    void video_output::add_sink(video_sink& sink)
+    {
+        this->remove_sink(sink);
+        this->sinks_.push_back(&sink);
+        std::vector<uint8_t>& buf = this->pixels_[(int)sink.format()];
+        if (sink.format() != pixel_format::indices) {
+            buf.resize(NES_SCREEN_PIXELS * pixel_format_size(sink.format()));
+        }
+    }
+
+    void video_output::remove_sink(video_sink& sink)
+    {
+        for (size_t i = 0; i < this->sinks_.size(); ++i) {
+            if (this->sinks_[i] == &sink) {
+                this->sinks_.erase(this->sinks_.begin() + (long)i);
+                return;
+            }
+        }
+    }
+
+    void video_output::convert(const uint8_t *indices, pixel_format fmt, uint8_t *out) const
+    {
+        const convert_kernels& k = *this->kernels_;
+        switch (fmt) {
+            case pixel_format::indices:
+                memcpy(out, indices, NES_SCREEN_PIXELS);
+                break;
+            case pixel_format::rgba:
+                k.rgba(indices, this->tables_[TABLE_R], this->tables_[TABLE_G], this->tables_[TABLE_B], out, NES_SCREEN_PIXELS);
+                break;
+            case pixel_format::rgb565:
+                k.rgb565(indices, this->tables_[TABLE_565_LO], this->tables_[TABLE_565_HI], out, NES_SCREEN_PIXELS);
+                break;
+            case pixel_format::yuv444:
+                k.bytes(indices, this->tables_[TABLE_Y], out, NES_SCREEN_PIXELS);
+                k.bytes(indices, this->tables_[TABLE_U], out + NES_SCREEN_PIXELS, NES_SCREEN_PIXELS);
+                k.bytes(indices, this->tables_[TABLE_V], out + 2 * NES_SCREEN_PIXELS, NES_SCREEN_PIXELS);
+                break;
+        }
+    }
+
+    bool video_output::write(const uint8_t *indices)
+    {
+        // every format once, whichever sinks want it
+        bool done[NES_PIXEL_FORMATS] = { true, false, false, false };
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < this->sinks_.size(); ++i) {
+            int fmt = (int)this->sinks_[i]->format();
+            if (!done[fmt] && this->sinks_[i]->wants()) {
+                this->convert(indices, (pixel_format)fmt, this->pixels_[fmt].data());
+                done[fmt] = true;
+            }
+        }
+        std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+        this->convert_ns_ += (uint64_t)elapsed.count();
+
+        bool ok = true;
+        for (size_t i = 0; i < this->sinks_.size(); ++i) {
+            if (!this->sinks_[i]->wants()) {
+                continue;
+            }
+            video_frame f;
+            f.indices = indices;
+            f.format = this->sinks_[i]->format();
+            f.pixels = f.format == pixel_format::indices ? indices : this->pixels_[(int)f.format].data();
+            f.number = this->frames_;
+            ok = this->sinks_[i]->write(f) && ok;
+        }
+        this->frames_++;
+        return ok;
+    }
+
+    y4m_sink::~y4m_sink()
+    {
+        this->close();
+    }
+
+    int y4m_sink::open(const char *path)
+    {
+        this->close();
+        FILE *f = fopen(path, "wb");
+        if (f == nullptr) {
+            return VIDEO_ERROR_OPEN;
+        }
+        int err = this->open(f);
+        this->own_ = true;
+        return err;
+    }
+
+    int y4m_sink::open(FILE *f)
+    {
+        this->close();
+        this->out_ = f;
+        this->own_ = false;
+        this->frames_ = 0;
+        this->failed_ = fputs(NES_Y4M_HEADER, f) < 0;
+        return this->failed_ ? VIDEO_ERROR_OPEN : 0;
+    }
+
+    void y4m_sink::close()
+    {
+        if (this->out_ == nullptr) {
+            return;
+        }
+        if (this->own_) {
+            fclose(this->out_);
+        }
+        else {
+            fflush(this->out_);
+        }
+        this->out_ = nullptr;
+        this->own_ = false;
+    }
+
+    bool y4m_sink::write(const video_frame& f)
+    {
+        if (this->out_ == nullptr || this->failed_) {
+            return false;
+        }
+        size_t size = NES_SCREEN_PIXELS * pixel_format_size(pixel_format::yuv444);
+        this->failed_ = fputs(NES_Y4M_FRAME, this->out_) < 0 || fwrite(f.pixels, 1, size, this->out_) != size;
+        this->frames_ += this->failed_ ? 0 : 1;
+        return !this->failed_;
+    }
+
+    struct png_crc_table {
+        uint32_t crc[256];
+
+        png_crc_table()
+        {
+            for (uint32_t n = 0; n < 256; ++n) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k) {
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                }
+                this->crc[n] = c;
+            }
+        }
+    };
+
+    static uint32_t png_crc(const uint8_t *p, size_t n)
+    {
+        static const png_crc_table table;
+        uint32_t c = 0xffffffff;
+        for (size_t i = 0; i < n; ++i) {
+            c = table.crc[(c ^ p[i]) & 0xff] ^ (c >> 8);
+        }
+        return c ^ 0xffffffff;
+    }
+
+    static void put_be32(std::vector<uint8_t>& out, uint32_t v)
+    {
+        out.push_back((uint8_t)(v >> 24));
+        out.push_back((uint8_t)(v >> 16));
+        out.push_back((uint8_t)(v >> 8));
+        out.push_back((uint8_t)v);
+    }
+
+    // length, type, data, CRC of type and data
+    static void png_chunk(std::vector<uint8_t>& out, const char *type, const uint8_t *data, size_t n)
+    {
+        put_be32(out, (uint32_t)n);
+        size_t start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data, data + n);
+        put_be32(out, png_crc(&out[start], n + 4));
+    }
+
+    int png_write(FILE *f, const uint8_t *rgba)
+    {
+        static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        std::vector<uint8_t> out(signature, signature + sizeof(signature));
+
+        std::vector<uint8_t> header;
+        put_be32(header, NES_SCREEN_WIDTH);
+        put_be32(header, NES_SCREEN_HEIGHT);
+        // 8 bit RGB, deflate, adaptive filters, not interlaced
+        const uint8_t rest[5] = { 8, 2, 0, 0, 0 };
+        header.insert(header.end(), rest, rest + sizeof(rest));
+        png_chunk(out, "IHDR", header.data(), header.size());
+
+        // scanlines with filter type 0 in front
+        std::vector<uint8_t> raw;
+        raw.reserve(NES_SCREEN_HEIGHT * (1 + NES_SCREEN_WIDTH * 3));
+        for (int y = 0; y < NES_SCREEN_HEIGHT; ++y) {
+            raw.push_back(0);
+            const uint8_t *row = rgba + y * NES_SCREEN_WIDTH * 4;
+            for (int x = 0; x < NES_SCREEN_WIDTH; ++x) {
+                raw.insert(raw.end(), row + x * 4, row + x * 4 + 3);
+            }
+        }
+
+        // zlib stream of stored blocks and the Adler-32 of the scanlines
+        std::vector<uint8_t> z;
+        z.reserve(raw.size() + raw.size() / PNG_STORED_BLOCK * 5 + 16);
+        z.push_back(0x78);
+        z.push_back(0x01);
+        for (size_t at = 0; at < raw.size(); at += PNG_STORED_BLOCK) {
+            size_t n = raw.size() - at < PNG_STORED_BLOCK ? raw.size() - at : PNG_STORED_BLOCK;
+            z.push_back(at + n == raw.size() ? 1 : 0);
+            z.push_back((uint8_t)n);
+            z.push_back((uint8_t)(n >> 8));
+            z.push_back((uint8_t)~n);
+            z.push_back((uint8_t)(~n >> 8));
+            z.insert(z.end(), raw.begin() + (long)at, raw.begin() + (long)(at + n));
+        }
+        uint32_t a = 1, b = 0;
+        for (size_t i = 0; i < raw.size(); ++i) {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        put_be32(z, b << 16 | a);
+        png_chunk(out, "IDAT", z.data(), z.size());
+        png_chunk(out, "IEND", nullptr, 0);
+
+        return fwrite(out.data(), 1, out.size(), f) == out.size() ? 0 : VIDEO_ERROR_OPEN;
+    }
+
+    bool png_sink::write(const video_frame& f)
+    {
+        FILE *out = fopen(this->path_.c_str(), "wb");
+        this->error_ = out ? png_write(out, f.pixels) : VIDEO_ERROR_OPEN;
+        if (out != nullptr && fclose(out) != 0) {
+            this->error_ = VIDEO_ERROR_OPEN;
+        }
+        this->path_.clear();
+        this->saved_ += this->error_ == 0 ? 1 : 0;
+        return this->error_ == 0;
+    }
+
+    // counts the pictures and keeps the RGBA of the last one
+    class test_sink : public video_sink {
+
+    public:
+        std::vector<uint8_t> last;
+        uint64_t frames{0};
+
+        pixel_format format() const override
+        {
+            return pixel_format::rgba;
+        }
+
+        bool write(const video_frame& f) override
+        {
+            this->last.assign(f.pixels, f.pixels + NES_SCREEN_PIXELS * 4);
+            this->frames++;
+            return f.indices != nullptr;
+        }
+    };
+
+    void video_output::test()
+    {
+        // a frame_buffers hands pictures over without tearing, the newest wins
+        {
+            frame_buffers b;
+            assert(!b.acquire());
+            memset(b.back(), 1, NES_SCREEN_PIXELS);
+            b.present();
+            memset(b.back(), 2, NES_SCREEN_PIXELS);
+            b.present();
+            assert(b.newest()[0] == 2 && b.acquire() && b.front()[NES_SCREEN_PIXELS - 1] == 2 && !b.acquire());
+            assert(b.back() != b.front() && b.presented() == 2 && b.acquired() == 1);
+
+            const int frames = 2000;
+            frame_buffers shared;
+            std::thread producer([&shared]() {
+                for (int f = 1; f <= frames; ++f) {
+                    memset(shared.back(), f & 0xff, NES_SCREEN_PIXELS);
+                    shared.present();
+                }
+            });
+            int last = 0;
+            bool whole = true;
+            while (last != (frames & 0xff)) {
+                if (!shared.acquire()) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                const uint8_t *p = shared.front();
+                for (int i = 0; i < NES_SCREEN_PIXELS; i += 97) {
+                    whole = whole && p[i] == p[0];
+                }
+                whole = whole && p[NES_SCREEN_PIXELS - 1] == p[0];
+                last = p[0];
+            }
+            producer.join();
+            assert(whole && shared.acquired() <= shared.presented());
+            (void)whole;
+        }
+
+        video_output v;
+        assert(v.get_palette()[0x30] == 0xfffeff);
+
+        // every path converts every format the way the scalar one does
+        std::vector<uint8_t> indices(NES_SCREEN_PIXELS);
+        uint32_t x = 12345;
+        for (size_t i = 0; i < indices.size(); ++i) {
+            x = x * 1103515245 + 12345;
+            // the top bits aren't part of the index
+            indices[i] = (uint8_t)(x >> 16);
+        }
+        static const pixel_format formats[] = { pixel_format::rgba, pixel_format::rgb565, pixel_format::yuv444 };
+        static const pixel_path paths[] = { pixel_path::ssse3, pixel_path::avx2 };
+        std::vector<uint8_t> expect(NES_SCREEN_PIXELS * 4);
+        std::vector<uint8_t> got(NES_SCREEN_PIXELS * 4);
+        for (size_t f = 0; f < arr_len(formats); ++f) {
+            v.set_pixel_path(pixel_path::scalar);
+            v.convert(indices.data(), formats[f], expect.data());
+            for (size_t p = 0; p < arr_len(paths); ++p) {
+                if (!pixel_path_supported(paths[p])) {
+                    continue;
+                }
+                v.set_pixel_path(paths[p]);
+                v.convert(indices.data(), formats[f], got.data());
+                assert(memcmp(got.data(), expect.data(), NES_SCREEN_PIXELS * pixel_format_size(formats[f])) == 0);
+            }
+        }
+        v.set_pixel_path(pixel_path::scalar);
+        uint8_t white[NES_SCREEN_PIXELS];
+        memset(white, 0x30, sizeof(white));
+        v.convert(white, pixel_format::rgba, got.data());
+        assert(got[0] == 0xff && got[1] == 0xfe && got[2] == 0xff && got[3] == 0xff);
+        v.convert(white, pixel_format::rgb565, got.data());
+        assert(got[0] == 0xff && got[1] == 0xff);
+        v.convert(white, pixel_format::yuv444, got.data());
+        // its green is 254, a hair under studio white
+        assert(got[0] == 234 && got[NES_SCREEN_PIXELS] == 128 && got[2 * NES_SCREEN_PIXELS] == 128);
+
+        // Y4M: a header, then FRAME and three planes a picture
+        {
+            FILE *f = tmpfile();
+            assert(f != nullptr);
+            video_output out;
+            y4m_sink y4m;
+            null_video_sink null;
+            int err = y4m.open(f);
+            assert(err == 0);
+            out.add_sink(y4m);
+            out.add_sink(null);
+            memset(white, 0x0f, sizeof(white));
+            assert(out.write(white) && out.write(indices.data()));
+            assert(y4m.frames() == 2 && null.frames() == 2 && out.frames() == 2);
+            y4m.close();
+            size_t header = strlen(NES_Y4M_HEADER);
+            size_t frame = strlen(NES_Y4M_FRAME) + NES_SCREEN_PIXELS * 3;
+            assert(ftell(f) == (long)(header + 2 * frame));
+            rewind(f);
+            std::vector<uint8_t> file(header + 2 * frame);
+            size_t n = fread(file.data(), 1, file.size(), f);
+            assert(n == file.size() && memcmp(file.data(), NES_Y4M_HEADER, header) == 0);
+            assert(memcmp(&file[header], NES_Y4M_FRAME, 6) == 0 && file[header + 6] == 16);
+            assert(memcmp(&file[header + frame + 6], expect.data(), NES_SCREEN_PIXELS * 3) == 0);
+            fclose(f);
+            (void)err;
+            (void)n;
+        }
+
+        // PNG: the stored blocks give the picture back
+        {
+            FILE *f = tmpfile();
+            assert(f != nullptr);
+            v.convert(indices.data(), pixel_format::rgba, got.data());
+            int err = png_write(f, got.data());
+            assert(err == 0);
+            long size = ftell(f);
+            rewind(f);
+            std::vector<uint8_t> file((size_t)size);
+            size_t n = fread(file.data(), 1, file.size(), f);
+            fclose(f);
+            assert(n == file.size() && file[0] == 0x89 && memcmp(&file[1], "PNG", 3) == 0);
+            assert(memcmp(&file[12], "IHDR", 4) == 0 && file[18] == 1 && file[22] == 0 && file[23] == 240);
+            assert(memcmp(&file[file.size() - 8], "IEND", 4) == 0);
+            // the IHDR CRC
+            uint32_t crc = (uint32_t)file[29] << 24 | file[30] << 16 | file[31] << 8 | file[32];
+            assert(crc == png_crc(&file[12], 17));
+            std::vector<uint8_t> raw;
+            size_t at = 33 + 8 + 2;
+            for (bool last = false; !last;) {
+                last = file[at] & 1;
+                size_t len = file[at + 1] | file[at + 2] << 8;
+                raw.insert(raw.end(), file.begin() + (long)(at + 5), file.begin() + (long)(at + 5 + len));
+                at += 5 + len;
+            }
+            assert(raw.size() == NES_SCREEN_HEIGHT * (1 + NES_SCREEN_WIDTH * 3));
+            size_t row = 1 + NES_SCREEN_WIDTH * 3;
+            assert(raw[100 * row] == 0 && raw[100 * row + 1 + 7 * 3 + 2] == got[(100 * NES_SCREEN_WIDTH + 7) * 4 + 2]);
+            (void)err;
+            (void)n;
+            (void)crc;
+            (void)row;
+        }
+
+        // a console's pictures through the PPU's frame_buffers, one sink per format
+        {
+            std::vector<uint8_t> demo;
+            bench_demo_rom(demo);
+            console nes;
+            int err = nes.load(demo.data(), demo.size());
+            assert(err == 0);
+            (void)err;
+            video_output out;
+            test_sink rgba;
+            png_sink png;
+            out.add_sink(rgba);
+            out.add_sink(png);
+            frame_buffers& b = nes.get_ppu().buffers();
+            for (int f = 0; f < 20; ++f) {
+                nes.run_frame();
+                bool polled = out.poll(b);
+                assert(polled && !out.poll(b) && b.front() == nes.frame());
+                (void)polled;
+            }
+            v.convert(nes.frame(), pixel_format::rgba, got.data());
+            assert(rgba.frames == 20 && rgba.last == got && out.frames() == 20 && png.saved() == 0);
+            // a snapshot nobody can write is an error of the PNG sink alone
+            png.snapshot("/nonexistent/dir/picture.png");
+            nes.run_frame();
+            assert(!out.poll(b) && png.error() == VIDEO_ERROR_OPEN && !png.pending() && rgba.frames == 21);
+            out.remove_sink(rgba);
+            nes.run_frame();
+            assert(out.poll(b) && rgba.frames == 21);
+        }
+    }
+
+}
@@ -0,0 +1,274 @@
+#ifndef video_hpp
+#define video_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "ppu.hpp"
+
+#define NES_PALETTE_SIZE 64
+#define NES_SCREEN_PIXELS (NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT)
+#define NES_PIXEL_FORMATS 4
+
+#define VIDEO_ERROR_OPEN -80
+
+
+namespace nes {
+
+    enum class pixel_format : uint8_t {
+        indices,    // the PPU's palette indices, nothing converted
+        rgba,       // R, G, B, 255 bytes
+        rgb565,     // 16 bit, little endian
+        yuv444,     // Y, U and V planes one after the other, BT.601 studio range
+    };
+
+    /*
+        Palette expansion kernels of one pixel path, on n pixels, a
+        multiple of 32. Every output comes from byte tables of
+        NES_PALETTE_SIZE entries looked up by pshufb, 16 at a time, and
+        interleaved: bytes fills one plane, rgba and rgb565 look up a
+        table per byte of the pixel. Indices are taken modulo 64.
+    */
+    struct convert_kernels {
+        void (*bytes)(const uint8_t *in, const uint8_t *table, uint8_t *out, size_t n);
+        void (*rgba)(const uint8_t *in, const uint8_t *r, const uint8_t *g, const uint8_t *b, uint8_t *out, size_t n);
+        void (*rgb565)(const uint8_t *in, const uint8_t *lo, const uint8_t *hi, uint8_t *out, size_t n);
+    };
+
+    const convert_kernels& get_convert_kernels(pixel_path path);
+
+    // a picture one of the formats, valid until the sink returns
+    struct video_frame {
+        const uint8_t *indices;
+        const uint8_t *pixels;
+        pixel_format format;
+        uint64_t number;        // counted from 0 by the video_output
+    };
+
+    class video_sink {
+
+    public:
+        virtual ~video_sink()
+        {
+        }
+
+        // what write() wants pixels in
+        virtual pixel_format format() const = 0;
+
+        // false skips the next picture, nothing is converted for it
+        virtual bool wants() const
+        {
+            return true;
+        }
+
+        // false once writing failed
+        virtual bool write(const video_frame& f) = 0;
+    };
+
+    // counts the pictures and forgets them
+    class null_video_sink : public video_sink {
+
+        uint64_t frames_{0};
+
+    public:
+        pixel_format format() const override
+        {
+            return pixel_format::indices;
+        }
+
+        bool write(const video_frame& f) override
+        {
+            this->frames_++;
+            return true;
+        }
+
+        uint64_t frames() const
+        {
+            return this->frames_;
+        }
+    };
+
+    // YUV4MPEG2, 4:4:4 at the NES frame rate with its 8:7 pixels; the
+    // planes go out with one fwrite straight from the converter
+    class y4m_sink : public video_sink {
+
+        FILE *out_{nullptr};
+        bool own_{false};
+        bool failed_{false};
+        uint64_t frames_{0};
+
+    public:
+        y4m_sink(const y4m_sink&) = delete;
+        y4m_sink(y4m_sink&&) = delete;
+        y4m_sink& operator=(const y4m_sink&) = delete;
+        y4m_sink& operator=(y4m_sink&&) = delete;
+
+        y4m_sink() noexcept
+        {
+        }
+
+        ~y4m_sink();
+
+        // 0 or VIDEO_ERROR_OPEN, a stream already open is closed first
+        int open(const char *path);
+        // writes to f from where it is, f stays open
+        int open(FILE *f);
+        void close();
+
+        pixel_format format() const override
+        {
+            return pixel_format::yuv444;
+        }
+
+        bool write(const video_frame& f) override;
+
+        uint64_t frames() const
+        {
+            return this->frames_;
+        }
+    };
+
+    // 8 bit RGB PNG of the next picture after snapshot(), stored deflate
+    // blocks so there is nothing to link; other pictures cost nothing
+    class png_sink : public video_sink {
+
+        std::string path_;
+        int error_{0};
+        uint64_t saved_{0};
+
+    public:
+        // the next picture goes to path
+        void snapshot(const char *path)
+        {
+            this->path_ = path;
+        }
+
+        bool pending() const
+        {
+            return !this->path_.empty();
+        }
+
+        pixel_format format() const override
+        {
+            return pixel_format::rgba;
+        }
+
+        bool wants() const override
+        {
+            return this->pending();
+        }
+
+        bool write(const video_frame& f) override;
+
+        // 0 or VIDEO_ERROR_OPEN of the last snapshot
+        int error() const
+        {
+            return this->error_;
+        }
+
+        uint64_t saved() const
+        {
+            return this->saved_;
+        }
+    };
+
+    // a 256 x 240 RGBA picture as an RGB PNG, 0 or VIDEO_ERROR_OPEN
+    int png_write(FILE *f, const uint8_t *rgba);
+
+    /*
+        Palette indices to pixels, for any number of sinks.
+
+        write() converts a picture once for every format a sink wants,
+        straight from where the PPU drew it into buffers of its own, and
+        hands each sink a pointer; nothing is copied between the stages.
+        poll() takes the newest picture of a frame_buffers first, so a
+        display thread can run it at its own rate while the PPU draws.
+
+        The 64 colors are expanded into byte tables for every format up
+        front, the kernels of the fastest pixel path look them up.
+    */
+    class video_output {
+
+        const convert_kernels *kernels_;
+        pixel_path path_;
+        uint32_t palette_[NES_PALETTE_SIZE];
+
+        // R, G, B, RGB565 low and high, Y, U, V
+        uint8_t tables_[8][NES_PALETTE_SIZE];
+        std::vector<uint8_t> pixels_[NES_PIXEL_FORMATS];
+        std::vector<video_sink*> sinks_;
+        uint64_t frames_{0};
+        uint64_t convert_ns_{0};
+
+    public:
+        video_output(const video_output&) = delete;
+        video_output(video_output&&) = delete;
+        video_output& operator=(const video_output&) = delete;
+        video_output& operator=(video_output&&) = delete;
+
+        video_output() noexcept;
+
+        // falls back to scalar when the CPU can't run path
+        void set_pixel_path(pixel_path path);
+
+        pixel_path get_pixel_path() const
+        {
+            return this->path_;
+        }
+
+        // 0xRRGGBB colors, the 2C02's by default
+        void set_palette(const uint32_t *rgb);
+
+        const uint32_t* get_palette() const
+        {
+            return this->palette_;
+        }
+
+        // sink has to outlive the video_output or remove_sink()
+        void add_sink(video_sink& sink);
+        void remove_sink(video_sink& sink);
+
+        // converts to the sinks' formats, false when a sink failed
+        bool write(const uint8_t *indices);
+
+        // write() of the newest picture in b; false when there's no new one
+        // or a sink failed
+        bool poll(frame_buffers& b)
+        {
+            return b.acquire() && this->write(b.front());
+        }
+
+        // fmt of the last write(), for the formats the sinks want
+        const uint8_t* pixels(pixel_format fmt) const
+        {
+            return this->pixels_[(int)fmt].data();
+        }
+
+        // indices into fmt without any sink, out holds a picture of it
+        void convert(const uint8_t *indices, pixel_format fmt, uint8_t *out) const;
+
+        uint64_t frames() const
+        {
+            return this->frames_;
+        }
+
+        // spent in the kernels by write()
+        uint64_t convert_ns() const
+        {
+            return this->convert_ns_;
+        }
+
+        static void test();
+    };
+
+    // bytes per pixel of fmt, planes counted together
+    size_t pixel_format_size(pixel_format fmt);
+
+    const char* pixel_format_name(pixel_format fmt);
+
+}
+
+
+#endif /* video_hpp */
@@ -0,0 +1,245 @@
+#include "video.hpp"
+
+#if NES_PPU_SIMD
+#include <immintrin.h>
+#endif
+
+
+namespace nes {
+
+    static void bytes_scalar(const uint8_t *in, const uint8_t *table, uint8_t *out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = table[in[i] & 0x3f];
+        }
+    }
+
+    static void rgba_scalar(const uint8_t *in, const uint8_t *r, const uint8_t *g, const uint8_t *b, uint8_t *out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t c = in[i] & 0x3f;
+            out[i * 4] = r[c];
+            out[i * 4 + 1] = g[c];
+            out[i * 4 + 2] = b[c];
+            out[i * 4 + 3] = 0xff;
+        }
+    }
+
+    static void rgb565_scalar(const uint8_t *in, const uint8_t *lo, const uint8_t *hi, uint8_t *out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t c = in[i] & 0x3f;
+            out[i * 2] = lo[c];
+            out[i * 2 + 1] = hi[c];
+        }
+    }
+
+#if NES_PPU_SIMD
+
+    /*
+        64 entry lookup: pshufb only sees the low 4 bits and zeroes lanes
+        with bit 7 set. XOR with 16 * k brings quarter k of the table to
+        0-15 and the other quarters to 16-63, which a saturating add of
+        0x70 pushes past 0x7f; ORing the four lookups leaves the entry.
+        The four selectors are shared by every table of a pixel.
+    */
+    struct lookup_ssse3 {
+        __m128i sel[4];
+
+        __attribute__((target("ssse3")))
+        void select(__m128i idx)
+        {
+            const __m128i bias = _mm_set1_epi8(0x70);
+            for (int k = 0; k < 4; ++k) {
+                this->sel[k] = _mm_adds_epu8(_mm_xor_si128(idx, _mm_set1_epi8((char)(k << 4))), bias);
+            }
+        }
+
+        __attribute__((target("ssse3")))
+        __m128i get(const __m128i *t) const
+        {
+            return _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(t[0], this->sel[0]), _mm_shuffle_epi8(t[1], this->sel[1])),
+                                _mm_or_si128(_mm_shuffle_epi8(t[2], this->sel[2]), _mm_shuffle_epi8(t[3], this->sel[3])));
+        }
+    };
+
+    __attribute__((target("ssse3")))
+    static void load_table_ssse3(const uint8_t *table, __m128i *t)
+    {
+        for (int k = 0; k < 4; ++k) {
+            t[k] = _mm_loadu_si128((const __m128i *)(table + k * 16));
+        }
+    }
+
+    __attribute__((target("ssse3")))
+    static void bytes_ssse3(const uint8_t *in, const uint8_t *table, uint8_t *out, size_t n)
+    {
+        const __m128i mask = _mm_set1_epi8(0x3f);
+        __m128i t[4];
+        load_table_ssse3(table, t);
+        lookup_ssse3 l;
+        for (size_t i = 0; i < n; i += 16) {
+            l.select(_mm_and_si128(_mm_loadu_si128((const __m128i *)(in + i)), mask));
+            _mm_storeu_si128((__m128i *)(out + i), l.get(t));
+        }
+    }
+
+    __attribute__((target("ssse3")))
+    static void rgba_ssse3(const uint8_t *in, const uint8_t *r, const uint8_t *g, const uint8_t *b, uint8_t *out, size_t n)
+    {
+        const __m128i mask = _mm_set1_epi8(0x3f);
+        const __m128i alpha = _mm_set1_epi8((char)0xff);
+        __m128i tr[4], tg[4], tb[4];
+        load_table_ssse3(r, tr);
+        load_table_ssse3(g, tg);
+        load_table_ssse3(b, tb);
+        lookup_ssse3 l;
+        for (size_t i = 0; i < n; i += 16) {
+            l.select(_mm_and_si128(_mm_loadu_si128((const __m128i *)(in + i)), mask));
+            __m128i rv = l.get(tr);
+            __m128i gv = l.get(tg);
+            __m128i bv = l.get(tb);
+            __m128i rg_lo = _mm_unpacklo_epi8(rv, gv);
+            __m128i rg_hi = _mm_unpackhi_epi8(rv, gv);
+            __m128i ba_lo = _mm_unpacklo_epi8(bv, alpha);
+            __m128i ba_hi = _mm_unpackhi_epi8(bv, alpha);
+            __m128i *o = (__m128i *)(out + i * 4);
+            _mm_storeu_si128(o, _mm_unpacklo_epi16(rg_lo, ba_lo));
+            _mm_storeu_si128(o + 1, _mm_unpackhi_epi16(rg_lo, ba_lo));
+            _mm_storeu_si128(o + 2, _mm_unpacklo_epi16(rg_hi, ba_hi));
+            _mm_storeu_si128(o + 3, _mm_unpackhi_epi16(rg_hi, ba_hi));
+        }
+    }
+
+    __attribute__((target("ssse3")))
+    static void rgb565_ssse3(const uint8_t *in, const uint8_t *lo, const uint8_t *hi, uint8_t *out, size_t n)
+    {
+        const __m128i mask = _mm_set1_epi8(0x3f);
+        __m128i tl[4], th[4];
+        load_table_ssse3(lo, tl);
+        load_table_ssse3(hi, th);
+        lookup_ssse3 l;
+        for (size_t i = 0; i < n; i += 16) {
+            l.select(_mm_and_si128(_mm_loadu_si128((const __m128i *)(in + i)), mask));
+            __m128i lv = l.get(tl);
+            __m128i hv = l.get(th);
+            __m128i *o = (__m128i *)(out + i * 2);
+            _mm_storeu_si128(o, _mm_unpacklo_epi8(lv, hv));
+            _mm_storeu_si128(o + 1, _mm_unpackhi_epi8(lv, hv));
+        }
+    }
+
+    // the same with the table in both 128 bit lanes; the unpacks work per
+    // lane, so the last step puts the halves of the two lanes back in order
+    struct lookup_avx2 {
+        __m256i sel[4];
+
+        __attribute__((target("avx2")))
+        void select(__m256i idx)
+        {
+            const __m256i bias = _mm256_set1_epi8(0x70);
+            for (int k = 0; k < 4; ++k) {
+                this->sel[k] = _mm256_adds_epu8(_mm256_xor_si256(idx, _mm256_set1_epi8((char)(k << 4))), bias);
+            }
+        }
+
+        __attribute__((target("avx2")))
+        __m256i get(const __m256i *t) const
+        {
+            return _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(t[0], this->sel[0]), _mm256_shuffle_epi8(t[1], this->sel[1])),
+                                   _mm256_or_si256(_mm256_shuffle_epi8(t[2], this->sel[2]), _mm256_shuffle_epi8(t[3], this->sel[3])));
+        }
+    };
+
+    __attribute__((target("avx2")))
+    static void load_table_avx2(const uint8_t *table, __m256i *t)
+    {
+        for (int k = 0; k < 4; ++k) {
+            t[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(table + k * 16)));
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static void bytes_avx2(const uint8_t *in, const uint8_t *table, uint8_t *out, size_t n)
+    {
+        const __m256i mask = _mm256_set1_epi8(0x3f);
+        __m256i t[4];
+        load_table_avx2(table, t);
+        lookup_avx2 l;
+        for (size_t i = 0; i < n; i += 32) {
+            l.select(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(in + i)), mask));
+            _mm256_storeu_si256((__m256i *)(out + i), l.get(t));
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static void rgba_avx2(const uint8_t *in, const uint8_t *r, const uint8_t *g, const uint8_t *b, uint8_t *out, size_t n)
+    {
+        const __m256i mask = _mm256_set1_epi8(0x3f);
+        const __m256i alpha = _mm256_set1_epi8((char)0xff);
+        __m256i tr[4], tg[4], tb[4];
+        load_table_avx2(r, tr);
+        load_table_avx2(g, tg);
+        load_table_avx2(b, tb);
+        lookup_avx2 l;
+        for (size_t i = 0; i < n; i += 32) {
+            l.select(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(in + i)), mask));
+            __m256i rv = l.get(tr);
+            __m256i gv = l.get(tg);
+            __m256i bv = l.get(tb);
+            // lane 0 has pixels 0-7 and 8-15, lane 1 16-23 and 24-31
+            __m256i rg_lo = _mm256_unpacklo_epi8(rv, gv);
+            __m256i rg_hi = _mm256_unpackhi_epi8(rv, gv);
+            __m256i ba_lo = _mm256_unpacklo_epi8(bv, alpha);
+            __m256i ba_hi = _mm256_unpackhi_epi8(bv, alpha);
+            __m256i p0 = _mm256_unpacklo_epi16(rg_lo, ba_lo);     // 0-3, 16-19
+            __m256i p1 = _mm256_unpackhi_epi16(rg_lo, ba_lo);     // 4-7, 20-23
+            __m256i p2 = _mm256_unpacklo_epi16(rg_hi, ba_hi);     // 8-11, 24-27
+            __m256i p3 = _mm256_unpackhi_epi16(rg_hi, ba_hi);     // 12-15, 28-31
+            __m256i *o = (__m256i *)(out + i * 4);
+            _mm256_storeu_si256(o, _mm256_permute2x128_si256(p0, p1, 0x20));
+            _mm256_storeu_si256(o + 1, _mm256_permute2x128_si256(p2, p3, 0x20));
+            _mm256_storeu_si256(o + 2, _mm256_permute2x128_si256(p0, p1, 0x31));
+            _mm256_storeu_si256(o + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static void rgb565_avx2(const uint8_t *in, const uint8_t *lo, const uint8_t *hi, uint8_t *out, size_t n)
+    {
+        const __m256i mask = _mm256_set1_epi8(0x3f);
+        __m256i tl[4], th[4];
+        load_table_avx2(lo, tl);
+        load_table_avx2(hi, th);
+        lookup_avx2 l;
+        for (size_t i = 0; i < n; i += 32) {
+            l.select(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(in + i)), mask));
+            __m256i lv = l.get(tl);
+            __m256i hv = l.get(th);
+            __m256i a = _mm256_unpacklo_epi8(lv, hv);     // 0-7, 16-23
+            __m256i b = _mm256_unpackhi_epi8(lv, hv);     // 8-15, 24-31
+            __m256i *o = (__m256i *)(out + i * 2);
+            _mm256_storeu_si256(o, _mm256_permute2x128_si256(a, b, 0x20));
+            _mm256_storeu_si256(o + 1, _mm256_permute2x128_si256(a, b, 0x31));
+        }
+    }
+
+#endif
+
+    static const convert_kernels g_convert_kernels[] = {
+        { bytes_scalar, rgba_scalar, rgb565_scalar },
+#if NES_PPU_SIMD
+        { bytes_ssse3, rgba_ssse3, rgb565_ssse3 },
+        { bytes_avx2, rgba_avx2, rgb565_avx2 },
+#else
+        { bytes_scalar, rgba_scalar, rgb565_scalar },
+        { bytes_scalar, rgba_scalar, rgb565_scalar },
+#endif
+    };
+
+    const convert_kernels& get_convert_kernels(pixel_path path)
+    {
+        return g_convert_kernels[(int)path];
+    }
+
+}
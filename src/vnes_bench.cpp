@@ -0,0 +1,31 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include "bench.hpp"
+
+
+// vnes_bench [json out|-] [reps] [warmup runs] [kernel|-] [mode|-]
+int main(int argc, const char * argv[])
+{
+    FILE *out = stdout;
+    if (argc > 1 && strcmp(argv[1], "-") != 0) {
+        out = fopen(argv[1], "w");
+        if (out == nullptr) {
+            fprintf(stderr, "can not open %s\n", argv[1]);
+            return 1;
+        }
+    }
+    int reps = argc > 2 ? atoi(argv[2]) : 10;
+    int warmup = argc > 3 ? atoi(argv[3]) : 3;
+    const char *kernel = argc > 4 && strcmp(argv[4], "-") != 0 ? argv[4] : nullptr;
+    const char *mode = argc > 5 && strcmp(argv[5], "-") != 0 ? argv[5] : nullptr;
+
+    bool ok = nes::bench_suite(out, reps, warmup, kernel, mode);
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (!ok) {
+        fprintf(stderr, "a kernel computed the wrong result\n");
+    }
+    return ok ? 0 : 2;
+}
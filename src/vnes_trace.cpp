@@ -0,0 +1,125 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include "trace.hpp"
+
+
+// records read at a time
+#define TRACE_CHUNK 4096
+
+
+static int usage()
+{
+    fprintf(stderr, "vnes_trace text <trace> [first] [count]\n"
+                    "vnes_trace diff <trace> <nestest.log> [mismatches]\n");
+    return 2;
+}
+
+static int open_trace(nes::trace_reader& in, const char *path)
+{
+    int err = in.open(path);
+    if (err != 0) {
+        fprintf(stderr, "can not read %s: %d\n", path, err);
+    }
+    return err;
+}
+
+// the records from first on as nestest.log lines
+static int trace_to_text(const char *path, uint64_t first, uint64_t count)
+{
+    nes::trace_reader in;
+    if (open_trace(in, path) != 0) {
+        return 1;
+    }
+    std::vector<nes::trace_record> recs(TRACE_CHUNK);
+    char line[NES_TRACE_SIZE];
+    uint64_t at = 0;
+    while (count) {
+        size_t n = in.read(recs.data(), recs.size());
+        if (n == 0) {
+            break;
+        }
+        for (size_t i = 0; i < n && count; ++i, ++at) {
+            if (at < first) {
+                continue;
+            }
+            size_t len = nes::trace_text(recs[i], line);
+            line[len] = '\n';
+            fwrite(line, 1, len + 1, stdout);
+            count--;
+        }
+    }
+    return 0;
+}
+
+// line by line against a reference log, stops after mismatches differences
+static int trace_diff(const char *path, const char *log_path, int mismatches)
+{
+    nes::trace_reader in;
+    if (open_trace(in, path) != 0) {
+        return 1;
+    }
+    FILE *log = fopen(log_path, "r");
+    if (log == nullptr) {
+        fprintf(stderr, "can not read %s\n", log_path);
+        return 1;
+    }
+
+    std::vector<nes::trace_record> recs(TRACE_CHUNK);
+    size_t n = 0, i = 0;
+    char want[512], got[NES_TRACE_SIZE], fields[64];
+    uint64_t line = 0;
+    int differences = 0;
+    bool trace_left = true;
+    while (differences < mismatches && fgets(want, sizeof(want), log) != nullptr) {
+        nes::trace_line a, b;
+        if (!nes::trace_parse(want, b)) {
+            // headers and blank lines
+            continue;
+        }
+        if (i == n) {
+            n = in.read(recs.data(), recs.size());
+            i = 0;
+            if (n == 0) {
+                trace_left = false;
+                break;
+            }
+        }
+        line++;
+        nes::trace_text(recs[i++], got);
+        nes::trace_parse(got, a);
+        nes::trace_compare(a, b, fields);
+        if (fields[0] != 0) {
+            want[strcspn(want, "\r\n")] = 0;
+            printf("line %llu differs in%s\n  want %s\n  got  %s\n", (unsigned long long)line, fields, want, got);
+            differences++;
+        }
+    }
+    bool log_left = !feof(log) && differences < mismatches;
+    fclose(log);
+
+    if (differences != 0) {
+        return 1;
+    }
+    if (!trace_left) {
+        printf("the trace ends after %llu matching lines, the log does not\n", (unsigned long long)line);
+        return 1;
+    }
+    printf("%llu lines match%s\n", (unsigned long long)line, log_left ? "" : ", the whole log");
+    return 0;
+}
+
+int main(int argc, const char * argv[])
+{
+    if (argc > 2 && strcmp(argv[1], "text") == 0) {
+        uint64_t first = argc > 3 ? strtoull(argv[3], nullptr, 10) : 0;
+        uint64_t count = argc > 4 ? strtoull(argv[4], nullptr, 10) : ~0ull;
+        return trace_to_text(argv[2], first, count);
+    }
+    if (argc > 3 && strcmp(argv[1], "diff") == 0) {
+        int mismatches = argc > 4 ? atoi(argv[4]) : 1;
+        return trace_diff(argv[2], argv[3], mismatches > 0 ? mismatches : 1);
+    }
+    return usage();
+}
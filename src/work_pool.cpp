@@ -0,0 +1,186 @@
+#include "work_pool.hpp"
+#include <cassert>
+#include <chrono>
+
+
+namespace nes {
+
+    work_pool::work_pool(int threads) noexcept
+    {
+        if (threads <= 0) {
+            threads = (int)std::thread::hardware_concurrency();
+        }
+        this->threads_ = threads > 0 ? threads : 1;
+
+        for (int i = 0; i < this->threads_; ++i) {
+            this->queues_.emplace_back(new worker_queue());
+        }
+        for (int w = 1; w < this->threads_; ++w) {
+            this->workers_.emplace_back(&work_pool::serve, this, w);
+        }
+    }
+
+    work_pool::~work_pool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(this->lock_);
+            this->stop_ = true;
+        }
+        this->start_.notify_all();
+        for (size_t i = 0; i < this->workers_.size(); ++i) {
+            this->workers_[i].join();
+        }
+    }
+
+    void work_pool::serve(int worker)
+    {
+        uint64_t seen = 0;
+        for (;;) {
+            const std::function<void(size_t, int)> *fn;
+            {
+                std::unique_lock<std::mutex> guard(this->lock_);
+                this->start_.wait(guard, [this, seen]() {
+                    return this->stop_ || this->generation_ != seen;
+                });
+                if (this->stop_) {
+                    return;
+                }
+                seen = this->generation_;
+                fn = this->fn_;
+            }
+            this->drain(worker, *fn);
+            std::lock_guard<std::mutex> guard(this->lock_);
+            if (--this->busy_ == 0) {
+                this->done_.notify_one();
+            }
+        }
+    }
+
+    bool work_pool::pop(int worker, size_t& task)
+    {
+        worker_queue& q = *this->queues_[worker];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.tasks.empty()) {
+            return false;
+        }
+        task = q.tasks.back();
+        q.tasks.pop_back();
+        return true;
+    }
+
+    bool work_pool::steal(int worker, size_t& task)
+    {
+        for (int i = 1; i < this->threads_; ++i) {
+            worker_queue& q = *this->queues_[(worker + i) % this->threads_];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (!q.tasks.empty()) {
+                task = q.tasks.front();
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // no task adds tasks, so a worker that finds every deque empty is done
+    void work_pool::drain(int worker, const std::function<void(size_t, int)>& fn)
+    {
+        size_t task;
+        for (;;) {
+            if (this->pop(worker, task)) {
+                fn(task, worker);
+            }
+            else if (this->steal(worker, task)) {
+                this->steals_.fetch_add(1, std::memory_order_relaxed);
+                fn(task, worker);
+            }
+            else {
+                return;
+            }
+        }
+    }
+
+    void work_pool::run(size_t count, const std::function<void(size_t, int)>& fn)
+    {
+        // worker w starts on [w * count / threads, (w + 1) * count / threads), in order
+        for (int w = 0; w < this->threads_; ++w) {
+            worker_queue& q = *this->queues_[w];
+            std::lock_guard<std::mutex> guard(q.lock);
+            q.tasks.clear();
+            size_t begin = w * count / this->threads_;
+            size_t end = (w + 1) * count / this->threads_;
+            for (size_t t = end; t > begin; --t) {
+                q.tasks.push_back(t - 1);
+            }
+        }
+        this->steals_.store(0, std::memory_order_relaxed);
+
+        {
+            std::lock_guard<std::mutex> guard(this->lock_);
+            this->fn_ = &fn;
+            this->busy_ = this->threads_ - 1;
+            this->generation_++;
+        }
+        this->start_.notify_all();
+        this->drain(0, fn);
+
+        std::unique_lock<std::mutex> guard(this->lock_);
+        this->done_.wait(guard, [this]() {
+            return this->busy_ == 0;
+        });
+    }
+
+    void work_pool::test()
+    {
+        // every task runs exactly once, whatever the thread count
+        for (int threads = 1; threads <= 4; ++threads) {
+            work_pool pool(threads);
+            assert(pool.threads() == threads);
+
+            std::vector<int> runs(1000, 0);
+            std::vector<int> workers(1000, -1);
+            pool.run(runs.size(), [&](size_t task, int worker) {
+                runs[task]++;
+                workers[task] = worker;
+            });
+            for (size_t i = 0; i < runs.size(); ++i) {
+                assert(runs[i] == 1);
+                assert(workers[i] >= 0 && workers[i] < threads);
+            }
+        }
+
+        // worker 0 gets all the slow tasks, the others have to steal them
+        work_pool pool(4);
+        std::vector<std::atomic<int>> runs(64);
+        for (size_t i = 0; i < runs.size(); ++i) {
+            runs[i] = 0;
+        }
+        pool.run(runs.size(), [&](size_t task, int) {
+            if (task < 16) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+            runs[task]++;
+        });
+        for (size_t i = 0; i < runs.size(); ++i) {
+            assert(runs[i] == 1);
+        }
+        assert(pool.steals() > 0);
+
+        // a worker index stays on its thread from one run() to the next,
+        // none is started per batch
+        std::vector<std::thread::id> ids(4);
+        for (int batch = 0; batch < 3; ++batch) {
+            pool.run(64, [&](size_t, int worker) {
+                std::thread::id me = std::this_thread::get_id();
+                if (ids[worker] == std::thread::id()) {
+                    ids[worker] = me;
+                }
+                assert(ids[worker] == me);
+                (void)me;
+            });
+        }
+        // the others may have stolen all of worker 0's tasks
+        assert(ids[0] == std::thread::id() || ids[0] == std::this_thread::get_id());
+    }
+
+}
@@ -0,0 +1,94 @@
+#ifndef work_pool_hpp
+#define work_pool_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace nes {
+
+    /*
+        Work stealing over a fixed set of threads.
+
+        The workers start with the pool and sleep on a condition variable
+        between runs, the thread calling run() is worker 0. run() deals the task indices out to one deque per worker in
+        contiguous blocks. A worker pops from the back of its own deque
+        and, once that is empty, steals from the front of the others, so
+        a few long jobs don't leave the rest of the machine idle. Tasks
+        are whole emulator sessions, a mutex per deque costs nothing next
+        to them.
+
+        Nothing is shared between tasks but the deques; fn gets the task
+        index and the worker it runs on, results go to per task slots.
+    */
+    class work_pool {
+
+        struct worker_queue {
+            std::mutex lock;
+            std::deque<size_t> tasks;
+        };
+
+        int threads_;
+        std::vector<std::unique_ptr<worker_queue>> queues_;
+        std::atomic<uint64_t> steals_{0};
+
+        // workers 1 and up; a new generation_ starts them on fn_, busy_
+        // counts down as they finish
+        std::vector<std::thread> workers_;
+        std::mutex lock_;
+        std::condition_variable start_;
+        std::condition_variable done_;
+        const std::function<void(size_t, int)> *fn_{nullptr};
+        uint64_t generation_{0};
+        int busy_{0};
+        bool stop_{false};
+
+        bool pop(int worker, size_t& task);
+        bool steal(int worker, size_t& task);
+        // runs tasks until every deque is empty
+        void drain(int worker, const std::function<void(size_t, int)>& fn);
+        void serve(int worker);
+
+    public:
+        work_pool() = delete;
+        work_pool(const work_pool&) = delete;
+        work_pool(work_pool&&) = delete;
+        work_pool& operator=(const work_pool&) = delete;
+        work_pool& operator=(work_pool&&) = delete;
+
+        // threads <= 0 is one per hardware thread, starts all but one of them
+        explicit work_pool(int threads) noexcept;
+        // stops and joins the workers
+        ~work_pool();
+
+        int threads() const
+        {
+            return this->threads_;
+        }
+
+        // fn(task, worker) for every task in [0, count), returns once all ran;
+        // from one thread at a time
+        void run(size_t count, const std::function<void(size_t, int)>& fn);
+
+        // tasks taken from another worker's deque by the last run()
+        uint64_t steals() const
+        {
+            return this->steals_.load(std::memory_order_relaxed);
+        }
+
+        static void test();
+    };
+
+}
+
+
+#endif /* work_pool_hpp */